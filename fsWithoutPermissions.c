@@ -8,9 +8,11 @@
     This code implements and demonstrates the simulation a simple file system in user space with the following features:
     - Block and inode management.
     - File creation, deletion, renaming, and modification.
+    - Hierarchical directories whose entries live in the directory inode's data blocks, with a dentry cache for path lookups.
     - Access Control Lists (ACLs) for managing permissions.
     - A journal for tracking operations to support recovery.
-    - Integration with GTK for a graphical user interface.
+    - Integration with GTK for a graphical user interface, in this file. The engine behind it is in fs_engine.c
+      and does not depend on GTK, see fs_engine.h; fs_bench.c benchmarks it.
 
     Allocation Technique:
 
@@ -20,898 +22,718 @@
     - Indexed Allocation: One additional block is used for indirect addressing (INDEX_BLOCKS). This block can point to more
       blocks if the file size exceeds the capacity of direct blocks.
 
-*/
-
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
-#include <gtk/gtk.h>
-#include <dirent.h>
-#include<direct.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <gio/gio.h>
-
-#define BLOCK_SIZE 4096
-#define NUM_BLOCKS 1024
-#define INODE_TABLE_SIZE 128
-#define MAX_FILENAME_LEN 255
-#define MAX_FILES 128
-#define DIRECT_BLOCKS 12
-#define INDEX_BLOCKS 1
-#define MAX_ACL_ENTRIES 10
-#define MAX_USERS 100
-
-//permission definitions
-#define PERMISSION_READ  0x4
-#define PERMISSION_WRITE 0x2
-#define PERMISSION_EXECUTE 0x1
-
-#define JOURNAL_SIZE 1024
-#define JOURNAL_FILENAME "journal.log"
+    - Double Indexed Allocation: A double index block lists further index blocks for files that outgrow the single one.
 
-#define INODE_TABLE_FILENAME "inode_table.bin"
+    - Extents: Up to INODE_EXTENTS (start, length) runs are kept in the inode and checked first, so a large file
+      written sequentially maps with a handful of extents instead of one pointer per block.
 
-typedef enum {
-    CREATE,
-    DELETE,
-    MODIFY,
-    RENAME,
-    READ,
-    CHANGE_PERMISSIONS
-} JournalOperation;
-
-typedef struct {
-    JournalOperation operation;
-    char filename[MAX_FILENAME_LEN];
-    char new_filename[MAX_FILENAME_LEN]; // For rename operation
-    char data[BLOCK_SIZE]; // For modify operation
-    time_t timestamp;
-} JournalEntry;
-
-JournalEntry journal[JOURNAL_SIZE];
-int journal_index = 0;
-
-//SuperBlock Structure
-typedef struct {
-    int _size;
-    int num_blocks;
-    int free_blocks;
-    int inode_table_size;
-    int free_inode_count;
-    int free_block_bitmap[NUM_BLOCKS];
-} Superblock;
-
-//access control list structure
-typedef struct {
-    int user_id;
-    unsigned int permissions;
-} ACL_Entry;
+    - Copy-on-write Clones: Data blocks carry reference counts, so a copied file shares the original's blocks
+      until either file writes one of them.
 
-//inode structure
-typedef struct {
-    int is_directory;
-    int _size;
-    int direct_blocks[DIRECT_BLOCKS];
-    int index_block;
-    unsigned int mode;
-    time_t atime; // access time
-    time_t mtime; // modification time
-    time_t ctime; // creation time
-    int owner_id;
-    int group_id;
-    ACL_Entry acl[MAX_ACL_ENTRIES];
-    int acl_count;
-} Inode;
+    - Snapshots: A snapshot starts out empty; each inode is copied into it, sharing its blocks, just before
+      the inode first changes, so taking one is O(1).
 
-typedef struct {
-    char name[MAX_FILENAME_LEN];
-    int inode_number;
-} DirectoryEntry;
+*/
 
-typedef struct {
-    DirectoryEntry entries[MAX_FILES];
-    int entry_count;
-} Directory;
+#include "fs_engine.h"
+#include <gtk/gtk.h>
+#include <gio/gio.h>
 
-Superblock superblock;
-Inode* inode_table[INODE_TABLE_SIZE];
-char* data_blocks[NUM_BLOCKS];
-Directory root_directory;
+#define HOST_IO_CHUNK (1 << 20) // bytes per read or write in background file jobs
+#define HOST_IO_PROGRESS_MIN (4 << 20) // file jobs from this size on show a progress dialog
+#define FILE_PAGER_PREVIOUS 1 // dialog responses of the pager buttons
+#define FILE_PAGER_NEXT 2
 
 static GFileMonitor *monitor;
-void init_file_system();
-void free_memory();
-int allocate_block();
-void free_block(int block_number);
-int allocate_index_block();
-void free_index_block(int block_number);
-int create_inode(int is_directory, unsigned int mode, int owner_id, int group_id);
-int file_exists(const char *path);
-int create_file(const char *path, int is_directory);
-void delete_file(const char *filename, GtkWidget *parent);
-void rename_file(const char *old_name, const char *new_name, GtkWidget *parent);
 void list_files(GtkWidget *widget, gpointer data);
+void list_files_queue(GtkWidget *window, GFile *file);
+void list_files_update(GtkWidget *window, const char *name);
 void edit_file(const char *filename, GtkWidget *parent);
 void open_file(const char *filename, GtkWidget *parent);
 void create_file_dialog(GtkWidget *widget, gpointer data);
 void delete_file_dialog(GtkWidget *widget, gpointer data);
 void open_file_dialog(GtkWidget *widget, gpointer data);
 void show_message_dialog(GtkWidget *parent, GtkMessageType type, const gchar *message);
-void set_permissions(int inode_number, unsigned int permissions);
-unsigned int get_permissions(int inode_number);
-void add_acl_entry(int inode_number, int user_id, unsigned int permissions);
-void remove_acl_entry(int inode_number, int user_id);
-unsigned int get_acl_permissions(int inode_number, int user_id);
-void load_permissions();
-void save_permissions();
-void save_file_system_state();
-void load_file_system_state();
-
-int current_user_id = 11 ; //for testing purposes
-int current_group_id = 10 ;
-char TEST_FOLDER_PATH[MAX_FILENAME_LEN] = "C:/Users/CLIENT/Music/tests/"; //for current directory, change to your preference for testing
-char PREVIOUS_ROOT_PATH[MAX_FILENAME_LEN] = "C:/Users/CLIENT/Music/tests/";//to keep "root directory"
-
-const char* operation_to_string(JournalOperation operation) {
-    switch (operation) {
-        case CREATE: return "CREATED";
-        case DELETE: return "DELETED";
-        case MODIFY: return "MODIFIED";
-        case RENAME: return "RENAMED";
-        case READ: return "READ";
-        case CHANGE_PERMISSIONS: return "CHANGED PERMISSIONS";
-        default: return "UNKNOWN";
-    }
-}
 
-JournalOperation string_to_operation(const char* str) {
-    if (strcmp(str, "CREATE") == 0) return CREATE;
-    if (strcmp(str, "DELETE") == 0) return DELETE;
-    if (strcmp(str, "MODIFY") == 0) return MODIFY;
-    if (strcmp(str, "RENAME") == 0) return RENAME;
-    if (strcmp(str, "READ") == 0) return READ;
-    if (strcmp(str, "CHANGE_PERMISSIONS") == 0) return CHANGE_PERMISSIONS;
-    return -1; // Unknown operation
-}
+void on_directory_changed(GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event_type, gpointer user_data) {
 
-void init_journal() {
-    FILE *file = fopen(JOURNAL_FILENAME, "r");
-    if (file) {
-        char line[1024];
-        int index = 0;
-        while (fgets(line, sizeof(line), file) && index < JOURNAL_SIZE) {
-            char op_str[20], filename[MAX_FILENAME_LEN], new_filename[MAX_FILENAME_LEN], data[BLOCK_SIZE];
-            time_t timestamp;
-            if (sscanf(line, "%ld %s %s %s %s", &timestamp, op_str, filename, new_filename, data) >= 3) {
-                journal[index].timestamp = timestamp;
-                journal[index].operation = string_to_operation(op_str);
-                strncpy(journal[index].filename, filename, MAX_FILENAME_LEN - 1);
-                strncpy(journal[index].new_filename, new_filename, MAX_FILENAME_LEN - 1);
-                strncpy(journal[index].data, data, BLOCK_SIZE - 1);
-                index++;
-            }
-        }
-        fclose(file);
-        journal_index = index % JOURNAL_SIZE;
-    } else {
-        printf("Journal file not found, starting fresh\n");
-        journal_index = 0;
-    }
+    GtkWidget *window = GTK_WIDGET(user_data);
+    list_files_queue(window, file);
+    if (other_file != NULL) list_files_queue(window, other_file);
 }
 
+void show_message_dialog(GtkWidget *parent, GtkMessageType type, const gchar *message) {
 
-void save_journal() {
-    FILE *file = fopen(JOURNAL_FILENAME, "w");
-    if (file) {
-        for (int i = 0; i < JOURNAL_SIZE; i++) {
-            if (journal[i].timestamp == 0) continue; // Skip empty entries
-            fprintf(file, "%ld %s %s %s %s\n",
-                    journal[i].timestamp,
-                    operation_to_string(journal[i].operation),
-                    journal[i].filename,
-                    journal[i].new_filename,
-                    journal[i].data);
-        }
-        fclose(file);
-    } else {
-        printf("Error: Could not open journal file for writing\n");
-    }
+    GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(parent), GTK_DIALOG_MODAL, type, GTK_BUTTONS_OK, "%s", message);
+    gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
 }
 
-void add_journal_entry(JournalOperation operation, const char *filename, const char *new_filename, const char *data) {
-    if (filename == NULL) {
-        printf("Error: Filename is required for journal entry\n");
-        return;
-    }
-
-    journal[journal_index].operation = operation;
-    strncpy(journal[journal_index].filename, filename, MAX_FILENAME_LEN - 1);
-    journal[journal_index].filename[MAX_FILENAME_LEN - 1] = '\0';
+//report the result of an engine operation: `done` when it succeeded, otherwise what went wrong
+static void show_result_dialog(GtkWidget *parent, int result, const gchar *done) {
 
-    if (new_filename) {
-        strncpy(journal[journal_index].new_filename, new_filename, MAX_FILENAME_LEN - 1);
-        journal[journal_index].new_filename[MAX_FILENAME_LEN - 1] = '\0';
+    if (result == FS_OK) {
+        show_message_dialog(parent, GTK_MESSAGE_INFO, done);
     } else {
-        journal[journal_index].new_filename[0] = '\0';
-    }
-
-    if (data) {
-        strncpy(journal[journal_index].data, data, BLOCK_SIZE - 1);
-        journal[journal_index].data[BLOCK_SIZE - 1] = '\0';
-    } else {
-        journal[journal_index].data[0] = '\0';
-    }
-
-    journal[journal_index].timestamp = time(NULL);
-    journal_index = (journal_index + 1) % JOURNAL_SIZE;
-    save_journal();
-}
-
-
-void replay_journal() {
-    for (int i = 0; i < JOURNAL_SIZE; i++) {
-        JournalEntry *entry = &journal[i];
-        if (entry->timestamp == 0) continue; // Skip empty entries
-
-        printf("Replaying journal entry: %d, Operation: %s, Filename: %s\n", i, operation_to_string(entry->operation), entry->filename);
-
-        switch (entry->operation) {
-            case CREATE:
-                if (create_file(entry->filename, 0)) {
-                    printf("Error: Failed to create file %s during journal replay\n", entry->filename);
-                }
-                break;
-            case DELETE:
-                delete_file(entry->filename, NULL);
-                break;
-            case MODIFY: {
-                FILE *file = fopen(entry->filename, "w");
-                if (file) {
-                    if (fwrite(entry->data, 1, strlen(entry->data), file) != strlen(entry->data)) {
-                        printf("Error: Failed to write data to file %s during journal replay\n", entry->filename);
-                    }
-                    fclose(file);
-                } else {
-                    printf("Error: Could not open file %s for writing during journal replay\n", entry->filename);
-                }
-                break;
-            }
-            case RENAME:
-                rename_file(entry->filename, entry->new_filename, NULL);
-                break;
-            default:
-                printf("Warning: Unknown operation in journal entry\n");
-                break;
-        }
+        show_message_dialog(parent, GTK_MESSAGE_ERROR, fs_strerror(result));
     }
 }
 
 
-int find_inode_by_filename(const char *filename) {
-
-    if (filename == NULL || strlen(filename) == 0) {
-        printf("Error: Filename is NULL.\n");
-        return -1;
-    }
+//file listing
+//the file list keeps every entry of the current directory in listing.store, so a monitor event restats only
+//the entry it names. Events are collected in listing.pending and applied together LISTING_DEBOUNCE_MS after
+//the first one. While the search box holds text the view shows listing.results instead, the matches from
+//the name index across the whole tree
+#define LISTING_DEBOUNCE_MS 100
+#define LISTING_SEARCH_DELAY_MS 150
+#define LISTING_RESCAN_THRESHOLD 4096 // more pending names than this and the directory is read again instead
+#define NAME_SEARCH_MAX_RESULTS 1000
 
-    printf("Searching for file: '%s'\n", filename);
-
-    for (int i = 0; i < root_directory.entry_count; i++) {
-
-        printf("Comparing with: '%s'\n", root_directory.entries[i].name);
+typedef struct {
+    GtkListStore *store;        // name, type, size, then atime, ctime and mtime in seconds
+    GtkListStore *results;      // matches of search_text, named by their path from the root
+    GHashTable *rows;           // entry name -> its GtkTreeIter in store
+    GHashTable *pending;        // names with monitor events not applied yet
+    guint pending_source;
+    guint search_source;
+    char search_text[MAX_FILENAME_LEN];
+    char dir[MAX_FILENAME_LEN]; // host directory the rows and the monitor belong to
+    GFileMonitor *monitor;
+} FileListing;
 
-        if (strcmp(root_directory.entries[i].name, filename) == 0) {
+static FileListing listing;
 
-            printf("Found inode number %d for file: '%s'\n", root_directory.entries[i].inode_number, filename);
-            return root_directory.entries[i].inode_number;
-        }
-    }
+//times are kept as numbers and formatted when a row is drawn, so only the rows on screen pay for strftime
+static void listing_render_time(GtkTreeViewColumn *column, GtkCellRenderer *renderer, GtkTreeModel *model, GtkTreeIter *iter, gpointer data) {
 
-    printf("Error: File '%s' not found in root directory\n", filename);
+    gint64 seconds;
+    char time_str[20];
 
-    return -1;
+    gtk_tree_model_get(model, iter, GPOINTER_TO_INT(data), &seconds, -1);
+    time_t t = (time_t)seconds;
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", localtime(&t));
+    g_object_set(renderer, "text", time_str, NULL);
 }
 
+//create the listing models; the list view starts with listing.store
+static void listing_init() {
 
-
-void on_directory_changed(GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event_type, gpointer user_data) {
-
-    GtkWidget *window = GTK_WIDGET(user_data);
-    list_files(NULL, window);
+    listing.store = gtk_list_store_new(6, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT, G_TYPE_INT64, G_TYPE_INT64, G_TYPE_INT64);
+    listing.results = gtk_list_store_new(6, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT, G_TYPE_INT64, G_TYPE_INT64, G_TYPE_INT64);
+    listing.rows = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    listing.pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 }
 
-void show_message_dialog(GtkWidget *parent, GtkMessageType type, const gchar *message) {
-
-    GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(parent), GTK_DIALOG_MODAL, type, GTK_BUTTONS_OK, "%s", message);
-    gtk_dialog_run(GTK_DIALOG(dialog));
-    gtk_widget_destroy(dialog);
+//insert or update the row of one entry from its host stat
+static void listing_put_row(const char *name, const struct stat *file_stat) {
+
+    const char *type = S_ISDIR(file_stat->st_mode) ? "Directory" : "File";
+    GtkTreeIter *row = g_hash_table_lookup(listing.rows, name);
+
+    if (row == NULL) {
+        row = g_new(GtkTreeIter, 1);
+        gtk_list_store_insert_with_values(listing.store, row, -1,
+                                          0, name,
+                                          1, type,
+                                          2, (gint)file_stat->st_size,
+                                          3, (gint64)file_stat->st_atime,
+                                          4, (gint64)file_stat->st_ctime,
+                                          5, (gint64)file_stat->st_mtime,
+                                          -1);
+        g_hash_table_insert(listing.rows, g_strdup(name), row);
+        return;
+    }
+    gtk_list_store_set(listing.store, row,
+                       1, type,
+                       2, (gint)file_stat->st_size,
+                       3, (gint64)file_stat->st_atime,
+                       4, (gint64)file_stat->st_ctime,
+                       5, (gint64)file_stat->st_mtime,
+                       -1);
 }
 
+//bring the row of one entry of the listed directory up to date, dropping it if the entry is gone
+static void listing_apply(const char *name) {
 
+    struct stat file_stat;
+    char full_path[MAX_FILENAME_LEN];
 
-//file initialization
-void init_file_system() {
-    // Initialize superblock
-    superblock._size = NUM_BLOCKS * BLOCK_SIZE;
-    superblock.num_blocks = NUM_BLOCKS;
-    superblock.free_blocks = NUM_BLOCKS - 1;
-    superblock.inode_table_size = INODE_TABLE_SIZE;
-    superblock.free_inode_count = INODE_TABLE_SIZE;
-    memset(superblock.free_block_bitmap, 0, sizeof(superblock.free_block_bitmap));
-
-    // Allocate and initialize inodes
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table[i] = (Inode*)malloc(sizeof(Inode));
-        if (inode_table[i] == NULL) {
-            printf("Failed to allocate memory for inode %d\n", i);
-            exit(EXIT_FAILURE);
-        }
-        memset(inode_table[i], 0, sizeof(Inode));
+    snprintf(full_path, sizeof(full_path), "%s%s", listing.dir, name);
+    if (stat(full_path, &file_stat) == 0) {
+        listing_put_row(name, &file_stat);
+        return;
     }
 
-    // Allocate memory for data blocks
-    for (int i = 0; i < NUM_BLOCKS; i++) {
-        data_blocks[i] = (char *)malloc(BLOCK_SIZE);
-        if (data_blocks[i] == NULL) {
-            printf("Failed to allocate memory for data block %d\n", i);
-            exit(EXIT_FAILURE);
-        }
+    GtkTreeIter *row = g_hash_table_lookup(listing.rows, name);
+    if (row != NULL) {
+        gtk_list_store_remove(listing.store, row);
+        g_hash_table_remove(listing.rows, name);
     }
-
-    // Initialize root directory
-    root_directory.entry_count = 0;
-
-    // Try to load the file system state from disk
-    load_file_system_state();
 }
 
+//watch listing.dir instead of the previously listed directory
+static void listing_watch(GtkWidget *window) {
 
+    if (listing.monitor != NULL) {
+        g_file_monitor_cancel(listing.monitor);
+        g_object_unref(listing.monitor);
+    }
 
-void save_file_system_state() {
-
-    FILE *fs_file = fopen("file_system_state.dat", "wb");
-    if (!fs_file) {
-        perror("Failed to open file system state file");
-        return;
+    GFile *directory = g_file_new_for_path(listing.dir);
+    listing.monitor = g_file_monitor_directory(directory, G_FILE_MONITOR_NONE, NULL, NULL);
+    if (listing.monitor != NULL) {
+        g_signal_connect(listing.monitor, "changed", G_CALLBACK(on_directory_changed), window);
+    } else {
+        printf("Could not watch %s, use Refresh to update the list\n", listing.dir);
     }
+    g_object_unref(directory);
+}
 
-    // Save superblock
-    fwrite(&superblock, sizeof(superblock), 1, fs_file);
+static void listing_cancel_pending() {
 
-    // Save inodes
-    for (int i = 0; i < superblock.inode_table_size; i++) {
-        fwrite(inode_table[i], sizeof(Inode), 1, fs_file);
+    if (listing.pending_source != 0) {
+        g_source_remove(listing.pending_source);
+        listing.pending_source = 0;
     }
-
-    fclose(fs_file);
+    g_hash_table_remove_all(listing.pending);
 }
 
+//show the matches of search_text from the name index, or the listed directory when it is empty. Results
+//are described from their inodes, so nothing is read from the host folder
+static gboolean listing_search(gpointer data) {
 
+    GtkWidget *window = GTK_WIDGET(data);
+    GtkTreeView *list_view = GTK_TREE_VIEW(g_object_get_data(G_OBJECT(window), "list_view"));
 
-void load_file_system_state() {
+    listing.search_source = 0;
+    if (listing.search_text[0] == '\0') {
+        gtk_tree_view_set_model(list_view, GTK_TREE_MODEL(listing.store));
+        return FALSE;
+    }
+
+    NameMatch *matches = malloc(NAME_SEARCH_MAX_RESULTS * sizeof(NameMatch));
+    if (matches == NULL) return FALSE;
+    int count = name_index_search(listing.search_text, 0, matches, NAME_SEARCH_MAX_RESULTS);
+
+    gtk_tree_view_set_model(list_view, NULL);
+    gtk_list_store_clear(listing.results);
+    g_rw_lock_reader_lock(&namespace_lock);
+    for (int i = 0; i < count; i++) {
+        const Inode *inode = &inode_table[matches[i].inode_number];
+        const InodeCold *cold = inode_cold(matches[i].inode_number);
+        char *path = g_strdup_printf("/%s", matches[i].path);
+        gtk_list_store_insert_with_values(listing.results, NULL, -1,
+                                          0, path,
+                                          1, inode->is_directory ? "Directory" : "File",
+                                          2, (gint)inode->_size,
+                                          3, (gint64)cold->atime,
+                                          4, (gint64)cold->ctime,
+                                          5, (gint64)cold->mtime,
+                                          -1);
+        g_free(path);
+    }
+    g_rw_lock_reader_unlock(&namespace_lock);
+    gtk_tree_view_set_model(list_view, GTK_TREE_MODEL(listing.results));
+
+    free(matches);
+    return FALSE;
+}
 
-    FILE *fs_file = fopen("file_system_state.dat", "rb");
-    if (!fs_file) {
-        printf("Initializing new file system.\n");
-        return;
-    }
+static gboolean listing_flush(gpointer data) {
 
-    // Load superblock
-    fread(&superblock, sizeof(superblock), 1, fs_file);
+    GtkWidget *window = GTK_WIDGET(data);
+    GHashTableIter it;
+    gpointer name;
 
-    // Allocate and load inodes
-    for (int i = 0; i < superblock.inode_table_size; i++) {
-        inode_table[i] = (Inode*)malloc(sizeof(Inode));
-        if (inode_table[i] == NULL) {
-            printf("Failed to allocate memory for inode %d\n", i);
-            exit(EXIT_FAILURE);
-        }
-        fread(inode_table[i], sizeof(Inode), 1, fs_file);
+    listing.pending_source = 0;
+    if (g_hash_table_size(listing.pending) > LISTING_RESCAN_THRESHOLD) {
+        list_files(NULL, window);
+        return FALSE;
     }
 
-    // Allocate memory for data blocks
-    for (int i = 0; i < NUM_BLOCKS; i++) {
-        data_blocks[i] = (char *)malloc(BLOCK_SIZE);
-        if (data_blocks[i] == NULL) {
-            printf("Failed to allocate memory for data block %d\n", i);
-            exit(EXIT_FAILURE);
-        }
+    g_hash_table_iter_init(&it, listing.pending);
+    while (g_hash_table_iter_next(&it, &name, NULL)) {
+        listing_apply(name);
     }
-
-    fclose(fs_file);
+    g_hash_table_remove_all(listing.pending);
+    if (listing.search_text[0] != '\0') listing_search(window);
+    return FALSE;
 }
 
+//note a monitor event for an entry of the listed directory; its row is updated with the rest of the burst
+void list_files_queue(GtkWidget *window, GFile *file) {
 
+    gchar *name = g_file_get_basename(file);
+    if (name == NULL) return;
 
-//set permissions
-void set_permissions(int inode_number, unsigned int permissions) {
-    if (inode_number < 0 || inode_number >= INODE_TABLE_SIZE) return;
-    if ((permissions & ~(PERMISSION_READ | PERMISSION_WRITE | PERMISSION_EXECUTE)) != 0) {
-        printf("Invalid permissions value: %u\n", permissions);
-        return;
+    g_hash_table_add(listing.pending, name);
+    if (listing.pending_source == 0) {
+        listing.pending_source = g_timeout_add(LISTING_DEBOUNCE_MS, listing_flush, window);
     }
-    inode_table[inode_number]->mode = permissions;
-    printf("Set permissions for inode %d to %u\n", inode_number, permissions);
 }
 
+//update the row of an entry the GUI just created, changed or removed. Names outside the listed directory
+//are left to the next listing of their own directory
+void list_files_update(GtkWidget *window, const char *name) {
 
+    if (listing.search_text[0] != '\0') listing_search(window);
+    if (name == NULL || name[0] == '\0' || strchr(name, '/') != NULL || strchr(name, '\\') != NULL) return;
+    if (strcmp(listing.dir, TEST_FOLDER_PATH) != 0) return;
+    listing_apply(name);
+}
 
-//get permissions
-unsigned int get_permissions(int inode_number) {
+//list files
+//read the current directory again into the listing and watch it; used after a change of directory, for
+//Refresh and when too many events arrive at once
+void list_files(GtkWidget *widget, gpointer data) {
 
-    if (inode_number < 0 || inode_number >= INODE_TABLE_SIZE) return 0;
-    return inode_table[inode_number]->mode;
-}
+    GtkWidget *window = GTK_WIDGET(data);
+    GtkWidget *list_view = g_object_get_data(G_OBJECT(window), "list_view");
 
+    DIR *dir;
+    struct dirent *entry;
+    struct stat file_stat;
+    char full_path[MAX_FILENAME_LEN];
 
-void add_acl_entry(int inode_number, int user_id, unsigned int permissions) {
+    if ((dir = opendir(TEST_FOLDER_PATH)) == NULL) {
 
-    if (inode_number < 0 || inode_number >= INODE_TABLE_SIZE) return;
-    Inode *inode = inode_table[inode_number];
-    if (inode->acl_count >= MAX_ACL_ENTRIES) {
-        printf("ACL entry limit reached\n");
+        perror("opendir");
         return;
     }
 
-    if ((permissions & ~(PERMISSION_READ | PERMISSION_WRITE | PERMISSION_EXECUTE)) != 0) {
-        printf("Invalid permissions value: %u\n", permissions);
-        return;
+    listing_cancel_pending();
+    if (strcmp(listing.dir, TEST_FOLDER_PATH) != 0) {
+        snprintf(listing.dir, sizeof(listing.dir), "%s", TEST_FOLDER_PATH);
+        listing_watch(window);
     }
 
-    inode->acl[inode->acl_count].user_id = user_id;
-    inode->acl[inode->acl_count].permissions = permissions;
-    inode->acl_count++;
-}
+    // Refill with the view detached, so it does not follow every row
+    gtk_tree_view_set_model(GTK_TREE_VIEW(list_view), NULL);
+    g_hash_table_remove_all(listing.rows);
+    gtk_list_store_clear(listing.store);
 
+    while ((entry = readdir(dir)) != NULL) {
 
-
-void remove_acl_entry(int inode_number, int user_id) {
-    if (inode_number < 0 || inode_number >= INODE_TABLE_SIZE) return;
-
-    Inode *inode = inode_table[inode_number];
-    int found = 0;
-
-    for (int i = 0; i < inode->acl_count; i++) {
-        if (inode->acl[i].user_id == user_id) {
-            memmove(&inode->acl[i], &inode->acl[i + 1], (inode->acl_count - i - 1) * sizeof(ACL_Entry));
-            inode->acl_count--;
-            found = 1;
-            printf("Removed ACL entry for inode %d, user %d\n", inode_number, user_id);
-            break;
+        // Skip directories like '.' and '..'
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
         }
-    }
-
-    if (!found) {
-        printf("No ACL entry found for inode %d, user %d\n", inode_number, user_id);
-    }
-}
 
-unsigned int get_acl_permissions(int inode_number, int user_id) {
+        snprintf(full_path, sizeof(full_path), "%s%s", TEST_FOLDER_PATH, entry->d_name);
 
-    if (inode_number < 0 || inode_number >= INODE_TABLE_SIZE) return 0;
-    Inode *inode = inode_table[inode_number];
+        if (stat(full_path, &file_stat) == -1) {
 
-    for (int i = 0; i < inode->acl_count; i++) {
-        if (inode->acl[i].user_id == user_id) {
-            printf("Found ACL entry for inode %d, user %d: %u\n", inode_number, user_id, inode->acl[i].permissions);
-            return inode->acl[i].permissions;
+            perror("stat");
+            continue;
         }
-    }
-    return 0;
-}
-
-int has_permission(int inode_number, int user_id, unsigned int required_permission) {
-    if (inode_number < 0 || inode_number >= INODE_TABLE_SIZE) {
-        return 0;
-    }
-
-    Inode *inode = inode_table[inode_number];
 
-    // Check the base permissions
-    unsigned int permissions = 0;
-    if (user_id == inode->owner_id) {
-        permissions = (inode->mode >> 6) & 0x7; // Owner permissions
-    } else if (user_id == inode->group_id) {
-        permissions = (inode->mode >> 3) & 0x7; // Group permissions
-    } else {
-        permissions = inode->mode & 0x7; // Others permissions
+        listing_put_row(entry->d_name, &file_stat);
     }
 
-    // Check ACL permissions
-    permissions |= get_acl_permissions(inode_number, user_id);
-
-    return (permissions & required_permission) == required_permission;
-}
-
-
-
-
-void free_memory() {
-
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        if (inode_table[i]) {
-            free(inode_table[i]);
-            inode_table[i] = NULL;
-        }
-    }
+    closedir(dir);
 
-    for (int i = 0; i < NUM_BLOCKS; i++) {
-        if (data_blocks[i]) {
-            free(data_blocks[i]);
-            data_blocks[i] = NULL;
-        }
-    }
+    gtk_tree_view_set_model(GTK_TREE_VIEW(list_view), GTK_TREE_MODEL(listing.search_text[0] != '\0' ? listing.results : listing.store));
 }
 
 
+//edit file
+//background host file jobs: saves from the editor and pastes run on GTask worker threads so large files never
+//block the main loop. Workers touch only the job; its completion callback runs on the main loop
+typedef enum {
+    HOST_IO_SAVE,
+    HOST_IO_COPY,
+    HOST_IO_COPY_TREE // a directory and everything below it, through copy_tree
+} HostIoKind;
 
-int allocate_block() {
-
-    for (int i = 0; i < NUM_BLOCKS; i++) {
-        if (superblock.free_block_bitmap[i] == 0) {
-            superblock.free_block_bitmap[i] = 1;
-            superblock.free_blocks--;
-            return i;
-        }
-    }
-    return -1;
+typedef struct {
+    HostIoKind kind;
+    char filename[MAX_FILENAME_LEN]; // as the user gave it, for the follow-up dialogs and the journal
+    char path[MAX_FILENAME_LEN + 1]; // host file read (load, copy) or written (save)
+    char dest_path[MAX_FILENAME_LEN + 1]; // copy target
+    char source[MAX_PATH_LEN + 1]; // copy tree: the directory copied, from the root
+    FileView *view; // save: the edited file, owned by the job
+    unsigned char *diff; // save: MODIFY diff of the edited pages, NULL if none changed
+    uint32_t diff_len;
+    int64_t total; // bytes to move, for the progress bar
+    gint progress; // permille done, set by the worker with g_atomic_int_set
+    const char *error; // message for the user when the job fails
+    GCancellable *cancellable;
+    GtkWidget *parent;
+    GtkWidget *progress_dialog; // only for jobs of at least HOST_IO_PROGRESS_MIN bytes
+    GtkWidget *progress_bar;
+    guint progress_timer;
+} HostIoJob;
+
+static HostIoJob *host_io_job_new(HostIoKind kind, const char *filename, GtkWidget *parent) {
+
+    HostIoJob *job = calloc(1, sizeof(HostIoJob));
+    if (job == NULL) return NULL;
+    job->kind = kind;
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    snprintf(job->path, sizeof(job->path), "%s%s", TEST_FOLDER_PATH, filename);
+    job->parent = parent;
+    return job;
 }
 
-void free_block(int block_number) {
+static void host_io_job_free(gpointer data) {
 
-    if (block_number < 0 || block_number >= NUM_BLOCKS) return;
-    if (superblock.free_block_bitmap[block_number] == 1) {
-        superblock.free_block_bitmap[block_number] = 0;
-        superblock.free_blocks++;
-    }
+    HostIoJob *job = data;
+    file_view_close(job->view);
+    free(job->diff);
+    if (job->cancellable != NULL) g_object_unref(job->cancellable);
+    free(job);
 }
 
-int allocate_index_block() {
-
-    for (int i = 0; i < NUM_BLOCKS; i++) {
-        if (superblock.free_block_bitmap[i] == 0) {
-            superblock.free_block_bitmap[i] = 1;
-            superblock.free_blocks--;
-            return i;
-        }
-    }
+static void host_io_report(HostIoJob *job, int64_t done) {
 
-    return -1;
+    g_atomic_int_set(&job->progress, job->total > 0 ? (gint)(done * 1000 / job->total) : 1000);
 }
 
-void free_index_block(int block_number) {
+//write the edited pages back and journal them as one diff with a hunk per page. Not cancellable, a
+//half-written edit would leave neither version
+static int host_io_save(HostIoJob *job) {
 
-    if (block_number < 0 || block_number >= NUM_BLOCKS) return;
-    if (superblock.free_block_bitmap[block_number] == 1) {
-        superblock.free_block_bitmap[block_number] = 0;
-        superblock.free_blocks++;
-    }
-}
-
-int create_inode(int is_directory, unsigned int mode, int owner_id, int group_id) {
-    if (superblock.free_inode_count == 0) {
-        printf("No free inodes available\n");
+    if (file_view_save(job->view, &job->diff, &job->diff_len) != 0) {
+        job->error = "Failed to save the file, it may have changed since it was opened.";
         return -1;
     }
-
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-
-        if (inode_table[i]->_size == 0) {
-            inode_table[i]->is_directory = is_directory;
-            inode_table[i]->_size = 0;
-            inode_table[i]->mode = mode;
-            inode_table[i]->atime = inode_table[i]->mtime = inode_table[i]->ctime = time(NULL);
-            inode_table[i]->owner_id = owner_id;
-            inode_table[i]->group_id = group_id;
-            inode_table[i]->acl_count = 0;
-            memset(inode_table[i]->direct_blocks, -1, sizeof(inode_table[i]->direct_blocks));
-            inode_table[i]->index_block = -1;
-            superblock.free_inode_count--;
-            printf("Created inode for %s\n", is_directory ? "directory" : "file");
-            return i;
+    host_io_report(job, job->total);
+
+    // The inode is looked up under the lock, the append and its fsync wait run without it
+    char fs_path[MAX_PATH_LEN];
+    if (job->diff != NULL && make_fs_path(job->filename, fs_path) == 0) {
+        g_rw_lock_reader_lock(&namespace_lock);
+        int inode_number = resolve_path(fs_path);
+        g_rw_lock_reader_unlock(&namespace_lock);
+        if (add_journal_record(MODIFY, inode_number, fs_path, NULL, JOURNAL_PAYLOAD_INLINE, job->diff, job->diff_len) != 0) {
+            job->error = "The file was saved, but the change could not be written to the journal.";
+            return -1;
         }
     }
-    return -1;
+    return 0;
 }
 
-
-
-int file_exists(const char *path) {
-
-    char full_path[MAX_FILENAME_LEN];
-    snprintf(full_path, sizeof(full_path), "%s%s", TEST_FOLDER_PATH, path);
-    return access(full_path, F_OK) == 0;
+//copy as much of src to dest as the kernel will without the data passing through user space: a reflink
+//where the host file system can share blocks between files, else copy_file_range(), else sendfile(), in
+//HOST_IO_CHUNK pieces. Both descriptors are left at the end of what was copied; returns its length
+static int64_t host_io_copy_kernel(HostIoJob *job, int src, int dest) {
+
+#ifdef __linux__
+    if (ioctl(dest, FICLONE, src) == 0) {
+        lseek(src, 0, SEEK_END);
+        lseek(dest, 0, SEEK_END);
+        host_io_report(job, job->total);
+        return job->total;
+    }
+
+    int64_t done = 0;
+    int use_sendfile = 0;
+    while (done < job->total && !g_cancellable_is_cancelled(job->cancellable)) {
+        size_t want = job->total - done < HOST_IO_CHUNK ? (size_t)(job->total - done) : HOST_IO_CHUNK;
+        ssize_t got = -1;
+        if (!use_sendfile) {
+            got = copy_file_range(src, NULL, dest, NULL, want, 0);
+            // Older kernels and some file system pairs cannot do it, sendfile() still avoids the copy out
+            if (got < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) use_sendfile = 1;
+        }
+        if (use_sendfile) got = sendfile(dest, src, NULL, want);
+        if (got <= 0) break;
+        done += got;
+        host_io_report(job, done);
+    }
+    return done;
+#else
+    (void)job;
+    (void)src;
+    (void)dest;
+    return 0;
+#endif
 }
 
-//create file
-int create_file(const char *path, int is_directory) {
+//copy job->path to job->dest_path, through host_io_copy_kernel and then in HOST_IO_CHUNK pieces for whatever
+//it left; a cancelled or failed copy removes the partial target
+static int host_io_copy(HostIoJob *job) {
 
-    if (file_exists(path)) {
-        printf("File already exists: %s\n", path);
-        show_message_dialog(NULL, GTK_MESSAGE_INFO, "The file already exists");
+    int src = open(job->path, O_RDONLY | O_BINARY);
+    struct stat st;
+    if (src == -1 || fstat(src, &st) != 0) {
+        if (src != -1) close(src);
+        job->error = "Failed to open source file.";
         return -1;
     }
-
-    char full_path[MAX_FILENAME_LEN];
-    snprintf(full_path, sizeof(full_path), "%s%s", TEST_FOLDER_PATH, path);
-
-    unsigned int default_permissions = 0777; // Default permissions for files
-    int inode_number = create_inode(is_directory, default_permissions, current_user_id, current_group_id);
-    if (inode_number == -1) {
-        printf("Failed to create inode for file\n");
+    int dest = open(job->dest_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    char *buffer = malloc(HOST_IO_CHUNK);
+    if (dest == -1 || buffer == NULL) {
+        if (dest != -1) close(dest);
+        close(src);
+        free(buffer);
+        job->error = dest == -1 ? "Failed to create destination file." : "Failed to allocate memory.";
         return -1;
     }
 
-    strcpy(root_directory.entries[root_directory.entry_count].name, path);
-    root_directory.entries[root_directory.entry_count].inode_number = inode_number;
-    root_directory.entry_count++;
+    job->total = st.st_size;
+    int64_t done = host_io_copy_kernel(job, src, dest);
+    ssize_t got;
+    while ((got = read(src, buffer, HOST_IO_CHUNK)) > 0) {
+        if (g_cancellable_is_cancelled(job->cancellable)) {
+            job->error = "Copy cancelled.";
+            break;
+        }
+        if (write(dest, buffer, (size_t)got) != got) {
+            job->error = "Failed to write destination file.";
+            break;
+        }
+        done += got;
+        host_io_report(job, done);
+    }
+    if (got < 0) job->error = "Failed to read source file.";
 
-    FILE *file = fopen(full_path, is_directory ? "w" : "w+");
-    if (file == NULL) {
-        perror("Failed to create file");
+    free(buffer);
+    close(src);
+    if (close(dest) != 0 && job->error == NULL) job->error = "Failed to write destination file.";
+    if (job->error != NULL) {
+        remove(job->dest_path);
         return -1;
     }
-    fclose(file);
-
-    add_journal_entry(CREATE, path, NULL, NULL);
-
     return 0;
 }
 
+//copy job->source to job->filename in the file system and the host folder; copy_tree removes a partial copy
+static int host_io_copy_tree(HostIoJob *job) {
 
-
-//delete file
-void delete_file(const char *filename, GtkWidget *parent) {
-    char full_path[MAX_FILENAME_LEN];
-    snprintf(full_path, sizeof(full_path), "%s%s", TEST_FOLDER_PATH, filename);
-
-    if (access(full_path, 0) != 0) {
-        perror("File does not exist");
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "File does not exist.");
-        return;
-    }
-
-
-    // Remove file from disk
-    if (remove(full_path) != 0) {
-        perror("Failed to delete file");
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to delete file.");
-        return;
+    if (copy_tree(job->source, job->filename) != FS_OK) {
+        job->error = "Failed to copy the directory.";
+        return -1;
     }
+    return 0;
+}
 
-    // Remove file entry from the root directory and free inode
-    for (int i = 0; i < root_directory.entry_count; i++) {
-        if (strcmp(root_directory.entries[i].name, filename) == 0) {
-            // Free blocks and reset inode
-            int inode_number = root_directory.entries[i].inode_number;
-            Inode *inode = inode_table[inode_number];
-
-            for (int j = 0; j < DIRECT_BLOCKS; j++) {
-                if (inode->direct_blocks[j] != -1) {
-                    free_block(inode->direct_blocks[j]);
-                    inode->direct_blocks[j] = -1;
-                }
-            }
-
-            if (inode->index_block != -1) {
-                free_index_block(inode->index_block);
-                inode->index_block = -1;
-            }
-
-            inode->is_directory = 0;
-            inode->_size = 0;
-            inode->mtime = time(NULL);
-            inode->ctime = time(NULL);
+static void host_io_thread(GTask *task, gpointer source, gpointer task_data, GCancellable *cancellable) {
 
-            // Remove from root directory
-            memmove(&root_directory.entries[i], &root_directory.entries[i + 1], (root_directory.entry_count - i - 1) * sizeof(DirectoryEntry));
-            root_directory.entry_count--;
+    HostIoJob *job = task_data;
+    int result = job->kind == HOST_IO_SAVE ? host_io_save(job) :
+                 job->kind == HOST_IO_COPY_TREE ? host_io_copy_tree(job) : host_io_copy(job);
+    g_task_return_boolean(task, result == 0);
+}
 
-            printf("Deleted file: %s\n", filename);
-            show_message_dialog(parent, GTK_MESSAGE_INFO, "File deleted successfully.");
-            break;
-        }
-    }
+static gboolean host_io_progress_tick(gpointer data) {
 
-    add_journal_entry(DELETE, filename, NULL, NULL);
+    HostIoJob *job = data;
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(job->progress_bar), g_atomic_int_get(&job->progress) / 1000.0);
+    return TRUE;
 }
 
+static void host_io_progress_response(GtkDialog *dialog, gint response, gpointer data) {
 
-//rename file
-void rename_file(const char *old_name, const char *new_name, GtkWidget *parent) {
+    HostIoJob *job = data;
+    g_cancellable_cancel(job->cancellable);
+}
 
-    if (file_exists(new_name)) {
-        printf("File already exists: %s\n", new_name);
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "File with that name already exists.");
-        return;
-    }
+//the window manager's close button cancels a copy like the Cancel button and leaves a save running; the dialog
+//stays up either way until host_io_finish closes it
+static gboolean host_io_progress_delete(GtkWidget *dialog, GdkEvent *event, gpointer data) {
 
-    char old_path[MAX_FILENAME_LEN];
-    char new_path[MAX_FILENAME_LEN];
-    snprintf(old_path, sizeof(old_path), "%s%s", TEST_FOLDER_PATH, old_name);
-    snprintf(new_path, sizeof(new_path), "%s%s", TEST_FOLDER_PATH, new_name);
+    HostIoJob *job = data;
+    if (job->kind != HOST_IO_SAVE) g_cancellable_cancel(job->cancellable);
+    return TRUE;
+}
 
-    if (rename(old_path, new_path) != 0) {
-        perror("Failed to rename file");
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to rename file.");
-        return;
-    }
+//the dialog also goes with its parent window; forget it then, so neither the timer nor host_io_finish touch it
+static void host_io_progress_destroyed(GtkWidget *dialog, gpointer data) {
 
-    // Update root directory
-    for (int i = 0; i < root_directory.entry_count; i++) {
-        if (strcmp(root_directory.entries[i].name, old_name) == 0) {
-            strcpy(root_directory.entries[i].name, new_name);
-            printf("Renamed file from %s to %s\n", old_name, new_name);
-            show_message_dialog(parent, GTK_MESSAGE_INFO, "File renamed successfully.");
-            break;
-        }
+    HostIoJob *job = data;
+    if (job->progress_timer != 0) {
+        g_source_remove(job->progress_timer);
+        job->progress_timer = 0;
     }
-
-    add_journal_entry(RENAME, old_name, new_name, NULL);
+    job->progress_dialog = NULL;
+    job->progress_bar = NULL;
 }
 
+//run a job on a worker thread; `done` gets it back on the main loop through g_task_get_task_data once it finished,
+//and must call host_io_finish. Jobs on large files show a progress dialog, with a Cancel button unless they save
+static void host_io_start(HostIoJob *job, GAsyncReadyCallback done) {
+
+    job->cancellable = g_cancellable_new();
+
+    struct stat st;
+    int64_t size = job->kind == HOST_IO_SAVE ? job->total : stat(job->path, &st) == 0 ? (int64_t)st.st_size : 0;
+    if (size >= HOST_IO_PROGRESS_MIN) {
+        job->progress_dialog = gtk_dialog_new_with_buttons(
+            job->kind == HOST_IO_SAVE ? "Saving" : "Copying",
+            GTK_WINDOW(job->parent),
+            GTK_DIALOG_DESTROY_WITH_PARENT,
+            job->kind == HOST_IO_SAVE ? NULL : "_Cancel",
+            GTK_RESPONSE_CANCEL,
+            NULL
+        );
+        job->progress_bar = gtk_progress_bar_new();
+        gtk_progress_bar_set_text(GTK_PROGRESS_BAR(job->progress_bar), job->filename);
+        gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(job->progress_bar), TRUE);
+        GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(job->progress_dialog));
+        gtk_box_pack_start(GTK_BOX(content_area), job->progress_bar, TRUE, TRUE, 10);
+        g_signal_connect(job->progress_dialog, "response", G_CALLBACK(host_io_progress_response), job);
+        g_signal_connect(job->progress_dialog, "delete-event", G_CALLBACK(host_io_progress_delete), job);
+        g_signal_connect(job->progress_dialog, "destroy", G_CALLBACK(host_io_progress_destroyed), job);
+        gtk_widget_show_all(job->progress_dialog);
+        job->progress_timer = g_timeout_add(100, host_io_progress_tick, job);
+    }
+
+    GTask *task = g_task_new(NULL, job->cancellable, done, NULL);
+    g_task_set_task_data(task, job, host_io_job_free);
+    g_task_run_in_thread(task, host_io_thread);
+    g_object_unref(task);
+}
 
-//list files
-void list_files(GtkWidget *widget, gpointer data) {
-
-    GtkWidget *window = GTK_WIDGET(data);
-    GtkWidget *list_view = g_object_get_data(G_OBJECT(window), "list_view");
-    GtkWidget *search_entry = g_object_get_data(G_OBJECT(window), "search_entry");
-
-    const gchar *search_text = gtk_entry_get_text(GTK_ENTRY(search_entry));
-    GtkListStore *list_store = GTK_LIST_STORE(gtk_tree_view_get_model(GTK_TREE_VIEW(list_view)));
-    gtk_list_store_clear(list_store);
-
-    DIR *dir;
-    struct dirent *entry;
-    struct stat file_stat;
-    char full_path[MAX_FILENAME_LEN];
-    char atime_str[20], ctime_str[20], mtime_str[20];
-
-    if ((dir = opendir(TEST_FOLDER_PATH)) == NULL) {
+//close a finished job's progress dialog; returns its job, or NULL after showing why it failed
+static HostIoJob *host_io_finish(GAsyncResult *result) {
 
-        perror("opendir");
-        return;
+    HostIoJob *job = g_task_get_task_data(G_TASK(result));
+    if (job->progress_dialog != NULL) {
+        gtk_widget_destroy(job->progress_dialog); // host_io_progress_destroyed stops the timer
     }
+    if (!g_task_propagate_boolean(G_TASK(result), NULL)) {
+        show_message_dialog(job->parent, GTK_MESSAGE_ERROR, job->error ? job->error : "File operation failed.");
+        return NULL;
+    }
+    return job;
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-
-        // Skip directories like '.' and '..'
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        // If search_text is not empty, check if the file name contains the search text
-
-        if (strlen(search_text) > 0 && strstr(entry->d_name, search_text) == NULL) {
-            continue;
-        }
-
-        snprintf(full_path, sizeof(full_path), "%s%s", TEST_FOLDER_PATH, entry->d_name);
-
-        if (stat(full_path, &file_stat) == -1) {
-
-            perror("stat");
-            continue;
-        }
-
-        // Format times
-        strftime(atime_str, sizeof(atime_str), "%Y-%m-%d %H:%M", localtime(&file_stat.st_atime));
-        strftime(ctime_str, sizeof(ctime_str), "%Y-%m-%d %H:%M", localtime(&file_stat.st_ctime));
-        strftime(mtime_str, sizeof(mtime_str), "%Y-%m-%d %H:%M", localtime(&file_stat.st_mtime));
-
+static void edit_file_saved(GObject *source, GAsyncResult *result, gpointer data) {
 
-        GtkTreeIter iter;
-        gtk_list_store_append(list_store, &iter);
-        gtk_list_store_set(list_store, &iter,
-                           0, entry->d_name,
-                           1, S_ISDIR(file_stat.st_mode) ? "Directory" : "File",
-                           2, (gint)file_stat.st_size,
-                           3, atime_str,
-                           4, ctime_str,
-                           5, mtime_str,
-                           -1);
+    HostIoJob *job = host_io_finish(result);
+    if (job != NULL) {
+        show_message_dialog(job->parent, GTK_MESSAGE_INFO, "File edited successfully.");
     }
-
-    closedir(dir);
 }
 
+//show one page of a file pager. Pages that are not valid UTF-8 are shown with replacement characters and
+//cannot be edited
+static void file_pager_show(FileView *view, int64_t page, int editable, GtkTextView *text_view, GtkWidget *label, GtkWidget *dialog) {
 
-//edit file
-void edit_file(const char *filename, GtkWidget *parent) {
-
-    if (strlen(filename) >= MAX_FILENAME_LEN) {
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Filename too long.");
-        return;
-    }
+    size_t length;
+    const char *text = file_view_page(view, page, &length);
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(text_view);
+    int valid = text != NULL && g_utf8_validate(text, (gssize)length, NULL);
+    if (valid) {
+        gtk_text_buffer_set_text(buffer, text, (gint)length);
+    } else {
+        gchar *shown = text != NULL ? g_utf8_make_valid(text, (gssize)length) : g_strdup("Failed to read this part of the file.");
+        gtk_text_buffer_set_text(buffer, shown, -1);
+        g_free(shown);
+    }
+    gtk_text_buffer_set_modified(buffer, FALSE);
+    gtk_text_view_set_editable(text_view, editable && valid);
+
+    int64_t start, end;
+    file_view_page_range(view, page, &start, &end);
+    char position[128];
+    snprintf(position, sizeof(position), "Page %lld of %lld, bytes %lld-%lld of %lld%s", (long long)page + 1,
+             (long long)file_view_page_count(view), (long long)start, (long long)end, (long long)view->size,
+             editable && !valid ? " (not text, read-only)" : "");
+    gtk_label_set_text(GTK_LABEL(label), position);
+    gtk_dialog_set_response_sensitive(GTK_DIALOG(dialog), FILE_PAGER_PREVIOUS, page > 0);
+    gtk_dialog_set_response_sensitive(GTK_DIALOG(dialog), FILE_PAGER_NEXT, page + 1 < file_view_page_count(view));
+}
 
-    char full_path[MAX_FILENAME_LEN + 1];
-    snprintf(full_path, sizeof(full_path), "%s%s", TEST_FOLDER_PATH, filename);
+//keep the shown page's text in the view if the user changed it
+static int file_pager_keep(FileView *view, int64_t page, GtkTextView *text_view) {
 
-    // Open the file
-    FILE *file = fopen(full_path, "r+");
-    if (file == NULL) {
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to open file for editing.");
-        return;
-    }
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(text_view);
+    if (!gtk_text_buffer_get_modified(buffer)) return 0;
 
-    // Read the file contents
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    if (file_size < 0) {
-        fclose(file);
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to determine file size.");
-        return;
-    }
-    fseek(file, 0, SEEK_SET);
+    GtkTextIter start, end;
+    gtk_text_buffer_get_bounds(buffer, &start, &end);
+    gchar *text = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
+    int result = file_view_set_page(view, page, text, strlen(text));
+    g_free(text);
+    return result;
+}
 
-    char *file_contents = malloc(file_size + 1);
-    if (file_contents == NULL) {
-        fclose(file);
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to allocate memory.");
-        return;
-    }
+//view or edit a host file a page of FILE_VIEW_PAGE bytes at a time, so only the pages shown or edited are
+//ever in memory. Saving writes back just the edited ranges, see file_view_save
+static void file_pager_dialog(const char *filename, GtkWidget *parent, int editable) {
 
-    size_t bytes_read = fread(file_contents, 1, file_size, file);
-    if (bytes_read != (size_t)file_size) {
-        free(file_contents);
-        fclose(file);
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to read the entire file.");
+    char host_path[MAX_FILENAME_LEN + 1];
+    snprintf(host_path, sizeof(host_path), "%s%s", TEST_FOLDER_PATH, filename);
+    FileView *view = file_view_open(host_path);
+    if (view == NULL) {
+        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to open file.");
         return;
     }
-    file_contents[file_size] = '\0';  // Null-terminate the string
-
-    fclose(file);
 
-    // Create the editing dialog
     GtkWidget *dialog = gtk_dialog_new_with_buttons(
-        "Edit File",
+        editable ? "Edit File" : "File Contents",
         GTK_WINDOW(parent),
         GTK_DIALOG_MODAL,
-        "_Cancel",
-        GTK_RESPONSE_CANCEL,
-        "_Save",
+        "_Previous",
+        FILE_PAGER_PREVIOUS,
+        "_Next",
+        FILE_PAGER_NEXT,
+        editable ? "_Cancel" : "_OK",
+        editable ? GTK_RESPONSE_CANCEL : GTK_RESPONSE_OK,
+        editable ? "_Save" : NULL,
         GTK_RESPONSE_ACCEPT,
         NULL
     );
 
-    gtk_window_set_default_size(GTK_WINDOW(dialog), 500, 300);
+    gtk_window_set_default_size(GTK_WINDOW(dialog), 640, 480);
     GtkWidget *text_view = gtk_text_view_new();
     gtk_text_view_set_wrap_mode(GTK_TEXT_VIEW(text_view), GTK_WRAP_WORD);
-    gtk_text_view_set_editable(GTK_TEXT_VIEW(text_view), TRUE);
-    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-    gtk_text_buffer_set_text(buffer, file_contents, -1);
+    GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_container_add(GTK_CONTAINER(scrolled_window), text_view);
+    GtkWidget *label = gtk_label_new(NULL);
 
     GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
-    gtk_box_pack_start(GTK_BOX(content_area), text_view, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(content_area), scrolled_window, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(content_area), label, FALSE, FALSE, 5);
 
+    int64_t page = 0;
+    file_pager_show(view, page, editable, GTK_TEXT_VIEW(text_view), label, dialog);
     gtk_widget_show_all(dialog);
 
-    gint response = gtk_dialog_run(GTK_DIALOG(dialog));
-
-    if (response == GTK_RESPONSE_ACCEPT) {
-        // Save the edited content back to the file
-        GtkTextIter start, end;
-        gtk_text_buffer_get_bounds(buffer, &start, &end);
-        const gchar *new_contents = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
-
-        file = fopen(full_path, "w");
-        if (file == NULL) {
-            show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to open file for saving.");
-        } else {
-            fwrite(new_contents, 1, strlen(new_contents), file);
-            fclose(file);
-            show_message_dialog(parent, GTK_MESSAGE_INFO, "File edited successfully.");
+    gint response;
+    while ((response = gtk_dialog_run(GTK_DIALOG(dialog))) == FILE_PAGER_PREVIOUS || response == FILE_PAGER_NEXT) {
+        if (file_pager_keep(view, page, GTK_TEXT_VIEW(text_view)) != 0) {
+            show_message_dialog(dialog, GTK_MESSAGE_ERROR, "Failed to allocate memory.");
+            continue;
         }
+        page += response == FILE_PAGER_NEXT ? 1 : -1;
+        file_pager_show(view, page, editable, GTK_TEXT_VIEW(text_view), label, dialog);
     }
 
+    if (response == GTK_RESPONSE_ACCEPT && file_pager_keep(view, page, GTK_TEXT_VIEW(text_view)) != 0) {
+        show_message_dialog(dialog, GTK_MESSAGE_ERROR, "Failed to allocate memory.");
+        response = GTK_RESPONSE_CANCEL;
+    }
     gtk_widget_destroy(dialog);
-    free(file_contents);
 
-    add_journal_entry(MODIFY, filename, NULL, NULL);
+    if (response != GTK_RESPONSE_ACCEPT || view->edit_count == 0) {
+        if (response == GTK_RESPONSE_ACCEPT) show_message_dialog(parent, GTK_MESSAGE_INFO, "File edited successfully.");
+        file_view_close(view);
+        return;
+    }
+
+    // The job takes the view; only the edited pages are written back
+    HostIoJob *save = host_io_job_new(HOST_IO_SAVE, filename, parent);
+    if (save == NULL) {
+        file_view_close(view);
+        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to allocate memory.");
+        return;
+    }
+    save->view = view;
+    save->total = view->size;
+    host_io_start(save, edit_file_saved);
+}
+
+void edit_file(const char *filename, GtkWidget *parent) {
+
+    if (strlen(filename) >= MAX_FILENAME_LEN) {
+        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Filename too long.");
+        return;
+    }
+    file_pager_dialog(filename, parent, TRUE);
 }
 
 //open file
@@ -940,195 +762,60 @@ void open_file(const char *filename, GtkWidget *parent) {
     if (response == GTK_RESPONSE_YES) {
         edit_file(filename, parent);
     } else {
-
-        // Open the file
-        FILE *file = fopen(full_path, "r");
-        if (file == NULL) {
-            show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to open file.");
-            return;
-        }
-
-        // Read the file contents
-        fseek(file, 0, SEEK_END);
-        long file_size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-
-        char *file_contents = malloc(file_size + 1);
-        if (file_contents == NULL) {
-            fclose(file);
-            show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to allocate memory.");
-            return;
-        }
-
-        fread(file_contents, 1, file_size, file);
-        file_contents[file_size] = '\0';  // Null-terminate the string
-
-        fclose(file);
-
-        // Display the file contents
-        GtkWidget *view_dialog = gtk_dialog_new_with_buttons(
-            "File Contents",
-            GTK_WINDOW(parent),
-            GTK_DIALOG_MODAL,
-            "_OK",
-            GTK_RESPONSE_OK,
-            NULL
-        );
-
-        gtk_window_set_default_size(GTK_WINDOW(view_dialog), 500, 300);
-        GtkWidget *text_view = gtk_text_view_new();
-        gtk_text_view_set_editable(GTK_TEXT_VIEW(text_view), FALSE);
-        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-        gtk_text_buffer_set_text(buffer, file_contents, -1);
-
-        GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(view_dialog));
-        gtk_box_pack_start(GTK_BOX(content_area), text_view, TRUE, TRUE, 0);
-
-        gtk_widget_show_all(view_dialog);
-        gtk_dialog_run(GTK_DIALOG(view_dialog));
-        gtk_widget_destroy(view_dialog);
-
-        free(file_contents);
+        file_pager_dialog(filename, parent, FALSE);
     }
 
-    add_journal_entry(READ, filename, NULL, NULL);
-}
-
-void save_permissions() {
-
-    save_file_system_state();
-}
-
-void load_permissions() {
-
-    load_file_system_state();
+    add_journal_entry(READ, -1, filename, NULL, NULL);
 }
 
-int change_file_permissions(const char *filename, unsigned int new_mode) {
 
-    int inode_number = find_inode_by_filename(filename);
-    if (inode_number == -1) {
-        return -1; // File not found
-    }
-
-    // Assuming inode_table is an array of Inode pointers
-    Inode *inode = inode_table[inode_number];
-    if (inode == NULL) {
-        return -1; // Inode not found
-    }
 
-    inode->mode = new_mode;
-    inode->ctime = time(NULL); // Update change time
 
-    // Save permissions after changing
-    save_permissions();
+/* GUI FUNCTIONS */
 
-    // Create a journal entry for permission change
-    char mode_str[12];
-    snprintf(mode_str, sizeof(mode_str), "%o", new_mode);
-    add_journal_entry(CHANGE_PERMISSIONS, filename, mode_str, NULL);
+//the first selected row, for the actions that take one name; the list lets several rows be selected
+static gboolean selection_first(GtkTreeSelection *selection, GtkTreeModel **model, GtkTreeIter *iter) {
 
-    return 0;
+    GList *rows = gtk_tree_selection_get_selected_rows(selection, model);
+    gboolean found = rows != NULL && gtk_tree_model_get_iter(*model, iter, rows->data);
+    g_list_free_full(rows, (GDestroyNotify)gtk_tree_path_free);
+    return found;
 }
 
+//names of the selected rows, NULL-terminated, for the batch operations; NULL if no row is selected.
+//Free with g_strfreev
+static gchar **selection_names(GtkWidget *window, int *count) {
 
-
-int create_directory(const char *path) {
-
-    if (file_exists(path)) {
-        printf("Directory already exists: %s\n", path);
-        show_message_dialog(NULL, GTK_MESSAGE_INFO, "The directory already exists");
-        return -1;
-    }
-
-    char full_path[MAX_FILENAME_LEN];
-    snprintf(full_path, sizeof(full_path), "%s%s", TEST_FOLDER_PATH, path);
-
-    // Create directory on disk
-    if (_mkdir(full_path) != 0) {  // Default permissions for directories
-        perror("Failed to create directory");
-        return -1;
-    }
-
-    // Create inode for the directory
-    int inode_number = create_inode(1, 0755, current_user_id, current_group_id);  // is_directory = 1 or True
-    if (inode_number == -1) {
-        printf("Failed to create inode for directory\n");
-        return -1;
+    GtkTreeView *list_view = GTK_TREE_VIEW(g_object_get_data(G_OBJECT(window), "list_view"));
+    GtkTreeModel *model;
+    GList *rows = gtk_tree_selection_get_selected_rows(gtk_tree_view_get_selection(list_view), &model);
+    gchar **names = rows == NULL ? NULL : g_new0(gchar *, g_list_length(rows) + 1);
+    *count = 0;
+    for (GList *row = rows; row != NULL; row = row->next) {
+        GtkTreeIter iter;
+        if (gtk_tree_model_get_iter(model, &iter, row->data)) {
+            gtk_tree_model_get(model, &iter, 0, &names[(*count)++], -1);
+        }
     }
-
-    // Add directory entry to the root directory
-    strcpy(root_directory.entries[root_directory.entry_count].name, path);
-    root_directory.entries[root_directory.entry_count].inode_number = inode_number;
-    root_directory.entry_count++;
-
-    add_journal_entry(CREATE, path, NULL, NULL);
-    show_message_dialog(NULL, GTK_MESSAGE_INFO, "Directory created successfully");
-
-    return 0;
+    g_list_free_full(rows, (GDestroyNotify)gtk_tree_path_free);
+    return names;
 }
 
-void delete_directory(const char *path, GtkWidget *parent) {
-
-    char full_path[MAX_FILENAME_LEN];
-    snprintf(full_path, sizeof(full_path), "%s%s", TEST_FOLDER_PATH, path);
-
-    // Check if directory exists
-    if (access(full_path, F_OK) != 0) {
-        perror("Directory does not exist");
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Directory does not exist.");
-        return;
-    }
+//report a batch operation: `done` when every name succeeded, otherwise the first failure
+static void show_batch_result_dialog(GtkWidget *parent, int succeeded, int count, const int results[], const gchar *done) {
 
-    // Remove directory from disk
-    if (_rmdir(full_path) != 0) {
-        perror("Failed to delete directory");
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to delete directory.");
+    int first_failure = 0;
+    while (first_failure < count && results[first_failure] == FS_OK) first_failure++;
+    if (succeeded == count || first_failure == count) {
+        show_message_dialog(parent, GTK_MESSAGE_INFO, done);
         return;
     }
-
-    // Remove directory entry from the root directory and free inode
-    for (int i = 0; i < root_directory.entry_count; i++) {
-        if (strcmp(root_directory.entries[i].name, path) == 0) {
-            // Free blocks and reset inode
-            int inode_number = root_directory.entries[i].inode_number;
-            Inode *inode = inode_table[inode_number]; // Corrected to use pointer
-
-            for (int j = 0; j < DIRECT_BLOCKS; j++) {
-                if (inode->direct_blocks[j] != -1) {
-                    free_block(inode->direct_blocks[j]);
-                    inode->direct_blocks[j] = -1;
-                }
-            }
-
-            if (inode->index_block != -1) {
-                free_index_block(inode->index_block);
-                inode->index_block = -1;
-            }
-
-            inode->is_directory = 0;
-            inode->_size = 0;
-            inode->mtime = time(NULL);
-            inode->ctime = time(NULL);
-
-            // Remove from root directory
-            memmove(&root_directory.entries[i], &root_directory.entries[i + 1], (root_directory.entry_count - i - 1) * sizeof(DirectoryEntry));
-            root_directory.entry_count--;
-
-            printf("Deleted directory: %s\n", path);
-            show_message_dialog(parent, GTK_MESSAGE_INFO, "Directory deleted successfully.");
-            break;
-        }
-    }
-
-    add_journal_entry(DELETE, path, NULL, NULL);
+    gchar *message = g_strdup_printf("%d of %d failed. %s", count - succeeded, count, fs_strerror(results[first_failure]));
+    show_message_dialog(parent, GTK_MESSAGE_ERROR, message);
+    g_free(message);
 }
 
 
-
-/* GUI FUNCTIONS */
-
-
 void create_file_dialog(GtkWidget *widget, gpointer data) {
     GtkWidget *dialog, *content_area, *entry;
     GtkDialogFlags flags = GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT;
@@ -1148,7 +835,7 @@ void create_file_dialog(GtkWidget *widget, gpointer data) {
 
     // Create and configure the file name entry
     entry = gtk_entry_new();
-    gtk_entry_set_placeholder_text(GTK_ENTRY(entry), "Enter file name");
+    gtk_entry_set_placeholder_text(GTK_ENTRY(entry), "Enter file name, or several separated by commas");
     gtk_container_add(GTK_CONTAINER(content_area), entry);
 
     gtk_widget_show_all(dialog);
@@ -1162,12 +849,25 @@ void create_file_dialog(GtkWidget *widget, gpointer data) {
         if (filename == NULL || strlen(filename) == 0) {
             show_message_dialog(window, GTK_MESSAGE_WARNING, "Filename cannot be empty");
         } else {
-            // Create file with default permissions
-            if (create_file(filename, 0) == 0) {
-                list_files(NULL, window);
-            } else {
-                show_message_dialog(window, GTK_MESSAGE_ERROR, "Failed to create file");
+            // Create the files with default permissions, all of them in one batch
+            gchar **names = g_strsplit(filename, ",", -1);
+            int count = 0;
+            for (int i = 0; names[i] != NULL; i++) {
+                g_strstrip(names[i]);
+                if (names[i][0] != '\0') names[count++] = names[i];
+                else g_free(names[i]);
+            }
+            names[count] = NULL;
+            int *results = g_new(int, count > 0 ? count : 1);
+            int created = create_files((const char *const *)names, count, 0, results);
+            for (int i = 0; i < count; i++) {
+                if (results[i] == FS_OK) list_files_update(window, names[i]);
             }
+            if (created < count) {
+                show_batch_result_dialog(window, created, count, results, "");
+            }
+            g_free(results);
+            g_strfreev(names);
         }
     }
 
@@ -1176,34 +876,41 @@ void create_file_dialog(GtkWidget *widget, gpointer data) {
 
 void delete_file_dialog(GtkWidget *widget, gpointer data) {
     GtkWidget *window = GTK_WIDGET(data);
-    GtkTreeView *list_view = GTK_TREE_VIEW(g_object_get_data(G_OBJECT(window), "list_view"));
-    GtkTreeSelection *selection = gtk_tree_view_get_selection(list_view);
-    GtkTreeModel *model;
-    GtkTreeIter iter;
-
-    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
-        char *filename;
-        gtk_tree_model_get(model, &iter, 0, &filename, -1);
+    int count;
+    gchar **names = selection_names(window, &count);
 
+    if (names != NULL && count > 0) {
         // Confirm deletion
-        GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(window),
+        GtkWidget *dialog = count == 1 ?
+                            gtk_message_dialog_new(GTK_WINDOW(window),
                                                    GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
                                                    GTK_MESSAGE_WARNING,
                                                    GTK_BUTTONS_OK_CANCEL,
                                                    "Are you sure you want to delete the file: %s?",
-                                                   filename);
+                                                   names[0]) :
+                            gtk_message_dialog_new(GTK_WINDOW(window),
+                                                   GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                   GTK_MESSAGE_WARNING,
+                                                   GTK_BUTTONS_OK_CANCEL,
+                                                   "Are you sure you want to delete these %d items?",
+                                                   count);
         gint response = gtk_dialog_run(GTK_DIALOG(dialog));
         gtk_widget_destroy(dialog);
 
         if (response == GTK_RESPONSE_OK) {
-            delete_file(filename, window);
-            list_files(NULL, window);
+            // Files and empty directories alike, in one batch
+            int *results = g_new(int, count);
+            int deleted = delete_files((const char *const *)names, count, results);
+            show_batch_result_dialog(window, deleted, count, results, count == 1 ? "File deleted successfully." : "Items deleted successfully.");
+            for (int i = 0; i < count; i++) {
+                list_files_update(window, names[i]);
+            }
+            g_free(results);
         }
-
-        g_free(filename);
     } else {
         show_message_dialog(window, GTK_MESSAGE_ERROR, "No file selected.");
     }
+    g_strfreev(names);
 }
 
 
@@ -1215,7 +922,7 @@ void open_file_dialog(GtkWidget *widget, gpointer data) {
     GtkTreeModel *model;
     GtkTreeIter iter;
 
-    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
+    if (selection_first(selection, &model, &iter)) {
         char *filename;
         gtk_tree_model_get(model, &iter, 0, &filename, -1);
 
@@ -1235,7 +942,7 @@ void rename_file_dialog(GtkWidget *widget, gpointer data) {
     GtkTreeModel *model;
     GtkTreeIter iter;
 
-    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
+    if (selection_first(selection, &model, &iter)) {
         char *old_filename;
         gtk_tree_model_get(model, &iter, 0, &old_filename, -1);
 
@@ -1263,8 +970,9 @@ void rename_file_dialog(GtkWidget *widget, gpointer data) {
         if (response == GTK_RESPONSE_ACCEPT) {
             const gchar *new_filename = gtk_entry_get_text(GTK_ENTRY(new_entry));
             if (new_filename != NULL && strlen(new_filename) > 0) {
-                rename_file(old_filename, new_filename, window);
-                list_files(NULL, window);
+                show_result_dialog(window, rename_file(old_filename, new_filename), "File renamed successfully.");
+                list_files_update(window, old_filename);
+                list_files_update(window, new_filename);
             }
         }
 
@@ -1276,30 +984,48 @@ void rename_file_dialog(GtkWidget *widget, gpointer data) {
     }
 }
 
+//search once typing pauses for LISTING_SEARCH_DELAY_MS
 void on_search_changed(GtkWidget *widget, gpointer data) {
 
-    GtkWidget *window = GTK_WIDGET(data);
-    list_files(NULL, window);
+    const gchar *search_text = gtk_entry_get_text(GTK_ENTRY(widget));
+    snprintf(listing.search_text, sizeof(listing.search_text), "%s", search_text != NULL ? search_text : "");
+
+    if (listing.search_source != 0) g_source_remove(listing.search_source);
+    listing.search_source = g_timeout_add(LISTING_SEARCH_DELAY_MS, listing_search, data);
 }
 
 void change_permissions_response(GtkDialog *dialog, gint response_id, gpointer user_data) {
 
     GtkWidget *entry_filename = GTK_WIDGET(g_object_get_data(G_OBJECT(user_data), "filename_entry"));
     GtkWidget *entry_permissions = GTK_WIDGET(g_object_get_data(G_OBJECT(user_data), "permissions_entry"));
+    GtkWidget *recursive_check = GTK_WIDGET(g_object_get_data(G_OBJECT(user_data), "recursive_check"));
+    GtkWidget *window = GTK_WIDGET(g_object_get_data(G_OBJECT(user_data), "window"));
 
     const char *filename = gtk_entry_get_text(GTK_ENTRY(entry_filename));
     const char *permissions_str = gtk_entry_get_text(GTK_ENTRY(entry_permissions));
 
-    if (response_id == GTK_RESPONSE_OK && strlen(filename) > 0 && strlen(permissions_str) > 0) {
+    // An empty name means the selected rows
+    int count = 1;
+    gchar **names;
+    if (strlen(filename) > 0) {
+        names = g_new0(gchar *, 2);
+        names[0] = g_strdup(filename);
+    } else {
+        names = selection_names(window, &count);
+    }
+
+    if (response_id == GTK_RESPONSE_OK && names != NULL && count > 0 && strlen(permissions_str) > 0) {
 
         unsigned int new_mode = strtol(permissions_str, NULL, 8); // Convert permissions string to octal
+        int recursive = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(recursive_check));
 
-        if (change_file_permissions(filename, new_mode) == 0) {
+        if (change_files_permissions((const char *const *)names, count, new_mode, recursive, NULL) == count) {
             show_message_dialog(GTK_WIDGET(dialog), GTK_MESSAGE_INFO, "Permissions changed successfully.");
         } else {
             show_message_dialog(GTK_WIDGET(dialog), GTK_MESSAGE_ERROR, "Failed to change permissions. File may not exist.");
         }
     }
+    g_strfreev(names);
 
     gtk_widget_destroy(GTK_WIDGET(dialog));
 }
@@ -1312,7 +1038,7 @@ void change_permissions_dialog(GtkWidget *widget, gpointer data) {
     GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
 
     GtkWidget *entry_filename = gtk_entry_new();
-    gtk_entry_set_placeholder_text(GTK_ENTRY(entry_filename), "Enter file name");
+    gtk_entry_set_placeholder_text(GTK_ENTRY(entry_filename), "Enter file name, or leave empty for the selection");
 
     GtkWidget *entry_permissions = gtk_entry_new();
     gtk_entry_set_placeholder_text(GTK_ENTRY(entry_permissions), "Enter new permissions (e.g., 755)");
@@ -1320,8 +1046,13 @@ void change_permissions_dialog(GtkWidget *widget, gpointer data) {
     gtk_box_pack_start(GTK_BOX(content_area), entry_filename, TRUE, TRUE, 5);
     gtk_box_pack_start(GTK_BOX(content_area), entry_permissions, TRUE, TRUE, 5);
 
+    GtkWidget *recursive_check = gtk_check_button_new_with_label("Apply to directory contents");
+    gtk_box_pack_start(GTK_BOX(content_area), recursive_check, TRUE, TRUE, 5);
+
     g_object_set_data(G_OBJECT(dialog), "filename_entry", entry_filename);
     g_object_set_data(G_OBJECT(dialog), "permissions_entry", entry_permissions);
+    g_object_set_data(G_OBJECT(dialog), "recursive_check", recursive_check);
+    g_object_set_data(G_OBJECT(dialog), "window", window);
 
     g_signal_connect(dialog, "response", G_CALLBACK(change_permissions_response), dialog);
 
@@ -1409,7 +1140,7 @@ void view_file_details_dialog(GtkWidget *button, gpointer user_data) {
     GtkTreeIter iter;
     gchar *filename;
 
-    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
+    if (selection_first(selection, &model, &iter)) {
         gtk_tree_model_get(model, &iter, 0, &filename, -1); // Assuming the filename is in column 0
 
         show_file_details(filename, window);
@@ -1446,61 +1177,17 @@ void create_directory_dialog(GtkWidget *button, gpointer user_data) {
     if (result == GTK_RESPONSE_OK) {
         const gchar *dir_name = gtk_entry_get_text(GTK_ENTRY(entry));
         if (strlen(dir_name) > 0) {
-            gchar *full_path = g_strdup_printf("%s/%s", TEST_FOLDER_PATH, dir_name);
-            int success = mkdir(full_path);
-            if (success != 0) {
-                perror("Failed to create directory");
-                show_message_dialog(window, GTK_MESSAGE_ERROR, "Failed to create directory.");
-            } else {
-                list_files(NULL, window); // Refresh the file list
+            int result = create_directory(dir_name);
+            show_result_dialog(window, result, "Directory created successfully.");
+            if (result == FS_OK) {
+                list_files_update(window, dir_name);
             }
-            g_free(full_path);
         }
     }
 
     gtk_widget_destroy(dialog);
 }
 
-void ensure_trailing_slash(char *path) {
-    size_t len = strlen(path);
-    if (len > 0 && path[len - 1] != '/') {
-        if (len < MAX_FILENAME_LEN - 1) {
-            path[len] = '/';
-            path[len + 1] = '\0';
-        } else {
-            // Handle error: path is too long
-        }
-    }
-}
-void change_directory(const char *new_path) {
-
-    char full_path[MAX_FILENAME_LEN];
-    snprintf(full_path, sizeof(full_path), "%s%s", TEST_FOLDER_PATH, new_path);
-
-    // Ensure the new path ends with a '/'
-    ensure_trailing_slash(full_path);
-
-    // Check if the new path exists and is a directory
-    struct stat statbuf;
-    if (stat(full_path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
-        // Save the current root directory as the previous root
-        snprintf(PREVIOUS_ROOT_PATH, sizeof(PREVIOUS_ROOT_PATH), "%s", TEST_FOLDER_PATH);
-
-        // Update the global path to the new root directory
-        snprintf(TEST_FOLDER_PATH, sizeof(TEST_FOLDER_PATH), "%s", full_path);
-
-        if (_chdir(TEST_FOLDER_PATH) == 0) {
-            printf("Changed directory to new root: %s\n", TEST_FOLDER_PATH);
-            // Optionally refresh file list or other UI updates here
-        } else {
-            perror("Failed to change directory");
-        }
-    } else {
-        printf("Invalid directory path: %s\n", full_path);
-        // Optionally show an error dialog
-    }
-}
-
 void change_directory_dialog(GtkWidget *widget, gpointer data) {
 
     GtkWidget *window = GTK_WIDGET(data);
@@ -1509,35 +1196,35 @@ void change_directory_dialog(GtkWidget *widget, gpointer data) {
     GtkTreeModel *model;
     GtkTreeIter iter;
 
-    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
+    if (selection_first(selection, &model, &iter)) {
         char *dirname;
         gtk_tree_model_get(model, &iter, 0, &dirname, -1);
 
-        char full_path[MAX_FILENAME_LEN];
-        snprintf(full_path, sizeof(full_path), "%s%s", TEST_FOLDER_PATH, dirname);
+        char fs_path[MAX_PATH_LEN];
+        char full_path[MAX_PATH_LEN];
+        if (make_fs_path(dirname, fs_path) != 0) {
+            fs_path[0] = '\0';
+        }
+        // The host path, with its trailing '/', becomes TEST_FOLDER_PATH and must fit it
+        int fits = make_host_path(fs_path, full_path, sizeof(full_path)) == 0 &&
+                   strlen(full_path) + 2 <= sizeof(TEST_FOLDER_PATH);
 
         // Ensure trailing slash for directories
-        size_t len = strlen(full_path);
-        if (dirname[strlen(dirname) - 1] != '/') {
-            full_path[len] = '/';
-            full_path[len + 1] = '\0';
-        }
+        if (fits) ensure_trailing_slash(full_path);
 
         // Check if the new path exists and is a directory
         struct stat statbuf;
-        if (stat(full_path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
-            if (_chdir(full_path) == 0) {
+        if (!fits) {
+            show_message_dialog(window, GTK_MESSAGE_ERROR, "Directory path too long.");
+        } else if (stat(full_path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
+            printf("Changed directory to: %s\n", full_path);
 
-                printf("Changed directory to: %s\n", full_path);
+            // Update TEST_FOLDER_PATH
+            snprintf(TEST_FOLDER_PATH, sizeof(TEST_FOLDER_PATH), "%s", full_path);
+            snprintf(current_dir_path, sizeof(current_dir_path), "%s", fs_path);
 
-                // Update TEST_FOLDER_PATH
-                snprintf(TEST_FOLDER_PATH, sizeof(TEST_FOLDER_PATH), "%s", full_path);
-
-                // Update the file list
-                list_files(NULL, window);
-            } else {
-                perror("Failed to change directory");
-            }
+            // Update the file list
+            list_files(NULL, window);
         } else {
             printf("Invalid directory path: %s\n", full_path);
             show_message_dialog(window, GTK_MESSAGE_ERROR, "Invalid directory path");
@@ -1556,17 +1243,13 @@ void go_back_to_previous_root(GtkWidget *window) {
 
     // Check if we are not already in the previous root
     if (strcmp(TEST_FOLDER_PATH, PREVIOUS_ROOT_PATH) != 0) {
-        // Attempt to change to the previous root directory
-        if (_chdir(PREVIOUS_ROOT_PATH) == 0) {
-            // Update the current root directory path
-            snprintf(TEST_FOLDER_PATH, sizeof(TEST_FOLDER_PATH), "%s", PREVIOUS_ROOT_PATH);
-            printf("Returned to previous root directory: %s\n", TEST_FOLDER_PATH);
+        // Update the current root directory path
+        snprintf(TEST_FOLDER_PATH, sizeof(TEST_FOLDER_PATH), "%s", PREVIOUS_ROOT_PATH);
+        snprintf(current_dir_path, sizeof(current_dir_path), "%s", previous_dir_path);
+        printf("Returned to previous root directory: %s\n", TEST_FOLDER_PATH);
 
-            // Refresh the file list to show contents of the new directory
-            list_files(NULL, window);
-        } else {
-            perror("Failed to change directory");
-        }
+        // Refresh the file list to show contents of the new directory
+        list_files(NULL, window);
     } else {
         printf("You are already in the previous root directory.\n");
         // Optionally show a message to the user
@@ -1585,6 +1268,7 @@ void delete_directory_dialog(GtkWidget *widget, gpointer window) {
     GtkWidget *dialog;
     GtkWidget *content_area;
     GtkWidget *entry;
+    GtkWidget *contents_check;
 
     dialog = gtk_dialog_new_with_buttons("Delete Directory",
                                          GTK_WINDOW(window),
@@ -1599,13 +1283,17 @@ void delete_directory_dialog(GtkWidget *widget, gpointer window) {
     entry = gtk_entry_new();
     gtk_entry_set_placeholder_text(GTK_ENTRY(entry), "Enter directory name");
     gtk_box_pack_start(GTK_BOX(content_area), entry, FALSE, FALSE, 5);
+    contents_check = gtk_check_button_new_with_label("Delete everything inside it too");
+    gtk_box_pack_start(GTK_BOX(content_area), contents_check, FALSE, FALSE, 5);
     gtk_widget_show_all(dialog);
 
     gint response = gtk_dialog_run(GTK_DIALOG(dialog));
     if (response == GTK_RESPONSE_OK) {
         const char *dir_name = gtk_entry_get_text(GTK_ENTRY(entry));
+        int contents = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(contents_check));
         if (strlen(dir_name) > 0) {
-            delete_directory(dir_name, window);
+            int result = contents ? delete_tree(dir_name) : delete_directory(dir_name);
+            show_result_dialog(window, result, "Directory deleted successfully.");
         } else {
             show_message_dialog(window, GTK_MESSAGE_ERROR, "Directory name cannot be empty");
         }
@@ -1614,44 +1302,106 @@ void delete_directory_dialog(GtkWidget *widget, gpointer window) {
 }
 
 char copied_file_path[256] = ""; // Buffer to store the path of the copied file
+char copied_fs_path[MAX_PATH_LEN + 1] = ""; // the same file as a path from the file system root
 
 void copy_file(const char *filename, GtkWidget *parent) {
+    char fs_path[MAX_PATH_LEN];
+    if (make_fs_path(filename, fs_path) != 0) {
+        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Invalid file name.");
+        return;
+    }
+    snprintf(copied_fs_path, sizeof(copied_fs_path), "/%s", fs_path);
     snprintf(copied_file_path, sizeof(copied_file_path), "%s%s", TEST_FOLDER_PATH, filename);
     show_message_dialog(parent, GTK_MESSAGE_INFO, "File copied to clipboard.");
 }
+//drop the entry of a pasted file whose host copy failed. host_io_copy removed the partial target, and
+//delete_file takes a missing host file for a missing file, so the entry is removed and journaled here
+static void paste_file_discard(HostIoJob *job) {
+
+    char fs_path[MAX_PATH_LEN];
+    if (make_fs_path(job->filename, fs_path) != 0) return;
+    remove(job->dest_path); // still there if the source could not be opened
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int inode_number = resolve_path(fs_path);
+    int failed = inode_number == -1 || apply_delete(fs_path) != 0 ||
+                 journal_txn_add(&txn, DELETE, inode_number, fs_path, NULL, NULL, 0) != 0;
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0) failed = 1;
+    if (failed) {
+        show_message_dialog(job->parent, GTK_MESSAGE_ERROR, "Failed to remove the incomplete copy.");
+    }
+}
+
+static void paste_file_done(GObject *source, GAsyncResult *result, gpointer data) {
+
+    HostIoJob *job = g_task_get_task_data(G_TASK(result));
+    if (host_io_finish(result) == NULL) {
+        // a tree copy cleaned up after itself
+        if (job->kind == HOST_IO_COPY) paste_file_discard(job);
+        return;
+    }
+    show_message_dialog(job->parent, GTK_MESSAGE_INFO,
+                        job->kind == HOST_IO_COPY_TREE ? "Directory pasted successfully." : "File pasted successfully.");
+    size_t dir_len = strlen(listing.dir);
+    if (dir_len > 0 && strncmp(job->dest_path, listing.dir, dir_len) == 0) {
+        list_files_update(job->parent, job->dest_path + dir_len);
+    }
+}
+
+//the copy is entered in the file system sharing the original's data blocks (see clone_file), then the host
+//file is copied on a worker thread, see host_io_copy. A directory is copied whole on the worker, see copy_tree
 void paste_file(GtkWidget *parent) {
     if (strcmp(copied_file_path, "") == 0) {
         show_message_dialog(parent, GTK_MESSAGE_ERROR, "No file copied.");
         return;
     }
 
-    char dest_path[256];
-    snprintf(dest_path, sizeof(dest_path), "%s%s_copy", TEST_FOLDER_PATH, strrchr(copied_file_path, '/') + 1);
-
-    FILE *src = fopen(copied_file_path, "rb");
-    if (src == NULL) {
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to open source file.");
+    char dest_name[MAX_FILENAME_LEN];
+    char fs_path[MAX_PATH_LEN];
+    snprintf(dest_name, sizeof(dest_name), "%s_copy", strrchr(copied_file_path, '/') + 1);
+    struct stat st;
+    if (stat(copied_file_path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        HostIoJob *job = make_fs_path(dest_name, fs_path) == 0 ? host_io_job_new(HOST_IO_COPY_TREE, "", parent) : NULL;
+        if (job == NULL) {
+            show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to create the copy.");
+            return;
+        }
+        snprintf(job->filename, sizeof(job->filename), "/%s", fs_path);
+        snprintf(job->source, sizeof(job->source), "%s", copied_fs_path);
+        snprintf(job->path, sizeof(job->path), "%s", copied_file_path);
+        if (make_host_path(fs_path, job->dest_path, sizeof(job->dest_path)) != 0) {
+            host_io_job_free(job);
+            show_message_dialog(parent, GTK_MESSAGE_ERROR, "Path too long for the copy.");
+            return;
+        }
+        host_io_start(job, paste_file_done);
         return;
     }
-
-    FILE *dest = fopen(dest_path, "wb");
-    if (dest == NULL) {
-        fclose(src);
-        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to create destination file.");
+    if (make_fs_path(dest_name, fs_path) != 0 || clone_file(copied_fs_path, dest_name) != 0) {
+        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to create the copy.");
         return;
     }
 
-    char buffer[1024];
-    size_t bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), src)) > 0) {
-        fwrite(buffer, 1, bytes, dest);
+    // The job names the copy from the root, so a failed copy is removed even after a change of directory
+    HostIoJob *job = host_io_job_new(HOST_IO_COPY, "", parent);
+    if (job == NULL) {
+        delete_file(dest_name);
+        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Failed to allocate memory.");
+        return;
     }
-
-    fclose(src);
-    fclose(dest);
-
-    show_message_dialog(parent, GTK_MESSAGE_INFO, "File pasted successfully.");
-    list_files(NULL, parent); // Refresh file list
+    snprintf(job->filename, sizeof(job->filename), "/%s", fs_path);
+    snprintf(job->path, sizeof(job->path), "%s", copied_file_path);
+    if (make_host_path(fs_path, job->dest_path, sizeof(job->dest_path)) != 0) {
+        host_io_job_free(job);
+        delete_file(dest_name);
+        show_message_dialog(parent, GTK_MESSAGE_ERROR, "Path too long for the copy.");
+        return;
+    }
+    host_io_start(job, paste_file_done);
 }
 
 void on_copy_button_clicked(GtkWidget *widget, gpointer data) {
@@ -1661,7 +1411,7 @@ void on_copy_button_clicked(GtkWidget *widget, gpointer data) {
     GtkTreeModel *model;
     GtkTreeIter iter;
 
-    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
+    if (selection_first(selection, &model, &iter)) {
         char *filename;
         gtk_tree_model_get(model, &iter, 0, &filename, -1);
         copy_file(filename, window);
@@ -1676,6 +1426,50 @@ void on_paste_button_clicked(GtkWidget *widget, gpointer data) {
     paste_file(window);
 }
 
+//refresh the stats panel's text with the current counters; runs until the panel is closed
+static gboolean stats_panel_refresh(gpointer data) {
+
+    char text[STATS_TEXT_MAX];
+    stats_format(text, sizeof(text));
+    gtk_text_buffer_set_text(GTK_TEXT_BUFFER(data), text, -1);
+    return TRUE;
+}
+
+//show the engine's operation stats, refreshed every second while the dialog is open
+void stats_dialog(GtkWidget *widget, gpointer data) {
+
+    GtkWidget *window = GTK_WIDGET(data);
+    GtkWidget *dialog = gtk_dialog_new_with_buttons(
+        "File System Stats",
+        GTK_WINDOW(window),
+        GTK_DIALOG_MODAL,
+        "_Reset",
+        GTK_RESPONSE_REJECT,
+        "_Close",
+        GTK_RESPONSE_CLOSE,
+        NULL
+    );
+
+    gtk_window_set_default_size(GTK_WINDOW(dialog), 640, 360);
+    GtkWidget *text_view = gtk_text_view_new();
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(text_view), FALSE);
+    gtk_text_view_set_monospace(GTK_TEXT_VIEW(text_view), TRUE);
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    stats_panel_refresh(buffer);
+
+    GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    gtk_box_pack_start(GTK_BOX(content_area), text_view, TRUE, TRUE, 0);
+    gtk_widget_show_all(dialog);
+
+    guint timer = g_timeout_add(1000, stats_panel_refresh, buffer);
+    while (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_REJECT) {
+        stats_reset();
+        stats_panel_refresh(buffer);
+    }
+    g_source_remove(timer);
+    gtk_widget_destroy(dialog);
+}
+
 
 //User Interface Initialization
 
@@ -1685,11 +1479,10 @@ void initialize_gui(GtkWidget **window, GtkWidget **list_view, GtkWidget **searc
     GtkToolItem *create_button, *delete_button, *rename_button, *refresh_button,
                 *permissions_button, *details_button, *create_dir_button,
                 *change_dir_button, *go_back_button,
-                *delete_dir_button,* copy_button, * paste_button;
+                *delete_dir_button,* copy_button, * paste_button, *stats_button;
 
     GtkCellRenderer *renderer;
     GtkTreeViewColumn *column;
-    GtkListStore *list_store;
     GtkToolItem *open_button;
     GFileMonitor *monitor;
 
@@ -1773,6 +1566,11 @@ void initialize_gui(GtkWidget **window, GtkWidget **list_view, GtkWidget **searc
     gtk_widget_set_tooltip_text(GTK_WIDGET(change_dir_button), "Change directory");
     g_signal_connect(change_dir_button, "clicked", G_CALLBACK(change_directory_dialog), *window);
 
+    stats_button = gtk_tool_button_new(gtk_image_new_from_stock(GTK_STOCK_INFO, GTK_ICON_SIZE_LARGE_TOOLBAR), NULL);
+    gtk_toolbar_insert(GTK_TOOLBAR(toolbar), stats_button, -1);
+    gtk_widget_set_tooltip_text(GTK_WIDGET(stats_button), "File system stats");
+    g_signal_connect(stats_button, "clicked", G_CALLBACK(stats_dialog), *window);
+
     GtkWidget *description_label = gtk_label_new("Root Directory:");
     folder_label = gtk_label_new(TEST_FOLDER_PATH);
     GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
@@ -1792,8 +1590,9 @@ void initialize_gui(GtkWidget **window, GtkWidget **list_view, GtkWidget **searc
     scrolled_window = gtk_scrolled_window_new(NULL, NULL);
     gtk_box_pack_start(GTK_BOX(*vbox), scrolled_window, TRUE, TRUE, 5);
 
-    list_store = gtk_list_store_new(6, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
-    *list_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(list_store));
+    listing_init();
+    *list_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(listing.store));
+    gtk_tree_selection_set_mode(gtk_tree_view_get_selection(GTK_TREE_VIEW(*list_view)), GTK_SELECTION_MULTIPLE);
     gtk_container_add(GTK_CONTAINER(scrolled_window), *list_view);
 
     renderer = gtk_cell_renderer_text_new();
@@ -1809,17 +1608,29 @@ void initialize_gui(GtkWidget **window, GtkWidget **list_view, GtkWidget **searc
     gtk_tree_view_append_column(GTK_TREE_VIEW(*list_view), column);
 
     renderer = gtk_cell_renderer_text_new();
-    column = gtk_tree_view_column_new_with_attributes("Last Accessed", renderer, "text", 3, NULL);
+    column = gtk_tree_view_column_new_with_attributes("Last Accessed", renderer, NULL);
+    gtk_tree_view_column_set_cell_data_func(column, renderer, listing_render_time, GINT_TO_POINTER(3), NULL);
     gtk_tree_view_append_column(GTK_TREE_VIEW(*list_view), column);
 
     renderer = gtk_cell_renderer_text_new();
-    column = gtk_tree_view_column_new_with_attributes("Date Created", renderer, "text", 4, NULL);
+    column = gtk_tree_view_column_new_with_attributes("Date Created", renderer, NULL);
+    gtk_tree_view_column_set_cell_data_func(column, renderer, listing_render_time, GINT_TO_POINTER(4), NULL);
     gtk_tree_view_append_column(GTK_TREE_VIEW(*list_view), column);
 
     renderer = gtk_cell_renderer_text_new();
-    column = gtk_tree_view_column_new_with_attributes("Date Modified", renderer, "text", 5, NULL);
+    column = gtk_tree_view_column_new_with_attributes("Date Modified", renderer, NULL);
+    gtk_tree_view_column_set_cell_data_func(column, renderer, listing_render_time, GINT_TO_POINTER(5), NULL);
     gtk_tree_view_append_column(GTK_TREE_VIEW(*list_view), column);
 
+    // Fixed column sizes and row heights let the view lay out only the rows on screen
+    for (int i = 0; i < 6; i++) {
+        column = gtk_tree_view_get_column(GTK_TREE_VIEW(*list_view), i);
+        gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+        gtk_tree_view_column_set_fixed_width(column, i == 0 ? 240 : 140);
+        gtk_tree_view_column_set_resizable(column, TRUE);
+    }
+    gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(*list_view), TRUE);
+
     g_object_set_data(G_OBJECT(*window), "list_view", *list_view);
     g_object_set_data(G_OBJECT(*window), "search_entry", *search_entry);
 
@@ -1833,22 +1644,145 @@ int main(int argc, char *argv[]) {
     GtkWidget *window, *list_view, *search_entry;
     GtkWidget *vbox;
 
+    // FUSE frontend: fsWithoutPermissions --mount [--snapshot ID] [FUSE options] MOUNTPOINT
+    if (argc > 1 && strcmp(argv[1], "--mount") == 0) {
+#ifdef FS_WITH_FUSE
+        // "--mount" takes the place of the program name, the rest is parsed by libfuse
+        if (argc > 3 && strcmp(argv[2], "--snapshot") == 0) {
+            int snapshot_id = atoi(argv[3]);
+            argv[3] = argv[1];
+            return fuse_mount_file_system(argc - 3, argv + 3, snapshot_id);
+        }
+        return fuse_mount_file_system(argc - 1, argv + 1, 0);
+#else
+        printf("This build has no FUSE support, rebuild with -DFS_WITH_FUSE and libfuse3\n");
+        return EXIT_FAILURE;
+#endif
+    }
+
+    // Format tool: fsWithoutPermissions --format [--block-size BYTES] [--blocks N] [--inodes N] [--dedup] [IMAGE]
+    if (argc > 1 && strcmp(argv[1], "--format") == 0) {
+        int block_size = DEFAULT_BLOCK_SIZE, num_blocks = DEFAULT_NUM_BLOCKS, inode_count = DEFAULT_INODE_COUNT;
+        unsigned int features = 0;
+        const char *image_path = FS_IMAGE_FILENAME;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc) {
+                block_size = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--blocks") == 0 && i + 1 < argc) {
+                num_blocks = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--inodes") == 0 && i + 1 < argc) {
+                inode_count = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--dedup") == 0) {
+                features |= FS_FEATURE_DEDUP;
+            } else {
+                image_path = argv[i];
+            }
+        }
+        int result = format_file_system(image_path, block_size, num_blocks, inode_count, features);
+        free_memory();
+        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Snapshots: fsWithoutPermissions --snapshot create | list | delete ID | rollback ID
+    if (argc > 2 && strcmp(argv[1], "--snapshot") == 0) {
+        fs_host_mirror = 0; // only the image is touched, replay leaves the host folder alone
+        init_file_system();
+        int ok = 1;
+        if (strcmp(argv[2], "create") == 0) {
+            int id = snapshot_create();
+            ok = id != -1;
+            if (ok) printf("Created snapshot %d\n", id);
+        } else if (strcmp(argv[2], "list") == 0) {
+            snapshot_list();
+        } else if (strcmp(argv[2], "delete") == 0 && argc > 3) {
+            ok = snapshot_delete(atoi(argv[3])) == 0;
+        } else if (strcmp(argv[2], "rollback") == 0 && argc > 3) {
+            ok = snapshot_rollback(atoi(argv[3])) == 0;
+        } else {
+            printf("usage: %s --snapshot create | list | delete ID | rollback ID\n", argv[0]);
+            ok = 0;
+        }
+        if (!ok) printf("Snapshot command failed\n");
+        checkpoint_file_system();
+        close_journal();
+        free_memory();
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Integrity check: fsWithoutPermissions --scrub
+    if (argc > 1 && strcmp(argv[1], "--scrub") == 0) {
+        fs_host_mirror = 0;
+        init_file_system();
+        ScrubReport report;
+        int64_t bad = fs_scrub(&report);
+        if (bad < 0) {
+            printf("Scrub failed\n");
+        } else {
+            double seconds = report.elapsed_ns / 1e9;
+            printf("Checked %lld blocks in %.3f s (%.1f MB/s, %s CRC32C)\n", (long long)report.checked, seconds,
+                   seconds > 0 ? report.checked * (double)superblock->block_size / seconds / 1e6 : 0.0,
+                   crc32c_hardware() ? "hardware" : "table");
+            printf("Superblock layout: %s\n", report.layout_ok ? "ok" : "CHECKSUM MISMATCH");
+            for (int r = 0; r < IMAGE_REGION_COUNT; r++) {
+                if (report.bad_by_region[r] > 0) {
+                    printf("  %s: %lld bad blocks\n", image_region_name(r), (long long)report.bad_by_region[r]);
+                }
+            }
+            for (int64_t i = 0; i < report.bad && i < SCRUB_BAD_MAX; i++) {
+                printf("  bad block %lld\n", (long long)report.bad_blocks[i]);
+            }
+            if (report.bad > SCRUB_BAD_MAX) printf("  ... %lld more\n", (long long)(report.bad - SCRUB_BAD_MAX));
+        }
+        checkpoint_file_system();
+        close_journal();
+        free_memory();
+        return bad == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Name search: fsWithoutPermissions --search [--prefix] TEXT
+    if (argc > 2 && strcmp(argv[1], "--search") == 0) {
+        int prefix = argc > 3 && strcmp(argv[2], "--prefix") == 0;
+        const char *query = argv[prefix ? 3 : 2];
+        NameMatch *matches = malloc(NAME_SEARCH_MAX_RESULTS * sizeof(NameMatch));
+        if (matches == NULL) return EXIT_FAILURE;
+
+        fs_host_mirror = 0;
+        init_file_system();
+        gint64 start = g_get_monotonic_time();
+        int count = name_index_search(query, prefix, matches, NAME_SEARCH_MAX_RESULTS);
+        gint64 built = g_get_monotonic_time();
+        // The first search builds the index, a second one shows what typing in the GUI costs
+        count = name_index_search(query, prefix, matches, NAME_SEARCH_MAX_RESULTS);
+        gint64 searched = g_get_monotonic_time();
+        for (int i = 0; i < count; i++) {
+            printf("/%s\n", matches[i].path);
+        }
+        if (count >= 0) {
+            printf("%d matches%s, index built in %.1f ms, searched in %.3f ms\n", count,
+                   count == NAME_SEARCH_MAX_RESULTS ? " (limit reached)" : "",
+                   (built - start) / 1000.0, (searched - built) / 1000.0);
+        }
+        free(matches);
+        close_journal();
+        free_memory();
+        return count >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     gtk_init(&argc, &argv);
 
     initialize_gui(&window, &list_view, &search_entry, &vbox);
 
-    // Initialize the file system and populate the file list
+    // Initialize the file system and populate the file list; listing it also starts watching it for changes
     init_file_system();
     list_files(NULL, window);
 
-    // Monitor the directory for changes
-    GFile *directory = g_file_new_for_path(TEST_FOLDER_PATH);
-    GFileMonitor *monitor = g_file_monitor_directory(directory, G_FILE_MONITOR_NONE, NULL, NULL);
-    g_signal_connect(monitor, "changed", G_CALLBACK(on_directory_changed), window);
-
     gtk_widget_show_all(window);
     gtk_main();
 
+    // Persist the directory tree and inodes before exiting, leaving an empty log
+    checkpoint_file_system();
+    close_journal();
+
     // Free allocated memory
     free_memory();
 
@@ -0,0 +1,543 @@
+/*
+    FILE SYSTEM BENCHMARKS
+
+    Drives the headless engine (fs_engine.h) on a scratch disk image and reports throughput and latency
+    percentiles per phase, in this order:
+      - create, stat, rename and delete storms over the directory tree
+      - the same storms through the batch operations
+      - copying and deleting a whole tree of small files
+      - sequential and random writes and reads on one large file
+      - a restart that replays the journal
+      - a scrub of the image's block checksums
+    followed by the engine's stats_format report for the whole run.
+    File contents live in data blocks (fs_host_mirror = 0), so the host folder is not part of what is measured.
+    --dedup formats the image with FS_FEATURE_DEDUP; every piece is written with the same bytes, so the data
+    phases then measure the deduplicating write path.
+
+    usage: fs_bench [--ops N] [--file-size BYTES] [--io-size BYTES] [--block-size BYTES] [--commit-window MS]
+                    [--seed N] [--dir DIR] [--keep] [--dedup]
+*/
+
+#include "fs_engine.h"
+
+#define BENCH_DEFAULT_OPS 1000
+#define BENCH_DEFAULT_FILE_SIZE (64 << 20)
+#define BENCH_DEFAULT_IO_SIZE 4096
+#define BENCH_DEFAULT_DIR "fs_bench.tmp"
+#define BENCH_FILES_PER_DIR 128 // well below DIR_MAX_ENTRIES of the smallest block size
+
+typedef struct {
+    int ops;
+    int64_t file_size;
+    int io_size;
+    int block_size;
+    int commit_window_ms;
+    uint32_t seed;
+    const char *dir;
+    int keep;
+    int dedup;
+} BenchOptions;
+
+//latencies of one phase, in nanoseconds
+typedef struct {
+    const char *name;
+    int64_t *samples;
+    int count;
+    int files; // handled by the sampled calls when each call takes many, 0 when a sample is one operation
+    int64_t bytes; // moved by the phase, 0 for metadata phases
+    int64_t elapsed;
+} BenchPhase;
+
+//xorshift32, so runs with the same --seed touch the same offsets
+static uint32_t bench_random(uint32_t *state) {
+
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static int compare_samples(const void *a, const void *b) {
+
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int phase_begin(BenchPhase *phase, const char *name, int count) {
+
+    phase->name = name;
+    phase->count = 0;
+    phase->files = 0;
+    phase->bytes = 0;
+    phase->samples = malloc((count > 0 ? count : 1) * sizeof(int64_t));
+    if (phase->samples == NULL) {
+        printf("Error: Memory allocation failed for %d samples\n", count);
+        return -1;
+    }
+    phase->elapsed = stats_now();
+    return 0;
+}
+
+static void phase_sample(BenchPhase *phase, int64_t start) {
+
+    phase->samples[phase->count++] = stats_now() - start;
+}
+
+static double percentile_us(const BenchPhase *phase, double p) {
+
+    int i = (int)(p * (phase->count - 1) + 0.5);
+    return phase->samples[i] / 1000.0;
+}
+
+//print one line of the report and free the samples
+static void phase_end(BenchPhase *phase) {
+
+    phase->elapsed = stats_now() - phase->elapsed;
+    if (phase->count > 0) {
+        qsort(phase->samples, phase->count, sizeof(int64_t), compare_samples);
+        double seconds = phase->elapsed / 1e9;
+        if (phase->files > 0) {
+            printf("%-22s %6d files %9.0f files/s", phase->name, phase->files, phase->files / seconds);
+        } else {
+            printf("%-22s %8d ops %11.0f ops/s", phase->name, phase->count, phase->count / seconds);
+        }
+        if (phase->bytes > 0) {
+            printf(" %9.1f MB/s", phase->bytes / seconds / (1 << 20));
+        } else {
+            printf("             ");
+        }
+        printf("   p50 %9.1f us  p95 %9.1f us  p99 %9.1f us  max %9.1f us", percentile_us(phase, 0.50),
+               percentile_us(phase, 0.95), percentile_us(phase, 0.99), phase->samples[phase->count - 1] / 1000.0);
+        if (phase->files > 0) {
+            printf("  per call, %d call%s", phase->count, phase->count == 1 ? "" : "s");
+        }
+        printf("\n");
+    }
+    free(phase->samples);
+    phase->samples = NULL;
+}
+
+static void bench_file_name(char *out, size_t out_size, const char *prefix, int i) {
+
+    snprintf(out, out_size, "d%d/%s%d", i / BENCH_FILES_PER_DIR, prefix, i);
+}
+
+//what a getattr costs: resolve the path, then copy the attributes under the inode's lock
+static int bench_stat(const char *fs_path, struct stat *st) {
+
+    g_rw_lock_reader_lock(&namespace_lock);
+    int inode_number = resolve_path(fs_path);
+    if (inode_number != -1) {
+        inode_lock_shared(inode_number);
+        Inode *inode = &inode_table[inode_number];
+        memset(st, 0, sizeof(*st));
+        st->st_mode = (inode->is_directory ? S_IFDIR : S_IFREG) | (inode->mode & 07777);
+        st->st_size = inode->_size;
+        st->st_mtime = inode_cold(inode_number)->mtime;
+        inode_unlock_shared(inode_number);
+    }
+    g_rw_lock_reader_unlock(&namespace_lock);
+    return inode_number == -1 ? -1 : 0;
+}
+
+static int64_t bench_io(int inode_number, char *buf, size_t size, int64_t offset, int write) {
+
+    g_rw_lock_reader_lock(&namespace_lock);
+    int64_t n;
+    if (write) {
+        inode_lock(inode_number);
+        n = inode_write(inode_number, buf, size, offset);
+        inode_unlock(inode_number);
+    } else {
+        inode_lock_shared(inode_number);
+        n = inode_read(inode_number, buf, size, offset);
+        inode_unlock_shared(inode_number);
+    }
+    g_rw_lock_reader_unlock(&namespace_lock);
+    return n;
+}
+
+//create, stat, rename and delete opts->ops files spread over directories of BENCH_FILES_PER_DIR
+static int bench_metadata(const BenchOptions *opts) {
+
+    char name[MAX_FILENAME_LEN], new_name[MAX_FILENAME_LEN], fs_path[MAX_PATH_LEN];
+    int dirs = (opts->ops + BENCH_FILES_PER_DIR - 1) / BENCH_FILES_PER_DIR;
+    for (int d = 0; d < dirs; d++) {
+        snprintf(name, sizeof(name), "d%d", d);
+        if (create_directory(name) != FS_OK) return -1;
+    }
+
+    BenchPhase phase;
+    if (phase_begin(&phase, "create", opts->ops) != 0) return -1;
+    for (int i = 0; i < opts->ops; i++) {
+        bench_file_name(name, sizeof(name), "f", i);
+        int64_t start = stats_now();
+        int result = create_file(name, 0);
+        phase_sample(&phase, start);
+        if (result != FS_OK) {
+            printf("create %s: %s\n", name, fs_strerror(result));
+            phase_end(&phase);
+            return -1;
+        }
+    }
+    phase_end(&phase);
+
+    struct stat st;
+    if (phase_begin(&phase, "stat", opts->ops) != 0) return -1;
+    for (int i = 0; i < opts->ops; i++) {
+        bench_file_name(name, sizeof(name), "f", i);
+        make_fs_path(name, fs_path);
+        int64_t start = stats_now();
+        int result = bench_stat(fs_path, &st);
+        phase_sample(&phase, start);
+        if (result != 0) {
+            printf("stat %s: not found\n", name);
+            phase_end(&phase);
+            return -1;
+        }
+    }
+    phase_end(&phase);
+
+    // Every file is renamed away and back again, both within its directory
+    if (phase_begin(&phase, "rename", 2 * opts->ops) != 0) return -1;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < opts->ops; i++) {
+            bench_file_name(name, sizeof(name), round == 0 ? "f" : "r", i);
+            bench_file_name(new_name, sizeof(new_name), round == 0 ? "r" : "f", i);
+            int64_t start = stats_now();
+            int result = rename_file(name, new_name);
+            phase_sample(&phase, start);
+            if (result != FS_OK) {
+                printf("rename %s: %s\n", name, fs_strerror(result));
+                phase_end(&phase);
+                return -1;
+            }
+        }
+    }
+    phase_end(&phase);
+
+    if (phase_begin(&phase, "delete", opts->ops) != 0) return -1;
+    for (int i = 0; i < opts->ops; i++) {
+        bench_file_name(name, sizeof(name), "f", i);
+        int64_t start = stats_now();
+        int result = delete_file(name);
+        phase_sample(&phase, start);
+        if (result != FS_OK) {
+            printf("delete %s: %s\n", name, fs_strerror(result));
+            phase_end(&phase);
+            return -1;
+        }
+    }
+    phase_end(&phase);
+    return 0;
+}
+
+//one batch per directory: the latencies are per call, the throughput per file
+static int bench_batch_phase(const BenchOptions *opts, const char *name, char **paths, int op) {
+
+    BenchPhase phase;
+    if (phase_begin(&phase, name, (opts->ops + BENCH_FILES_PER_DIR - 1) / BENCH_FILES_PER_DIR) != 0) return -1;
+    for (int first = 0; first < opts->ops; first += BENCH_FILES_PER_DIR) {
+        int count = opts->ops - first < BENCH_FILES_PER_DIR ? opts->ops - first : BENCH_FILES_PER_DIR;
+        const char *const *batch = (const char *const *)paths + first;
+        int64_t start = stats_now();
+        int done = op == 0 ? create_files(batch, count, 0, NULL) :
+                   op == 1 ? change_files_permissions(batch, count, 0640, 0, NULL) : delete_files(batch, count, NULL);
+        phase_sample(&phase, start);
+        phase.files += count;
+        if (done != count) {
+            printf("%s: %d of %d failed in %s\n", name, count - done, count, paths[first]);
+            phase_end(&phase);
+            return -1;
+        }
+    }
+    phase_end(&phase);
+    return 0;
+}
+
+//the create, chmod and delete storms again, a directory's worth of files per call
+static int bench_batch(const BenchOptions *opts) {
+
+    char **paths = calloc(opts->ops, sizeof(char *));
+    int result = paths != NULL ? 0 : -1;
+    for (int i = 0; result == 0 && i < opts->ops; i++) {
+        if ((paths[i] = malloc(MAX_FILENAME_LEN)) == NULL) result = -1;
+        else bench_file_name(paths[i], MAX_FILENAME_LEN, "b", i);
+    }
+    if (result == 0) {
+        result = bench_batch_phase(opts, "batch create", paths, 0) == 0 &&
+                 bench_batch_phase(opts, "batch chmod", paths, 1) == 0 &&
+                 bench_batch_phase(opts, "batch delete", paths, 2) == 0 ? 0 : -1;
+    }
+    for (int i = 0; paths != NULL && i < opts->ops; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    return result;
+}
+
+//time one call on the whole tree: its latency, and the throughput per file
+static int bench_tree_phase(const BenchOptions *opts, const char *name, const char *src, const char *dst) {
+
+    BenchPhase phase;
+    if (phase_begin(&phase, name, 1) != 0) return -1;
+    int64_t start = stats_now();
+    int result = dst != NULL ? copy_tree(src, dst) : delete_tree(src);
+    phase_sample(&phase, start);
+    phase.files = opts->ops;
+    phase_end(&phase);
+    if (result != FS_OK) {
+        printf("%s %s: %s\n", name, src, fs_strerror(result));
+        return -1;
+    }
+    return 0;
+}
+
+//a build-artifact tree: opts->ops files of io_size bytes under tree/, copied whole and then deleted whole,
+//the copy first so the second delete frees the data blocks the two shared
+static int bench_tree(const BenchOptions *opts) {
+
+    char name[MAX_FILENAME_LEN], fs_path[MAX_PATH_LEN];
+    int dirs = (opts->ops + BENCH_FILES_PER_DIR - 1) / BENCH_FILES_PER_DIR;
+    if (create_directory("tree") != FS_OK) return -1;
+    for (int d = 0; d < dirs; d++) {
+        snprintf(name, sizeof(name), "tree/d%d", d);
+        if (create_directory(name) != FS_OK) return -1;
+    }
+
+    char *buf = calloc(1, opts->io_size);
+    if (buf == NULL) return -1;
+    int result = 0;
+    for (int i = 0; result == 0 && i < opts->ops; i++) {
+        snprintf(name, sizeof(name), "tree/d%d/t%d", i / BENCH_FILES_PER_DIR, i);
+        make_fs_path(name, fs_path);
+        if (create_file(name, 0) != FS_OK) {
+            result = -1;
+        } else {
+            g_rw_lock_reader_lock(&namespace_lock);
+            int inode_number = resolve_path(fs_path);
+            g_rw_lock_reader_unlock(&namespace_lock);
+            if (bench_io(inode_number, buf, opts->io_size, 0, 1) != opts->io_size) {
+                printf("write %s: failed\n", name);
+                result = -1;
+            }
+        }
+    }
+    free(buf);
+
+    if (result == 0 && (bench_tree_phase(opts, "tree copy", "tree", "tree_copy") != 0 ||
+                        bench_tree_phase(opts, "tree delete (copy)", "tree_copy", NULL) != 0 ||
+                        bench_tree_phase(opts, "tree delete (original)", "tree", NULL) != 0)) {
+        result = -1;
+    }
+    return result;
+}
+
+//one pass over the file in io_size pieces, or opts->ops pieces at random io_size-aligned offsets
+static int bench_data_phase(const BenchOptions *opts, const char *name, int inode_number, char *buf, int write, int random) {
+
+    int64_t pieces = opts->file_size / opts->io_size;
+    int count = random ? opts->ops : (int)pieces;
+    uint32_t state = opts->seed;
+    BenchPhase phase;
+    if (phase_begin(&phase, name, count) != 0) return -1;
+    for (int i = 0; i < count; i++) {
+        int64_t piece = random ? bench_random(&state) % pieces : i;
+        int64_t start = stats_now();
+        int64_t n = bench_io(inode_number, buf, opts->io_size, piece * opts->io_size, write);
+        phase_sample(&phase, start);
+        if (n != opts->io_size) {
+            printf("%s at %lld: %lld bytes\n", name, (long long)(piece * opts->io_size), (long long)n);
+            phase_end(&phase);
+            return -1;
+        }
+        phase.bytes += n;
+    }
+    phase_end(&phase);
+    return 0;
+}
+
+static int bench_data(const BenchOptions *opts) {
+
+    if (create_file("data", 0) != FS_OK) return -1;
+    char fs_path[MAX_PATH_LEN];
+    make_fs_path("data", fs_path);
+    g_rw_lock_reader_lock(&namespace_lock);
+    int inode_number = resolve_path(fs_path);
+    g_rw_lock_reader_unlock(&namespace_lock);
+
+    char *buf = malloc(opts->io_size);
+    if (buf == NULL) {
+        printf("Error: Memory allocation failed for the I/O buffer\n");
+        return -1;
+    }
+    for (int i = 0; i < opts->io_size; i++) {
+        buf[i] = (char)(i * 31 + 7);
+    }
+
+    int result = 0;
+    if (bench_data_phase(opts, "seq write", inode_number, buf, 1, 0) != 0 ||
+        bench_data_phase(opts, "seq read", inode_number, buf, 0, 0) != 0 ||
+        bench_data_phase(opts, "random write", inode_number, buf, 1, 1) != 0 ||
+        bench_data_phase(opts, "random read", inode_number, buf, 0, 1) != 0) {
+        result = -1;
+    }
+    free(buf);
+    if (delete_file("data") != FS_OK) result = -1;
+    return result;
+}
+
+//journal up to a checkpoint interval of creates, stop without a checkpoint and time the restart
+static int bench_replay(const BenchOptions *opts) {
+
+    int records = opts->ops < JOURNAL_CHECKPOINT_INTERVAL - 1 ? opts->ops : JOURNAL_CHECKPOINT_INTERVAL - 1;
+    char name[MAX_FILENAME_LEN], fs_path[MAX_PATH_LEN];
+    if (checkpoint_file_system() != 0) return -1;
+    for (int i = 0; i < records; i++) {
+        bench_file_name(name, sizeof(name), "j", i);
+        if (create_file(name, 0) != FS_OK) return -1;
+    }
+    close_journal();
+    free_memory();
+
+    int64_t start = stats_now();
+    init_file_system();
+    int64_t elapsed = stats_now() - start;
+
+    int found = 0;
+    for (int i = 0; i < records; i++) {
+        bench_file_name(name, sizeof(name), "j", i);
+        make_fs_path(name, fs_path);
+        found += resolve_path(fs_path) != -1;
+    }
+    printf("%-22s %8d records replayed in %.1f ms, %.1f us per record\n", "journal replay", records,
+           elapsed / 1e6, records > 0 ? elapsed / 1e3 / records : 0.0);
+    if (found != records) {
+        printf("journal replay: %d of %d files recovered\n", found, records);
+        return -1;
+    }
+    return 0;
+}
+
+static int bench_scrub() {
+
+    ScrubReport report;
+    int64_t bad = fs_scrub(&report);
+    double seconds = report.elapsed_ns / 1e9;
+    printf("%-22s %8lld blocks in %.1f ms %9.1f MB/s (%s CRC32C)\n", "scrub", (long long)report.checked,
+           report.elapsed_ns / 1e6, seconds > 0 ? report.checked * (double)superblock->block_size / seconds / (1 << 20) : 0.0,
+           crc32c_hardware() ? "hardware" : "table");
+    if (bad != 0) {
+        printf("scrub: %lld bad blocks\n", (long long)report.bad);
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_options(int argc, char *argv[], BenchOptions *opts) {
+
+    opts->ops = BENCH_DEFAULT_OPS;
+    opts->file_size = BENCH_DEFAULT_FILE_SIZE;
+    opts->io_size = BENCH_DEFAULT_IO_SIZE;
+    opts->block_size = DEFAULT_BLOCK_SIZE;
+    opts->commit_window_ms = JOURNAL_COMMIT_WINDOW_MS;
+    opts->seed = 2463534242u;
+    opts->dir = BENCH_DEFAULT_DIR;
+    opts->keep = 0;
+    opts->dedup = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--keep") == 0) {
+            opts->keep = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--dedup") == 0) {
+            opts->dedup = 1;
+            continue;
+        }
+        if (value == NULL) {
+            printf("usage: %s [--ops N] [--file-size BYTES] [--io-size BYTES] [--block-size BYTES] "
+                   "[--commit-window MS] [--seed N] [--dir DIR] [--keep] [--dedup]\n", argv[0]);
+            return -1;
+        }
+        if (strcmp(argv[i], "--ops") == 0) opts->ops = atoi(value);
+        else if (strcmp(argv[i], "--file-size") == 0) opts->file_size = atoll(value);
+        else if (strcmp(argv[i], "--io-size") == 0) opts->io_size = atoi(value);
+        else if (strcmp(argv[i], "--block-size") == 0) opts->block_size = atoi(value);
+        else if (strcmp(argv[i], "--commit-window") == 0) opts->commit_window_ms = atoi(value);
+        else if (strcmp(argv[i], "--seed") == 0) opts->seed = (uint32_t)strtoul(value, NULL, 10);
+        else if (strcmp(argv[i], "--dir") == 0) opts->dir = value;
+        else {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+        i++;
+    }
+
+    if (opts->ops < 1 || opts->io_size < 1 || opts->file_size < opts->io_size || opts->seed == 0) {
+        printf("--ops and --io-size must be positive, --file-size at least --io-size and --seed not 0\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void remove_image_files() {
+
+    remove(FS_IMAGE_FILENAME);
+    remove(JOURNAL_FILENAME);
+    remove(JOURNAL_SEGMENT_FILENAME);
+    remove(HOTLIST_FILENAME);
+}
+
+int main(int argc, char *argv[]) {
+
+    BenchOptions opts;
+    if (parse_options(argc, argv, &opts) != 0) return EXIT_FAILURE;
+
+    // The image and the journal are created in the scratch directory, next to nothing else
+    _mkdir(opts.dir);
+    if (_chdir(opts.dir) != 0) {
+        perror("Failed to enter the benchmark directory");
+        return EXIT_FAILURE;
+    }
+    remove_image_files();
+
+    // Room for every file of the storms at once, the data file and a block map for it
+    int dirs = (opts.ops + BENCH_FILES_PER_DIR - 1) / BENCH_FILES_PER_DIR;
+    int64_t file_blocks = (opts.file_size + opts.block_size - 1) / opts.block_size;
+    int64_t num_blocks = file_blocks + file_blocks / 64 + (int64_t)dirs * DIRECT_BLOCKS * 3 + opts.ops + 1024;
+    int64_t inode_count = 2 * (opts.ops + dirs) + 64; // the tree and its copy at once
+    if (!geometry_valid(opts.block_size, num_blocks, inode_count)) {
+        printf("No valid geometry for %lld blocks of %d bytes and %lld inodes\n", (long long)num_blocks,
+               opts.block_size, (long long)inode_count);
+        return EXIT_FAILURE;
+    }
+
+    fs_host_mirror = 0;
+    dcache_init();
+    if (format_file_system(FS_IMAGE_FILENAME, opts.block_size, (int)num_blocks, (int)inode_count, opts.dedup ? FS_FEATURE_DEDUP : 0) != 0) {
+        return EXIT_FAILURE;
+    }
+    free_memory();
+    init_file_system();
+    journal_set_commit_window(opts.commit_window_ms);
+
+    printf("%d ops, %lld byte file in %d byte pieces, %d byte blocks, %d ms commit window\n", opts.ops,
+           (long long)opts.file_size, opts.io_size, opts.block_size, opts.commit_window_ms);
+
+    int result = bench_metadata(&opts) == 0 && bench_batch(&opts) == 0 && bench_tree(&opts) == 0 && bench_data(&opts) == 0 && bench_replay(&opts) == 0 && bench_scrub() == 0;
+    if (!result) printf("Benchmark failed\n");
+
+    // The engine's own view of the run: where the time went inside it, across every phase
+    char stats[STATS_TEXT_MAX];
+    stats_format(stats, sizeof(stats));
+    printf("\n%s", stats);
+
+    checkpoint_file_system();
+    close_journal();
+    free_memory();
+    if (!opts.keep) remove_image_files();
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
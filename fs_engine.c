@@ -0,0 +1,6932 @@
+/*
+    FILE SYSTEM ENGINE
+
+    Journal, directories and the dentry cache, the memory-mapped disk image, block and inode allocation,
+    snapshots, the name index, permissions and the FUSE frontend. Nothing here touches GTK: operations
+    print their diagnostics and return a result for the caller to present, see FsResult in fs_engine.h.
+*/
+
+#include "fs_engine.h"
+#include <errno.h>
+
+#ifdef FS_WITH_FUSE
+#define FUSE_USE_VERSION 30
+#include <fuse_lowlevel.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BITMAP_CTZ(word) __builtin_ctzll(word)
+#else
+static int bitmap_ctz(uint64_t word) {
+    int n = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        n++;
+    }
+    return n;
+}
+#define BITMAP_CTZ(word) bitmap_ctz(word)
+#endif
+
+//CRC instructions for crc32c: SSE4.2 is checked for at run time, the ARMv8 ones are used when the compiler
+//targets them (e.g. -march=armv8-a+crc)
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+//engine state, described with its declarations in fs_engine.h
+OpStats op_stats[STAT_OP_COUNT];
+uint64_t stat_counters[STAT_COUNTER_COUNT];
+
+JournalRecord* journal[JOURNAL_SIZE]; // ring of the most recent records, NULL = unused slot
+int journal_index = 0;
+int journal_fd = -1; // journal file, opened with O_APPEND
+int journal_segment_fd = -1; // log segment for large payloads, opened with O_APPEND
+GMutex journal_lock; // guards journal[], journal_index, both descriptors and the commit state below
+GCond journal_commit_cond;
+uint64_t journal_next_seq = 1; // sequence number of the next record
+uint64_t journal_since_checkpoint = 0; // records appended since the log was last truncated
+uint64_t journal_appended_seq = 0; // records written to journal_fd
+uint64_t journal_durable_seq = 0; // records covered by a completed fsync
+int journal_flush_in_progress = 0;
+int journal_sync_failed = 0; // an fsync failed, nothing past journal_durable_seq is durable until a checkpoint
+int journal_waiters = 0; // callers inside journal_wait_durable
+int journal_commit_window_ms = JOURNAL_COMMIT_WINDOW_MS;
+JournalSubmission *journal_submit_head = NULL; // lock-free stack of queued submissions, newest first
+GMutex journal_segment_lock; // orders appends to journal_segment_fd
+GRWLock journal_checkpoint_lock; // shared by appenders, exclusive while a checkpoint saves and truncates the log
+unsigned char *journal_batch = NULL; // a drained batch is gathered here for its write(), guarded by journal_lock
+size_t journal_batch_capacity = 0;
+
+unsigned char *fs_image = NULL; // the mapped disk image
+size_t fs_image_size = 0;
+int fs_image_fd = -1;
+#ifdef _WIN32
+HANDLE fs_image_mapping = NULL;
+#endif
+
+uint64_t *image_dirty = NULL;
+int64_t image_dirty_count = 0;
+GMutex image_dirty_lock;
+GMutex image_flush_lock; // one flush at a time, so a finished flush has stored the checksums of what it wrote
+GCond image_flush_cond;
+GThread *image_flusher = NULL;
+int image_flusher_stop = 0;
+GThread *prefetcher = NULL;
+int prefetcher_stop = 0;
+
+Superblock *superblock = NULL;
+uint64_t *block_bitmap = NULL;
+uint32_t *block_refs = NULL; // per data block: references beyond the first, from files sharing it after a clone
+uint32_t *image_checksums = NULL; // per image block outside the checksum region, crc32c as of its last write-back
+uint64_t *inode_bitmap = NULL;
+Inode *inode_table = NULL;
+InodeCold *inode_cold_table = NULL;
+
+Directory** directory_cache = NULL; // loaded directory views, indexed by inode number, sized from the superblock
+
+DentryCacheEntry dcache[DCACHE_SIZE];
+int dcache_buckets[DCACHE_HASH_SIZE];
+int dcache_lru_head = -1; // most recently used
+int dcache_lru_tail = -1; // evicted first
+int dcache_free_head = -1;
+
+NameIndex name_index;
+GMutex name_index_lock; // makes sure concurrent first searches build the index once
+
+GRWLock namespace_lock;
+GRWLock *inode_locks = NULL; // one per inode, sized from the superblock
+GMutex bitmap_lock;
+GMutex inode_bitmap_lock; // covers the inode bitmap and the free inode count
+GMutex dcache_lock;
+GMutex dir_load_lock;
+int inode_next_free_hint = 0; // inode number where the next inode bitmap scan starts
+
+AclBlockSlot *acl_blocks = NULL; // open addressing, built from the inode table on first use
+int acl_blocks_size = 0; // power of two
+int acl_blocks_used = 0; // slots not empty, removed ones included
+GMutex acl_lock; // covers acl_blocks and the reference counts of ACL blocks
+
+uint8_t *fragment_used = NULL; // per block, bit i set = fragment slot i holds a file's bytes; built from the inode table on first use
+int *fragment_partial = NULL; // fragment blocks with a free slot, the newest last
+int fragment_partial_count = 0;
+int fragment_partial_capacity = 0;
+GMutex fragment_lock; // covers the three above
+
+DedupSlot *dedup_blocks = NULL; // open addressing, holds the blocks written whole since the mount
+int dedup_blocks_size = 0; // power of two
+int dedup_blocks_used = 0; // slots not empty, removed ones included
+gint *dedup_registered = NULL; // per block, its slot in dedup_blocks or -1. All of these change under bitmap_lock
+
+guint *perm_generations = NULL; // per inode, bumped by every change to its mode, owner or ACL
+static guint perm_mount_epoch = 0; // bumped by every attach, whose perm_generations start again at 0
+static GPrivate perm_cache_key = G_PRIVATE_INIT(free); // this thread's PermCacheEntry[PERM_CACHE_SIZE]
+
+AllocPool *alloc_pools = NULL; // every thread's pool
+GMutex alloc_pools_lock;
+
+GMutex snapshot_lock; // orders writes to the newest snapshot's table
+int fs_read_only = 0; // 1 while a snapshot is mounted, changes are refused
+
+int current_user_id = 11 ; //for testing purposes
+int current_group_id = 10 ;
+char TEST_FOLDER_PATH[MAX_FILENAME_LEN] = DEFAULT_ROOT_PATH; //for current directory
+char PREVIOUS_ROOT_PATH[MAX_FILENAME_LEN] = DEFAULT_ROOT_PATH;//to keep "root directory"
+char FS_ROOT_PATH[MAX_FILENAME_LEN] = DEFAULT_ROOT_PATH; //host folder for the file system root
+char current_dir_path[MAX_PATH_LEN] = ""; //current directory, relative to the file system root
+char previous_dir_path[MAX_PATH_LEN] = "";
+int fs_host_mirror = 1; //1 while file contents live in the host folder (GUI), 0 when they live in data blocks (FUSE mount)
+
+
+//message for an FsResult, worded for the user
+const char *fs_strerror(int result) {
+
+    switch (result) {
+        case FS_OK: return "Done.";
+        case FS_ERR_INVALID: return "Invalid name.";
+        case FS_ERR_EXISTS: return "A file or directory with that name already exists.";
+        case FS_ERR_NOT_FOUND: return "No such file or directory.";
+        case FS_ERR_NOT_EMPTY: return "Directory is not empty.";
+        case FS_ERR_NO_SPACE: return "Not enough free space.";
+        case FS_ERR_IO: return "The host folder refused the change.";
+        default: return "Unknown error.";
+    }
+}
+
+const char* operation_to_string(JournalOperation operation) {
+    switch (operation) {
+        case CREATE: return "CREATED";
+        case DELETE: return "DELETED";
+        case MODIFY: return "MODIFIED";
+        case RENAME: return "RENAMED";
+        case READ: return "READ";
+        case CHANGE_PERMISSIONS: return "CHANGED PERMISSIONS";
+        case CREATE_DIRECTORY: return "CREATED DIRECTORY";
+        default: return "UNKNOWN";
+    }
+}
+
+JournalOperation string_to_operation(const char* str) {
+    if (strcmp(str, "CREATE") == 0) return CREATE;
+    if (strcmp(str, "DELETE") == 0) return DELETE;
+    if (strcmp(str, "MODIFY") == 0) return MODIFY;
+    if (strcmp(str, "RENAME") == 0) return RENAME;
+    if (strcmp(str, "READ") == 0) return READ;
+    if (strcmp(str, "CHANGE_PERMISSIONS") == 0) return CHANGE_PERMISSIONS;
+    if (strcmp(str, "CREATE_DIRECTORY") == 0) return CREATE_DIRECTORY;
+    return -1; // Unknown operation
+}
+
+static uint32_t crc32c_table[256];
+
+#ifdef CRC32C_SSE42
+//eight bytes per crc32 instruction, unaligned loads go through memcpy
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+
+#ifdef __x86_64__
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = (uint32_t)c;
+#endif
+    for (; len >= 4; p += 4, len -= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+static uint32_t crc32c_arm(uint32_t crc, const unsigned char *p, size_t len) {
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+//1 if crc32c runs on the processor's CRC instructions, 0 if it falls back to the table
+int crc32c_hardware() {
+
+#if defined(CRC32C_SSE42)
+    static int supported = -1;
+    if (supported == -1) supported = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    return supported;
+#elif defined(CRC32C_ARM)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+//CRC-32C (Castagnoli): the CRC instructions where the processor has them, table driven otherwise
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+
+#if defined(CRC32C_SSE42)
+    if (crc32c_hardware()) return ~crc32c_sse42(~crc, (const unsigned char *)data, len);
+#elif defined(CRC32C_ARM)
+    return ~crc32c_arm(~crc, (const unsigned char *)data, len);
+#endif
+    if (crc32c_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+            }
+            crc32c_table[i] = c;
+        }
+    }
+
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    while (len--) {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+//64-bit atomic add and maximum for the statistics; relaxed, the counters order nothing
+#if defined(__GNUC__) || defined(__clang__)
+#define STATS_ADD(counter, value) __atomic_fetch_add((counter), (value), __ATOMIC_RELAXED)
+#define STATS_LOAD(counter) __atomic_load_n((counter), __ATOMIC_RELAXED)
+#define STATS_CAS(counter, expected, value) __atomic_compare_exchange_n((counter), &(expected), (value), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define STATS_ADD(counter, value) InterlockedExchangeAdd64((volatile LONG64 *)(counter), (LONG64)(value))
+#define STATS_LOAD(counter) ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(counter), 0, 0))
+static int stats_cas(uint64_t *counter, uint64_t *expected, uint64_t value) {
+
+    uint64_t seen = (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)counter, (LONG64)value, (LONG64)*expected);
+    if (seen == *expected) return 1;
+    *expected = seen;
+    return 0;
+}
+#define STATS_CAS(counter, expected, value) stats_cas((counter), &(expected), (value))
+#endif
+
+static const char *stat_op_names[STAT_OP_COUNT] = {
+    "lookup", "alloc", "journal append", "journal fsync", "flush", "checkpoint", "replay", "mount"
+};
+
+//monotonic clock in nanoseconds
+int64_t stats_now() {
+
+#ifdef _WIN32
+    LARGE_INTEGER frequency, now;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (int64_t)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+void stats_record(StatOp op, int64_t elapsed_ns) {
+
+    uint64_t ns = elapsed_ns > 0 ? (uint64_t)elapsed_ns : 0;
+    int bucket = 0;
+    for (uint64_t v = ns; v != 0 && bucket < STATS_BUCKETS - 1; v >>= 1) {
+        bucket++;
+    }
+
+    OpStats *stats = &op_stats[op];
+    STATS_ADD(&stats->count, 1);
+    STATS_ADD(&stats->total_ns, ns);
+    STATS_ADD(&stats->buckets[bucket], 1);
+    uint64_t max = STATS_LOAD(&stats->max_ns);
+    while (ns > max && !STATS_CAS(&stats->max_ns, max, ns)) {
+    }
+}
+
+void stats_count(StatCounter counter) {
+
+    STATS_ADD(&stat_counters[counter], 1);
+}
+
+//zero every statistic; concurrent updates may survive it
+void stats_reset() {
+
+    memset(op_stats, 0, sizeof(op_stats));
+    memset(stat_counters, 0, sizeof(stat_counters));
+}
+
+//upper bound in microseconds of the bucket holding the given fraction of the samples
+static double stats_percentile_us(const uint64_t *buckets, uint64_t count, double fraction) {
+
+    uint64_t wanted = (uint64_t)(fraction * count + 0.5), seen = 0;
+    if (wanted == 0) wanted = 1;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= wanted) return (double)((uint64_t)1 << b) / 1000.0;
+    }
+    return (double)((uint64_t)1 << (STATS_BUCKETS - 1)) / 1000.0;
+}
+
+//snprintf at out + *n, advancing *n; output beyond out_size is dropped
+static void stats_append(char *out, size_t out_size, size_t *n, const char *format, ...) {
+
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(*n < out_size ? out + *n : NULL, *n < out_size ? out_size - *n : 0, format, args);
+    va_end(args);
+    if (written > 0) *n += (size_t)written;
+}
+
+//the statistics as text, one line per operation followed by the allocation and journal state.
+//Percentiles are bucket upper bounds, so within a factor of two. Returns the length written
+int stats_format(char *out, size_t out_size) {
+
+    size_t n = 0;
+    stats_append(out, out_size, &n, "%-15s %10s %12s %10s %10s %10s %12s\n", "operation", "count", "total ms", "avg us", "p50 us", "p99 us", "max us");
+    for (int op = 0; op < STAT_OP_COUNT; op++) {
+        uint64_t buckets[STATS_BUCKETS];
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            buckets[b] = STATS_LOAD(&op_stats[op].buckets[b]);
+        }
+        uint64_t count = STATS_LOAD(&op_stats[op].count);
+        uint64_t total = STATS_LOAD(&op_stats[op].total_ns);
+        if (count == 0) {
+            stats_append(out, out_size, &n, "%-15s %10d\n", stat_op_names[op], 0);
+            continue;
+        }
+        stats_append(out, out_size, &n, "%-15s %10llu %12.3f %10.2f %10.2f %10.2f %12.2f\n", stat_op_names[op], (unsigned long long)count,
+                     total / 1e6, total / 1e3 / count, stats_percentile_us(buckets, count, 0.50),
+                     stats_percentile_us(buckets, count, 0.99), STATS_LOAD(&op_stats[op].max_ns) / 1e3);
+    }
+
+    stats_append(out, out_size, &n, "dentry cache: %llu hits, %llu misses, %llu directories prefetched\n",
+                 (unsigned long long)STATS_LOAD(&stat_counters[STAT_DCACHE_HIT]),
+                 (unsigned long long)STATS_LOAD(&stat_counters[STAT_DCACHE_MISS]),
+                 (unsigned long long)STATS_LOAD(&stat_counters[STAT_PREFETCH_DIR]));
+    if (superblock != NULL) {
+        stats_append(out, out_size, &n, "blocks: %d free of %d, inodes: %d free of %d, dirty image blocks: %lld\n", superblock->free_blocks,
+                     superblock->num_blocks, superblock->free_inode_count, superblock->inode_table_size,
+                     (long long)image_dirty_count);
+        stats_append(out, out_size, &n, "journal: next record %llu, %llu since the last checkpoint\n", (unsigned long long)journal_next_seq,
+                     (unsigned long long)journal_since_checkpoint);
+        if (superblock->features & FS_FEATURE_DEDUP) {
+            stats_append(out, out_size, &n, "dedup: %llu blocks shared, %llu zero blocks left as holes\n",
+                         (unsigned long long)STATS_LOAD(&stat_counters[STAT_DEDUP_HIT]),
+                         (unsigned long long)STATS_LOAD(&stat_counters[STAT_ZERO_BLOCK]));
+        }
+    }
+    return (int)(n < out_size ? n : out_size - 1);
+}
+
+//bytes of a record's payload as stored in journal.bin
+static uint32_t journal_stored_len(const JournalRecord *record) {
+
+    switch (record->payload_kind) {
+        case JOURNAL_PAYLOAD_SEGMENT: return sizeof(JournalSegmentRef);
+        case JOURNAL_PAYLOAD_NONE: return 0;
+        default: return record->payload_len;
+    }
+}
+
+//allocate a record with room for both names and `stored_len` payload bytes
+static JournalRecord *journal_record_new(JournalOperation operation, const char *filename, const char *new_filename,
+                                         JournalPayloadKind kind, uint32_t payload_len, uint32_t stored_len) {
+
+    size_t filename_len = strlen(filename);
+    size_t new_filename_len = new_filename ? strlen(new_filename) : 0;
+    if (filename_len >= MAX_PATH_LEN || new_filename_len >= MAX_PATH_LEN) {
+        printf("Error: Journal file name too long\n");
+        return NULL;
+    }
+
+    JournalRecord *record = malloc(sizeof(JournalRecord) + filename_len + new_filename_len + 2 + stored_len);
+    if (record == NULL) {
+        printf("Error: Memory allocation failed for journal record\n");
+        return NULL;
+    }
+    record->seq = 0; // assigned when appended
+    record->inode_number = -1;
+    record->operation = operation;
+    record->timestamp = time(NULL);
+    record->payload_kind = kind;
+    record->payload_len = payload_len;
+    record->filename_len = (uint16_t)filename_len;
+    record->new_filename_len = (uint16_t)new_filename_len;
+    memcpy(journal_record_filename(record), filename, filename_len + 1);
+    if (new_filename) {
+        memcpy(journal_record_new_filename(record), new_filename, new_filename_len + 1);
+    } else {
+        journal_record_new_filename(record)[0] = '\0';
+    }
+    return record;
+}
+
+//store a record in the in-memory ring, dropping the one it replaces
+static void journal_ring_put(JournalRecord *record) {
+
+    free(journal[journal_index]);
+    journal[journal_index] = record;
+    journal_index = (journal_index + 1) % JOURNAL_SIZE;
+}
+
+//serialize a record as header + payload into out[], returns the record size. The sequence number and the
+//checksum are filled in by journal_seal once the record's place in the log is known
+static size_t journal_encode(const JournalRecord *record, unsigned char *out) {
+
+    int32_t operation = record->operation;
+    int64_t timestamp = record->timestamp;
+    uint32_t kind = record->payload_kind;
+    uint32_t stored_len = journal_stored_len(record);
+
+    unsigned char *p = out + sizeof(JournalRecordHeader);
+    memset(p, 0, 8); p += 8;
+    memcpy(p, &record->inode_number, 4); p += 4;
+    memcpy(p, &operation, 4); p += 4;
+    memcpy(p, &timestamp, 8); p += 8;
+    memcpy(p, &kind, 4); p += 4;
+    memcpy(p, &record->payload_len, 4); p += 4;
+    memcpy(p, &record->filename_len, 2); p += 2;
+    memcpy(p, &record->new_filename_len, 2); p += 2;
+    memcpy(p, journal_record_filename(record), record->filename_len); p += record->filename_len;
+    memcpy(p, journal_record_new_filename(record), record->new_filename_len); p += record->new_filename_len;
+    memcpy(p, journal_record_stored(record), stored_len); p += stored_len;
+
+    JournalRecordHeader header;
+    header.magic = JOURNAL_RECORD_MAGIC;
+    header.length = (uint32_t)(p - out - sizeof(JournalRecordHeader));
+    header.checksum = 0;
+    memcpy(out, &header, sizeof(header));
+    return p - out;
+}
+
+//stamp an encoded record with its sequence number and checksum
+static void journal_seal(unsigned char *out, uint64_t seq) {
+
+    JournalRecordHeader header;
+    memcpy(&header, out, sizeof(header));
+    memcpy(out + sizeof(header), &seq, 8);
+    header.checksum = crc32c(0, out + sizeof(header), header.length);
+    memcpy(out, &header, sizeof(header));
+}
+
+//parse a checksummed payload back into a new record, NULL if the lengths are inconsistent
+static JournalRecord *journal_decode(const unsigned char *payload, uint32_t length) {
+
+    if (length < JOURNAL_PAYLOAD_FIXED) return NULL;
+
+    uint64_t seq;
+    int32_t inode_number, operation;
+    int64_t timestamp;
+    uint32_t kind, payload_len;
+    uint16_t filename_len, new_filename_len;
+    const unsigned char *p = payload;
+    memcpy(&seq, p, 8); p += 8;
+    memcpy(&inode_number, p, 4); p += 4;
+    memcpy(&operation, p, 4); p += 4;
+    memcpy(&timestamp, p, 8); p += 8;
+    memcpy(&kind, p, 4); p += 4;
+    memcpy(&payload_len, p, 4); p += 4;
+    memcpy(&filename_len, p, 2); p += 2;
+    memcpy(&new_filename_len, p, 2); p += 2;
+
+    if (kind > JOURNAL_PAYLOAD_BLOCKS || filename_len >= MAX_PATH_LEN || new_filename_len >= MAX_PATH_LEN) {
+        return NULL;
+    }
+    uint32_t stored_len = kind == JOURNAL_PAYLOAD_SEGMENT ? sizeof(JournalSegmentRef) :
+                          kind == JOURNAL_PAYLOAD_NONE ? 0 : payload_len;
+    if (JOURNAL_PAYLOAD_FIXED + filename_len + new_filename_len + (uint64_t)stored_len != length) {
+        return NULL;
+    }
+
+    JournalRecord *record = malloc(sizeof(JournalRecord) + filename_len + new_filename_len + 2 + stored_len);
+    if (record == NULL) return NULL;
+    record->seq = seq;
+    record->inode_number = inode_number;
+    record->operation = (JournalOperation)operation;
+    record->timestamp = (time_t)timestamp;
+    record->payload_kind = (JournalPayloadKind)kind;
+    record->payload_len = payload_len;
+    record->filename_len = filename_len;
+    record->new_filename_len = new_filename_len;
+    memcpy(journal_record_filename(record), p, filename_len); p += filename_len;
+    journal_record_filename(record)[filename_len] = '\0';
+    memcpy(journal_record_new_filename(record), p, new_filename_len); p += new_filename_len;
+    journal_record_new_filename(record)[new_filename_len] = '\0';
+    memcpy(journal_record_stored(record), p, stored_len);
+    return record;
+}
+
+//fetch a record's payload, reading it from the log segment if needed; returns a malloc'd buffer or NULL.
+//Segment payloads are checked against the checksum kept in the record.
+unsigned char *journal_load_payload(const JournalRecord *record, uint32_t *length) {
+
+    *length = 0;
+    if (record->payload_kind == JOURNAL_PAYLOAD_NONE) return NULL;
+
+    unsigned char *payload = malloc(record->payload_len ? record->payload_len : 1);
+    if (payload == NULL) {
+        printf("Error: Memory allocation failed for journal payload\n");
+        return NULL;
+    }
+
+    if (record->payload_kind != JOURNAL_PAYLOAD_SEGMENT) {
+        memcpy(payload, journal_record_stored(record), record->payload_len);
+        *length = record->payload_len;
+        return payload;
+    }
+
+    JournalSegmentRef ref;
+    memcpy(&ref, journal_record_stored(record), sizeof(ref));
+    FILE *segment = fopen(JOURNAL_SEGMENT_FILENAME, "rb");
+    if (segment == NULL || fseek(segment, (long)ref.offset, SEEK_SET) != 0 ||
+        fread(payload, 1, ref.length, segment) != ref.length || crc32c(0, payload, ref.length) != ref.checksum) {
+        printf("Error: Journal segment payload for %s is missing or damaged\n", journal_record_filename(record));
+        if (segment) fclose(segment);
+        free(payload);
+        return NULL;
+    }
+    fclose(segment);
+    *length = ref.length;
+    return payload;
+}
+
+//load the journal into memory and open it for appending; a torn or corrupt tail is cut off.
+//Called after the file system state is loaded, sequence numbers continue from its checkpoint
+void init_journal() {
+
+    int index = 0;
+    long valid_end = 0;
+    uint64_t last_seq = superblock->checkpoint_seq;
+    uint64_t loaded = 0;
+
+    FILE *file = fopen(JOURNAL_FILENAME, "rb");
+    if (file) {
+        static unsigned char payload[JOURNAL_MAX_PAYLOAD];
+        JournalRecordHeader header;
+        JournalRecord *record = NULL;
+        while (fread(&header, sizeof(header), 1, file) == 1) {
+            if (header.magic != JOURNAL_RECORD_MAGIC || header.length > JOURNAL_MAX_PAYLOAD ||
+                fread(payload, 1, header.length, file) != header.length ||
+                crc32c(0, payload, header.length) != header.checksum ||
+                (record = journal_decode(payload, header.length)) == NULL) {
+                printf("Journal: ignoring damaged records after offset %ld\n", valid_end);
+                break;
+            }
+            // The ring keeps the most recent JOURNAL_SIZE records
+            if (record->seq > last_seq) last_seq = record->seq;
+            free(journal[index]);
+            journal[index] = record;
+            index = (index + 1) % JOURNAL_SIZE;
+            valid_end = ftell(file);
+            loaded++;
+        }
+        fclose(file);
+    } else {
+        printf("Journal file not found, starting fresh\n");
+    }
+    journal_index = index;
+    journal_next_seq = last_seq + 1;
+    journal_since_checkpoint = loaded;
+    if (loaded > JOURNAL_SIZE) {
+        printf("Warning: Journal holds %lu records, only the last %d can be replayed\n", (unsigned long)loaded, JOURNAL_SIZE);
+    }
+
+    journal_fd = open(JOURNAL_FILENAME, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0644);
+    if (journal_fd == -1) {
+        perror("Error: Could not open journal file for appending");
+        return;
+    }
+    if (ftruncate(journal_fd, valid_end) != 0) {
+        perror("Error: Could not truncate damaged journal tail");
+    }
+
+    // Segment bytes past the last valid reference are never read, so a torn segment tail needs no repair
+    journal_segment_fd = open(JOURNAL_SEGMENT_FILENAME, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0644);
+    if (journal_segment_fd == -1) {
+        perror("Error: Could not open journal segment for appending");
+    }
+}
+
+void journal_set_commit_window(int milliseconds) {
+
+    g_mutex_lock(&journal_lock);
+    journal_commit_window_ms = milliseconds < 0 ? 0 : milliseconds;
+    g_mutex_unlock(&journal_lock);
+}
+
+//block until record `seq` is on stable storage; called with journal_lock held.
+//The first waiter becomes the leader and issues one fsync for every record appended so far; the others
+//just wait for its result. When other callers are waiting too, or have records queued or appended past
+//`seq`, the leader first lets the commit window pass so more appends can join. A lone caller does not sleep.
+//Returns 0, or -1 once an fsync has failed: the records past journal_durable_seq may then be lost, and
+//every wait for them fails until a checkpoint has written their state to the image
+static int journal_wait_durable(uint64_t seq) {
+
+    int result = 0;
+    journal_waiters++;
+    while (journal_durable_seq < seq) {
+        if (journal_sync_failed) {
+            result = -1;
+            break;
+        }
+        if (journal_flush_in_progress) {
+            g_cond_wait(&journal_commit_cond, &journal_lock);
+            continue;
+        }
+
+        journal_flush_in_progress = 1;
+        int busy = journal_waiters > 1 || journal_appended_seq > seq || g_atomic_pointer_get(&journal_submit_head) != NULL;
+        if (journal_commit_window_ms > 0 && busy) {
+            g_mutex_unlock(&journal_lock);
+            g_usleep(journal_commit_window_ms * 1000);
+            g_mutex_lock(&journal_lock);
+        }
+
+        uint64_t target = journal_appended_seq;
+        int fd = journal_fd;
+        int segment_fd = journal_segment_fd;
+        g_mutex_unlock(&journal_lock);
+        STATS_START(start);
+        // Segment first, so a durable record never references payload bytes that are not
+        int synced = 1;
+        if (segment_fd != -1 && fsync(segment_fd) != 0) {
+            perror("Error: Could not sync journal segment");
+            synced = 0;
+        }
+        if (synced && fd != -1 && fsync(fd) != 0) {
+            perror("Error: Could not sync journal");
+            synced = 0;
+        }
+        STATS_END(STAT_JOURNAL_FSYNC, start);
+        FS_TRACE("journal: commit up to record %llu%s\n", (unsigned long long)target, synced ? "" : " failed");
+        g_mutex_lock(&journal_lock);
+
+        // After a failed fsync the kernel may have dropped the dirty pages, so a later one proves nothing
+        if (synced) {
+            if (target > journal_durable_seq) journal_durable_seq = target;
+        } else {
+            journal_sync_failed = 1;
+        }
+        journal_flush_in_progress = 0;
+        g_cond_broadcast(&journal_commit_cond);
+    }
+    journal_waiters--;
+    return result;
+}
+
+//wait until record `seq` is durable, then run the checkpoint if one is due. Called without namespace_lock,
+//so other operations can append while this one waits and share its fsync. Returns 0, or -1 if the record
+//could not be made durable
+static int journal_sync(uint64_t seq) {
+
+    g_mutex_lock(&journal_lock);
+    int result = journal_wait_durable(seq);
+    int need_checkpoint = journal_since_checkpoint >= JOURNAL_CHECKPOINT_INTERVAL;
+    g_mutex_unlock(&journal_lock);
+
+    // The caller has already applied the operation, so the state written now includes this record
+    if (need_checkpoint) {
+        checkpoint_file_system();
+    }
+    return result;
+}
+
+//push the submissions from `newest` down its next links to `oldest` onto the queue in one step, so a
+//transaction's records stay together; lock-free, so producers never wait for each other here
+static void journal_submit(JournalSubmission *newest, JournalSubmission *oldest) {
+
+    JournalSubmission *head;
+    do {
+        head = g_atomic_pointer_get(&journal_submit_head);
+        oldest->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&journal_submit_head, head, newest));
+}
+
+//write every queued submission with one write(), in submission order and with consecutive sequence numbers;
+//called with journal_lock held. The queue is only ever emptied as a whole, so the stack has no ABA problem
+static void journal_drain() {
+
+    JournalSubmission *head;
+    do {
+        head = g_atomic_pointer_get(&journal_submit_head);
+    } while (head != NULL && !g_atomic_pointer_compare_and_exchange(&journal_submit_head, head, NULL));
+
+    // Reverse the stack so the oldest submission comes first
+    JournalSubmission *batch = NULL;
+    size_t total = 0;
+    while (head != NULL) {
+        JournalSubmission *next = head->next;
+        head->next = batch;
+        batch = head;
+        total += head->size;
+        head = next;
+    }
+    if (batch == NULL) return;
+
+    if (total > journal_batch_capacity) {
+        unsigned char *grown = realloc(journal_batch, total);
+        if (grown != NULL) {
+            journal_batch = grown;
+            journal_batch_capacity = total;
+        }
+    }
+
+    int written = 0;
+    if (total <= journal_batch_capacity && journal_fd != -1) {
+        size_t used = 0;
+        uint64_t seq = journal_next_seq;
+        for (JournalSubmission *submission = batch; submission != NULL; submission = submission->next) {
+            submission->record->seq = seq++;
+            journal_seal(submission->encoded, submission->record->seq);
+            memcpy(journal_batch + used, submission->encoded, submission->size);
+            used += submission->size;
+        }
+        // A short write would leave a torn batch that replay stops at, hiding every record appended after it
+        off_t before = lseek(journal_fd, 0, SEEK_END);
+        ssize_t put = write(journal_fd, journal_batch, used);
+        written = put == (ssize_t)used;
+        if (!written && put > 0 && (before < 0 || ftruncate(journal_fd, before) != 0)) {
+            perror("Error: Could not cut a torn batch off the journal, no longer appending to it");
+            close(journal_fd);
+            journal_fd = -1;
+        }
+    }
+    if (!written) {
+        printf("Error: Could not append to journal file\n");
+    }
+
+    while (batch != NULL) {
+        JournalSubmission *next = batch->next;
+        if (written) {
+            journal_next_seq++;
+            journal_ring_put(batch->record);
+            journal_since_checkpoint++;
+            batch->appended = ++journal_appended_seq;
+        } else {
+            free(batch->record);
+            batch->failed = 1;
+        }
+        batch = next;
+    }
+}
+
+void close_journal() {
+
+    g_mutex_lock(&journal_lock);
+    journal_wait_durable(journal_appended_seq);
+    if (journal_fd != -1) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    if (journal_segment_fd != -1) {
+        close(journal_segment_fd);
+        journal_segment_fd = -1;
+    }
+    for (int i = 0; i < JOURNAL_SIZE; i++) {
+        free(journal[i]);
+        journal[i] = NULL;
+    }
+    journal_index = 0;
+    free(journal_batch);
+    journal_batch = NULL;
+    journal_batch_capacity = 0;
+    g_mutex_unlock(&journal_lock);
+}
+
+//append a record and wait until it is durable. Payloads up to JOURNAL_INLINE_MAX bytes are stored in the
+//record, larger ones go to the log segment. With kind JOURNAL_PAYLOAD_BLOCKS the payload is a block list and
+//always stays inline. inode_number names the inode the operation applied to (-1 if none), so replay can tell
+//whether the record is already reflected in the disk image. Records from concurrent callers are queued and
+//written in batches, see journal_drain. Returns 0 on success, -1 on failure
+int add_journal_record(JournalOperation operation, int inode_number, const char *filename, const char *new_filename,
+                       JournalPayloadKind kind, const void *payload, uint32_t length) {
+
+    if (filename == NULL) {
+        printf("Error: Filename is required for journal entry\n");
+        return -1;
+    }
+    if (payload == NULL || length == 0) {
+        kind = JOURNAL_PAYLOAD_NONE;
+        length = 0;
+    } else if (kind != JOURNAL_PAYLOAD_BLOCKS) {
+        kind = length <= JOURNAL_INLINE_MAX ? JOURNAL_PAYLOAD_INLINE : JOURNAL_PAYLOAD_SEGMENT;
+    } else if (length > JOURNAL_INLINE_MAX) {
+        printf("Error: Journal block list too long\n");
+        return -1;
+    }
+
+    STATS_START(start);
+    uint32_t stored_len = kind == JOURNAL_PAYLOAD_SEGMENT ? sizeof(JournalSegmentRef) : length;
+    JournalRecord *record = journal_record_new(operation, filename, new_filename, kind, length, stored_len);
+    if (record == NULL) return -1;
+    record->inode_number = inode_number;
+    if (kind != JOURNAL_PAYLOAD_SEGMENT && length > 0) {
+        memcpy(journal_record_stored(record), payload, length);
+    }
+
+    JournalSubmission submission;
+    submission.record = record;
+    submission.appended = 0;
+    submission.failed = 0;
+
+    // Held until the record is durable, so a checkpoint never truncates a record its state does not include
+    g_rw_lock_reader_lock(&journal_checkpoint_lock);
+    if (kind == JOURNAL_PAYLOAD_SEGMENT) {
+        g_mutex_lock(&journal_segment_lock);
+        JournalSegmentRef ref;
+        off_t offset = journal_segment_fd == -1 ? -1 : lseek(journal_segment_fd, 0, SEEK_END);
+        ref.offset = (uint64_t)offset;
+        ref.length = length;
+        ref.checksum = crc32c(0, payload, length);
+        int appended = offset >= 0 && write(journal_segment_fd, payload, length) == (ssize_t)length;
+        g_mutex_unlock(&journal_segment_lock);
+        if (!appended) {
+            printf("Error: Could not append to journal segment\n");
+            g_rw_lock_reader_unlock(&journal_checkpoint_lock);
+            free(record);
+            return -1;
+        }
+        memcpy(journal_record_stored(record), &ref, sizeof(ref));
+    }
+
+    // Encode outside journal_lock; the record only waits for the lock to be written, possibly by another caller
+    submission.size = journal_encode(record, submission.encoded);
+    journal_submit(&submission, &submission);
+
+    g_mutex_lock(&journal_lock);
+    if (submission.appended == 0 && !submission.failed) {
+        journal_drain();
+    }
+    g_mutex_unlock(&journal_lock);
+    // A checkpoint may run from here on: the record is in the log and its operation in the state
+    g_rw_lock_reader_unlock(&journal_checkpoint_lock);
+    if (submission.failed) {
+        STATS_END(STAT_JOURNAL_APPEND, start);
+        return -1;
+    }
+    int result = journal_sync(submission.appended);
+    STATS_END(STAT_JOURNAL_APPEND, start);
+    FS_TRACE("journal: %s %s, record %llu\n", operation_to_string(operation), filename,
+             (unsigned long long)submission.appended);
+    return result;
+}
+
+void add_journal_entry(JournalOperation operation, int inode_number, const char *filename, const char *new_filename, const char *data) {
+
+    add_journal_record(operation, inode_number, filename, new_filename, JOURNAL_PAYLOAD_INLINE, data, data ? (uint32_t)strlen(data) : 0);
+}
+
+void journal_txn_begin(JournalTransaction *txn) {
+
+    memset(txn, 0, sizeof(*txn));
+}
+
+//queue a record in `txn`, encoded now and written when the transaction commits. Only inline payloads, up to
+//JOURNAL_INLINE_MAX bytes, can be queued. Returns 0, or -1 if the record could not be queued
+int journal_txn_add(JournalTransaction *txn, JournalOperation operation, int inode_number, const char *filename,
+                    const char *new_filename, const void *payload, uint32_t length) {
+
+    if (filename == NULL || length > JOURNAL_INLINE_MAX) {
+        printf("Error: Journal transactions take named records with inline payloads only\n");
+        txn->failed = 1;
+        return -1;
+    }
+    if (txn->count == txn->capacity) {
+        // Most transactions hold one or two records, so the array grows towards JOURNAL_TXN_MAX as needed
+        int capacity = txn->capacity == 0 ? 2 : txn->capacity * 4 > JOURNAL_TXN_MAX ? JOURNAL_TXN_MAX : txn->capacity * 4;
+        JournalSubmission *grown = realloc(txn->submissions, (size_t)capacity * sizeof(JournalSubmission));
+        if (grown == NULL) {
+            txn->failed = 1;
+            return -1;
+        }
+        txn->submissions = grown;
+        txn->capacity = capacity;
+    }
+
+    JournalPayloadKind kind = payload == NULL || length == 0 ? JOURNAL_PAYLOAD_NONE : JOURNAL_PAYLOAD_INLINE;
+    if (kind == JOURNAL_PAYLOAD_NONE) length = 0;
+    JournalRecord *record = journal_record_new(operation, filename, new_filename, kind, length, length);
+    if (record == NULL) {
+        txn->failed = 1;
+        return -1;
+    }
+    record->inode_number = inode_number;
+    if (length > 0) {
+        memcpy(journal_record_stored(record), payload, length);
+    }
+
+    JournalSubmission *submission = &txn->submissions[txn->count++];
+    submission->record = record;
+    submission->appended = 0;
+    submission->failed = 0;
+    submission->size = journal_encode(record, submission->encoded);
+    return txn->count == JOURNAL_TXN_MAX ? journal_txn_append(txn) : 0;
+}
+
+//write the queued records with one write(), without waiting for them to be durable. Callers append under
+//namespace_lock, which orders their records against other operations', and wait in journal_txn_end once
+//they have released it. Returns 0, or -1 if they could not be written or an earlier record failed
+int journal_txn_append(JournalTransaction *txn) {
+
+    if (txn->count == 0) return txn->failed ? -1 : 0;
+
+    STATS_START(start);
+    JournalSubmission *oldest = &txn->submissions[0];
+    JournalSubmission *newest = &txn->submissions[txn->count - 1];
+    for (int i = txn->count - 1; i > 0; i--) {
+        txn->submissions[i].next = &txn->submissions[i - 1];
+    }
+
+    g_rw_lock_reader_lock(&journal_checkpoint_lock);
+    journal_submit(newest, oldest);
+    g_mutex_lock(&journal_lock);
+    // The records are queued together, so whichever drain writes one of them writes all
+    if (newest->appended == 0 && !newest->failed) {
+        journal_drain();
+    }
+    g_mutex_unlock(&journal_lock);
+    g_rw_lock_reader_unlock(&journal_checkpoint_lock);
+    STATS_END(STAT_JOURNAL_APPEND, start);
+    FS_TRACE("journal: transaction of %d records, up to record %llu\n", txn->count, (unsigned long long)newest->appended);
+
+    if (newest->failed) {
+        txn->failed = 1;
+    } else {
+        txn->appended = newest->appended;
+    }
+    txn->count = 0;
+    return txn->failed ? -1 : 0;
+}
+
+//append what is still queued and wait for one fsync covering every record of the transaction. Returns 0, or
+//-1 if a record could not be written
+int journal_txn_commit(JournalTransaction *txn) {
+
+    journal_txn_append(txn);
+    if (txn->appended != 0 && journal_sync(txn->appended) != 0) txn->failed = 1;
+    return txn->failed ? -1 : 0;
+}
+
+//commit what is still queued and release the transaction
+int journal_txn_end(JournalTransaction *txn) {
+
+    int result = journal_txn_commit(txn);
+    free(txn->submissions);
+    txn->submissions = NULL;
+    txn->capacity = 0;
+    return result;
+}
+
+//encode the change from old to new contents as a MODIFY payload: one hunk covering everything between
+//the common prefix and the common suffix. Returns a malloc'd payload and its size in *length
+unsigned char *journal_make_diff(const char *old_data, size_t old_len, const char *new_data, size_t new_len, uint32_t *length) {
+
+    size_t prefix = 0;
+    while (prefix < old_len && prefix < new_len && old_data[prefix] == new_data[prefix]) prefix++;
+    size_t suffix = 0;
+    while (suffix < old_len - prefix && suffix < new_len - prefix &&
+           old_data[old_len - 1 - suffix] == new_data[new_len - 1 - suffix]) suffix++;
+
+    JournalDiffHeader header = { (int64_t)old_len, (int64_t)new_len, 1 };
+    JournalDiffHunk hunk = { (int64_t)prefix, (int64_t)(old_len - prefix - suffix), (int64_t)(new_len - prefix - suffix) };
+
+    size_t size = sizeof(header) + sizeof(hunk) + hunk.inserted;
+    if (size > UINT32_MAX) {
+        printf("Error: Change too large to journal\n");
+        return NULL;
+    }
+    unsigned char *payload = malloc(size);
+    if (payload == NULL) {
+        printf("Error: Memory allocation failed for journal diff\n");
+        return NULL;
+    }
+    memcpy(payload, &header, sizeof(header));
+    memcpy(payload + sizeof(header), &hunk, sizeof(hunk));
+    memcpy(payload + sizeof(header) + sizeof(hunk), new_data + prefix, hunk.inserted);
+    *length = (uint32_t)size;
+    return payload;
+}
+
+//read or write exactly `length` bytes at `offset` of a host file; return 0, or -1 on a short transfer
+static int host_read_at(int fd, int64_t offset, void *buf, size_t length) {
+
+    if (lseek(fd, (off_t)offset, SEEK_SET) != (off_t)offset) return -1;
+    for (size_t done = 0; done < length;) {
+        ssize_t got = read(fd, (char *)buf + done, length - done);
+        if (got <= 0) return -1;
+        done += (size_t)got;
+    }
+    return 0;
+}
+
+static int host_write_at(int fd, int64_t offset, const void *buf, size_t length) {
+
+    if (lseek(fd, (off_t)offset, SEEK_SET) != (off_t)offset) return -1;
+    for (size_t done = 0; done < length;) {
+        ssize_t put = write(fd, (const char *)buf + done, length - done);
+        if (put <= 0) return -1;
+        done += (size_t)put;
+    }
+    return 0;
+}
+
+//append `length` bytes of a host file from `offset` to `out`, DIFF_COPY_CHUNK at a time through `buf`
+static int host_copy_out(int fd, int64_t offset, int64_t length, FILE *out, char *buf) {
+
+    while (length > 0) {
+        size_t step = length < DIFF_COPY_CHUNK ? (size_t)length : DIFF_COPY_CHUNK;
+        if (host_read_at(fd, offset, buf, step) != 0 || fwrite(buf, 1, step, out) != step) return -1;
+        offset += step;
+        length -= step;
+    }
+    return 0;
+}
+
+//apply a MODIFY diff to an open host file of the diff's starting size, without reading the file whole.
+//Hunks must be in file order. Those before the first one that changes the length are written in place;
+//from that one on, the rest of the file is rebuilt in a temporary file and copied back.
+//Returns 0 on success, -1 on failure
+static int diff_apply_fd(int fd, const unsigned char *diff, uint32_t length) {
+
+    JournalDiffHeader header;
+    if (length < sizeof(header)) return -1;
+    memcpy(&header, diff, sizeof(header));
+
+    // Validate every hunk before anything is written, so a malformed diff leaves the file alone
+    int64_t delta = 0, original_end = 0;
+    uint32_t shift_hunk = header.hunk_count, shift_pos = 0; // the first hunk that changes the length
+    uint32_t pos = sizeof(header);
+    for (uint32_t i = 0; i < header.hunk_count; i++) {
+        JournalDiffHunk hunk;
+        if (length - pos < sizeof(hunk)) return -1;
+        memcpy(&hunk, diff + pos, sizeof(hunk));
+        int64_t original = hunk.offset - delta;
+        if (hunk.removed < 0 || hunk.inserted < 0 || original < original_end || original + hunk.removed > header.old_size ||
+            (uint64_t)hunk.inserted > length - pos - sizeof(hunk)) {
+            return -1;
+        }
+        if (shift_hunk == header.hunk_count && hunk.removed != hunk.inserted) {
+            shift_hunk = i;
+            shift_pos = pos;
+        }
+        original_end = original + hunk.removed;
+        delta += hunk.inserted - hunk.removed;
+        pos += sizeof(hunk) + (uint32_t)hunk.inserted;
+    }
+    if (header.old_size + delta != header.new_size) return -1;
+
+    pos = sizeof(header);
+    for (uint32_t i = 0; i < shift_hunk; i++) {
+        JournalDiffHunk hunk;
+        memcpy(&hunk, diff + pos, sizeof(hunk));
+        if (host_write_at(fd, hunk.offset, diff + pos + sizeof(hunk), (size_t)hunk.inserted) != 0) return -1;
+        pos += sizeof(hunk) + (uint32_t)hunk.inserted;
+    }
+    if (shift_hunk == header.hunk_count) return 0;
+
+    // Nothing before the first length change moved, so the tail starts at the same offset in both versions
+    FILE *tail = tmpfile();
+    char *buf = malloc(DIFF_COPY_CHUNK);
+    int result = tail != NULL && buf != NULL ? 0 : -1;
+    JournalDiffHunk hunk;
+    memcpy(&hunk, diff + shift_pos, sizeof(hunk));
+    int64_t tail_start = hunk.offset, copied = tail_start;
+    delta = 0;
+    pos = shift_pos;
+    for (uint32_t i = shift_hunk; result == 0 && i < header.hunk_count; i++) {
+        memcpy(&hunk, diff + pos, sizeof(hunk));
+        int64_t original = hunk.offset - delta;
+        if (host_copy_out(fd, copied, original - copied, tail, buf) != 0 ||
+            fwrite(diff + pos + sizeof(hunk), 1, (size_t)hunk.inserted, tail) != (size_t)hunk.inserted) {
+            result = -1;
+        }
+        copied = original + hunk.removed;
+        delta += hunk.inserted - hunk.removed;
+        pos += sizeof(hunk) + (uint32_t)hunk.inserted;
+    }
+    if (result == 0 && host_copy_out(fd, copied, header.old_size - copied, tail, buf) != 0) result = -1;
+
+    // Copy the rebuilt tail over the old one
+    if (result == 0 && (fflush(tail) != 0 || fseek(tail, 0, SEEK_SET) != 0)) result = -1;
+    for (int64_t offset = tail_start; result == 0 && offset < header.new_size;) {
+        size_t step = header.new_size - offset < DIFF_COPY_CHUNK ? (size_t)(header.new_size - offset) : DIFF_COPY_CHUNK;
+        if (fread(buf, 1, step, tail) != step || host_write_at(fd, offset, buf, step) != 0) result = -1;
+        offset += step;
+    }
+    if (result == 0 && ftruncate(fd, (off_t)header.new_size) != 0) result = -1;
+    free(buf);
+    if (tail) fclose(tail);
+    return result;
+}
+
+//apply a MODIFY diff to a host file. A file that already has the diff's final size and does not have
+//its starting size is taken as already modified. Returns 0 on success, -1 on failure
+int apply_diff_to_file(const char *host_path, const unsigned char *diff, uint32_t length) {
+
+    JournalDiffHeader header;
+    if (length < sizeof(header)) return -1;
+    memcpy(&header, diff, sizeof(header));
+
+    int fd = open(host_path, O_RDWR | O_BINARY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        if (fd != -1) close(fd);
+        printf("Error: Could not open file %s for writing during journal replay\n", host_path);
+        return -1;
+    }
+    if (st.st_size != header.old_size) {
+        close(fd);
+        if (st.st_size == header.new_size) return 0;
+        printf("Error: File %s does not match the journaled change\n", host_path);
+        return -1;
+    }
+
+    int result = diff_apply_fd(fd, diff, length);
+    if (result != 0) printf("Error: Failed to apply the journaled change to %s\n", host_path);
+    close(fd);
+    return result;
+}
+
+//open a host file for paging; returns NULL if it cannot be read
+FileView *file_view_open(const char *host_path) {
+
+    int fd = open(host_path, O_RDONLY | O_BINARY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        if (fd != -1) close(fd);
+        printf("Failed to open %s\n", host_path);
+        return NULL;
+    }
+
+    FileView *view = calloc(1, sizeof(FileView));
+    char *page = malloc(FILE_VIEW_PAGE + 8);
+    if (view == NULL || page == NULL || strlen(host_path) >= sizeof(view->path)) {
+        free(view);
+        free(page);
+        close(fd);
+        printf("Failed to open a view of %s\n", host_path);
+        return NULL;
+    }
+    strcpy(view->path, host_path);
+    view->fd = fd;
+    view->size = st.st_size;
+    view->mtime = st.st_mtime;
+    view->page = page;
+    return view;
+}
+
+void file_view_close(FileView *view) {
+
+    if (view == NULL) return;
+    for (int i = 0; i < view->edit_count; i++) {
+        free(view->edits[i].data);
+    }
+    free(view->edits);
+    free(view->page);
+    close(view->fd);
+    free(view);
+}
+
+//pages of the file as it was opened; an empty file still has one, so it can be edited
+int64_t file_view_page_count(const FileView *view) {
+
+    return view->size == 0 ? 1 : (view->size + FILE_VIEW_PAGE - 1) / FILE_VIEW_PAGE;
+}
+
+//first byte of a page in the original file: its nominal offset, moved back past UTF-8 continuation bytes
+//so no character is split between two pages
+static int64_t file_view_page_start(FileView *view, int64_t page) {
+
+    int64_t offset = page * FILE_VIEW_PAGE;
+    if (page <= 0) return 0;
+    if (offset >= view->size) return view->size;
+
+    unsigned char around[4]; // the three bytes before the nominal offset and the one at it
+    if (host_read_at(view->fd, offset - 3, around, sizeof(around)) != 0) return offset;
+    int back = 0;
+    while (back < 3 && (around[3 - back] & 0xC0) == 0x80) back++;
+    return offset - back;
+}
+
+//bytes [*start, *end) of the original file that a page covers
+void file_view_page_range(FileView *view, int64_t page, int64_t *start, int64_t *end) {
+
+    *start = file_view_page_start(view, page);
+    *end = file_view_page_start(view, page + 1);
+}
+
+//slot of a page's edit, or where it would be inserted
+static int file_view_edit_position(const FileView *view, int64_t page) {
+
+    int low = 0, high = view->edit_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (view->edits[mid].page < page) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+//original bytes of a page into view->page, NUL-terminated; returns NULL if they cannot be read
+static char *file_view_read_page(FileView *view, int64_t page, size_t *length) {
+
+    int64_t start, end;
+    file_view_page_range(view, page, &start, &end);
+    if (host_read_at(view->fd, start, view->page, (size_t)(end - start)) != 0) {
+        printf("Failed to read %s at %lld\n", view->path, (long long)start);
+        return NULL;
+    }
+    view->page[end - start] = '\0';
+    *length = (size_t)(end - start);
+    return view->page;
+}
+
+//the text of a page, edited or as read from the file, NUL-terminated. It stays valid until the next call on
+//the view; returns NULL if the page cannot be read
+const char *file_view_page(FileView *view, int64_t page, size_t *length) {
+
+    int slot = file_view_edit_position(view, page);
+    if (slot < view->edit_count && view->edits[slot].page == page) {
+        *length = view->edits[slot].length;
+        return view->edits[slot].data;
+    }
+    return file_view_read_page(view, page, length);
+}
+
+//replace the text of a page; nothing is written until file_view_save. Returns 0, or -1 if out of memory
+int file_view_set_page(FileView *view, int64_t page, const char *text, size_t length) {
+
+    char *data = malloc(length + 1);
+    if (data == NULL) return -1;
+    memcpy(data, text, length);
+    data[length] = '\0';
+
+    int slot = file_view_edit_position(view, page);
+    if (slot < view->edit_count && view->edits[slot].page == page) {
+        free(view->edits[slot].data);
+    } else {
+        if (view->edit_count == view->edit_capacity) {
+            int capacity = view->edit_capacity ? view->edit_capacity * 2 : 8;
+            FileViewEdit *grown = realloc(view->edits, capacity * sizeof(FileViewEdit));
+            if (grown == NULL) {
+                free(data);
+                return -1;
+            }
+            view->edits = grown;
+            view->edit_capacity = capacity;
+        }
+        memmove(&view->edits[slot + 1], &view->edits[slot], (view->edit_count - slot) * sizeof(FileViewEdit));
+        view->edit_count++;
+        view->edits[slot].page = page;
+    }
+    view->edits[slot].data = data;
+    view->edits[slot].length = length;
+    return 0;
+}
+
+//encode the edits as one MODIFY diff with a hunk per changed page, trimmed to the bytes that differ.
+//*diff is NULL when no page differs from the file. Returns 0, or -1 on failure
+int file_view_diff(FileView *view, unsigned char **diff, uint32_t *length) {
+
+    JournalDiffHeader header = { view->size, view->size, 0 };
+    size_t size = sizeof(header), capacity = 0;
+    unsigned char *payload = NULL;
+    *diff = NULL;
+    *length = 0;
+
+    for (int i = 0; i < view->edit_count; i++) {
+        const FileViewEdit *edit = &view->edits[i];
+        size_t old_len;
+        const char *old_data = file_view_read_page(view, edit->page, &old_len);
+        if (old_data == NULL) {
+            free(payload);
+            return -1;
+        }
+        size_t prefix = 0;
+        while (prefix < old_len && prefix < edit->length && old_data[prefix] == edit->data[prefix]) prefix++;
+        size_t suffix = 0;
+        while (suffix < old_len - prefix && suffix < edit->length - prefix &&
+               old_data[old_len - 1 - suffix] == edit->data[edit->length - 1 - suffix]) suffix++;
+        if (prefix == old_len && prefix == edit->length) continue;
+
+        // Hunk offsets are in the file as left by the hunks before, so they include the size change so far
+        JournalDiffHunk hunk = { file_view_page_start(view, edit->page) + (int64_t)prefix + header.new_size - view->size,
+                                 (int64_t)(old_len - prefix - suffix), (int64_t)(edit->length - prefix - suffix) };
+        if (size + sizeof(hunk) + hunk.inserted > UINT32_MAX) {
+            printf("Error: Change too large to journal\n");
+            free(payload);
+            return -1;
+        }
+        if (size + sizeof(hunk) + hunk.inserted > capacity) {
+            capacity = (size + sizeof(hunk) + hunk.inserted) * 2;
+            unsigned char *grown = realloc(payload, capacity);
+            if (grown == NULL) {
+                printf("Error: Memory allocation failed for journal diff\n");
+                free(payload);
+                return -1;
+            }
+            payload = grown;
+        }
+        memcpy(payload + size, &hunk, sizeof(hunk));
+        memcpy(payload + size + sizeof(hunk), edit->data + prefix, hunk.inserted);
+        size += sizeof(hunk) + hunk.inserted;
+        header.new_size += hunk.inserted - hunk.removed;
+        header.hunk_count++;
+    }
+    if (header.hunk_count == 0) {
+        free(payload);
+        return 0;
+    }
+    memcpy(payload, &header, sizeof(header));
+    *diff = payload;
+    *length = (uint32_t)size;
+    return 0;
+}
+
+//write the edited ranges back to the file, and return them as the MODIFY diff for the journal (*diff
+//is NULL if nothing changed). Fails if the file changed since the view was opened. The view describes the
+//old contents afterwards and should be closed. Returns 0 on success, -1 on failure
+int file_view_save(FileView *view, unsigned char **diff, uint32_t *length) {
+
+    if (file_view_diff(view, diff, length) != 0) return -1;
+    if (*diff == NULL) return 0;
+
+    int fd = open(view->path, O_RDWR | O_BINARY);
+    struct stat st;
+    int result = -1;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        printf("Failed to open %s for saving\n", view->path);
+    } else if (st.st_size != view->size || st.st_mtime != view->mtime) {
+        printf("%s changed since it was opened, not saving\n", view->path);
+    } else {
+        result = diff_apply_fd(fd, *diff, *length);
+        if (result != 0) printf("Failed to write the changes to %s\n", view->path);
+    }
+    if (fd != -1) close(fd);
+    if (result != 0) {
+        free(*diff);
+        *diff = NULL;
+    }
+    return result;
+}
+
+//FNV-1a hash of a file name
+static unsigned int dir_hash_name(const char *name) {
+
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//returns 0, or -1 if the arrays could not be allocated
+int dir_init(Directory *dir, int inode_number) {
+
+    dir->inode_number = inode_number;
+    dir->entry_count = 0;
+    dir->capacity = DIR_INITIAL_CAPACITY;
+    dir->hash_size = DIR_INITIAL_CAPACITY * 2;
+    dir->entries = malloc(dir->capacity * sizeof(DirectoryEntry));
+    dir->hash_index = malloc(dir->hash_size * sizeof(int));
+    if (dir->entries == NULL || dir->hash_index == NULL) {
+        free(dir->entries);
+        free(dir->hash_index);
+        return -1;
+    }
+    for (int i = 0; i < dir->hash_size; i++) {
+        dir->hash_index[i] = DIR_HASH_EMPTY;
+    }
+    return 0;
+}
+
+static void dir_hash_insert(Directory *dir, int slot);
+
+//double the entry capacity and rebuild the hash index at twice that size; returns 0 on success
+static int dir_grow(Directory *dir) {
+
+    int capacity = dir->capacity * 2;
+    DirectoryEntry *entries = realloc(dir->entries, capacity * sizeof(DirectoryEntry));
+    if (entries == NULL) return -1;
+    dir->entries = entries;
+
+    int *hash_index = malloc(capacity * 2 * sizeof(int));
+    if (hash_index == NULL) return -1;
+    free(dir->hash_index);
+    dir->hash_index = hash_index;
+    dir->hash_size = capacity * 2;
+    dir->capacity = capacity;
+    for (int i = 0; i < dir->hash_size; i++) {
+        dir->hash_index[i] = DIR_HASH_EMPTY;
+    }
+    for (int slot = 0; slot < dir->entry_count; slot++) {
+        dir_hash_insert(dir, slot);
+    }
+    return 0;
+}
+
+//position in hash_index[] that refers to entry `slot`
+static int dir_hash_position(Directory *dir, int slot) {
+
+    int pos = dir_hash_name(dir->entries[slot].name) & (dir->hash_size - 1);
+    while (dir->hash_index[pos] != slot) {
+        pos = (pos + 1) & (dir->hash_size - 1);
+    }
+    return pos;
+}
+
+//remove a position from the hash index, shifting later probes back so no tombstones are needed
+static void dir_hash_remove(Directory *dir, int pos) {
+
+    int hole = pos;
+    int next = (hole + 1) & (dir->hash_size - 1);
+    while (dir->hash_index[next] != DIR_HASH_EMPTY) {
+        int home = dir_hash_name(dir->entries[dir->hash_index[next]].name) & (dir->hash_size - 1);
+        // Move the entry back if its home is not cyclically inside (hole, next]
+        if (((next - home) & (dir->hash_size - 1)) >= ((next - hole) & (dir->hash_size - 1))) {
+            dir->hash_index[hole] = dir->hash_index[next];
+            hole = next;
+        }
+        next = (next + 1) & (dir->hash_size - 1);
+    }
+    dir->hash_index[hole] = DIR_HASH_EMPTY;
+}
+
+static void dir_hash_insert(Directory *dir, int slot) {
+
+    int pos = dir_hash_name(dir->entries[slot].name) & (dir->hash_size - 1);
+    while (dir->hash_index[pos] != DIR_HASH_EMPTY) {
+        pos = (pos + 1) & (dir->hash_size - 1);
+    }
+    dir->hash_index[pos] = slot;
+}
+
+//slot of `name` in dir->entries[], or -1
+int dir_lookup(Directory *dir, const char *name) {
+
+    int pos = dir_hash_name(name) & (dir->hash_size - 1);
+    while (dir->hash_index[pos] != DIR_HASH_EMPTY) {
+        int slot = dir->hash_index[pos];
+        if (strcmp(dir->entries[slot].name, name) == 0) {
+            return slot;
+        }
+        pos = (pos + 1) & (dir->hash_size - 1);
+    }
+    return -1;
+}
+
+static int inode_unshare_block(Inode *inode, int64_t file_block, int block);
+
+//make the block holding entry `slot` writable: preserve the directory inode for the newest snapshot and
+//allocate or unshare the block; returns 0, or -1 if no block is free. Once this succeeds, storing the slot cannot fail
+static int dir_prepare_slot(Directory *dir, int slot) {
+
+    Inode *inode = &inode_table[dir->inode_number];
+    if (snapshot_preserve(dir->inode_number) != 0) return -1;
+    int b = slot / DIR_ENTRIES_PER_BLOCK;
+    if (inode->direct_blocks[b] == -1) {
+        int block = allocate_block();
+        if (block == -1) return -1;
+        inode->direct_blocks[b] = block;
+        inode_mark_dirty(inode);
+    } else if (block_shared(inode->direct_blocks[b]) && inode_unshare_block(inode, b, inode->direct_blocks[b]) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+//copy entry `slot` into the directory inode's data blocks, allocating the block on first use
+static int dir_store_slot(Directory *dir, int slot) {
+
+    if (dir_prepare_slot(dir, slot) != 0) return -1;
+    Inode *inode = &inode_table[dir->inode_number];
+    int b = slot / DIR_ENTRIES_PER_BLOCK;
+    char *entry = block_data(inode->direct_blocks[b]) + (slot % DIR_ENTRIES_PER_BLOCK) * sizeof(DirectoryEntry);
+    memcpy(entry, &dir->entries[slot], sizeof(DirectoryEntry));
+    image_mark_dirty(entry, sizeof(DirectoryEntry));
+    return 0;
+}
+
+//update the directory inode's size and release blocks that no longer hold entries
+static void dir_sync_size(Directory *dir) {
+
+    Inode *inode = &inode_table[dir->inode_number];
+    snapshot_preserve(dir->inode_number); // only fails where dir_store_slot already did
+    int used_blocks = (dir->entry_count + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK;
+    for (int b = used_blocks; b < DIRECT_BLOCKS; b++) {
+        if (inode->direct_blocks[b] != -1) {
+            free_block(inode->direct_blocks[b]);
+            inode->direct_blocks[b] = -1;
+        }
+    }
+    inode->_size = dir->entry_count * sizeof(DirectoryEntry);
+    inode_mark_dirty(inode);
+    inode_cold(dir->inode_number)->mtime = time(NULL);
+    inode_cold_mark_dirty(inode_cold(dir->inode_number));
+}
+
+//returns the new slot, or -1 if the directory is full, the name is too long or no block is free
+int dir_add_entry(Directory *dir, const char *name, int inode_number) {
+
+    if (dir->entry_count >= DIR_MAX_ENTRIES || strlen(name) >= MAX_FILENAME_LEN) {
+        return -1;
+    }
+    if (dir->entry_count == dir->capacity && dir_grow(dir) != 0) {
+        return -1;
+    }
+
+    int slot = dir->entry_count;
+    strcpy(dir->entries[slot].name, name);
+    dir->entries[slot].inode_number = inode_number;
+    if (dir_store_slot(dir, slot) != 0) {
+        return -1;
+    }
+
+    dir->entry_count++;
+    dir_hash_insert(dir, slot);
+    dir_sync_size(dir);
+    name_index_add(dir->inode_number, name, inode_number);
+    return slot;
+}
+
+//the last entry is moved into the freed slot, so removal is O(1) and entry order is not preserved;
+//returns 0, or -1 with the directory unchanged if the volume is too full to rewrite that slot.
+//Removing the last entry only needs the directory inode preserved, so it cannot fail once the entry was stored
+int dir_remove_entry(Directory *dir, int slot) {
+
+    int last = dir->entry_count - 1;
+    if ((slot != last ? dir_prepare_slot(dir, slot) : snapshot_preserve(dir->inode_number)) != 0) {
+        return -1;
+    }
+
+    name_index_remove(dir->inode_number, dir->entries[slot].name);
+    dir_hash_remove(dir, dir_hash_position(dir, slot));
+
+    if (slot != last) {
+        dir->hash_index[dir_hash_position(dir, last)] = slot;
+        dir->entries[slot] = dir->entries[last];
+        dir_store_slot(dir, slot);
+    }
+    dir->entry_count--;
+    dir_sync_size(dir);
+    return 0;
+}
+
+int dir_rename_entry(Directory *dir, int slot, const char *new_name) {
+
+    if (strlen(new_name) >= MAX_FILENAME_LEN || dir_prepare_slot(dir, slot) != 0) {
+        return -1;
+    }
+
+    name_index_remove(dir->inode_number, dir->entries[slot].name);
+    dir_hash_remove(dir, dir_hash_position(dir, slot));
+    strcpy(dir->entries[slot].name, new_name);
+    dir_hash_insert(dir, slot);
+    name_index_add(dir->inode_number, new_name, dir->entries[slot].inode_number);
+    dir_store_slot(dir, slot);
+    inode_cold(dir->inode_number)->mtime = time(NULL);
+    inode_cold_mark_dirty(inode_cold(dir->inode_number));
+    return 0;
+}
+
+//build the in-memory view of directory inode `inode_number` from its data blocks
+static Directory *dir_load(int inode_number) {
+
+    Inode *inode = &inode_table[inode_number];
+    Directory *dir = (Directory*)malloc(sizeof(Directory));
+    if (dir == NULL || dir_init(dir, inode_number) != 0) {
+        printf("Failed to allocate memory for directory %d\n", inode_number);
+        free(dir);
+        return NULL;
+    }
+
+    int count = inode->_size / (int)sizeof(DirectoryEntry);
+    for (int slot = 0; slot < count && slot < DIR_MAX_ENTRIES; slot++) {
+        if (slot == dir->capacity && dir_grow(dir) != 0) break;
+        int block = inode->direct_blocks[slot / DIR_ENTRIES_PER_BLOCK];
+        memcpy(&dir->entries[slot], block_data(block) + (slot % DIR_ENTRIES_PER_BLOCK) * sizeof(DirectoryEntry),
+               sizeof(DirectoryEntry));
+        dir->entries[slot].name[MAX_FILENAME_LEN - 1] = '\0';
+        dir->entry_count++;
+        dir_hash_insert(dir, slot);
+    }
+    return dir;
+}
+
+//in-memory view of directory inode `inode_number`, read from its data blocks on first use. Namespace readers
+//may race to load the same view, dir_load_lock makes sure it is built once
+Directory* dir_get(int inode_number) {
+
+    if (inode_number < 0 || inode_number >= superblock->inode_table_size) return NULL;
+    if (!inode_table[inode_number].is_directory || inode_cold(inode_number)->nlink == 0) return NULL;
+    Directory *dir = g_atomic_pointer_get(&directory_cache[inode_number]);
+    if (dir != NULL) return dir;
+
+    g_mutex_lock(&dir_load_lock);
+    dir = directory_cache[inode_number];
+    if (dir == NULL) {
+        dir = dir_load(inode_number);
+        g_atomic_pointer_set(&directory_cache[inode_number], dir);
+    }
+    g_mutex_unlock(&dir_load_lock);
+    return dir;
+}
+
+void dir_release(int inode_number) {
+
+    Directory *dir = directory_cache[inode_number];
+    if (dir == NULL) return;
+    free(dir->entries);
+    free(dir->hash_index);
+    free(dir);
+    directory_cache[inode_number] = NULL;
+}
+
+void dcache_init();
+
+//drop every directory view and the dentry cache, after inode_table changed under them; called with
+//namespace_lock held exclusively or before any other thread runs
+void dir_cache_clear() {
+
+    for (int i = 0; i < superblock->inode_table_size; i++) {
+        dir_release(i);
+    }
+    dcache_init();
+    name_index_reset();
+    perm_invalidate_all();
+}
+
+
+
+//dentry cache
+
+void dcache_init() {
+
+    g_mutex_lock(&dcache_lock);
+    for (int i = 0; i < DCACHE_HASH_SIZE; i++) {
+        dcache_buckets[i] = -1;
+    }
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        free(dcache[i].path);
+        dcache[i].path = NULL;
+        dcache[i].hash_next = i + 1 < DCACHE_SIZE ? i + 1 : -1;
+    }
+    dcache_free_head = 0;
+    dcache_lru_head = dcache_lru_tail = -1;
+    g_mutex_unlock(&dcache_lock);
+}
+
+static void dcache_lru_unlink(int n) {
+
+    if (dcache[n].lru_prev != -1) dcache[dcache[n].lru_prev].lru_next = dcache[n].lru_next;
+    else dcache_lru_head = dcache[n].lru_next;
+    if (dcache[n].lru_next != -1) dcache[dcache[n].lru_next].lru_prev = dcache[n].lru_prev;
+    else dcache_lru_tail = dcache[n].lru_prev;
+}
+
+static void dcache_lru_push_front(int n) {
+
+    dcache[n].lru_prev = -1;
+    dcache[n].lru_next = dcache_lru_head;
+    if (dcache_lru_head != -1) dcache[dcache_lru_head].lru_prev = n;
+    dcache_lru_head = n;
+    if (dcache_lru_tail == -1) dcache_lru_tail = n;
+}
+
+static int dcache_find(const char *path, unsigned int hash) {
+
+    for (int n = dcache_buckets[hash & (DCACHE_HASH_SIZE - 1)]; n != -1; n = dcache[n].hash_next) {
+        if (dcache[n].hash == hash && strcmp(dcache[n].path, path) == 0) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+static void dcache_remove_node(int n) {
+
+    int *link = &dcache_buckets[dcache[n].hash & (DCACHE_HASH_SIZE - 1)];
+    while (*link != n) {
+        link = &dcache[*link].hash_next;
+    }
+    *link = dcache[n].hash_next;
+
+    dcache_lru_unlink(n);
+    free(dcache[n].path);
+    dcache[n].path = NULL;
+    dcache[n].hash_next = dcache_free_head;
+    dcache_free_head = n;
+}
+
+//returns 1 on a hit and stores the cached inode number (-1 for a negative entry)
+int dcache_lookup(const char *path, int *inode_number) {
+
+    unsigned int hash = dir_hash_name(path);
+    g_mutex_lock(&dcache_lock);
+    int n = dcache_find(path, hash);
+    if (n != -1) {
+        dcache_lru_unlink(n);
+        dcache_lru_push_front(n);
+        *inode_number = dcache[n].inode_number;
+    }
+    g_mutex_unlock(&dcache_lock);
+    STATS_COUNT(n != -1 ? STAT_DCACHE_HIT : STAT_DCACHE_MISS);
+    return n != -1;
+}
+
+void dcache_insert(const char *path, int inode_number) {
+
+    unsigned int hash = dir_hash_name(path);
+    g_mutex_lock(&dcache_lock);
+    int n = dcache_find(path, hash);
+    if (n != -1) {
+        dcache[n].inode_number = inode_number;
+        dcache_lru_unlink(n);
+        dcache_lru_push_front(n);
+        g_mutex_unlock(&dcache_lock);
+        return;
+    }
+
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        g_mutex_unlock(&dcache_lock);
+        return;
+    }
+    if (dcache_free_head == -1) {
+        dcache_remove_node(dcache_lru_tail);
+    }
+
+    n = dcache_free_head;
+    dcache_free_head = dcache[n].hash_next;
+    dcache[n].path = copy;
+    dcache[n].hash = hash;
+    dcache[n].inode_number = inode_number;
+    dcache[n].hash_next = dcache_buckets[hash & (DCACHE_HASH_SIZE - 1)];
+    dcache_buckets[hash & (DCACHE_HASH_SIZE - 1)] = n;
+    dcache_lru_push_front(n);
+    g_mutex_unlock(&dcache_lock);
+}
+
+//drop `path` and every cached path below it, used when a directory is renamed or removed
+void dcache_invalidate_prefix(const char *path) {
+
+    size_t len = strlen(path);
+    g_mutex_lock(&dcache_lock);
+    for (int n = 0; n < DCACHE_SIZE; n++) {
+        if (dcache[n].path != NULL && strncmp(dcache[n].path, path, len) == 0 &&
+            (dcache[n].path[len] == '\0' || dcache[n].path[len] == '/')) {
+            dcache_remove_node(n);
+        }
+    }
+    g_mutex_unlock(&dcache_lock);
+}
+
+
+
+//path resolution
+
+//normalize `path` into out: relative to the file system root, no leading or trailing '/', no "." or ".." components
+int normalize_path(const char *path, char *out, size_t out_size) {
+
+    size_t len = 0;
+    out[0] = '\0';
+
+    while (*path) {
+        while (*path == '/') path++;
+        if (*path == '\0') break;
+
+        const char *end = strchr(path, '/');
+        size_t n = end ? (size_t)(end - path) : strlen(path);
+
+        if (n == 2 && path[0] == '.' && path[1] == '.') {
+            char *slash = strrchr(out, '/');
+            len = slash ? (size_t)(slash - out) : 0;
+            out[len] = '\0';
+        } else if (!(n == 1 && path[0] == '.')) {
+            if (n >= MAX_FILENAME_LEN || len + n + 2 > out_size) return -1;
+            if (len > 0) out[len++] = '/';
+            memcpy(out + len, path, n);
+            len += n;
+            out[len] = '\0';
+        }
+        path += n;
+    }
+    return 0;
+}
+
+//file system path of `name`, which is relative to the current directory unless it starts with '/'
+int make_fs_path(const char *name, char *out) {
+
+    char joined[MAX_PATH_LEN * 2];
+    if (name[0] == '/') {
+        snprintf(joined, sizeof(joined), "%s", name);
+    } else {
+        snprintf(joined, sizeof(joined), "%s/%s", current_dir_path, name);
+    }
+    return normalize_path(joined, out, MAX_PATH_LEN);
+}
+
+//host path mirroring a file system path. Returns 0, or -1 if it does not fit in out_size bytes
+int make_host_path(const char *fs_path, char *out, size_t out_size) {
+
+    int n = snprintf(out, out_size, "%s%s", FS_ROOT_PATH, fs_path);
+    return n >= 0 && (size_t)n < out_size ? 0 : -1;
+}
+
+//split a normalized path into its parent path and its final component
+static const char* split_path(const char *path, char *parent_out) {
+
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        parent_out[0] = '\0';
+        return path;
+    }
+    memcpy(parent_out, path, slash - path);
+    parent_out[slash - path] = '\0';
+    return slash + 1;
+}
+
+//inode number for a normalized path, or -1; every resolved prefix is remembered in the dentry cache
+static int resolve_path_walk(const char *path) {
+
+    if (path[0] == '\0') return ROOT_INODE;
+
+    int inode_number;
+    if (dcache_lookup(path, &inode_number)) return inode_number;
+
+    char parent_path[MAX_PATH_LEN];
+    const char *name = split_path(path, parent_path);
+    Directory *dir = dir_get(resolve_path_walk(parent_path));
+    int slot = dir ? dir_lookup(dir, name) : -1;
+
+    inode_number = slot == -1 ? -1 : dir->entries[slot].inode_number;
+    dcache_insert(path, inode_number);
+    return inode_number;
+}
+
+int resolve_path(const char *path) {
+
+    STATS_START(start);
+    int inode_number = resolve_path_walk(path);
+    STATS_END(STAT_LOOKUP, start);
+    return inode_number;
+}
+
+//directory inode that holds (or would hold) a normalized path, or -1; *name is set to the final component
+int resolve_parent(const char *path, const char **name) {
+
+    char parent_path[MAX_PATH_LEN];
+    *name = split_path(path, parent_path);
+    int parent_inode = resolve_path(parent_path);
+    return dir_get(parent_inode) ? parent_inode : -1;
+}
+
+//slot of the entry for a normalized path and the directory holding it, or -1
+static int find_entry(const char *fs_path, Directory **dir_out) {
+
+    const char *name;
+    int parent_inode = resolve_parent(fs_path, &name);
+    *dir_out = parent_inode == -1 ? NULL : dir_get(parent_inode);
+    return *dir_out ? dir_lookup(*dir_out, name) : -1;
+}
+
+int find_inode_by_filename(const char *filename) {
+
+    if (filename == NULL || strlen(filename) == 0) {
+        FS_TRACE("lookup: empty file name\n");
+        return -1;
+    }
+
+    char fs_path[MAX_PATH_LEN];
+    if (make_fs_path(filename, fs_path) != 0) return -1;
+    return resolve_path(fs_path);
+}
+
+//file system path of an inode, rebuilt by following parent links up to the root.
+//Returns 0, or -1 if the inode is not linked into the tree or the path is too long
+int inode_to_path(int inode_number, char *out, size_t out_size) {
+
+    char path[MAX_PATH_LEN] = "";
+    size_t length = 0;
+    int depth = 0;
+
+    while (inode_number != ROOT_INODE) {
+        if (inode_number < 0 || inode_number >= superblock->inode_table_size || ++depth > MAX_PATH_LEN / 2) return -1;
+        Directory *parent = dir_get(inode_cold(inode_number)->parent_inode);
+        if (parent == NULL) return -1;
+
+        // Directories have no back pointer to the entry naming them, so the parent is scanned
+        int slot = 0;
+        while (slot < parent->entry_count && parent->entries[slot].inode_number != inode_number) slot++;
+        if (slot == parent->entry_count) return -1;
+
+        const char *name = parent->entries[slot].name;
+        size_t name_len = strlen(name);
+        if (length + name_len + 1 >= sizeof(path)) return -1;
+        memmove(path + name_len + (length ? 1 : 0), path, length + 1);
+        memcpy(path, name, name_len);
+        if (length) path[name_len] = '/';
+        length += name_len + (length ? 1 : 0);
+        inode_number = parent->inode_number;
+    }
+
+    if (length >= out_size) return -1;
+    memcpy(out, path, length + 1);
+    return 0;
+}
+
+
+//name search index
+//records are appended and never reused, so posting lists stay sorted and a query intersects them by merging.
+//A removed entry leaves a dead record behind until dead records outnumber live ones and the index is
+//compacted. The index is built by walking the tree on the first search, then kept current by
+//dir_add_entry, dir_remove_entry and dir_rename_entry, which run with namespace_lock held exclusively;
+//searches hold it shared
+#define NAME_INDEX_INITIAL 1024
+#define NAME_INDEX_COMPACT_MIN 4096 // dead records tolerated before a compaction is considered
+
+static uint32_t name_trigram(const char *s) {
+
+    return ((uint32_t)(unsigned char)s[0] << 16) | ((uint32_t)(unsigned char)s[1] << 8) | (unsigned char)s[2];
+}
+
+static unsigned int name_trigram_hash(uint32_t trigram) {
+
+    trigram *= 2654435761u;
+    return trigram ^ (trigram >> 16);
+}
+
+static unsigned int name_entry_hash(int dir_inode, const char *name) {
+
+    return dir_hash_name(name) ^ ((unsigned int)dir_inode * 2654435761u);
+}
+
+//forget the index; the next search builds it again
+void name_index_reset() {
+
+    for (int r = 0; r < name_index.record_count; r++) {
+        free(name_index.records[r].name);
+    }
+    for (int i = 0; i < name_index.posting_size; i++) {
+        free(name_index.postings[i].records);
+    }
+    free(name_index.records);
+    free(name_index.postings);
+    free(name_index.entry_hash);
+    memset(&name_index, 0, sizeof(name_index));
+}
+
+static int name_postings_grow() {
+
+    int size = name_index.posting_size ? name_index.posting_size * 2 : NAME_INDEX_INITIAL;
+    NamePosting *postings = calloc(size, sizeof(NamePosting));
+    if (postings == NULL) return -1;
+
+    for (int i = 0; i < name_index.posting_size; i++) {
+        if (name_index.postings[i].trigram == 0) continue;
+        int pos = name_trigram_hash(name_index.postings[i].trigram) & (size - 1);
+        while (postings[pos].trigram != 0) {
+            pos = (pos + 1) & (size - 1);
+        }
+        postings[pos] = name_index.postings[i];
+    }
+    free(name_index.postings);
+    name_index.postings = postings;
+    name_index.posting_size = size;
+    return 0;
+}
+
+//posting list of `trigram`, added if `create` is set; NULL if there is none or it could not be added
+static NamePosting *name_posting(uint32_t trigram, int create) {
+
+    if (create && (name_index.posting_used + 1) * 2 > name_index.posting_size && name_postings_grow() != 0) {
+        return NULL;
+    }
+    if (name_index.posting_size == 0) return NULL;
+
+    int pos = name_trigram_hash(trigram) & (name_index.posting_size - 1);
+    while (name_index.postings[pos].trigram != 0) {
+        if (name_index.postings[pos].trigram == trigram) return &name_index.postings[pos];
+        pos = (pos + 1) & (name_index.posting_size - 1);
+    }
+    if (!create) return NULL;
+    name_index.postings[pos].trigram = trigram;
+    name_index.posting_used++;
+    return &name_index.postings[pos];
+}
+
+static void name_entry_hash_insert(int record) {
+
+    const NameRecord *entry = &name_index.records[record];
+    int pos = name_entry_hash(entry->dir_inode, entry->name) & (name_index.entry_hash_size - 1);
+    while (name_index.entry_hash[pos] != -1) {
+        pos = (pos + 1) & (name_index.entry_hash_size - 1);
+    }
+    name_index.entry_hash[pos] = record;
+}
+
+static int name_entry_hash_grow() {
+
+    int size = name_index.entry_hash_size ? name_index.entry_hash_size * 2 : NAME_INDEX_INITIAL;
+    int *entry_hash = malloc(size * sizeof(int));
+    if (entry_hash == NULL) return -1;
+
+    free(name_index.entry_hash);
+    name_index.entry_hash = entry_hash;
+    name_index.entry_hash_size = size;
+    for (int i = 0; i < size; i++) {
+        name_index.entry_hash[i] = -1;
+    }
+    for (int r = 0; r < name_index.record_count; r++) {
+        if (name_index.records[r].name != NULL) name_entry_hash_insert(r);
+    }
+    return 0;
+}
+
+//position in entry_hash[] of the live record for `name` in directory `dir_inode`, or -1
+static int name_entry_find(int dir_inode, const char *name) {
+
+    if (name_index.entry_hash_size == 0) return -1;
+    int pos = name_entry_hash(dir_inode, name) & (name_index.entry_hash_size - 1);
+    while (name_index.entry_hash[pos] != -1) {
+        const NameRecord *entry = &name_index.records[name_index.entry_hash[pos]];
+        if (entry->dir_inode == dir_inode && strcmp(entry->name, name) == 0) return pos;
+        pos = (pos + 1) & (name_index.entry_hash_size - 1);
+    }
+    return -1;
+}
+
+//same backward shift as dir_hash_remove
+static void name_entry_hash_remove(int pos) {
+
+    int mask = name_index.entry_hash_size - 1;
+    int hole = pos;
+    int next = (hole + 1) & mask;
+    while (name_index.entry_hash[next] != -1) {
+        const NameRecord *entry = &name_index.records[name_index.entry_hash[next]];
+        int home = name_entry_hash(entry->dir_inode, entry->name) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            name_index.entry_hash[hole] = name_index.entry_hash[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    name_index.entry_hash[hole] = -1;
+}
+
+//append a record and enter it in the posting list of each of its trigrams; returns 0, or -1 if out of memory
+static int name_index_add_record(int dir_inode, const char *name, int inode_number) {
+
+    if (name_index.record_count == name_index.record_capacity) {
+        int capacity = name_index.record_capacity ? name_index.record_capacity * 2 : NAME_INDEX_INITIAL;
+        NameRecord *records = realloc(name_index.records, capacity * sizeof(NameRecord));
+        if (records == NULL) return -1;
+        name_index.records = records;
+        name_index.record_capacity = capacity;
+    }
+    if ((name_index.live_count + 1) * 2 > name_index.entry_hash_size && name_entry_hash_grow() != 0) {
+        return -1;
+    }
+
+    int r = name_index.record_count;
+    NameRecord *record = &name_index.records[r];
+    record->name = strdup(name);
+    if (record->name == NULL) return -1;
+    record->dir_inode = dir_inode;
+    record->inode_number = inode_number;
+    name_index.record_count++;
+    name_index.live_count++;
+    name_entry_hash_insert(r);
+
+    for (size_t i = 0; name[i] != '\0' && name[i + 1] != '\0' && name[i + 2] != '\0'; i++) {
+        NamePosting *posting = name_posting(name_trigram(name + i), 1);
+        if (posting == NULL) return -1;
+        // A trigram that occurs twice in the name is listed once
+        if (posting->count > 0 && posting->records[posting->count - 1] == r) continue;
+        if (posting->count == posting->capacity) {
+            int capacity = posting->capacity ? posting->capacity * 2 : 4;
+            int *records = realloc(posting->records, capacity * sizeof(int));
+            if (records == NULL) return -1;
+            posting->records = records;
+            posting->capacity = capacity;
+        }
+        posting->records[posting->count++] = r;
+    }
+    return 0;
+}
+
+//index the live records again, numbered from 0
+static int name_index_compact() {
+
+    NameRecord *records = name_index.records;
+    int record_count = name_index.record_count;
+
+    name_index.records = NULL;
+    name_index.record_count = 0;
+    name_index.record_capacity = 0;
+    name_index.live_count = 0;
+    for (int i = 0; i < name_index.posting_size; i++) {
+        free(name_index.postings[i].records);
+    }
+    free(name_index.postings);
+    name_index.postings = NULL;
+    name_index.posting_size = 0;
+    name_index.posting_used = 0;
+    free(name_index.entry_hash);
+    name_index.entry_hash = NULL;
+    name_index.entry_hash_size = 0;
+
+    int result = 0;
+    for (int r = 0; r < record_count; r++) {
+        if (records[r].name == NULL) continue;
+        if (result == 0) result = name_index_add_record(records[r].dir_inode, records[r].name, records[r].inode_number);
+        free(records[r].name);
+    }
+    free(records);
+    return result;
+}
+
+//entry `name` was added to directory `dir_inode`. Like the other updates below this is a no-op until the
+//index is built, and a failure drops the index so the next search builds it again
+void name_index_add(int dir_inode, const char *name, int inode_number) {
+
+    if (!name_index.built) return;
+    if (name_index_add_record(dir_inode, name, inode_number) != 0) {
+        name_index_reset();
+    }
+}
+
+void name_index_remove(int dir_inode, const char *name) {
+
+    if (!name_index.built) return;
+    int pos = name_entry_find(dir_inode, name);
+    if (pos == -1) return;
+
+    NameRecord *record = &name_index.records[name_index.entry_hash[pos]];
+    name_entry_hash_remove(pos);
+    free(record->name);
+    record->name = NULL;
+    name_index.live_count--;
+
+    int dead = name_index.record_count - name_index.live_count;
+    if (dead >= NAME_INDEX_COMPACT_MIN && dead > name_index.live_count && name_index_compact() != 0) {
+        name_index_reset();
+    }
+}
+
+//index every entry of the tree, walking it from the root; called with namespace_lock held
+static int name_index_build() {
+
+    int *pending = malloc(superblock->inode_table_size * sizeof(int));
+    if (pending == NULL) return -1;
+
+    int count = 0, result = 0;
+    pending[count++] = ROOT_INODE;
+    while (count > 0 && result == 0) {
+        Directory *dir = dir_get(pending[--count]);
+        if (dir == NULL) continue;
+        for (int slot = 0; slot < dir->entry_count && result == 0; slot++) {
+            const DirectoryEntry *entry = &dir->entries[slot];
+            result = name_index_add_record(dir->inode_number, entry->name, entry->inode_number);
+            int child = entry->inode_number;
+            if (child >= 0 && child < superblock->inode_table_size && inode_table[child].is_directory &&
+                count < superblock->inode_table_size) {
+                pending[count++] = child;
+            }
+        }
+    }
+    free(pending);
+
+    if (result != 0) {
+        printf("Failed to build the name index\n");
+        name_index_reset();
+        return -1;
+    }
+    name_index.built = 1;
+    return 0;
+}
+
+static int name_matches(const char *name, const char *query, size_t query_len, int prefix) {
+
+    return prefix ? strncmp(name, query, query_len) == 0 : strstr(name, query) != NULL;
+}
+
+//fill a search result from a record; returns -1 if its path cannot be built
+static int name_match_fill(const NameRecord *record, NameMatch *match) {
+
+    char dir_path[MAX_PATH_LEN];
+    if (inode_to_path(record->dir_inode, dir_path, sizeof(dir_path)) != 0) return -1;
+
+    int length = snprintf(match->path, sizeof(match->path), "%s%s%s", dir_path, dir_path[0] ? "/" : "", record->name);
+    if (length < 0 || length >= (int)sizeof(match->path)) return -1;
+    match->inode_number = record->inode_number;
+    return 0;
+}
+
+//search the names of the whole tree for `query`, anywhere in a name or, with `prefix`, at its start. Fills
+//out[] with up to `max` matches and returns how many, or -1 if the index could not be built
+int name_index_search(const char *query, int prefix, NameMatch *out, int max) {
+
+    size_t query_len = strlen(query);
+    int found = 0;
+    if (query_len == 0 || max <= 0) return 0;
+
+    g_rw_lock_reader_lock(&namespace_lock);
+    g_mutex_lock(&name_index_lock);
+    int ready = name_index.built || name_index_build() == 0;
+    g_mutex_unlock(&name_index_lock);
+    if (!ready) {
+        g_rw_lock_reader_unlock(&namespace_lock);
+        return -1;
+    }
+
+    if (query_len < 3) {
+        // Too short for a trigram, the names are scanned instead
+        for (int r = 0; r < name_index.record_count && found < max; r++) {
+            const NameRecord *record = &name_index.records[r];
+            if (record->name != NULL && name_matches(record->name, query, query_len, prefix) &&
+                name_match_fill(record, &out[found]) == 0) {
+                found++;
+            }
+        }
+        g_rw_lock_reader_unlock(&namespace_lock);
+        return found;
+    }
+
+    // A match holds every trigram of the query: walk the shortest posting list and look each of its records
+    // up in the others, whose cursors only move forward
+    int lists = (int)query_len - 2;
+    NamePosting **postings = malloc(lists * sizeof(NamePosting *));
+    int *cursors = calloc(lists, sizeof(int));
+    if (postings == NULL || cursors == NULL) {
+        free(postings);
+        free(cursors);
+        g_rw_lock_reader_unlock(&namespace_lock);
+        return -1;
+    }
+
+    int shortest = 0;
+    for (int i = 0; i < lists; i++) {
+        postings[i] = name_posting(name_trigram(query + i), 0);
+        if (postings[i] == NULL) {
+            lists = 0; // no name holds this trigram
+            break;
+        }
+        if (postings[i]->count < postings[shortest]->count) shortest = i;
+    }
+
+    for (int c = 0; lists > 0 && c < postings[shortest]->count && found < max; c++) {
+        int r = postings[shortest]->records[c];
+        int in_all = 1;
+        for (int i = 0; i < lists && in_all; i++) {
+            const NamePosting *posting = postings[i];
+            while (cursors[i] < posting->count && posting->records[cursors[i]] < r) cursors[i]++;
+            in_all = cursors[i] < posting->count && posting->records[cursors[i]] == r;
+        }
+
+        // Trigrams in the wrong order or a dead record still get here, the name itself decides
+        const NameRecord *record = &name_index.records[r];
+        if (in_all && record->name != NULL && name_matches(record->name, query, query_len, prefix) &&
+            name_match_fill(record, &out[found]) == 0) {
+            found++;
+        }
+    }
+
+    free(postings);
+    free(cursors);
+    g_rw_lock_reader_unlock(&namespace_lock);
+    return found;
+}
+
+static void bitmap_set_range(int start, int count);
+
+//map `size` bytes of fd shared and writable, so stores reach the image file; NULL on failure
+static void *image_map(int fd, size_t size) {
+
+#ifdef _WIN32
+    fs_image_mapping = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_READWRITE, 0, 0, NULL);
+    if (fs_image_mapping == NULL) return NULL;
+    void *addr = MapViewOfFile(fs_image_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (addr == NULL) {
+        CloseHandle(fs_image_mapping);
+        fs_image_mapping = NULL;
+    }
+    return addr;
+#else
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+#endif
+}
+
+static void image_unmap(void *addr, size_t size) {
+
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(addr);
+    CloseHandle(fs_image_mapping);
+    fs_image_mapping = NULL;
+#else
+    munmap(addr, size);
+#endif
+}
+
+//write dirty pages of the mapping back to the image file, returns 0 on success
+static int image_sync(void *addr, size_t size) {
+
+#ifdef _WIN32
+    if (!FlushViewOfFile(addr, size)) return -1;
+    return FlushFileBuffers((HANDLE)_get_osfhandle(fs_image_fd)) ? 0 : -1;
+#else
+    // msync wants a page-aligned start, and pages may be larger than blocks
+    size_t misalign = (size_t)((unsigned char *)addr - fs_image) % (size_t)sysconf(_SC_PAGESIZE);
+    return msync((unsigned char *)addr - misalign, size + misalign, MS_SYNC);
+#endif
+}
+
+//record that `size` bytes at `addr` inside the mapping were changed, so the flusher writes their blocks back
+void image_mark_dirty(const void *addr, size_t size) {
+
+    if (image_dirty == NULL || size == 0) return;
+    size_t offset = (size_t)((const unsigned char *)addr - fs_image);
+    if (offset >= fs_image_size) return; // an inode copy outside the mapping, such as a snapshot slot being built
+    int64_t first = offset / superblock->block_size;
+    int64_t last = (offset + size - 1) / superblock->block_size;
+
+    g_mutex_lock(&image_dirty_lock);
+    for (int64_t b = first; b <= last; b++) {
+        uint64_t mask = 1ULL << (b % BITMAP_WORD_BITS);
+        if (!(image_dirty[b / BITMAP_WORD_BITS] & mask)) {
+            image_dirty[b / BITMAP_WORD_BITS] |= mask;
+            image_dirty_count++;
+        }
+    }
+    if (image_dirty_count >= WRITEBACK_DIRTY_HIGH) {
+        g_cond_signal(&image_flush_cond);
+    }
+    g_mutex_unlock(&image_dirty_lock);
+}
+
+//checksum table entry of image block `block`; the table covers every block but its own region
+static uint32_t *image_checksum_slot(int64_t block) {
+
+    if (block >= superblock->checksum_start) block -= superblock->data_start - superblock->checksum_start;
+    return &image_checksums[block];
+}
+
+//store the checksums of image blocks [first, end) as they are now. Blocks of the checksum region are skipped
+static void image_checksum_run(int64_t first, int64_t end) {
+
+    size_t block_size = superblock->block_size;
+    for (int64_t b = first; b < end; b++) {
+        if (b >= superblock->checksum_start && b < superblock->data_start) continue;
+        uint32_t *slot = image_checksum_slot(b);
+        uint32_t crc = crc32c(0, fs_image + b * block_size, block_size);
+        if (*slot != crc) {
+            *slot = crc;
+            image_mark_dirty(slot, sizeof(*slot));
+        }
+    }
+}
+
+//checksums of every block still dirty, for an unmount that leaves them to the mapping
+static void image_checksum_dirty() {
+
+    if (image_dirty == NULL) return;
+    for (int64_t b = 0; b < superblock->image_blocks; b++) {
+        if ((image_dirty[b / BITMAP_WORD_BITS] >> (b % BITMAP_WORD_BITS)) & 1) image_checksum_run(b, b + 1);
+    }
+}
+
+//write every dirty block back, one msync per run of adjacent dirty blocks, storing each block's checksum
+//first. Bits are cleared before the run is written, so a block changed meanwhile is marked again and caught
+//by the next flush. The checksums dirtied on the way lie before the data region, a second pass from the
+//start writes them. Returns 0 or -1
+int image_flush_dirty() {
+
+    STATS_START(start);
+    if (image_dirty == NULL) {
+        int result = image_sync(fs_image, fs_image_size);
+        STATS_END(STAT_FLUSH, start);
+        return result;
+    }
+
+    int64_t flushed = 0;
+    int result = 0;
+    int passes = 0;
+    int64_t words = BITMAP_WORDS(superblock->image_blocks);
+    int64_t block = 0;
+    g_mutex_lock(&image_flush_lock);
+    g_mutex_lock(&image_dirty_lock);
+    while (image_dirty_count > 0) {
+        // Find the next run [start, end) of dirty blocks
+        int64_t w = block / BITMAP_WORD_BITS;
+        uint64_t bits = w < words ? image_dirty[w] & (~0ULL << (block % BITMAP_WORD_BITS)) : 0;
+        while (bits == 0 && ++w < words) bits = image_dirty[w];
+        if (bits == 0) {
+            if (++passes == 2) break;
+            block = 0;
+            continue;
+        }
+        int64_t first = w * BITMAP_WORD_BITS + BITMAP_CTZ(bits);
+        int64_t end = first;
+        while (end < superblock->image_blocks && (image_dirty[end / BITMAP_WORD_BITS] >> (end % BITMAP_WORD_BITS)) & 1) {
+            image_dirty[end / BITMAP_WORD_BITS] &= ~(1ULL << (end % BITMAP_WORD_BITS));
+            end++;
+        }
+        image_dirty_count -= end - first;
+        g_mutex_unlock(&image_dirty_lock);
+
+        size_t block_size = superblock->block_size;
+        image_checksum_run(first, end);
+        if (image_sync(fs_image + first * block_size, (end - first) * block_size) != 0) {
+            perror("Failed to write back dirty blocks");
+            image_mark_dirty(fs_image + first * block_size, (end - first) * block_size);
+            result = -1;
+        }
+        flushed += end - first;
+        block = end;
+        g_mutex_lock(&image_dirty_lock);
+    }
+    g_mutex_unlock(&image_dirty_lock);
+    g_mutex_unlock(&image_flush_lock);
+    STATS_END(STAT_FLUSH, start);
+    FS_TRACE("flush: %lld blocks written back\n", (long long)flushed);
+    return result;
+}
+
+//background flusher: writes dirty blocks back every WRITEBACK_INTERVAL_MS, or sooner once
+//WRITEBACK_DIRTY_HIGH blocks are dirty, so checkpoints find little left to write
+static gpointer image_flusher_main(gpointer data) {
+
+    (void)data;
+    g_mutex_lock(&image_dirty_lock);
+    while (!image_flusher_stop) {
+        gint64 deadline = g_get_monotonic_time() + WRITEBACK_INTERVAL_MS * G_TIME_SPAN_MILLISECOND;
+        while (!image_flusher_stop && image_dirty_count < WRITEBACK_DIRTY_HIGH &&
+               g_cond_wait_until(&image_flush_cond, &image_dirty_lock, deadline)) {
+        }
+        if (image_flusher_stop || image_dirty_count == 0) continue;
+        g_mutex_unlock(&image_dirty_lock);
+        image_flush_dirty();
+        g_mutex_lock(&image_dirty_lock);
+    }
+    g_mutex_unlock(&image_dirty_lock);
+    return NULL;
+}
+
+//start dirty tracking and the flusher for the mounted image
+static int image_writeback_start() {
+
+    image_dirty = calloc(BITMAP_WORDS(superblock->image_blocks), sizeof(uint64_t));
+    if (image_dirty == NULL) return -1;
+    image_dirty_count = 0;
+    image_flusher_stop = 0;
+    image_flusher = g_thread_new("flusher", image_flusher_main, NULL);
+    return 0;
+}
+
+//stop the flusher and drop the dirty bits; whatever is still dirty stays in the mapping until unmapped
+static void image_writeback_stop() {
+
+    if (image_flusher != NULL) {
+        g_mutex_lock(&image_dirty_lock);
+        image_flusher_stop = 1;
+        g_cond_signal(&image_flush_cond);
+        g_mutex_unlock(&image_dirty_lock);
+        g_thread_join(image_flusher);
+        image_flusher = NULL;
+    }
+    free(image_dirty);
+    image_dirty = NULL;
+    image_dirty_count = 0;
+}
+
+static void bitmap_set_range(int start, int count);
+
+//point the bitmaps and the inode tables at their regions and size the directory cache, once the superblock is valid
+static int image_attach_regions() {
+
+    size_t block_size = superblock->block_size;
+    block_bitmap = (uint64_t *)(fs_image + (size_t)superblock->bitmap_start * block_size);
+    block_refs = (uint32_t *)(fs_image + (size_t)superblock->refcount_start * block_size);
+    image_checksums = (uint32_t *)(fs_image + (size_t)superblock->checksum_start * block_size);
+    inode_bitmap = (uint64_t *)(fs_image + (size_t)superblock->inode_bitmap_start * block_size);
+    inode_table = (Inode *)(fs_image + (size_t)superblock->inode_table_start * block_size);
+    inode_cold_table = (InodeCold *)(fs_image + (size_t)superblock->inode_cold_start * block_size);
+    inode_next_free_hint = 0;
+    // A zeroed GRWLock is ready to use like a static one, so none of these is touched before its inode is,
+    // and mounting costs the same whatever the inode count
+    directory_cache = calloc(superblock->inode_table_size, sizeof(Directory*));
+    inode_locks = calloc(superblock->inode_table_size, sizeof(GRWLock));
+    perm_generations = calloc(superblock->inode_table_size, sizeof(guint));
+    perm_mount_epoch++; // answers threads cached for an earlier mount must not match the new generations
+    if (directory_cache == NULL || inode_locks == NULL || perm_generations == NULL) return -1;
+    return 0;
+}
+
+//crc32c of the superblock fields that never change after the format: the geometry, where each region starts
+//and the features. load_file_system_state checks it before trusting them
+uint32_t superblock_layout_checksum(const Superblock *sb) {
+
+    uint32_t crc = crc32c(0, &sb->magic, sizeof(sb->magic));
+    crc = crc32c(crc, &sb->version, sizeof(sb->version));
+    crc = crc32c(crc, &sb->_size, sizeof(sb->_size));
+    crc = crc32c(crc, &sb->block_size, sizeof(sb->block_size));
+    crc = crc32c(crc, &sb->num_blocks, sizeof(sb->num_blocks));
+    crc = crc32c(crc, &sb->inode_table_size, sizeof(sb->inode_table_size));
+    crc = crc32c(crc, &sb->bitmap_start, (size_t)((const char *)&sb->image_blocks - (const char *)&sb->bitmap_start) + sizeof(sb->image_blocks));
+    return crc32c(crc, &sb->features, sizeof(sb->features));
+}
+
+//returns 1 if a block size, block count and inode count can be formatted
+int geometry_valid(int block_size, int64_t num_blocks, int64_t inode_count) {
+
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) return 0;
+    // Fragment addresses count slots, FRAGMENTS_PER_BLOCK to a block
+    if (num_blocks < MIN_NUM_BLOCKS || num_blocks > INT32_MAX / FRAGMENTS_PER_BLOCK) return 0;
+    if (inode_count < 1 || inode_count > INT32_MAX) return 0;
+    // Directory entries must fit in a block
+    return block_size / (int)sizeof(DirectoryEntry) > 0;
+}
+
+//lay out the mapped image for the given geometry: superblock, empty bitmaps and inode table
+void format_superblock(int block_size, int num_blocks, int inode_count) {
+
+    int64_t bitmap_blocks = BITMAP_BLOCKS(num_blocks, block_size);
+    int64_t refcount_blocks = REFCOUNT_BLOCKS(num_blocks, block_size);
+    int64_t inode_bitmap_blocks = BITMAP_BLOCKS(inode_count, block_size);
+    int64_t inode_blocks = INODE_TABLE_BLOCKS(inode_count, block_size);
+    memset(fs_image, 0, (size_t)METADATA_BLOCKS(num_blocks, inode_count, block_size) * block_size);
+
+    superblock->magic = FS_MAGIC;
+    superblock->version = FS_VERSION;
+    superblock->block_size = block_size;
+    superblock->_size = (int64_t)num_blocks * block_size;
+    superblock->num_blocks = num_blocks;
+    superblock->free_blocks = num_blocks - 1;
+    superblock->inode_table_size = inode_count;
+    superblock->free_inode_count = inode_count;
+    superblock->bitmap_start = 1;
+    superblock->refcount_start = 1 + bitmap_blocks;
+    superblock->inode_bitmap_start = superblock->refcount_start + refcount_blocks;
+    superblock->inode_table_start = superblock->inode_bitmap_start + inode_bitmap_blocks;
+    superblock->inode_cold_start = superblock->inode_table_start + inode_blocks;
+    superblock->checksum_start = superblock->inode_cold_start + INODE_COLD_BLOCKS(inode_count, block_size);
+    superblock->data_start = superblock->checksum_start + CHECKSUM_BLOCKS(num_blocks, inode_count, block_size);
+    superblock->image_blocks = superblock->data_start + num_blocks;
+    block_bitmap = (uint64_t *)(fs_image + (size_t)superblock->bitmap_start * block_size);
+    block_refs = (uint32_t *)(fs_image + (size_t)superblock->refcount_start * block_size);
+    inode_bitmap = (uint64_t *)(fs_image + (size_t)superblock->inode_bitmap_start * block_size);
+
+    // Block 0 is reserved, and padding bits past num_blocks are marked used so the scans never return them
+    bitmap_set_range(0, 1);
+    if (num_blocks % BITMAP_WORD_BITS != 0) {
+        bitmap_set_range(num_blocks, (int)(BITMAP_WORDS(num_blocks) * BITMAP_WORD_BITS - num_blocks));
+    }
+    if (inode_count % BITMAP_WORD_BITS != 0) {
+        inode_bitmap[inode_count / BITMAP_WORD_BITS] |= ~0ULL << (inode_count % BITMAP_WORD_BITS);
+    }
+    superblock->next_free_hint = 1;
+}
+
+//format tool: create (or overwrite) a disk image with the given geometry and an empty root directory,
+//and leave it mounted. Returns 0 on success, -1 on failure
+int format_file_system(const char *image_path, int block_size, int num_blocks, int inode_count, unsigned int features) {
+
+    if (!geometry_valid(block_size, num_blocks, inode_count)) {
+        printf("Invalid geometry: block size %d (power of two, %d-%d), %d blocks (at least %d), %d inodes\n",
+               block_size, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE, num_blocks, MIN_NUM_BLOCKS, inode_count);
+        return -1;
+    }
+    if (fs_image != NULL) free_memory();
+
+    int64_t image_blocks = METADATA_BLOCKS(num_blocks, inode_count, block_size) + num_blocks;
+    fs_image_fd = open(image_path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    fs_image_size = (size_t)(image_blocks * block_size);
+    // Unwritten blocks read back as zeroes and take no space on most file systems
+    if (fs_image_fd == -1 || ftruncate(fs_image_fd, (off_t)fs_image_size) != 0 ||
+        (fs_image = image_map(fs_image_fd, fs_image_size)) == NULL) {
+        perror("Failed to create disk image");
+        if (fs_image_fd != -1) close(fs_image_fd);
+        fs_image_fd = -1;
+        return -1;
+    }
+
+    superblock = (Superblock *)fs_image;
+    format_superblock(block_size, num_blocks, inode_count);
+    superblock->features = features;
+    superblock->layout_checksum = superblock_layout_checksum(superblock);
+    if (image_attach_regions() != 0) {
+        printf("Failed to allocate the directory cache\n");
+        free_memory();
+        return -1;
+    }
+    create_inode_at(ROOT_INODE, 1, 0755, current_user_id, current_group_id);
+    inode_cold(ROOT_INODE)->parent_inode = ROOT_INODE;
+
+    // The data region is still all zeroes, one checksum serves every block of it
+    image_checksum_run(0, superblock->checksum_start);
+    uint32_t zero_crc = crc32c(0, block_data(0), superblock->block_size);
+    for (int64_t b = superblock->data_start; b < superblock->image_blocks; b++) {
+        *image_checksum_slot(b) = zero_crc;
+    }
+
+    if (image_sync(fs_image, fs_image_size) != 0) {
+        perror("Failed to write disk image");
+        return -1;
+    }
+    printf("Formatted %s: %d blocks of %d bytes, %d inodes\n", image_path, num_blocks, block_size, inode_count);
+    return 0;
+}
+
+//hot list: the directories of the most recently used dentry cache paths, a file's path counting for its parent.
+//Saved before the image is unmapped, so the next mount can warm them. Returns 0, or -1 if it could not be written
+int hotlist_save() {
+
+    if (fs_image == NULL) return 0;
+    int dirs[HOTLIST_MAX_DIRS];
+    int count = 0;
+    g_mutex_lock(&dcache_lock);
+    for (int n = dcache_lru_head; n != -1 && count < HOTLIST_MAX_DIRS; n = dcache[n].lru_next) {
+        int inode_number = dcache[n].inode_number;
+        if (inode_number == -1) continue;
+        int dir = inode_table[inode_number].is_directory ? inode_number : inode_cold(inode_number)->parent_inode;
+        int seen = 0;
+        for (int i = 0; i < count && !seen; i++) seen = dirs[i] == dir;
+        if (!seen) dirs[count++] = dir;
+    }
+    g_mutex_unlock(&dcache_lock);
+    // An empty cache, e.g. after a snapshot mount, says nothing about what the live tree uses
+    if (count == 0) return 0;
+
+    uint32_t header[2] = {HOTLIST_MAGIC, (uint32_t)count};
+    FILE *file = fopen(HOTLIST_FILENAME, "wb");
+    if (file == NULL || fwrite(header, sizeof(header), 1, file) != 1 || fwrite(dirs, sizeof(int), count, file) != (size_t)count) {
+        perror("Failed to write the hot list");
+        if (file != NULL) fclose(file);
+        return -1;
+    }
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+static gpointer prefetcher_main(gpointer data) {
+
+    int *dirs = data;
+    for (int i = 1; i <= dirs[0] && !g_atomic_int_get(&prefetcher_stop); i++) {
+        // One directory per hold of the lock, so writers are never kept waiting for the whole list
+        g_rw_lock_reader_lock(&namespace_lock);
+        if (dirs[i] >= 0 && dirs[i] < superblock->inode_table_size && g_atomic_pointer_get(&directory_cache[dirs[i]]) == NULL &&
+            dir_get(dirs[i]) != NULL) {
+            STATS_COUNT(STAT_PREFETCH_DIR);
+        }
+        g_rw_lock_reader_unlock(&namespace_lock);
+    }
+    free(dirs);
+    return NULL;
+}
+
+//load the directory views on the saved hot list in the background. Entries may be stale, dir_get skips whatever
+//is no longer a directory
+void prefetch_start() {
+
+    if (prefetcher != NULL) return;
+    FILE *file = fopen(HOTLIST_FILENAME, "rb");
+    if (file == NULL) return;
+    uint32_t header[2];
+    int *dirs = NULL;
+    if (fread(header, sizeof(header), 1, file) == 1 && header[0] == HOTLIST_MAGIC && header[1] <= HOTLIST_MAX_DIRS &&
+        (dirs = malloc((header[1] + 1) * sizeof(int))) != NULL) {
+        dirs[0] = (int)fread(&dirs[1], sizeof(int), header[1], file);
+    }
+    fclose(file);
+    if (dirs == NULL) return;
+
+    prefetcher_stop = 0;
+    prefetcher = g_thread_new("prefetcher", prefetcher_main, dirs);
+}
+
+//stop the prefetcher; must precede swapping the inode tables or unmapping them
+void prefetch_stop() {
+
+    if (prefetcher == NULL) return;
+    g_atomic_int_set(&prefetcher_stop, 1);
+    g_thread_join(prefetcher);
+    prefetcher = NULL;
+}
+
+//file initialization. Only the superblock is read up front: the bitmaps, inode tables and directory blocks are pages of
+//the mapping, faulted in on first access, so mounting takes the same time for any inode count
+void init_file_system() {
+
+    dcache_init();
+
+    // Map the disk image; only a missing one is formatted, with the default geometry
+    STATS_START(start);
+    int loaded = load_file_system_state();
+    STATS_END(STAT_MOUNT, start);
+    if (loaded == 0) {
+        loaded = format_file_system(FS_IMAGE_FILENAME, DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, DEFAULT_INODE_COUNT, 0) == 0;
+    }
+    if (loaded != 1) {
+        printf("Not mounting the disk image %s\n", FS_IMAGE_FILENAME);
+        exit(EXIT_FAILURE);
+    }
+
+    if (image_writeback_start() != 0) {
+        printf("Failed to start the write-back flusher, blocks are written at checkpoints only\n");
+    }
+    init_journal();
+    replay_journal();
+    prefetch_start();
+}
+
+
+
+//checkpoint the state: flush every page of the image, stamped with the last journal record it reflects.
+//Pages may also reach the image earlier, replay applies records on top of that idempotently.
+//Returns 0 on success, -1 on failure
+int save_file_system_state() {
+
+    if (fs_image == NULL) return -1;
+
+    // Every record appended so far is reflected in the state being written
+    g_mutex_lock(&journal_lock);
+    superblock->checkpoint_seq = journal_next_seq - 1;
+    g_mutex_unlock(&journal_lock);
+    superblock_mark_dirty();
+
+    // Only the superblock, bitmap words, inode slots and data blocks changed since the last flush are written
+    if (image_flush_dirty() != 0) {
+        perror("Failed to write file system state");
+        return -1;
+    }
+    return 0;
+}
+
+
+
+//map the disk image with the geometry its superblock records. Returns 1 if it holds a compatible
+//file system, 0 if there is no image yet, -1 if it could not be mapped or is unreadable or incompatible.
+//An existing image is never formatted over, whatever is wrong with it
+int load_file_system_state() {
+
+    if (fs_image != NULL) free_memory();
+
+    fs_image_fd = open(FS_IMAGE_FILENAME, O_RDWR | O_BINARY);
+    if (fs_image_fd == -1) {
+        if (errno != ENOENT) {
+            perror("Failed to open the disk image");
+            return -1;
+        }
+        printf("Initializing new file system.\n");
+        return 0;
+    }
+
+    // The superblock sits at offset 0 whatever the block size, so the geometry can be read before mapping
+    Superblock loaded;
+    struct stat st;
+    const char *problem = NULL;
+    if (read(fs_image_fd, &loaded, sizeof(loaded)) != (ssize_t)sizeof(loaded) || fstat(fs_image_fd, &st) != 0) {
+        problem = "cannot read its superblock";
+    } else if (loaded.magic != FS_MAGIC) {
+        problem = "it does not hold this file system";
+    } else if (loaded.version != FS_VERSION) {
+        printf("Disk image version %d, this build reads version %d\n", loaded.version, FS_VERSION);
+        problem = "it was formatted by a different version";
+    } else if (loaded.layout_checksum != superblock_layout_checksum(&loaded)) {
+        // Checked before the geometry, so a damaged size or offset is reported as damage
+        problem = "superblock checksum mismatch, its layout fields are damaged";
+    } else if (!geometry_valid(loaded.block_size, loaded.num_blocks, loaded.inode_table_size) ||
+               loaded.data_start != METADATA_BLOCKS(loaded.num_blocks, loaded.inode_table_size, loaded.block_size) ||
+               loaded.checksum_start != loaded.inode_cold_start + INODE_COLD_BLOCKS(loaded.inode_table_size, loaded.block_size) ||
+               loaded.image_blocks != loaded.data_start + loaded.num_blocks) {
+        problem = "its superblock geometry is invalid";
+    } else if ((int64_t)st.st_size != loaded.image_blocks * loaded.block_size) {
+        problem = "its size does not match its superblock, it may be truncated";
+    }
+    if (problem != NULL) {
+        printf("Incompatible disk image %s: %s. Move it away to format a new one\n", FS_IMAGE_FILENAME, problem);
+        close(fs_image_fd);
+        fs_image_fd = -1;
+        return -1;
+    }
+
+    fs_image_size = (size_t)(loaded.image_blocks * loaded.block_size);
+    fs_image = image_map(fs_image_fd, fs_image_size);
+    if (fs_image == NULL) {
+        perror("Failed to map disk image");
+        close(fs_image_fd);
+        fs_image_fd = -1;
+        return -1;
+    }
+
+    superblock = (Superblock *)fs_image;
+    if (image_attach_regions() != 0) {
+        printf("Failed to allocate the directory cache\n");
+        free_memory();
+        return -1;
+    }
+    return 1;
+}
+
+
+
+//permission decisions: each thread remembers recent has_permission answers per (inode, user), tagged with
+//the inode's generation in perm_generations and the mount it was given in. Whatever changes an inode's mode, owner or ACL calls
+//perm_invalidate, which retires every answer cached for it without touching other threads' caches
+
+void perm_invalidate(int inode_number) {
+
+    if (perm_generations != NULL) g_atomic_int_inc((gint *)&perm_generations[inode_number]);
+}
+
+//after inode_table was replaced as a whole
+void perm_invalidate_all() {
+
+    for (int i = 0; perm_generations != NULL && i < superblock->inode_table_size; i++) {
+        perm_invalidate(i);
+    }
+}
+
+static PermCacheEntry *perm_cache_get() {
+
+    PermCacheEntry *cache = g_private_get(&perm_cache_key);
+    if (cache == NULL) {
+        cache = malloc(PERM_CACHE_SIZE * sizeof(PermCacheEntry));
+        if (cache == NULL) return NULL;
+        for (int i = 0; i < PERM_CACHE_SIZE; i++) {
+            cache[i].inode_number = -1;
+        }
+        g_private_set(&perm_cache_key, cache);
+    }
+    return cache;
+}
+
+
+
+static void block_ref(int block_number);
+
+//ACL storage: up to ACL_INLINE_ENTRIES entries live in the inode. A longer list is written to a data block
+//that every inode with the same list shares, counted in block_refs like the blocks of a clone. ACL blocks are
+//never changed in place: a changed list is looked up or written anew and the old block is released
+
+//the inode's ACL entries, sorted by user_id; called with acl_lock held if they may be in a block
+static const ACL_Entry *acl_entries(const InodeCold *cold) {
+
+    return cold->acl_count > ACL_INLINE_ENTRIES ? (const ACL_Entry *)block_data(cold->acl_block) : cold->acl;
+}
+
+//position of `user_id` in sorted entries, or of the first larger user if it has none
+static int acl_position(const ACL_Entry *entries, int count, int user_id) {
+
+    int low = 0, high = count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (entries[mid].user_id < user_id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static uint32_t acl_hash(const ACL_Entry *entries, int count) {
+
+    return crc32c(0, entries, (size_t)count * sizeof(ACL_Entry));
+}
+
+static void acl_blocks_put(uint32_t hash, int count, int block) {
+
+    int pos = hash & (acl_blocks_size - 1);
+    while (acl_blocks[pos].block >= 0) {
+        pos = (pos + 1) & (acl_blocks_size - 1);
+    }
+    if (acl_blocks[pos].block == -1) acl_blocks_used++;
+    acl_blocks[pos].hash = hash;
+    acl_blocks[pos].count = count;
+    acl_blocks[pos].block = block;
+}
+
+//double the registry, dropping removed slots
+static int acl_blocks_grow() {
+
+    AclBlockSlot *old = acl_blocks;
+    int old_size = acl_blocks_size;
+    int size = old_size ? old_size * 2 : 64;
+    acl_blocks = malloc(size * sizeof(AclBlockSlot));
+    if (acl_blocks == NULL) {
+        acl_blocks = old;
+        return -1;
+    }
+    acl_blocks_size = size;
+    acl_blocks_used = 0;
+    for (int i = 0; i < size; i++) {
+        acl_blocks[i].block = -1;
+    }
+    for (int i = 0; i < old_size; i++) {
+        if (old[i].block >= 0) acl_blocks_put(old[i].hash, old[i].count, old[i].block);
+    }
+    free(old);
+    return 0;
+}
+
+//registry slot of the ACL block holding exactly these entries, or -1
+static int acl_blocks_find(const ACL_Entry *entries, int count, uint32_t hash) {
+
+    int pos = hash & (acl_blocks_size - 1);
+    while (acl_blocks[pos].block != -1) {
+        const AclBlockSlot *slot = &acl_blocks[pos];
+        if (slot->block >= 0 && slot->hash == hash && slot->count == count &&
+            memcmp(block_data(slot->block), entries, (size_t)count * sizeof(ACL_Entry)) == 0) {
+            return pos;
+        }
+        pos = (pos + 1) & (acl_blocks_size - 1);
+    }
+    return -1;
+}
+
+static int acl_blocks_add(uint32_t hash, int count, int block) {
+
+    if ((acl_blocks_used + 1) * 2 > acl_blocks_size && acl_blocks_grow() != 0) return -1;
+    acl_blocks_put(hash, count, block);
+    return 0;
+}
+
+//register the ACL blocks of the live inodes, on the first use of the registry
+static int acl_blocks_init() {
+
+    if (acl_blocks != NULL) return 0;
+    if (acl_blocks_grow() != 0) return -1;
+    for (int i = 0; i < superblock->inode_table_size; i++) {
+        const InodeCold *cold = inode_cold(i);
+        if (cold->nlink == 0 || cold->acl_count <= ACL_INLINE_ENTRIES) continue;
+        const ACL_Entry *entries = acl_entries(cold);
+        uint32_t hash = acl_hash(entries, cold->acl_count);
+        if (acl_blocks_find(entries, cold->acl_count, hash) == -1 && acl_blocks_add(hash, cold->acl_count, cold->acl_block) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//a reference to a block holding `entries`, shared with the inodes that already have this list or newly
+//written; -1 if no block is free. Called with acl_lock held
+static int acl_block_get(const ACL_Entry *entries, int count) {
+
+    if (acl_blocks_init() != 0) return -1;
+    uint32_t hash = acl_hash(entries, count);
+    int pos = acl_blocks_find(entries, count, hash);
+    if (pos != -1) {
+        g_mutex_lock(&bitmap_lock);
+        block_ref(acl_blocks[pos].block);
+        g_mutex_unlock(&bitmap_lock);
+        return acl_blocks[pos].block;
+    }
+
+    int block = allocate_block();
+    if (block == -1) return -1;
+    memcpy(block_data(block), entries, (size_t)count * sizeof(ACL_Entry));
+    image_mark_dirty(block_data(block), (size_t)count * sizeof(ACL_Entry));
+    if (acl_blocks_add(hash, count, block) != 0) {
+        free_block(block);
+        return -1;
+    }
+    return block;
+}
+
+//drop one reference to an ACL block, unregistering it with its last; called with acl_lock held
+static void acl_block_put(int block, int count) {
+
+    if (g_atomic_int_get((gint *)&block_refs[block]) == 0 && acl_blocks != NULL) {
+        int pos = acl_blocks_find((const ACL_Entry *)block_data(block), count, acl_hash((const ACL_Entry *)block_data(block), count));
+        if (pos != -1 && acl_blocks[pos].block == block) acl_blocks[pos].block = -2;
+    }
+    free_block(block);
+}
+
+//an inode was copied, e.g. into a snapshot: the copy holds another reference to its ACL block
+void acl_share(const InodeCold *cold) {
+
+    if (cold->acl_count <= ACL_INLINE_ENTRIES) return;
+    g_mutex_lock(&acl_lock);
+    g_mutex_lock(&bitmap_lock);
+    block_ref(cold->acl_block);
+    g_mutex_unlock(&bitmap_lock);
+    g_mutex_unlock(&acl_lock);
+}
+
+//empty an inode's ACL, releasing its ACL block
+void acl_release(InodeCold *cold) {
+
+    if (cold->acl_count > ACL_INLINE_ENTRIES) {
+        g_mutex_lock(&acl_lock);
+        acl_block_put(cold->acl_block, cold->acl_count);
+        g_mutex_unlock(&acl_lock);
+    }
+    cold->acl_count = 0;
+}
+
+static int acl_has_entry(const InodeCold *cold, int user_id) {
+
+    g_mutex_lock(&acl_lock);
+    const ACL_Entry *entries = acl_entries(cold);
+    int pos = acl_position(entries, cold->acl_count, user_id);
+    int found = pos < cold->acl_count && entries[pos].user_id == user_id;
+    g_mutex_unlock(&acl_lock);
+    return found;
+}
+
+//give an inode the sorted list `entries`, inline if it fits and in a shared ACL block otherwise, and release
+//the old list. `entries` must not point into the inode. Returns 0, or -1 if no block was free and the inode
+//keeps its list. Called with acl_lock held
+static int acl_store(InodeCold *cold, const ACL_Entry *entries, int count) {
+
+    int block = -1;
+    if (count > ACL_INLINE_ENTRIES && (block = acl_block_get(entries, count)) == -1) return -1;
+    if (cold->acl_count > ACL_INLINE_ENTRIES) acl_block_put(cold->acl_block, cold->acl_count);
+
+    if (block == -1) {
+        memcpy(cold->acl, entries, (size_t)count * sizeof(ACL_Entry));
+    } else {
+        cold->acl_block = block;
+    }
+    cold->acl_count = count;
+    inode_cold_mark_dirty(cold);
+    return 0;
+}
+
+
+
+//set permissions
+void set_permissions(int inode_number, unsigned int permissions) {
+    if (inode_number < 0 || inode_number >= superblock->inode_table_size) return;
+    if ((permissions & ~(PERMISSION_READ | PERMISSION_WRITE | PERMISSION_EXECUTE)) != 0) {
+        printf("Invalid permissions value: %u\n", permissions);
+        return;
+    }
+    if (snapshot_preserve(inode_number) != 0) return;
+    inode_table[inode_number].mode = permissions;
+    inode_mark_dirty(&inode_table[inode_number]);
+    perm_invalidate(inode_number);
+    FS_TRACE("permissions: inode %d set to %u\n", inode_number, permissions);
+}
+
+
+
+//get permissions
+unsigned int get_permissions(int inode_number) {
+
+    if (inode_number < 0 || inode_number >= superblock->inode_table_size) return 0;
+    return inode_table[inode_number].mode;
+}
+
+
+//give `user_id` its own permissions on the inode, replacing an entry it already has
+void add_acl_entry(int inode_number, int user_id, unsigned int permissions) {
+
+    if (inode_number < 0 || inode_number >= superblock->inode_table_size) return;
+    InodeCold *cold = inode_cold(inode_number);
+
+    if ((permissions & ~(PERMISSION_READ | PERMISSION_WRITE | PERMISSION_EXECUTE)) != 0) {
+        printf("Invalid permissions value: %u\n", permissions);
+        return;
+    }
+
+    if (snapshot_preserve(inode_number) != 0) return;
+    ACL_Entry entries[MAX_ACL_ENTRIES];
+    g_mutex_lock(&acl_lock);
+    int count = cold->acl_count;
+    memcpy(entries, acl_entries(cold), (size_t)count * sizeof(ACL_Entry));
+    int pos = acl_position(entries, count, user_id);
+    if (pos < count && entries[pos].user_id == user_id) {
+        entries[pos].permissions = permissions;
+    } else if (count >= MAX_ACL_ENTRIES) {
+        printf("ACL entry limit reached\n");
+        g_mutex_unlock(&acl_lock);
+        return;
+    } else {
+        memmove(&entries[pos + 1], &entries[pos], (size_t)(count - pos) * sizeof(ACL_Entry));
+        entries[pos].user_id = user_id;
+        entries[pos].permissions = permissions;
+        count++;
+    }
+    if (acl_store(cold, entries, count) != 0) {
+        printf("No free block for the ACL of inode %d\n", inode_number);
+    }
+    g_mutex_unlock(&acl_lock);
+    perm_invalidate(inode_number);
+}
+
+
+
+void remove_acl_entry(int inode_number, int user_id) {
+    if (inode_number < 0 || inode_number >= superblock->inode_table_size) return;
+
+    InodeCold *cold = inode_cold(inode_number);
+    ACL_Entry entries[MAX_ACL_ENTRIES];
+    int found = 0;
+
+    // snapshot_preserve shares the ACL block under acl_lock, so it runs before the list is copied
+    if (!acl_has_entry(cold, user_id)) {
+        FS_TRACE("acl: inode %d has no entry for user %d\n", inode_number, user_id);
+        return;
+    }
+    if (snapshot_preserve(inode_number) != 0) return;
+
+    g_mutex_lock(&acl_lock);
+    int count = cold->acl_count;
+    memcpy(entries, acl_entries(cold), (size_t)count * sizeof(ACL_Entry));
+    int pos = acl_position(entries, count, user_id);
+    if (pos < count && entries[pos].user_id == user_id) {
+        memmove(&entries[pos], &entries[pos + 1], (size_t)(count - pos - 1) * sizeof(ACL_Entry));
+        found = acl_store(cold, entries, count - 1) == 0;
+    }
+    g_mutex_unlock(&acl_lock);
+
+    if (found) {
+        perm_invalidate(inode_number);
+        FS_TRACE("acl: removed the entry of user %d from inode %d\n", user_id, inode_number);
+    } else {
+        FS_TRACE("acl: inode %d has no entry for user %d\n", inode_number, user_id);
+    }
+}
+
+unsigned int get_acl_permissions(int inode_number, int user_id) {
+
+    if (inode_number < 0 || inode_number >= superblock->inode_table_size) return 0;
+    const InodeCold *cold = inode_cold(inode_number);
+    unsigned int permissions = 0;
+
+    g_mutex_lock(&acl_lock);
+    const ACL_Entry *entries = acl_entries(cold);
+    int pos = acl_position(entries, cold->acl_count, user_id);
+    if (pos < cold->acl_count && entries[pos].user_id == user_id) {
+        permissions = entries[pos].permissions;
+    }
+    g_mutex_unlock(&acl_lock);
+    return permissions;
+}
+
+//answered from this thread's decision cache while the inode's permissions are unchanged
+int has_permission(int inode_number, int user_id, unsigned int required_permission) {
+    if (inode_number < 0 || inode_number >= superblock->inode_table_size) {
+        return 0;
+    }
+
+    Inode *inode = &inode_table[inode_number];
+
+    // The generation is read first, so a change made while the answer is worked out retires it
+    guint generation = g_atomic_int_get((gint *)&perm_generations[inode_number]);
+    PermCacheEntry *cache = perm_cache_get();
+    PermCacheEntry *entry = cache == NULL ? NULL :
+                            &cache[((unsigned int)inode_number * 2654435761u ^ (unsigned int)user_id * 40503u) & (PERM_CACHE_SIZE - 1)];
+    if (entry != NULL && entry->inode_number == inode_number && entry->user_id == user_id && entry->generation == generation &&
+        entry->epoch == perm_mount_epoch) {
+        return (entry->permissions & required_permission) == required_permission;
+    }
+
+    // Check the base permissions
+    unsigned int permissions = 0;
+    if (user_id == inode->owner_id) {
+        permissions = (inode->mode >> 6) & 0x7; // Owner permissions
+    } else if (user_id == inode->group_id) {
+        permissions = (inode->mode >> 3) & 0x7; // Group permissions
+    } else {
+        permissions = inode->mode & 0x7; // Others permissions
+    }
+
+    // Check ACL permissions
+    permissions |= get_acl_permissions(inode_number, user_id);
+
+    if (entry != NULL) {
+        entry->inode_number = inode_number;
+        entry->user_id = user_id;
+        entry->generation = generation;
+        entry->epoch = perm_mount_epoch;
+        entry->permissions = permissions;
+    }
+    return (permissions & required_permission) == required_permission;
+}
+
+
+
+
+void free_memory() {
+
+    // The hot list is read from the dentry cache before it is dropped
+    prefetch_stop();
+    hotlist_save();
+
+    // Pooled numbers go back to the bitmaps while they are still mapped
+    alloc_pools_drain();
+    if (directory_cache != NULL) {
+        for (int i = 0; i < superblock->inode_table_size; i++) {
+            dir_release(i);
+        }
+        free(directory_cache);
+        directory_cache = NULL;
+    }
+    name_index_reset();
+    if (inode_locks != NULL) {
+        for (int i = 0; i < superblock->inode_table_size; i++) {
+            g_rw_lock_clear(&inode_locks[i]);
+        }
+        free(inode_locks);
+        inode_locks = NULL;
+    }
+    free(perm_generations);
+    perm_generations = NULL;
+    free(acl_blocks);
+    acl_blocks = NULL;
+    acl_blocks_size = 0;
+    acl_blocks_used = 0;
+    free(fragment_used);
+    fragment_used = NULL;
+    free(fragment_partial);
+    fragment_partial = NULL;
+    fragment_partial_count = 0;
+    fragment_partial_capacity = 0;
+    free(dedup_blocks);
+    dedup_blocks = NULL;
+    dedup_blocks_size = 0;
+    dedup_blocks_used = 0;
+    free(dedup_registered);
+    dedup_registered = NULL;
+    dcache_init();
+
+    if (fs_image != NULL) image_checksum_dirty();
+    image_writeback_stop();
+
+    // Unmapping keeps the contents, they live in the image file
+    if (fs_image != NULL) {
+        image_unmap(fs_image, fs_image_size);
+        fs_image = NULL;
+        superblock = NULL;
+        block_bitmap = NULL;
+        block_refs = NULL;
+        image_checksums = NULL;
+        inode_bitmap = NULL;
+        inode_table = NULL;
+        inode_cold_table = NULL;
+    }
+    if (fs_image_fd != -1) {
+        close(fs_image_fd);
+        fs_image_fd = -1;
+    }
+}
+
+
+
+//first clear bit of `map` in [from, to), or `to` if there is none
+static int bits_next_clear(const uint64_t *map, int from, int to) {
+
+    if (from >= to) return to;
+    int w = from / BITMAP_WORD_BITS;
+    uint64_t bits = ~map[w] & (~0ULL << (from % BITMAP_WORD_BITS));
+    while (bits == 0) {
+        if (++w * BITMAP_WORD_BITS >= to) return to;
+        bits = ~map[w];
+    }
+    int bit = w * BITMAP_WORD_BITS + BITMAP_CTZ(bits);
+    return bit < to ? bit : to;
+}
+
+//first free block in [from, to), or `to` if there is none
+static int bitmap_next_free(int from, int to) {
+
+    return bits_next_clear(block_bitmap, from, to);
+}
+
+//first used block in [from, to), or `to` if there is none
+static int bitmap_next_used(int from, int to) {
+
+    if (from >= to) return to;
+    int w = from / BITMAP_WORD_BITS;
+    uint64_t bits = block_bitmap[w] & (~0ULL << (from % BITMAP_WORD_BITS));
+    while (bits == 0) {
+        if (++w * BITMAP_WORD_BITS >= to) return to;
+        bits = block_bitmap[w];
+    }
+    int block = w * BITMAP_WORD_BITS + BITMAP_CTZ(bits);
+    return block < to ? block : to;
+}
+
+//start of the first run of `count` free blocks in [from, to), or -1
+static int bitmap_find_run(int from, int to, int count) {
+
+    int block = from;
+    while (block < to) {
+        int start = bitmap_next_free(block, to);
+        if (start >= to) break;
+        int end = bitmap_next_used(start, to);
+        if (end - start >= count) return start;
+        block = end;
+    }
+    return -1;
+}
+
+static void bitmap_set_range(int start, int count) {
+
+    while (count > 0) {
+        int w = start / BITMAP_WORD_BITS;
+        int bit = start % BITMAP_WORD_BITS;
+        int span = BITMAP_WORD_BITS - bit < count ? BITMAP_WORD_BITS - bit : count;
+        uint64_t mask = (span == BITMAP_WORD_BITS) ? ~0ULL : (((1ULL << span) - 1) << bit);
+        block_bitmap[w] |= mask;
+        image_mark_dirty(&block_bitmap[w], sizeof(uint64_t));
+        start += span;
+        count -= span;
+    }
+}
+
+//claim up to `max` free blocks from the rotating hint on and store their numbers in out[]; called with
+//bitmap_lock held. Returns how many were claimed
+static int bitmap_claim_blocks(int out[], int max) {
+
+    int got = 0;
+    int block = superblock->next_free_hint;
+    int wrapped = 0;
+    while (got < max && got < superblock->free_blocks) {
+        block = bitmap_next_free(block, superblock->num_blocks);
+        if (block >= superblock->num_blocks) {
+            if (wrapped) break;
+            wrapped = 1;
+            block = 0;
+            continue;
+        }
+        block_bitmap[block / BITMAP_WORD_BITS] |= 1ULL << (block % BITMAP_WORD_BITS);
+        image_mark_dirty(&block_bitmap[block / BITMAP_WORD_BITS], sizeof(uint64_t));
+        out[got++] = block++;
+    }
+    if (got > 0) {
+        superblock->free_blocks -= got;
+        superblock->next_free_hint = block % superblock->num_blocks;
+        superblock_mark_dirty();
+    }
+    return got;
+}
+
+//mark a block free again; called with bitmap_lock held
+static void bitmap_release_block(int block_number) {
+
+    uint64_t mask = 1ULL << (block_number % BITMAP_WORD_BITS);
+    if (block_bitmap[block_number / BITMAP_WORD_BITS] & mask) {
+        block_bitmap[block_number / BITMAP_WORD_BITS] &= ~mask;
+        image_mark_dirty(&block_bitmap[block_number / BITMAP_WORD_BITS], sizeof(uint64_t));
+        superblock->free_blocks++;
+        superblock_mark_dirty();
+    }
+}
+
+//inode counterparts of the two functions above, called with inode_bitmap_lock held
+static int inode_bitmap_claim(int out[], int max) {
+
+    int got = 0;
+    int i = inode_next_free_hint;
+    int wrapped = 0;
+    while (got < max && got < superblock->free_inode_count) {
+        i = bits_next_clear(inode_bitmap, i, superblock->inode_table_size);
+        if (i >= superblock->inode_table_size) {
+            if (wrapped) break;
+            wrapped = 1;
+            i = 0;
+            continue;
+        }
+        inode_bitmap[i / BITMAP_WORD_BITS] |= 1ULL << (i % BITMAP_WORD_BITS);
+        image_mark_dirty(&inode_bitmap[i / BITMAP_WORD_BITS], sizeof(uint64_t));
+        out[got++] = i++;
+    }
+    if (got > 0) {
+        superblock->free_inode_count -= got;
+        inode_next_free_hint = i % superblock->inode_table_size;
+        superblock_mark_dirty();
+    }
+    return got;
+}
+
+static void inode_bitmap_release(int i) {
+
+    uint64_t mask = 1ULL << (i % BITMAP_WORD_BITS);
+    if (inode_bitmap[i / BITMAP_WORD_BITS] & mask) {
+        inode_bitmap[i / BITMAP_WORD_BITS] &= ~mask;
+        image_mark_dirty(&inode_bitmap[i / BITMAP_WORD_BITS], sizeof(uint64_t));
+        superblock->free_inode_count++;
+        superblock_mark_dirty();
+    }
+}
+
+//hand a cache's unused numbers back through `release` under `bitmap`
+static void alloc_cache_return(AllocCache *cache, GMutex *bitmap, void (*release)(int)) {
+
+    if (cache->first == cache->count) return;
+    g_mutex_lock(bitmap);
+    for (int i = cache->first; i < cache->count; i++) {
+        release(cache->numbers[i]);
+    }
+    g_mutex_unlock(bitmap);
+    cache->first = cache->count = 0;
+}
+
+//return one pool's unused numbers to the bitmaps
+static void alloc_pool_drain(AllocPool *pool) {
+
+    g_mutex_lock(&pool->lock);
+    alloc_cache_return(&pool->blocks, &bitmap_lock, bitmap_release_block);
+    alloc_cache_return(&pool->inodes, &inode_bitmap_lock, inode_bitmap_release);
+    g_mutex_unlock(&pool->lock);
+}
+
+//return every thread's unused numbers to the bitmaps, before unmapping or when a bitmap runs dry
+void alloc_pools_drain() {
+
+    g_mutex_lock(&alloc_pools_lock);
+    for (AllocPool *pool = alloc_pools; pool != NULL; pool = pool->next) {
+        alloc_pool_drain(pool);
+    }
+    g_mutex_unlock(&alloc_pools_lock);
+}
+
+//thread exit: give the pool's numbers back and unregister it
+static void alloc_pool_release(gpointer data) {
+
+    AllocPool *pool = data;
+    g_mutex_lock(&alloc_pools_lock);
+    AllocPool **link = &alloc_pools;
+    while (*link != pool) {
+        link = &(*link)->next;
+    }
+    *link = pool->next;
+    alloc_pool_drain(pool);
+    g_mutex_unlock(&alloc_pools_lock);
+    g_mutex_clear(&pool->lock);
+    free(pool);
+}
+
+static GPrivate alloc_pool_key = G_PRIVATE_INIT(alloc_pool_release);
+
+//the calling thread's pool, created on first use; NULL if it cannot be allocated
+static AllocPool *alloc_pool_get() {
+
+    AllocPool *pool = g_private_get(&alloc_pool_key);
+    if (pool != NULL) return pool;
+
+    pool = calloc(1, sizeof(AllocPool));
+    if (pool == NULL) return NULL;
+    g_mutex_init(&pool->lock);
+    pool->blocks.capacity = ALLOC_POOL_BLOCKS;
+    pool->inodes.capacity = ALLOC_POOL_INODES;
+    g_mutex_lock(&alloc_pools_lock);
+    pool->next = alloc_pools;
+    alloc_pools = pool;
+    g_mutex_unlock(&alloc_pools_lock);
+    g_private_set(&alloc_pool_key, pool);
+    return pool;
+}
+
+//one block (`inodes` == 0) or inode number for the calling thread: from its pool, refilled a batch at a time,
+//or straight from the bitmap once every pool has returned its reserve. Returns -1 when none is left
+static int alloc_pool_take_locked(int inodes) {
+
+    GMutex *bitmap = inodes ? &inode_bitmap_lock : &bitmap_lock;
+    int (*claim)(int[], int) = inodes ? inode_bitmap_claim : bitmap_claim_blocks;
+    int number = -1;
+
+    AllocPool *pool = alloc_pool_get();
+    if (pool != NULL) {
+        g_mutex_lock(&pool->lock);
+        AllocCache *cache = inodes ? &pool->inodes : &pool->blocks;
+        if (cache->first == cache->count) {
+            g_mutex_lock(bitmap);
+            cache->count = claim(cache->numbers, cache->capacity);
+            g_mutex_unlock(bitmap);
+            cache->first = 0;
+        }
+        if (cache->first < cache->count) {
+            number = cache->numbers[cache->first++];
+        }
+        g_mutex_unlock(&pool->lock);
+        if (number != -1) return number;
+
+        // The bitmap ran dry; take back what other threads still hold in reserve
+        alloc_pools_drain();
+    }
+
+    g_mutex_lock(bitmap);
+    if (claim(&number, 1) == 0) number = -1;
+    g_mutex_unlock(bitmap);
+    return number;
+}
+
+static int alloc_pool_take(int inodes) {
+
+    STATS_START(start);
+    int number = alloc_pool_take_locked(inodes);
+    STATS_END(STAT_ALLOC, start);
+    return number;
+}
+
+int allocate_block() {
+
+    return alloc_pool_take(0);
+}
+
+//allocate `n` contiguous blocks, store their numbers in out[] (unless it is NULL) and return the first one, or -1
+int allocate_blocks(int n, int out[]) {
+
+    STATS_START(start);
+    g_mutex_lock(&bitmap_lock);
+    int run = -1;
+    if (n > 0 && n <= superblock->free_blocks) {
+        int hint = superblock->next_free_hint;
+        run = bitmap_find_run(hint, superblock->num_blocks, n);
+        if (run < 0) {
+            // Wrap around; the second pass overlaps the hint so runs straddling it are still found
+            int limit = hint + n - 1 < superblock->num_blocks ? hint + n - 1 : superblock->num_blocks;
+            run = bitmap_find_run(0, limit, n);
+        }
+    }
+    if (run < 0) {
+        g_mutex_unlock(&bitmap_lock);
+        STATS_END(STAT_ALLOC, start);
+        return -1;
+    }
+
+    bitmap_set_range(run, n);
+    superblock->free_blocks -= n;
+    superblock->next_free_hint = (run + n) % superblock->num_blocks;
+    superblock_mark_dirty();
+    g_mutex_unlock(&bitmap_lock);
+    for (int i = 0; out != NULL && i < n; i++) {
+        out[i] = run + i;
+    }
+    STATS_END(STAT_ALLOC, start);
+    return run;
+}
+
+//claim up to `n` inode numbers in one pass over the inode bitmap, for a batch that creates many inodes.
+//create_inode_at takes them like pooled ones, release_inodes returns the ones left over. Returns how many were claimed
+int allocate_inodes(int n, int out[]) {
+
+    STATS_START(start);
+    g_mutex_lock(&inode_bitmap_lock);
+    int got = inode_bitmap_claim(out, n);
+    g_mutex_unlock(&inode_bitmap_lock);
+    if (got < n) {
+        // Take back what other threads still hold in reserve
+        alloc_pools_drain();
+        g_mutex_lock(&inode_bitmap_lock);
+        got += inode_bitmap_claim(out + got, n - got);
+        g_mutex_unlock(&inode_bitmap_lock);
+    }
+    STATS_END(STAT_ALLOC, start);
+    return got;
+}
+
+//give back the numbers from allocate_inodes that no inode was created at
+void release_inodes(const int numbers[], int n) {
+
+    g_mutex_lock(&inode_bitmap_lock);
+    for (int i = 0; i < n; i++) {
+        if (inode_cold(numbers[i])->nlink == 0) inode_bitmap_release(numbers[i]);
+    }
+    g_mutex_unlock(&inode_bitmap_lock);
+}
+
+//Dedup registry, on volumes with FS_FEATURE_DEDUP: data blocks a file wrote whole, by the crc32c of their
+//bytes, so a later whole-block write of the same bytes takes a reference instead of a block. It covers only
+//blocks written since the mount and lives in memory. A registered block counts as shared (block_shared), so
+//its own file copies it before changing it and the registered bytes stay what they were. Everything here is
+//called with bitmap_lock held
+
+static void dedup_blocks_put(uint32_t hash, int block) {
+
+    int pos = hash & (dedup_blocks_size - 1);
+    while (dedup_blocks[pos].block >= 0) {
+        pos = (pos + 1) & (dedup_blocks_size - 1);
+    }
+    if (dedup_blocks[pos].block == -1) dedup_blocks_used++;
+    dedup_blocks[pos].hash = hash;
+    dedup_blocks[pos].block = block;
+    g_atomic_int_set(&dedup_registered[block], pos);
+}
+
+//double the registry, dropping removed slots
+static int dedup_blocks_grow() {
+
+    DedupSlot *old = dedup_blocks;
+    int old_size = dedup_blocks_size;
+    int size = old_size ? old_size * 2 : 1024;
+    dedup_blocks = malloc(size * sizeof(DedupSlot));
+    if (dedup_blocks == NULL) {
+        dedup_blocks = old;
+        return -1;
+    }
+    dedup_blocks_size = size;
+    dedup_blocks_used = 0;
+    for (int i = 0; i < size; i++) {
+        dedup_blocks[i].block = -1;
+    }
+    for (int i = 0; i < old_size; i++) {
+        if (old[i].block >= 0) dedup_blocks_put(old[i].hash, old[i].block);
+    }
+    free(old);
+    return 0;
+}
+
+static int dedup_init() {
+
+    if (dedup_registered != NULL) return 0;
+    gint *registered = malloc((size_t)superblock->num_blocks * sizeof(gint));
+    if (registered == NULL) return -1;
+    memset(registered, 0xff, (size_t)superblock->num_blocks * sizeof(gint));
+    dedup_registered = registered;
+    return dedup_blocks_grow();
+}
+
+//registered block holding exactly these bytes, or -1
+static int dedup_blocks_find(const char *data, uint32_t hash) {
+
+    if (dedup_blocks == NULL) return -1;
+    int pos = hash & (dedup_blocks_size - 1);
+    while (dedup_blocks[pos].block != -1) {
+        const DedupSlot *slot = &dedup_blocks[pos];
+        if (slot->block >= 0 && slot->hash == hash && memcmp(block_data(slot->block), data, superblock->block_size) == 0) {
+            return slot->block;
+        }
+        pos = (pos + 1) & (dedup_blocks_size - 1);
+    }
+    return -1;
+}
+
+//register a block its file has just written whole with bytes hashing to `hash`, unless an equal one already is
+static void dedup_add(int block_number, uint32_t hash) {
+
+    if (dedup_init() != 0 || dedup_registered[block_number] != -1 || dedup_blocks_find(block_data(block_number), hash) != -1) return;
+    if ((dedup_blocks_used + 1) * 2 > dedup_blocks_size && dedup_blocks_grow() != 0) return;
+    dedup_blocks_put(hash, block_number);
+}
+
+//a freed block leaves the registry
+static void dedup_forget(int block_number) {
+
+    if (dedup_registered == NULL || dedup_registered[block_number] == -1) return;
+    dedup_blocks[dedup_registered[block_number]].block = -2;
+    g_atomic_int_set(&dedup_registered[block_number], -1);
+}
+
+//drop one reference to a block; called with bitmap_lock held
+static void block_put(int block_number) {
+
+    if (block_number <= 0 || block_number >= superblock->num_blocks) return;
+    if (block_refs[block_number] > 0) {
+        g_atomic_int_set((gint *)&block_refs[block_number], (gint)block_refs[block_number] - 1);
+        image_mark_dirty(&block_refs[block_number], sizeof(uint32_t));
+    } else {
+        dedup_forget(block_number);
+        bitmap_release_block(block_number);
+    }
+}
+
+//drop one reference to a block; it becomes free once no file shares it any more
+void free_block(int block_number) {
+
+    g_mutex_lock(&bitmap_lock);
+    block_put(block_number);
+    g_mutex_unlock(&bitmap_lock);
+}
+
+//free_block for `n` blocks under a single bitmap_lock hold, so freeing a large file or a whole tree does
+//not take the lock once per block. The blocks are released in order, a block listed twice loses two references
+void free_blocks(const int blocks[], int n) {
+
+    if (n <= 0) return;
+    g_mutex_lock(&bitmap_lock);
+    for (int i = 0; i < n; i++) {
+        block_put(blocks[i]);
+    }
+    g_mutex_unlock(&bitmap_lock);
+}
+
+static void block_batch_flush(BlockBatch *batch) {
+
+    free_blocks(batch->blocks, batch->count);
+    batch->count = 0;
+}
+
+//queue a block to be freed with the batch, which is flushed once it is full
+static void block_batch_add(BlockBatch *batch, int block_number) {
+
+    batch->blocks[batch->count++] = block_number;
+    if (batch->count == BLOCK_BATCH_MAX) block_batch_flush(batch);
+}
+
+//add a reference to a block another file now shares; called with bitmap_lock held
+static void block_ref(int block_number) {
+
+    g_atomic_int_set((gint *)&block_refs[block_number], (gint)block_refs[block_number] + 1);
+    image_mark_dirty(&block_refs[block_number], sizeof(uint32_t));
+}
+
+int allocate_index_block() {
+
+    return allocate_block();
+}
+
+void free_index_block(int block_number) {
+
+    free_block(block_number);
+}
+
+//empty block map; slots never used since the format hold zeroes instead
+static void inode_clear_map(Inode *inode) {
+
+    memset(inode->direct_blocks, -1, sizeof(inode->direct_blocks));
+    inode->index_block = -1;
+    inode->double_index_block = -1;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->flags = 0;
+}
+
+int create_inode(int is_directory, unsigned int mode, int owner_id, int group_id) {
+
+    int i = alloc_pool_take(1);
+    if (i == -1) {
+        printf("No free inodes available\n");
+        return -1;
+    }
+    return create_inode_at(i, is_directory, mode, owner_id, group_id);
+}
+
+//initialize a specific free inode, used by replay to give a node back the number it was journaled with
+int create_inode_at(int i, int is_directory, unsigned int mode, int owner_id, int group_id) {
+
+    if (i < 0 || i >= superblock->inode_table_size || inode_cold(i)->nlink != 0 || snapshot_preserve(i) != 0) {
+        return -1;
+    }
+    // Numbers from a pool are already claimed in the inode bitmap, the ones replay asks for may not be
+    g_mutex_lock(&inode_bitmap_lock);
+    if (!(inode_bitmap[i / BITMAP_WORD_BITS] & (1ULL << (i % BITMAP_WORD_BITS)))) {
+        inode_bitmap[i / BITMAP_WORD_BITS] |= 1ULL << (i % BITMAP_WORD_BITS);
+        image_mark_dirty(&inode_bitmap[i / BITMAP_WORD_BITS], sizeof(uint64_t));
+        superblock->free_inode_count--;
+    }
+    g_mutex_unlock(&inode_bitmap_lock);
+    inode_table[i].is_directory = is_directory;
+    inode_table[i]._size = 0;
+    inode_table[i].mode = mode;
+    inode_table[i].owner_id = owner_id;
+    inode_table[i].group_id = group_id;
+    inode_clear_map(&inode_table[i]);
+    inode_mark_dirty(&inode_table[i]);
+    InodeCold *cold = inode_cold(i);
+    cold->atime = cold->mtime = cold->ctime = time(NULL);
+    cold->acl_count = 0;
+    cold->nlink = 1;
+    cold->parent_inode = ROOT_INODE;
+    inode_cold_mark_dirty(cold);
+    superblock_mark_dirty();
+    perm_invalidate(i);
+    return i;
+}
+
+
+
+//Small files: one of up to INODE_INLINE_MAX bytes keeps them in the inode, in place of its block map, and one
+//of up to FRAGMENT_FILE_MAX bytes in a run of fragment slots of a block it shares with other small files. Which
+//slots are taken is not stored on disk, fragment_used is rebuilt from the inode table when first needed. So
+//only inodes of inode_table hold fragments; a snapshot's copy of such a file gets a data block of its own
+
+//slots a file of `size` bytes takes
+static int fragment_count(int64_t size) {
+
+    int fragment_size = FRAGMENT_SIZE(superblock->block_size);
+    return (int)((size + fragment_size - 1) / fragment_size);
+}
+
+static uint8_t fragment_mask(int first, int count) {
+
+    return (uint8_t)(((1u << count) - 1) << first);
+}
+
+static char *fragment_data(int address) {
+
+    return block_data(address / FRAGMENTS_PER_BLOCK) + (size_t)(address % FRAGMENTS_PER_BLOCK) * FRAGMENT_SIZE(superblock->block_size);
+}
+
+//where a regular file of `size` bytes belongs: INODE_INLINE, INODE_FRAGMENT, or 0 for data blocks. An empty
+//file maps nothing either way and is kept as 0
+static int inode_storage(int64_t size) {
+
+    if (size == 0) return 0;
+    if (size <= INODE_INLINE_MAX) return INODE_INLINE;
+    return size <= FRAGMENT_FILE_MAX(superblock->block_size) ? INODE_FRAGMENT : 0;
+}
+
+//the bytes of a file with INODE_INLINE or INODE_FRAGMENT set
+static char *inode_packed_data(Inode *inode) {
+
+    return inode->flags & INODE_INLINE ? inode->inline_data : fragment_data(inode->fragment);
+}
+
+static void inode_packed_mark_dirty(Inode *inode, int64_t offset, int64_t length) {
+
+    if (length <= 0) return;
+    if (inode->flags & INODE_INLINE) {
+        inode_mark_dirty(inode);
+    } else {
+        image_mark_dirty(inode_packed_data(inode) + offset, (size_t)length);
+    }
+}
+
+//called with fragment_lock held; a block that does not fit is only found again once it was emptied
+static void fragment_partial_push(int block) {
+
+    if (fragment_partial_count == fragment_partial_capacity) {
+        int capacity = fragment_partial_capacity == 0 ? 64 : fragment_partial_capacity * 2;
+        int *grown = realloc(fragment_partial, (size_t)capacity * sizeof(int));
+        if (grown == NULL) return;
+        fragment_partial = grown;
+        fragment_partial_capacity = capacity;
+    }
+    fragment_partial[fragment_partial_count++] = block;
+}
+
+//called with fragment_lock held
+static int fragments_init() {
+
+    if (fragment_used != NULL) return 0;
+    fragment_used = calloc((size_t)superblock->num_blocks, 1);
+    if (fragment_used == NULL) return -1;
+    for (int i = 0; i < superblock->inode_table_size; i++) {
+        const Inode *inode = &inode_table[i];
+        if (inode_cold(i)->nlink == 0 || !(inode->flags & INODE_FRAGMENT)) continue;
+        fragment_used[inode->fragment / FRAGMENTS_PER_BLOCK] |=
+            fragment_mask(inode->fragment % FRAGMENTS_PER_BLOCK, fragment_count(inode->_size));
+    }
+    for (int b = 0; b < superblock->num_blocks; b++) {
+        if (fragment_used[b] != 0 && fragment_used[b] != FRAGMENT_FULL) fragment_partial_push(b);
+    }
+    return 0;
+}
+
+//first slot of `count` adjacent free ones in a block whose taken slots are `used`, or -1
+static int fragment_find_run(uint8_t used, int count) {
+
+    for (int first = 0; first + count <= FRAGMENTS_PER_BLOCK; first++) {
+        if (!(used & fragment_mask(first, count))) return first;
+    }
+    return -1;
+}
+
+//claim `count` adjacent fragment slots, in one of the newest partly used blocks or else a new one. Returns the
+//address of the first, or -1 if the volume is full
+static int fragment_alloc(int count) {
+
+    g_mutex_lock(&fragment_lock);
+    int address = -1;
+    if (fragments_init() == 0) {
+        for (int p = fragment_partial_count - 1; address == -1 && p >= 0 && p >= fragment_partial_count - FRAGMENT_SEARCH_MAX; p--) {
+            int block = fragment_partial[p];
+            int first = fragment_find_run(fragment_used[block], count);
+            if (first == -1) continue;
+            fragment_used[block] |= fragment_mask(first, count);
+            if (fragment_used[block] == FRAGMENT_FULL) fragment_partial[p] = fragment_partial[--fragment_partial_count];
+            address = block * FRAGMENTS_PER_BLOCK + first;
+        }
+        int block = address == -1 ? allocate_block() : -1;
+        if (block != -1) {
+            fragment_used[block] = fragment_mask(0, count);
+            if (fragment_used[block] != FRAGMENT_FULL) fragment_partial_push(block);
+            address = block * FRAGMENTS_PER_BLOCK;
+        }
+    }
+    g_mutex_unlock(&fragment_lock);
+    return address;
+}
+
+//give back `count` slots from `address` on; a block left with none taken is freed
+static void fragment_free(int address, int count) {
+
+    g_mutex_lock(&fragment_lock);
+    if (fragments_init() == 0) {
+        int block = address / FRAGMENTS_PER_BLOCK;
+        int was_full = fragment_used[block] == FRAGMENT_FULL;
+        fragment_used[block] &= (uint8_t)~fragment_mask(address % FRAGMENTS_PER_BLOCK, count);
+        if (fragment_used[block] == 0) {
+            for (int p = fragment_partial_count - 1; p >= 0; p--) {
+                if (fragment_partial[p] == block) {
+                    fragment_partial[p] = fragment_partial[--fragment_partial_count];
+                    break;
+                }
+            }
+            free_block(block);
+        } else if (was_full) {
+            fragment_partial_push(block);
+        }
+    }
+    g_mutex_unlock(&fragment_lock);
+}
+
+//move the bytes of a packed or empty file to where a file of `size` bytes belongs (see inode_storage): the
+//inode, a fragment run of the right length, or its first data block once it outgrows both. What lies between
+//the old and the new size reads as zeroes. Returns 0, or -1 if the volume is full, the file is then unchanged
+static int inode_repack(Inode *inode, int64_t size) {
+
+    int storage = inode_storage(size);
+    int64_t keep = inode->_size < size ? inode->_size : size;
+    if (storage == 0 && inode->flags == 0) return 0;
+    if (storage == inode->flags && (storage == INODE_INLINE || fragment_count(size) == fragment_count(inode->_size))) {
+        if (size > inode->_size) {
+            memset(inode_packed_data(inode) + keep, 0, (size_t)(size - keep));
+            inode_packed_mark_dirty(inode, keep, size - keep);
+        }
+        return 0;
+    }
+
+    const char *from = inode->flags != 0 ? inode_packed_data(inode) : NULL;
+    int old_fragment = inode->flags & INODE_FRAGMENT ? inode->fragment : -1;
+    int old_count = old_fragment != -1 ? fragment_count(inode->_size) : 0;
+    if (storage == INODE_INLINE) {
+        // An empty file or a shrinking fragment file; the bytes are copied out before the map is reused
+        char bytes[INODE_INLINE_MAX];
+        if (keep > 0) memcpy(bytes, from, (size_t)keep);
+        inode_clear_map(inode);
+        memset(inode->inline_data, 0, sizeof(inode->inline_data));
+        if (keep > 0) memcpy(inode->inline_data, bytes, (size_t)keep);
+    } else if (storage == INODE_FRAGMENT) {
+        int address = fragment_alloc(fragment_count(size));
+        if (address == -1) return -1;
+        char *to = fragment_data(address);
+        if (keep > 0) memcpy(to, from, (size_t)keep);
+        memset(to + keep, 0, (size_t)(size - keep));
+        image_mark_dirty(to, (size_t)size);
+        inode_clear_map(inode);
+        inode->fragment = address;
+    } else if (size == 0) {
+        inode_clear_map(inode);
+    } else {
+        int block = allocate_block();
+        if (block == -1) return -1;
+        memcpy(block_data(block), from, (size_t)keep);
+        memset(block_data(block) + keep, 0, superblock->block_size - (size_t)keep);
+        image_mark_dirty(block_data(block), superblock->block_size);
+        inode_clear_map(inode);
+        inode->direct_blocks[0] = block;
+    }
+    if (old_fragment != -1) fragment_free(old_fragment, old_count);
+    inode->flags = (uint16_t)storage;
+    inode_mark_dirty(inode);
+    return 0;
+}
+
+
+
+//largest file the block map can address
+int64_t inode_max_size() {
+
+    int64_t per_block = INDEX_ENTRIES_PER_BLOCK;
+    return (DIRECT_BLOCKS + per_block + per_block * per_block) * superblock->block_size;
+}
+
+//data block for `file_block` from the inode's extents, or -1. *run gets the blocks left in that extent
+static int inode_extent_find(const Inode *inode, int64_t file_block, int64_t *run) {
+
+    for (int i = 0; i < INODE_EXTENTS; i++) {
+        const Extent *e = &inode->extents[i];
+        if (e->length > 0 && file_block >= e->file_block && file_block < (int64_t)e->file_block + e->length) {
+            if (run) *run = e->file_block + e->length - file_block;
+            return e->start + (int)(file_block - e->file_block);
+        }
+    }
+    return -1;
+}
+
+//map up to `want` unmapped file blocks from `file_block` on through an extent: grow the extent that ends
+//at file_block while the data blocks after it are free, or with `may_start` set open a new extent on a
+//contiguous run. New blocks are zero-filled. Returns the data block for file_block, or -1
+static int inode_extent_alloc(Inode *inode, int64_t file_block, int want, int may_start) {
+
+    if (file_block > INT_MAX - (int64_t)want) return -1; // extents hold int file block numbers
+    Extent *unused = NULL;
+    for (int i = 0; i < INODE_EXTENTS; i++) {
+        Extent *e = &inode->extents[i];
+        if (e->length == 0) {
+            if (unused == NULL) unused = e;
+        } else if ((int64_t)e->file_block + e->length == file_block) {
+            int next = e->start + e->length;
+            int limit = (int64_t)next + want < superblock->num_blocks ? next + want : superblock->num_blocks;
+            g_mutex_lock(&bitmap_lock);
+            int got = bitmap_next_used(next, limit) - next;
+            if (got > 0) {
+                bitmap_set_range(next, got);
+                superblock->free_blocks -= got;
+                superblock_mark_dirty();
+            }
+            g_mutex_unlock(&bitmap_lock);
+            if (got <= 0) continue;
+            memset(block_data(next), 0, (size_t)got * superblock->block_size);
+            image_mark_dirty(block_data(next), (size_t)got * superblock->block_size);
+            e->length += got;
+            inode_mark_dirty(inode);
+            return next;
+        }
+    }
+    if (unused == NULL || !may_start) return -1;
+
+    // Take the longest run up to `want` blocks, halving the request until one fits
+    g_mutex_lock(&bitmap_lock);
+    int n = want < superblock->free_blocks ? want : superblock->free_blocks;
+    g_mutex_unlock(&bitmap_lock);
+    int start = -1;
+    while (n > 0 && (start = allocate_blocks(n, NULL)) == -1) {
+        n /= 2;
+    }
+    if (start == -1) return -1;
+    memset(block_data(start), 0, (size_t)n * superblock->block_size);
+    image_mark_dirty(block_data(start), (size_t)n * superblock->block_size);
+    unused->file_block = (int)file_block;
+    unused->start = start;
+    unused->length = n;
+    inode_mark_dirty(inode);
+    return start;
+}
+
+//entry `i` of the index block `*index_block`, allocating it with every entry -1 when `allocate` is set
+static int *index_entry(int *index_block, int64_t i, int allocate) {
+
+    if (*index_block == -1) {
+        if (!allocate) return NULL;
+        int block = allocate_index_block();
+        if (block == -1) return NULL;
+        memset(block_data(block), 0xff, superblock->block_size);
+        image_mark_dirty(block_data(block), superblock->block_size);
+        *index_block = block;
+        image_mark_dirty(index_block, sizeof(*index_block));
+    }
+    return (int *)block_data(*index_block) + i;
+}
+
+//block map slot holding the data block of `file_block`: a direct pointer, an entry of the index block,
+//or an entry of an index block listed in the double index block. NULL if out of range or, when
+//`allocate` is set, if an index block could not be allocated
+static int *inode_block_slot(Inode *inode, int64_t file_block, int allocate) {
+
+    int64_t per_block = INDEX_ENTRIES_PER_BLOCK;
+    if (file_block < DIRECT_BLOCKS) return &inode->direct_blocks[file_block];
+
+    file_block -= DIRECT_BLOCKS;
+    if (file_block < per_block) return index_entry(&inode->index_block, file_block, allocate);
+
+    file_block -= per_block;
+    if (file_block >= per_block * per_block) return NULL;
+    int *index_block = index_entry(&inode->double_index_block, file_block / per_block, allocate);
+    if (index_block == NULL) return NULL;
+    return index_entry(index_block, file_block % per_block, allocate);
+}
+
+//data block holding block `file_block` of a file, or -1 for a hole. *run (if not NULL) receives how many
+//file blocks from file_block on continue contiguously in the same extent, 1 for block map entries.
+//With `allocate` > 0 a missing block is allocated and zero-filled; at the end of the file up to
+//`allocate` blocks are taken as one extent. -1 then means the volume is full
+int inode_bmap(Inode *inode, int64_t file_block, int allocate, int64_t *run) {
+
+    if (run) *run = 1;
+    if (file_block < 0) return -1;
+    int block = inode_extent_find(inode, file_block, run);
+    if (block != -1) return block;
+
+    int *slot = inode_block_slot(inode, file_block, 0);
+    if (slot != NULL && *slot != -1) return *slot;
+    if (allocate <= 0 || file_block * superblock->block_size >= inode_max_size()) return -1;
+
+    // Nothing is mapped past the last block of the file, so appends may claim a whole run at once
+    int64_t end_block = (inode->_size + superblock->block_size - 1) / superblock->block_size;
+    int append = file_block >= end_block;
+    block = inode_extent_alloc(inode, file_block, append ? allocate : 1, append);
+    if (block != -1) {
+        inode_extent_find(inode, file_block, run);
+        return block;
+    }
+
+    slot = inode_block_slot(inode, file_block, 1);
+    if (slot == NULL) return -1;
+    block = allocate_block();
+    if (block == -1) return -1;
+    memset(block_data(block), 0, superblock->block_size);
+    image_mark_dirty(block_data(block), superblock->block_size);
+    *slot = block;
+    image_mark_dirty(slot, sizeof(*slot));
+    return block;
+}
+
+//queue the blocks listed in an index block from entry `first` on, and the index block itself if `first` is 0
+static void free_index_entries(int *index_block, int64_t first, BlockBatch *batch) {
+
+    if (*index_block == -1) return;
+    int *index = (int *)block_data(*index_block);
+    image_mark_dirty(index, superblock->block_size);
+    for (int64_t i = first; i < INDEX_ENTRIES_PER_BLOCK; i++) {
+        if (index[i] != -1) {
+            block_batch_add(batch, index[i]);
+            index[i] = -1;
+        }
+    }
+    if (first == 0) {
+        block_batch_add(batch, *index_block);
+        *index_block = -1;
+        image_mark_dirty(index_block, sizeof(*index_block));
+    }
+}
+
+//inode_free_blocks with the blocks queued in `batch`; the map is cleared at once, the blocks are freed
+//when the batch is flushed
+static void inode_release_blocks(Inode *inode, int64_t first_block, BlockBatch *batch) {
+
+    int64_t per_block = INDEX_ENTRIES_PER_BLOCK;
+    inode_mark_dirty(inode);
+    if (inode->flags != 0) {
+        // A small file's bytes fit in its first block's worth, they go only with the whole file
+        if (first_block == 0 && (inode->flags & INODE_FRAGMENT)) fragment_free(inode->fragment, fragment_count(inode->_size));
+        if (first_block == 0) inode_clear_map(inode);
+        return;
+    }
+    for (int i = 0; i < INODE_EXTENTS; i++) {
+        Extent *e = &inode->extents[i];
+        if (e->length == 0 || (int64_t)e->file_block + e->length <= first_block) continue;
+        int keep = first_block > e->file_block ? (int)(first_block - e->file_block) : 0;
+        for (int b = keep; b < e->length; b++) {
+            block_batch_add(batch, e->start + b);
+        }
+        e->length = keep;
+    }
+
+    for (int64_t b = first_block; b < DIRECT_BLOCKS; b++) {
+        if (inode->direct_blocks[b] != -1) {
+            block_batch_add(batch, inode->direct_blocks[b]);
+            inode->direct_blocks[b] = -1;
+        }
+    }
+
+    int64_t first = first_block > DIRECT_BLOCKS ? first_block - DIRECT_BLOCKS : 0;
+    free_index_entries(&inode->index_block, first < per_block ? first : per_block, batch);
+
+    if (inode->double_index_block == -1) return;
+    first = first > per_block ? first - per_block : 0;
+    int *outer = (int *)block_data(inode->double_index_block);
+    for (int64_t i = first / per_block; i < per_block; i++) {
+        free_index_entries(&outer[i], i == first / per_block ? first % per_block : 0, batch);
+    }
+    if (first == 0) {
+        block_batch_add(batch, inode->double_index_block);
+        inode->double_index_block = -1;
+    }
+}
+
+//free every data block at file block `first_block` and beyond, and the index blocks that no longer map anything
+void inode_free_blocks(Inode *inode, int64_t first_block) {
+
+    BlockBatch batch;
+    batch.count = 0;
+    inode_release_blocks(inode, first_block, &batch);
+    block_batch_flush(&batch);
+}
+
+//move an extent's blocks into the block map, so single blocks of the run can be remapped. Returns 0, or -1
+//if an index block could not be allocated, in which case the extent is kept
+static int inode_extent_demote(Inode *inode, Extent *e) {
+
+    for (int b = 0; b < e->length; b++) {
+        int *slot = inode_block_slot(inode, (int64_t)e->file_block + b, 1);
+        if (slot == NULL) {
+            while (b-- > 0) {
+                slot = inode_block_slot(inode, (int64_t)e->file_block + b, 0);
+                *slot = -1;
+                image_mark_dirty(slot, sizeof(*slot));
+            }
+            return -1;
+        }
+        *slot = e->start + b;
+        image_mark_dirty(slot, sizeof(*slot));
+    }
+    e->length = 0;
+    inode_mark_dirty(inode);
+    return 0;
+}
+
+//copy-on-write: before file block `file_block` is written, give the file its own copy of the shared data
+//block `block` mapping it. An extent holding the block is moved into the block map first, since the copy
+//breaks its run. Returns the new data block, or -1 if the volume is full
+static int inode_unshare_block(Inode *inode, int64_t file_block, int block) {
+
+    int copy = allocate_block();
+    if (copy == -1) return -1;
+    for (int i = 0; i < INODE_EXTENTS; i++) {
+        Extent *e = &inode->extents[i];
+        if (e->length > 0 && file_block >= e->file_block && file_block < (int64_t)e->file_block + e->length) {
+            if (inode_extent_demote(inode, e) != 0) {
+                free_block(copy);
+                return -1;
+            }
+            break;
+        }
+    }
+
+    memcpy(block_data(copy), block_data(block), superblock->block_size);
+    image_mark_dirty(block_data(copy), superblock->block_size);
+    int *slot = inode_block_slot(inode, file_block, 0);
+    *slot = copy;
+    image_mark_dirty(slot, sizeof(*slot));
+    free_block(block); // the other files keep their reference
+    return copy;
+}
+
+//blocks from `block` on, out of `count`, that can be written in place before the first shared one
+static int64_t blocks_unshared(int block, int64_t count) {
+
+    int64_t n = 0;
+    while (n < count && !block_shared(block + n)) {
+        n++;
+    }
+    return n;
+}
+
+//map file block `file_block` to `block`, a reference the caller hands over, releasing the block mapped there
+//before. An extent holding the file block is moved into the block map first. Returns 0, or -1 if an index
+//block could not be allocated, nothing is then changed
+static int inode_remap_block(Inode *inode, int64_t file_block, int block) {
+
+    for (int i = 0; i < INODE_EXTENTS; i++) {
+        Extent *e = &inode->extents[i];
+        if (e->length > 0 && file_block >= e->file_block && file_block < (int64_t)e->file_block + e->length) {
+            if (inode_extent_demote(inode, e) != 0) return -1;
+            break;
+        }
+    }
+    int *slot = inode_block_slot(inode, file_block, 1);
+    if (slot == NULL) return -1;
+    int old = *slot;
+    *slot = block;
+    image_mark_dirty(slot, sizeof(*slot));
+    if (old != -1) free_block(old);
+    return 0;
+}
+
+//on a FS_FEATURE_DEDUP volume, a whole block of `data` for file block `file_block` that needs no block of its
+//own: zeroes over a hole leave the hole, and bytes a registered block already holds are shared with it.
+//Returns 1 if the file block is taken care of, or 0 if the bytes must be written, *hash then gets their crc32c
+static int inode_dedup_block(Inode *inode, int64_t file_block, const char *data, uint32_t *hash) {
+
+    int block_size = superblock->block_size;
+    int current = inode_bmap(inode, file_block, 0, NULL);
+    if (current == -1 && (file_block + 1) * block_size <= inode_max_size() && data[0] == 0 &&
+        memcmp(data, data + 1, block_size - 1) == 0) {
+        STATS_COUNT(STAT_ZERO_BLOCK);
+        return 1;
+    }
+
+    *hash = crc32c(0, data, block_size);
+    g_mutex_lock(&bitmap_lock);
+    int block = dedup_blocks_find(data, *hash);
+    if (block != -1 && block != current) block_ref(block);
+    g_mutex_unlock(&bitmap_lock);
+    if (block == -1) return 0;
+    if (block != current && inode_remap_block(inode, file_block, block) != 0) {
+        free_block(block);
+        return 0;
+    }
+    STATS_COUNT(STAT_DEDUP_HIT);
+    return 1;
+}
+
+//copy up to `size` bytes at `offset` out of a file; holes read as zeroes. Returns the bytes read
+int64_t inode_read(int inode_number, char *buf, size_t size, int64_t offset) {
+
+    Inode *inode = &inode_table[inode_number];
+    if (offset < 0 || offset >= inode->_size) return 0;
+    if ((int64_t)size > inode->_size - offset) size = (size_t)(inode->_size - offset);
+    if (inode->flags != 0) {
+        memcpy(buf, inode_packed_data(inode) + offset, size);
+        return (int64_t)size;
+    }
+
+    int block_size = superblock->block_size;
+    size_t done = 0;
+    while (done < size) {
+        int64_t pos = offset + done;
+        size_t within = (size_t)(pos % block_size);
+        int64_t run;
+        int block = inode_bmap(inode, pos / block_size, 0, &run);
+        int64_t span = run * block_size - (int64_t)within; // an extent is copied in one go
+        size_t chunk = span < (int64_t)(size - done) ? (size_t)span : size - done;
+        if (block == -1) {
+            memset(buf + done, 0, chunk);
+        } else {
+            memcpy(buf + done, block_data(block) + within, chunk);
+        }
+        done += chunk;
+    }
+    return (int64_t)done;
+}
+
+//copy `size` bytes into a file at `offset`, allocating blocks as needed. Returns the bytes written,
+//which is short only if the volume filled up or the file reached inode_max_size(), or -1 if nothing was written
+int64_t inode_write(int inode_number, const char *buf, size_t size, int64_t offset) {
+
+    Inode *inode = &inode_table[inode_number];
+    if (offset < 0 || snapshot_preserve(inode_number) != 0) return -1;
+
+    // A file that stays small is written where inode_repack put it, one outgrowing that moves to a data block first
+    int64_t end = offset + (int64_t)size > inode->_size ? offset + (int64_t)size : inode->_size;
+    if (!inode->is_directory && (inode->flags != 0 || inode->_size == 0) && size > 0 && inode_repack(inode, end) != 0) return -1;
+
+    int block_size = superblock->block_size;
+    size_t done = 0;
+    if (inode->flags != 0) {
+        memcpy(inode_packed_data(inode) + offset, buf, size);
+        inode_packed_mark_dirty(inode, offset, (int64_t)size);
+        done = size;
+    }
+    // Deduplicating volumes look at every whole block on its own, before a block is allocated for it
+    int dedup = (superblock->features & FS_FEATURE_DEDUP) && !inode->is_directory;
+    while (done < size) {
+        int64_t pos = offset + done;
+        size_t within = (size_t)(pos % block_size);
+        uint32_t hash = 0;
+        int whole = dedup && within == 0 && size - done >= (size_t)block_size;
+        if (whole && inode_dedup_block(inode, pos / block_size, buf + done, &hash)) {
+            done += block_size;
+            continue;
+        }
+        int64_t wanted = dedup ? 1 : (offset + (int64_t)size - 1) / block_size - pos / block_size + 1;
+        int64_t run;
+        int block = inode_bmap(inode, pos / block_size, wanted < INT_MAX ? (int)wanted : INT_MAX, &run);
+        if (block == -1) break;
+        int64_t span = dedup ? block_size - (int64_t)within : run * block_size - (int64_t)within;
+        size_t chunk = span < (int64_t)(size - done) ? (size_t)span : size - done;
+
+        // Blocks shared with a clone are copied first, the unshared ones before them are written in place
+        int64_t blocks = ((int64_t)within + (int64_t)chunk + block_size - 1) / block_size;
+        int64_t in_place = blocks_unshared(block, blocks);
+        if (in_place == 0) {
+            block = inode_unshare_block(inode, pos / block_size, block);
+            if (block == -1) break;
+            if (chunk > block_size - within) chunk = block_size - within;
+        } else if (in_place < blocks) {
+            chunk = (size_t)(in_place * block_size - (int64_t)within);
+        }
+        memcpy(block_data(block) + within, buf + done, chunk);
+        image_mark_dirty(block_data(block) + within, chunk);
+        if (whole) {
+            g_mutex_lock(&bitmap_lock);
+            dedup_add(block, hash);
+            g_mutex_unlock(&bitmap_lock);
+        }
+        done += chunk;
+    }
+
+    if (done == 0 && size > 0) return -1;
+    if (offset + (int64_t)done > inode->_size) {
+        inode->_size = offset + done;
+        inode_mark_dirty(inode);
+    }
+    inode_cold(inode_number)->mtime = inode_cold(inode_number)->ctime = time(NULL);
+    inode_cold_mark_dirty(inode_cold(inode_number));
+    return (int64_t)done;
+}
+
+//set a file's size; shrinking frees the blocks past the end and zeroes the rest of the last block,
+//growing leaves a hole. A small file is repacked for its new size. Returns 0, or -1 if the size is out
+//of range or the volume is full
+int inode_truncate(int inode_number, int64_t size) {
+
+    Inode *inode = &inode_table[inode_number];
+    if (size < 0 || size > inode_max_size() || snapshot_preserve(inode_number) != 0) return -1;
+
+    if (!inode->is_directory && (inode->flags != 0 || inode->_size == 0)) {
+        if (inode_repack(inode, size) != 0) return -1;
+    } else if (size < inode->_size) {
+        int block_size = superblock->block_size;
+        inode_free_blocks(inode, (size + block_size - 1) / block_size);
+        if (size % block_size != 0) {
+            int block = inode_bmap(inode, size / block_size, 0, NULL);
+            if (block != -1 && block_shared(block)) {
+                block = inode_unshare_block(inode, size / block_size, block);
+            }
+            if (block != -1) {
+                memset(block_data(block) + size % block_size, 0, block_size - size % block_size);
+                image_mark_dirty(block_data(block) + size % block_size, block_size - size % block_size);
+            }
+        }
+    }
+    inode->_size = size;
+    inode_mark_dirty(inode);
+    inode_cold(inode_number)->mtime = inode_cold(inode_number)->ctime = time(NULL);
+    inode_cold_mark_dirty(inode_cold(inode_number));
+    return 0;
+}
+
+
+
+//duplicate the index block `src` into a new block stored in *dst. With `depth` 1 the blocks it lists are index
+//blocks and are duplicated too, the data block numbers are copied as they are. Returns 0, or -1 if the volume
+//is full; what was duplicated so far is left in *dst for clone_index_release
+static int clone_index_block(int src, int *dst, int depth) {
+
+    if (src == -1) return 0;
+    int block = allocate_index_block();
+    if (block == -1) return -1;
+    int *from = (int *)block_data(src);
+    int *to = (int *)block_data(block);
+    if (depth == 0) {
+        memcpy(to, from, superblock->block_size);
+    } else {
+        memset(to, 0xff, superblock->block_size);
+    }
+    image_mark_dirty(to, superblock->block_size);
+    *dst = block;
+
+    for (int64_t i = 0; depth > 0 && i < INDEX_ENTRIES_PER_BLOCK; i++) {
+        if (clone_index_block(from[i], &to[i], depth - 1) != 0) return -1;
+    }
+    return 0;
+}
+
+//free index blocks made by clone_index_block, leaving the data blocks they list alone
+static void clone_index_release(int *index_block, int depth) {
+
+    if (*index_block == -1) return;
+    int *index = (int *)block_data(*index_block);
+    for (int64_t i = 0; depth > 0 && i < INDEX_ENTRIES_PER_BLOCK; i++) {
+        clone_index_release(&index[i], depth - 1);
+    }
+    free_index_block(*index_block);
+    *index_block = -1;
+}
+
+//add a reference to every data block an index block lists, or with `depth` 1 the index blocks it lists;
+//called with bitmap_lock held
+static void block_ref_index(int index_block, int depth) {
+
+    if (index_block == -1) return;
+    int *index = (int *)block_data(index_block);
+    for (int64_t i = 0; i < INDEX_ENTRIES_PER_BLOCK; i++) {
+        if (index[i] == -1) continue;
+        if (depth > 0) {
+            block_ref_index(index[i], depth - 1);
+        } else {
+            block_ref(index[i]);
+        }
+    }
+}
+
+//point `copy`'s block map at `inode`'s data blocks: the extents and direct pointers are copied, the index
+//blocks are duplicated, and every data block gains a reference. Inline bytes are copied with the map, and a
+//fragment file's bytes go to a data block of the copy's own, since only the live table may hold fragments.
+//Returns 0, or -1 if the volume is full, nothing is then changed
+static int inode_share_blocks(const Inode *inode, Inode *copy) {
+
+    if (inode->flags & INODE_INLINE) {
+        memcpy(copy->inline_data, inode->inline_data, sizeof(copy->inline_data));
+        copy->flags = INODE_INLINE;
+        return 0;
+    }
+    if (inode->flags & INODE_FRAGMENT) {
+        int block = allocate_block();
+        if (block == -1) return -1;
+        memcpy(block_data(block), fragment_data(inode->fragment), (size_t)inode->_size);
+        memset(block_data(block) + inode->_size, 0, superblock->block_size - (size_t)inode->_size);
+        image_mark_dirty(block_data(block), superblock->block_size);
+        inode_clear_map(copy);
+        copy->direct_blocks[0] = block;
+        return 0;
+    }
+
+    int index_block = -1;
+    int double_index_block = -1;
+    if (clone_index_block(inode->index_block, &index_block, 0) != 0 ||
+        clone_index_block(inode->double_index_block, &double_index_block, 1) != 0) {
+        clone_index_release(&index_block, 0);
+        clone_index_release(&double_index_block, 1);
+        return -1;
+    }
+
+    g_mutex_lock(&bitmap_lock);
+    for (int i = 0; i < INODE_EXTENTS; i++) {
+        for (int b = 0; b < inode->extents[i].length; b++) {
+            block_ref(inode->extents[i].start + b);
+        }
+    }
+    for (int i = 0; i < DIRECT_BLOCKS; i++) {
+        if (inode->direct_blocks[i] != -1) block_ref(inode->direct_blocks[i]);
+    }
+    block_ref_index(inode->index_block, 0);
+    block_ref_index(inode->double_index_block, 1);
+    g_mutex_unlock(&bitmap_lock);
+
+    memcpy(copy->extents, inode->extents, sizeof(copy->extents));
+    memcpy(copy->direct_blocks, inode->direct_blocks, sizeof(copy->direct_blocks));
+    copy->index_block = index_block;
+    copy->double_index_block = double_index_block;
+    copy->flags = 0;
+    return 0;
+}
+
+//make `dst_inode` a copy of `src_inode` that shares its data blocks (see inode_share_blocks). This touches
+//metadata only; a block is copied when either file first writes it. A fragment file is small and copied
+//into fragments of dst's own. Whatever dst held is freed. Returns 0, or -1 if the index blocks could not be
+//allocated, dst is then left empty
+int inode_clone(int src_inode, int dst_inode) {
+
+    Inode *src = &inode_table[src_inode];
+    Inode *dst = &inode_table[dst_inode];
+    if (src_inode == dst_inode || src->is_directory || dst->is_directory || snapshot_preserve(dst_inode) != 0) return -1;
+    inode_free_blocks(dst, 0);
+    dst->_size = 0;
+    if (src->flags & INODE_FRAGMENT) {
+        if (inode_repack(dst, src->_size) != 0) {
+            inode_mark_dirty(dst);
+            return -1;
+        }
+        memcpy(fragment_data(dst->fragment), fragment_data(src->fragment), (size_t)src->_size);
+        image_mark_dirty(fragment_data(dst->fragment), (size_t)src->_size);
+    } else if (inode_share_blocks(src, dst) != 0) {
+        inode_mark_dirty(dst);
+        return -1;
+    }
+    dst->_size = src->_size;
+    inode_mark_dirty(dst);
+    inode_cold(dst_inode)->mtime = inode_cold(dst_inode)->ctime = time(NULL);
+    inode_cold_mark_dirty(inode_cold(dst_inode));
+    return 0;
+}
+
+//copy `len` bytes from one file to another through a buffer, for ranges a clone cannot share. The ranges must
+//not overlap. Returns the bytes copied, which is short at the end of the source or if the volume filled up,
+//or -1 if nothing could be written
+int64_t inode_copy_range(int src_inode, int64_t src_offset, int dst_inode, int64_t dst_offset, size_t len) {
+
+    char *buffer = malloc(INODE_COPY_CHUNK);
+    if (buffer == NULL) return -1;
+    int64_t done = 0;
+    while ((size_t)done < len) {
+        size_t want = len - (size_t)done < INODE_COPY_CHUNK ? len - (size_t)done : INODE_COPY_CHUNK;
+        int64_t got = inode_read(src_inode, buffer, want, src_offset + done);
+        if (got <= 0) break;
+        int64_t put = inode_write(dst_inode, buffer, (size_t)got, dst_offset + done);
+        if (put < 0) {
+            if (done == 0) done = -1;
+            break;
+        }
+        done += put;
+        if (put != got) break;
+    }
+    free(buffer);
+    return done;
+}
+
+
+
+//free_inode with the inode's blocks queued in `batch`, so a tree of inodes can be freed with few bitmap_lock holds
+static void inode_release(int inode_number, BlockBatch *batch) {
+
+    Inode *inode = &inode_table[inode_number];
+    InodeCold *cold = inode_cold(inode_number);
+    // Callers preserve the inode before unlinking it (see apply_delete), so this finds it preserved already.
+    // Were it not, its blocks and ACL are leaked rather than freed under a snapshot that may still read them
+    if (snapshot_preserve(inode_number) == 0) {
+        inode_release_blocks(inode, 0, batch);
+        acl_release(cold);
+    }
+    cold->acl_count = 0;
+
+    inode->is_directory = 0;
+    inode->_size = 0;
+    inode_mark_dirty(inode);
+    cold->nlink = 0;
+    cold->mtime = cold->ctime = time(NULL);
+    inode_cold_mark_dirty(cold);
+    perm_invalidate(inode_number);
+    g_mutex_lock(&inode_bitmap_lock);
+    inode_bitmap_release(inode_number);
+    g_mutex_unlock(&inode_bitmap_lock);
+    dir_release(inode_number);
+}
+
+//release an inode's blocks and return it to the free pool
+void free_inode(int inode_number) {
+
+    BlockBatch batch;
+    batch.count = 0;
+    inode_release(inode_number, &batch);
+    block_batch_flush(&batch);
+}
+
+
+
+//Tree pool, see TreePool. The thread that starts a run works as one of its workers, the others are started
+//for the run and joined before it returns
+
+//queue a task on `worker`'s deque; if the deque cannot grow, the task is run right away instead
+static void tree_pool_push(TreePool *pool, int worker, int task) {
+
+    TreeDeque *deque = &pool->deques[worker];
+    g_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity && deque->head > 0) {
+        // Steals left room at the head
+        memmove(deque->tasks, deque->tasks + deque->head, (size_t)(deque->tail - deque->head) * sizeof(int));
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+    if (deque->tail == deque->capacity) {
+        int capacity = deque->capacity == 0 ? TREE_DEQUE_INITIAL : deque->capacity * 2;
+        int *grown = realloc(deque->tasks, (size_t)capacity * sizeof(int));
+        if (grown == NULL) {
+            g_mutex_unlock(&deque->lock);
+            pool->run(pool, worker, task);
+            return;
+        }
+        deque->tasks = grown;
+        deque->capacity = capacity;
+    }
+    deque->tasks[deque->tail++] = task;
+    g_atomic_int_inc(&pool->pending); // before a thief can see the task, so pending never drops to 0 early
+    g_mutex_unlock(&deque->lock);
+}
+
+//take the newest task of the worker's own deque, else steal the oldest of another's. Returns 0 if all were empty
+static int tree_pool_take(TreePool *pool, int worker, int *task) {
+
+    for (int i = 0; i < pool->worker_count; i++) {
+        TreeDeque *deque = &pool->deques[(worker + i) % pool->worker_count];
+        g_mutex_lock(&deque->lock);
+        int found = deque->head < deque->tail;
+        if (found) {
+            *task = i == 0 ? deque->tasks[--deque->tail] : deque->tasks[deque->head++];
+        }
+        if (deque->head == deque->tail) deque->head = deque->tail = 0;
+        g_mutex_unlock(&deque->lock);
+        if (found) return 1;
+    }
+    return 0;
+}
+
+static gpointer tree_pool_worker(gpointer data) {
+
+    TreePool *pool = data;
+    int worker = g_atomic_int_add(&pool->next_worker, 1);
+    int task;
+    while (g_atomic_int_get(&pool->pending) > 0) {
+        if (tree_pool_take(pool, worker, &task)) {
+            pool->run(pool, worker, task);
+            g_atomic_int_add(&pool->pending, -1);
+        } else {
+            g_usleep(50); // what is left is running elsewhere and may still push more
+        }
+    }
+    return NULL;
+}
+
+//run `count` tasks, tasks[] or with tasks NULL the numbers 0 to count-1, and every task they push, on up to
+//TREE_WORKERS_MAX threads. Returns once all finished: 0, or -1 if a task set pool->failed
+static int tree_pool_run(TreePool *pool, TreeTaskFunc run, void *data, const int tasks[], int count) {
+
+    memset(pool, 0, sizeof(*pool));
+    int processors = (int)g_get_num_processors();
+    pool->worker_count = processors < 1 ? 1 : processors < TREE_WORKERS_MAX ? processors : TREE_WORKERS_MAX;
+    pool->run = run;
+    pool->data = data;
+    for (int i = 0; i < pool->worker_count; i++) {
+        g_mutex_init(&pool->deques[i].lock);
+    }
+    for (int i = 0; i < count; i++) {
+        tree_pool_push(pool, i % pool->worker_count, tasks != NULL ? tasks[i] : i);
+    }
+
+    // A worker that could not be started leaves its deque to the others to steal from
+    GThread *threads[TREE_WORKERS_MAX];
+    int started = 0;
+    for (int i = 1; i < pool->worker_count; i++) {
+        GThread *thread = g_thread_try_new("tree-worker", tree_pool_worker, pool, NULL);
+        if (thread != NULL) threads[started++] = thread;
+    }
+    tree_pool_worker(pool);
+    for (int i = 0; i < started; i++) {
+        g_thread_join(threads[i]);
+    }
+
+    for (int i = 0; i < pool->worker_count; i++) {
+        free(pool->deques[i].tasks);
+        g_mutex_clear(&pool->deques[i].lock);
+    }
+    return g_atomic_int_get(&pool->failed) ? -1 : 0;
+}
+
+//tree pool task of tree_free: free directory `dir_inode`'s files, queue its subdirectories as tasks of their
+//own, then free the directory itself. Every inode of the subtree is some task's alone and namespace_lock is
+//held exclusively by the thread that started the run, so the workers only meet on the allocator locks
+static void tree_free_dir(TreePool *pool, int worker, int dir_inode) {
+
+    BlockBatch *batch = (BlockBatch *)pool->data + worker;
+    Directory *dir = dir_get(dir_inode);
+    for (int e = 0; dir != NULL && e < dir->entry_count; e++) {
+        int child = dir->entries[e].inode_number;
+        if (inode_table[child].is_directory) {
+            tree_pool_push(pool, worker, child);
+        } else {
+            inode_release(child, batch);
+        }
+    }
+    g_mutex_lock(&name_index_lock);
+    for (int e = 0; dir != NULL && name_index.built && e < dir->entry_count; e++) {
+        name_index_remove(dir_inode, dir->entries[e].name);
+    }
+    g_mutex_unlock(&name_index_lock);
+    inode_release(dir_inode, batch);
+}
+
+//snapshot_preserve every inode of the subtree at directory `inode_number`, before tree_free frees it; returns 0,
+//or -1 if the volume is too full to keep one of them. Called with namespace_lock held exclusively
+static int tree_preserve(int inode_number) {
+
+    if (superblock->snapshot_count == 0) return 0;
+    int *stack = malloc((size_t)superblock->inode_table_size * sizeof(int)); // every inode is pushed at most once
+    if (stack == NULL) return -1;
+    int depth = 0, result = 0;
+    stack[depth++] = inode_number;
+    while (depth > 0 && result == 0) {
+        int current = stack[--depth];
+        result = snapshot_preserve(current);
+        Directory *dir = inode_table[current].is_directory ? dir_get(current) : NULL;
+        for (int e = 0; dir != NULL && e < dir->entry_count; e++) {
+            stack[depth++] = dir->entries[e].inode_number;
+        }
+    }
+    free(stack);
+    return result;
+}
+
+//free directory `inode_number` and everything below it on the tree pool, each worker batching the blocks
+//it frees. Its entry in the parent is left to the caller. Called with namespace_lock held exclusively
+static void tree_free(int inode_number) {
+
+    BlockBatch batches[TREE_WORKERS_MAX];
+    for (int i = 0; i < TREE_WORKERS_MAX; i++) {
+        batches[i].count = 0;
+    }
+    TreePool pool;
+    tree_pool_run(&pool, tree_free_dir, batches, &inode_number, 1);
+    for (int i = 0; i < TREE_WORKERS_MAX; i++) {
+        block_batch_flush(&batches[i]);
+    }
+}
+
+
+
+//Internal apply functions: they change only the in-memory tree (inodes, directories, dentry cache) and
+//write no journal records and show no dialogs, so both the operations below and journal replay use them.
+
+//add fs_path as a new inode; returns its inode number, or -1 if it exists or its parent is missing or full
+int apply_create(const char *fs_path, int is_directory, unsigned int mode, int want_inode) {
+
+    if (fs_path[0] == '\0' || resolve_path(fs_path) != -1) return -1;
+
+    const char *name;
+    int parent_inode = resolve_parent(fs_path, &name);
+    if (parent_inode == -1 || dir_get(parent_inode)->entry_count >= DIR_MAX_ENTRIES) return -1;
+
+    int inode_number = want_inode == -1 ? create_inode(is_directory, mode, current_user_id, current_group_id) :
+                       create_inode_at(want_inode, is_directory, mode, current_user_id, current_group_id);
+    if (inode_number == -1) return -1;
+
+    if (dir_add_entry(dir_get(parent_inode), name, inode_number) == -1) {
+        free_inode(inode_number);
+        return -1;
+    }
+    inode_cold(inode_number)->parent_inode = parent_inode;
+    inode_cold_mark_dirty(inode_cold(inode_number));
+    dcache_insert(fs_path, inode_number);
+    return inode_number;
+}
+
+//remove fs_path's entry and free its inode, and for a directory that still has entries everything below it
+//(see tree_free); returns 0, or -1 if there is no such entry or the volume is too full to preserve the victims
+//or rewrite the parent
+int apply_delete(const char *fs_path) {
+
+    Directory *dir;
+    int slot = find_entry(fs_path, &dir);
+    if (slot == -1) return -1;
+
+    int inode_number = dir->entries[slot].inode_number;
+    Directory *victim = inode_table[inode_number].is_directory ? dir_get(inode_number) : NULL;
+    // The victims' old state goes into the newest snapshot first, while the delete can still be refused
+    int preserved = victim != NULL && victim->entry_count > 0 ? tree_preserve(inode_number) : snapshot_preserve(inode_number);
+    if (preserved != 0) return -1;
+    if (inode_table[inode_number].is_directory) {
+        dcache_invalidate_prefix(fs_path);
+    }
+    if (dir_remove_entry(dir, slot) != 0) return -1;
+    if (victim != NULL && victim->entry_count > 0) {
+        tree_free(inode_number);
+    } else {
+        free_inode(inode_number);
+    }
+    dcache_insert(fs_path, -1);
+    return 0;
+}
+
+//move old_fs_path's entry to new_fs_path, which may be in another directory; returns 0 on success, -1 on failure
+int apply_rename(const char *old_fs_path, const char *new_fs_path) {
+
+    if (new_fs_path[0] == '\0' || resolve_path(new_fs_path) != -1) return -1;
+
+    Directory *old_dir;
+    int slot = find_entry(old_fs_path, &old_dir);
+    const char *new_leaf;
+    int new_parent_inode = resolve_parent(new_fs_path, &new_leaf);
+    if (slot == -1 || new_parent_inode == -1) return -1;
+
+    int inode_number = old_dir->entries[slot].inode_number;
+    if (new_parent_inode == old_dir->inode_number) {
+        if (dir_rename_entry(old_dir, slot, new_leaf) != 0) return -1;
+    } else {
+        Directory *new_dir = dir_get(new_parent_inode);
+        if (snapshot_preserve(inode_number) != 0) return -1;
+        int new_slot = dir_add_entry(new_dir, new_leaf, inode_number);
+        if (new_slot == -1) return -1;
+        if (dir_remove_entry(old_dir, slot) != 0) {
+            dir_remove_entry(new_dir, new_slot); // the last entry, so this cannot fail
+            return -1;
+        }
+        inode_cold(inode_number)->parent_inode = new_parent_inode;
+        inode_cold_mark_dirty(inode_cold(inode_number));
+    }
+
+    if (inode_table[inode_number].is_directory) {
+        dcache_invalidate_prefix(old_fs_path);
+        dcache_invalidate_prefix(new_fs_path);
+    }
+    dcache_insert(old_fs_path, -1);
+    dcache_insert(new_fs_path, inode_number);
+    return 0;
+}
+
+//set an inode's mode; returns 0, or -1 if the volume is too full to preserve its old state
+static int inode_set_mode(int inode_number, unsigned int mode) {
+
+    if (snapshot_preserve(inode_number) != 0) return -1;
+    inode_table[inode_number].mode = mode;
+    inode_mark_dirty(&inode_table[inode_number]);
+    inode_cold(inode_number)->ctime = time(NULL);
+    inode_cold_mark_dirty(inode_cold(inode_number));
+    perm_invalidate(inode_number);
+    return 0;
+}
+
+//set fs_path's mode; returns 0, or -1 if it does not exist
+int apply_set_mode(const char *fs_path, unsigned int mode) {
+
+    int inode_number = resolve_path(fs_path);
+    return inode_number == -1 ? -1 : inode_set_mode(inode_number, mode);
+}
+
+
+
+//Snapshots: every inode change goes through snapshot_preserve first, which copies the inode into the newest
+//snapshot the first time it changes after that snapshot was taken. The copy shares the inode's data blocks,
+//and writes to shared blocks are copy-on-write, so a snapshot keeps its contents while the live tree moves on.
+
+//position of snapshot `id` in superblock->snapshots, or -1
+static int snapshot_find(int id) {
+
+    for (int i = 0; i < superblock->snapshot_count; i++) {
+        if (superblock->snapshots[i].id == id) return i;
+    }
+    return -1;
+}
+
+//read slot `inode_number` of a snapshot table; returns 1 if the snapshot holds that inode, 0 for a hole
+static int snapshot_slot_read(int table_inode, int inode_number, SnapshotSlot *slot) {
+
+    int64_t n = inode_read(table_inode, (char *)slot, sizeof(*slot), (int64_t)inode_number * (int64_t)sizeof(*slot));
+    return n == (int64_t)sizeof(*slot) && slot->present;
+}
+
+//write slot `inode_number` of a snapshot table, all or nothing. A slot crossing into a table block the full volume
+//could not provide is left a hole again, so the table never lists an inode whose blocks it took no reference on
+static int snapshot_slot_write(int table_inode, int inode_number, const SnapshotSlot *slot) {
+
+    int64_t offset = (int64_t)inode_number * (int64_t)sizeof(*slot);
+    int64_t written = inode_write(table_inode, (const char *)slot, sizeof(*slot), offset);
+    if (written == (int64_t)sizeof(*slot)) return 0;
+    if (written > 0) {
+        int hole = 0;
+        inode_write(table_inode, (const char *)&hole, sizeof(hole), offset); // in the block the short write reached
+    }
+    return -1;
+}
+
+//before inode `inode_number` changes for the first time since the newest snapshot, store its current state in
+//that snapshot. Callers hold namespace_lock, shared at least, and are the inode's only writer. Returns 0, or -1
+//if the volume is too full to keep the old state, the change must then not be made
+int snapshot_preserve(int inode_number) {
+
+    if (superblock->snapshot_count == 0) return 0;
+    Inode *inode = &inode_table[inode_number];
+    InodeCold *cold = inode_cold(inode_number);
+    const SnapshotInfo *newest = &superblock->snapshots[superblock->snapshot_count - 1];
+    if (cold->snapshot_seen >= newest->id) return 0;
+
+    SnapshotSlot slot;
+    memset(&slot, 0, sizeof(slot));
+    slot.present = 1;
+    slot.inode = *inode;
+    slot.cold = *cold;
+    if (cold->nlink == 0) {
+        inode_clear_map(&slot.inode); // a free inode maps nothing
+    } else if (inode_share_blocks(inode, &slot.inode) != 0) {
+        return -1;
+    } else {
+        acl_share(cold);
+    }
+    g_mutex_lock(&snapshot_lock);
+    int result = snapshot_slot_write(newest->table_inode, inode_number, &slot);
+    g_mutex_unlock(&snapshot_lock);
+    if (result != 0) {
+        inode_free_blocks(&slot.inode, 0);
+        acl_release(&slot.cold);
+        return -1;
+    }
+    cold->snapshot_seen = newest->id;
+    inode_cold_mark_dirty(cold);
+    return 0;
+}
+
+//inode `inode_number` as it was in the snapshot at position `pos`: from the first table holding it, that
+//snapshot's or a newer one's, else the live inode. Both halves are copied out. Returns 1 if a table held it
+static int snapshot_inode_at(int pos, int inode_number, Inode *out, InodeCold *cold_out) {
+
+    SnapshotSlot slot;
+    for (int i = pos; i < superblock->snapshot_count; i++) {
+        if (snapshot_slot_read(superblock->snapshots[i].table_inode, inode_number, &slot)) {
+            *out = slot.inode;
+            *cold_out = slot.cold;
+            return 1;
+        }
+    }
+    *out = inode_table[inode_number];
+    *cold_out = *inode_cold(inode_number);
+    return 0;
+}
+
+//take a snapshot of the whole file system. Only an empty table is created, so this is O(1) whatever the size
+//of the tree. Returns the new snapshot's id, or -1 if MAX_SNAPSHOTS exist or no inode is free
+int snapshot_create() {
+
+    g_rw_lock_writer_lock(&namespace_lock);
+    int id = -1;
+    int table = superblock->snapshot_count < MAX_SNAPSHOTS ? create_inode(0, 0400, current_user_id, current_group_id) : -1;
+    if (table != -1) {
+        inode_cold(table)->snapshot_seen = SNAPSHOT_TABLE;
+        inode_cold_mark_dirty(inode_cold(table));
+        SnapshotInfo *snapshot = &superblock->snapshots[superblock->snapshot_count++];
+        snapshot->id = ++superblock->next_snapshot_id;
+        snapshot->table_inode = table;
+        snapshot->created = time(NULL);
+        superblock_mark_dirty();
+        id = snapshot->id;
+
+        // Inodes are stamped with this id as they are preserved, so the list must never go back to a state without it
+        if (image_sync(inode_cold(table), sizeof(InodeCold)) != 0 || image_sync(superblock, sizeof(Superblock)) != 0) {
+            perror("Failed to write the snapshot list");
+        }
+    }
+    g_rw_lock_writer_unlock(&namespace_lock);
+    return id;
+}
+
+void snapshot_list() {
+
+    g_rw_lock_reader_lock(&namespace_lock);
+    for (int i = 0; i < superblock->snapshot_count; i++) {
+        printf("%d\t%s", superblock->snapshots[i].id, ctime(&superblock->snapshots[i].created));
+    }
+    g_rw_lock_reader_unlock(&namespace_lock);
+}
+
+//delete snapshot `id`. Inodes the next older snapshot reads through it are first handed down to that snapshot,
+//then the snapshot leaves the list, and only then the blocks it alone kept are freed, so a crash halfway leaks
+//blocks but never leaves a listed snapshot pointing at freed ones. Returns 0, or -1 if there is no such snapshot
+int snapshot_delete(int id) {
+
+    g_rw_lock_writer_lock(&namespace_lock);
+    int pos = snapshot_find(id);
+    char *handed_down = pos == -1 ? NULL : calloc(superblock->inode_table_size, 1);
+    if (handed_down == NULL) {
+        g_rw_lock_writer_unlock(&namespace_lock);
+        return -1;
+    }
+
+    int table = superblock->snapshots[pos].table_inode;
+    int older = pos > 0 ? superblock->snapshots[pos - 1].table_inode : -1;
+    SnapshotSlot slot, held;
+    for (int i = 0; older != -1 && i < superblock->inode_table_size; i++) {
+        if (snapshot_slot_read(table, i, &slot) && !snapshot_slot_read(older, i, &held)) {
+            handed_down[i] = snapshot_slot_write(older, i, &slot) == 0;
+        }
+    }
+
+    memmove(&superblock->snapshots[pos], &superblock->snapshots[pos + 1],
+            (size_t)(superblock->snapshot_count - pos - 1) * sizeof(SnapshotInfo));
+    superblock->snapshot_count--;
+    superblock_mark_dirty();
+    if (image_sync(superblock, sizeof(Superblock)) != 0) {
+        perror("Failed to write the snapshot list");
+    }
+
+    for (int i = 0; i < superblock->inode_table_size; i++) {
+        if (!handed_down[i] && snapshot_slot_read(table, i, &slot)) {
+            inode_free_blocks(&slot.inode, 0);
+            acl_release(&slot.cold);
+        }
+    }
+    free(handed_down);
+    free_inode(table); // its snapshot_seen keeps snapshot_preserve off it
+    inode_cold(table)->snapshot_seen = 0;
+    inode_cold_mark_dirty(inode_cold(table));
+    g_rw_lock_writer_unlock(&namespace_lock);
+    return 0;
+}
+
+//make the live file system what it was when snapshot `id` was taken, inode by inode. Each inode changed since
+//is preserved in the newest snapshot like any other change, so the rollback can be undone from there. Host
+//files mirrored by the GUI are not part of the image and keep their contents. Returns 0, or -1 if there is no
+//such snapshot or the volume filled up, in which case the inodes restored so far stay restored
+int snapshot_rollback(int id) {
+
+    g_rw_lock_writer_lock(&namespace_lock);
+    int pos = snapshot_find(id);
+    int result = pos == -1 ? -1 : 0;
+
+    // Inode numbers held in pools are marked used, and the restore below may need them
+    alloc_pools_drain();
+    for (int i = 0; result == 0 && i < superblock->inode_table_size; i++) {
+        Inode old;
+        InodeCold old_cold;
+        if (inode_cold(i)->snapshot_seen == SNAPSHOT_TABLE || !snapshot_inode_at(pos, i, &old, &old_cold)) continue;
+        Inode restored = old;
+        if (snapshot_preserve(i) != 0 || (old_cold.nlink != 0 && inode_share_blocks(&old, &restored) != 0)) {
+            printf("Not enough free blocks to restore inode %d\n", i);
+            result = -1;
+            break;
+        }
+
+        if (old_cold.nlink != 0) acl_share(&old_cold);
+
+        Inode *inode = &inode_table[i];
+        InodeCold *cold = inode_cold(i);
+        inode_free_blocks(inode, 0);
+        acl_release(cold);
+        old_cold.snapshot_seen = cold->snapshot_seen;
+        *inode = restored;
+        *cold = old_cold;
+        inode_mark_dirty(inode);
+        inode_cold_mark_dirty(cold);
+
+        g_mutex_lock(&inode_bitmap_lock);
+        uint64_t mask = 1ULL << (i % BITMAP_WORD_BITS);
+        if (cold->nlink != 0 && !(inode_bitmap[i / BITMAP_WORD_BITS] & mask)) {
+            inode_bitmap[i / BITMAP_WORD_BITS] |= mask;
+            image_mark_dirty(&inode_bitmap[i / BITMAP_WORD_BITS], sizeof(uint64_t));
+            superblock->free_inode_count--;
+            superblock_mark_dirty();
+        } else if (cold->nlink == 0 && (inode_bitmap[i / BITMAP_WORD_BITS] & mask)) {
+            inode_bitmap_release(i);
+        }
+        g_mutex_unlock(&inode_bitmap_lock);
+    }
+
+    // Directory views and cached paths describe the tree as it was before
+    if (pos != -1) dir_cache_clear();
+    g_rw_lock_writer_unlock(&namespace_lock);
+
+    // The journal holds operations on the tree that was replaced
+    if (pos != -1) checkpoint_file_system();
+    return result;
+}
+
+//the inode tables as they were in snapshot `id`, for a read-only mount: the hot half is returned and the cold
+//half stored in `*cold`; NULL if there is no such snapshot. Both are the caller's to free
+Inode *snapshot_view(int id, InodeCold **cold) {
+
+    g_rw_lock_reader_lock(&namespace_lock);
+    int pos = snapshot_find(id);
+    size_t count = (size_t)superblock->inode_table_size;
+    Inode *view = pos == -1 ? NULL : malloc(count * sizeof(Inode));
+    *cold = view == NULL ? NULL : malloc(count * sizeof(InodeCold));
+    if (view != NULL && *cold == NULL) {
+        free(view);
+        view = NULL;
+    }
+    for (int i = 0; view != NULL && i < superblock->inode_table_size; i++) {
+        snapshot_inode_at(pos, i, &view[i], &(*cold)[i]);
+    }
+    g_rw_lock_reader_unlock(&namespace_lock);
+    return view;
+}
+
+
+
+//Integrity. Every image block but the checksum region has a crc32c, stored as the flusher writes the block
+//back. A scrub verifies them all; blocks changed after the last write-back before a crash can show up as
+//mismatches, since the mapping may have written them without their checksum
+
+//the region of the image block `block` lies in
+static ImageRegion image_region(int64_t block) {
+
+    if (block == 0) return IMAGE_SUPERBLOCK;
+    if (block < superblock->refcount_start) return IMAGE_BLOCK_BITMAP;
+    if (block < superblock->inode_bitmap_start) return IMAGE_REFCOUNTS;
+    if (block < superblock->inode_table_start) return IMAGE_INODE_BITMAP;
+    if (block < superblock->inode_cold_start) return IMAGE_INODE_TABLE;
+    if (block < superblock->checksum_start) return IMAGE_INODE_COLD;
+    return IMAGE_DATA;
+}
+
+const char *image_region_name(ImageRegion region) {
+
+    static const char *names[IMAGE_REGION_COUNT] = {"superblock", "block bitmap", "reference counts", "inode bitmap",
+                                                    "inode table", "cold inode table", "data"};
+    return region >= 0 && region < IMAGE_REGION_COUNT ? names[region] : "unknown";
+}
+
+//verify the SCRUB_CHUNK_BLOCKS image blocks of chunk `task` into this worker's ScrubReport. A block dirtied
+//again since the scrub's flush, e.g. by a pool returned as its thread exited, is not counted either way
+static void scrub_chunk(TreePool *pool, int worker, int task) {
+
+    ScrubReport *report = &((ScrubReport *)pool->data)[worker];
+    size_t block_size = superblock->block_size;
+    int64_t first = (int64_t)task * SCRUB_CHUNK_BLOCKS;
+    int64_t end = first + SCRUB_CHUNK_BLOCKS < superblock->image_blocks ? first + SCRUB_CHUNK_BLOCKS : superblock->image_blocks;
+    for (int64_t b = first; b < end; b++) {
+        if (b >= superblock->checksum_start && b < superblock->data_start) continue;
+        if (crc32c(0, fs_image + b * block_size, block_size) != *image_checksum_slot(b)) {
+            if ((image_dirty[b / BITMAP_WORD_BITS] >> (b % BITMAP_WORD_BITS)) & 1) continue;
+            if (report->bad < SCRUB_BAD_MAX) report->bad_blocks[report->bad] = b;
+            report->bad++;
+            report->bad_by_region[image_region(b)]++;
+        }
+        report->checked++;
+    }
+}
+
+//fsck-style check of the mounted image: flush it, then verify every block against its checksum on a TreePool,
+//a chunk of blocks per task, so the image is read at memory bandwidth. The namespace lock is held exclusively
+//throughout. Returns the blocks that failed, counting a damaged superblock layout as one, or -1 if the scrub
+//could not run
+int64_t fs_scrub(ScrubReport *report) {
+
+    memset(report, 0, sizeof(*report));
+    if (superblock == NULL || image_dirty == NULL) return -1;
+    ScrubReport *workers = calloc(TREE_WORKERS_MAX, sizeof(ScrubReport));
+    if (workers == NULL) return -1;
+
+    g_rw_lock_writer_lock(&namespace_lock);
+    int64_t start = stats_now();
+    report->layout_ok = superblock->layout_checksum == superblock_layout_checksum(superblock);
+    int result = image_flush_dirty();
+    if (result == 0) {
+        TreePool pool;
+        tree_pool_run(&pool, scrub_chunk, workers, NULL, (int)((superblock->image_blocks + SCRUB_CHUNK_BLOCKS - 1) / SCRUB_CHUNK_BLOCKS));
+    }
+    report->elapsed_ns = stats_now() - start;
+    g_rw_lock_writer_unlock(&namespace_lock);
+
+    for (int i = 0; i < TREE_WORKERS_MAX; i++) {
+        const ScrubReport *part = &workers[i];
+        for (int64_t j = 0; j < part->bad && j < SCRUB_BAD_MAX && report->bad + j < SCRUB_BAD_MAX; j++) {
+            report->bad_blocks[report->bad + j] = part->bad_blocks[j];
+        }
+        report->checked += part->checked;
+        report->bad += part->bad;
+        for (int r = 0; r < IMAGE_REGION_COUNT; r++) {
+            report->bad_by_region[r] += part->bad_by_region[r];
+        }
+    }
+    free(workers);
+    FS_TRACE("scrub: %lld blocks checked, %lld bad\n", (long long)report->checked, (long long)report->bad);
+    if (result != 0) return -1;
+    return report->bad + (report->layout_ok ? 0 : 1);
+}
+
+
+
+int file_exists(const char *path) {
+
+    char fs_path[MAX_PATH_LEN];
+    if (make_fs_path(path, fs_path) != 0) return 0;
+    g_rw_lock_reader_lock(&namespace_lock);
+    int inode_number = resolve_path(fs_path);
+    g_rw_lock_reader_unlock(&namespace_lock);
+    return inode_number != -1;
+}
+
+//journal an operation with an inline payload: appended now, or queued in `txn` while a batch operation runs
+static int journal_op(JournalTransaction *txn, JournalOperation operation, int inode_number, const char *filename,
+                      const char *new_filename, const void *payload, uint32_t length) {
+
+    if (txn != NULL) return journal_txn_add(txn, operation, inode_number, filename, new_filename, payload, length);
+    return add_journal_record(operation, inode_number, filename, new_filename, JOURNAL_PAYLOAD_INLINE, payload, length);
+}
+
+//create file at inode `want_inode`, or a new one if it is -1; called with namespace_lock held exclusively
+static int create_file_locked(const char *path, int is_directory, int want_inode, JournalTransaction *txn) {
+
+    char fs_path[MAX_PATH_LEN];
+    if (make_fs_path(path, fs_path) != 0 || fs_path[0] == '\0') {
+        printf("Invalid file name: %s\n", path);
+        return FS_ERR_INVALID;
+    }
+
+    if (resolve_path(fs_path) != -1) {
+        printf("File already exists: %s\n", path);
+        return FS_ERR_EXISTS;
+    }
+
+    const char *name;
+    int parent_inode = resolve_parent(fs_path, &name);
+    if (parent_inode == -1) {
+        printf("No parent directory for %s\n", path);
+        return FS_ERR_NOT_FOUND;
+    }
+    if (dir_get(parent_inode)->entry_count >= DIR_MAX_ENTRIES) {
+        printf("Cannot add %s to its parent directory\n", path);
+        return FS_ERR_NO_SPACE;
+    }
+
+    char full_path[MAX_PATH_LEN];
+    if (make_host_path(fs_path, full_path, sizeof(full_path)) != 0 && fs_host_mirror) {
+        printf("Path too long for the host folder: %s\n", path);
+        return FS_ERR_INVALID;
+    }
+
+    // O_EXCL instead of an access() check, so a host file unknown to the file system is never truncated
+    int fd = fs_host_mirror ? open(full_path, O_CREAT | O_EXCL | O_RDWR, 0666) : -2;
+    if (fd == -1) {
+        perror("Failed to create file");
+        return FS_ERR_IO;
+    }
+    if (fd >= 0) close(fd);
+
+    unsigned int default_permissions = 0777; // Default permissions for files
+    int inode_number = apply_create(fs_path, is_directory, default_permissions, want_inode);
+    if (inode_number == -1) {
+        printf("Failed to create inode for file\n");
+        if (fs_host_mirror) remove(full_path);
+        return FS_ERR_NO_SPACE;
+    }
+
+    return journal_op(txn, CREATE, inode_number, fs_path, NULL, NULL, 0) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+int create_file(const char *path, int is_directory) {
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int result = create_file_locked(path, is_directory, -1, &txn);
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && result == FS_OK) result = FS_ERR_IO;
+    return result;
+}
+
+static int delete_file_locked(const char *filename, JournalTransaction *txn);
+
+//create `dst` as a copy of the file `src` that shares its data blocks, so the copy costs metadata only
+//(see inode_clone). The host file is not copied
+int clone_file(const char *src, const char *dst) {
+
+    char fs_path[MAX_PATH_LEN];
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int src_inode = make_fs_path(src, fs_path) == 0 ? resolve_path(fs_path) : -1;
+    int result = FS_ERR_NOT_FOUND;
+    if (src_inode != -1 && inode_table[src_inode].is_directory) {
+        result = FS_ERR_INVALID;
+    } else if (src_inode != -1 && (result = create_file_locked(dst, 0, -1, &txn)) == FS_OK) {
+        make_fs_path(dst, fs_path);
+        if (inode_clone(src_inode, resolve_path(fs_path)) != 0) {
+            printf("Not enough free blocks to share %s\n", src);
+            delete_file_locked(dst, &txn);
+            result = FS_ERR_NO_SPACE;
+        }
+    }
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && result == FS_OK) result = FS_ERR_IO;
+    return result;
+}
+
+
+
+//delete file; called with namespace_lock held exclusively
+static int delete_file_locked(const char *filename, JournalTransaction *txn) {
+
+    char fs_path[MAX_PATH_LEN];
+    if (make_fs_path(filename, fs_path) != 0) {
+        printf("Invalid file name: %s\n", filename);
+        return FS_ERR_INVALID;
+    }
+
+    char full_path[MAX_PATH_LEN];
+    if (make_host_path(fs_path, full_path, sizeof(full_path)) != 0 && fs_host_mirror) {
+        printf("Path too long for the host folder: %s\n", filename);
+        return FS_ERR_INVALID;
+    }
+
+    int inode_number = resolve_path(fs_path);
+    if (fs_host_mirror ? access(full_path, 0) != 0 : inode_number == -1) {
+        printf("File does not exist: %s\n", filename);
+        return FS_ERR_NOT_FOUND;
+    }
+
+    // Remove file from disk
+    if (fs_host_mirror && remove(full_path) != 0) {
+        perror("Failed to delete file");
+        return FS_ERR_IO;
+    }
+
+    // Remove file entry from its directory and free inode
+    if (apply_delete(fs_path) != 0) {
+        printf("Volume too full to delete %s\n", filename);
+        return FS_ERR_NO_SPACE;
+    }
+
+    return journal_op(txn, DELETE, inode_number, fs_path, NULL, NULL, 0) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+int delete_file(const char *filename) {
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int result = delete_file_locked(filename, &txn);
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && result == FS_OK) result = FS_ERR_IO;
+    return result;
+}
+
+
+//rename file; called with namespace_lock held exclusively
+static int rename_file_locked(const char *old_name, const char *new_name, JournalTransaction *txn) {
+
+    char old_fs_path[MAX_PATH_LEN];
+    char new_fs_path[MAX_PATH_LEN];
+    if (make_fs_path(old_name, old_fs_path) != 0 || make_fs_path(new_name, new_fs_path) != 0 || new_fs_path[0] == '\0') {
+        printf("Invalid file name: %s\n", new_name);
+        return FS_ERR_INVALID;
+    }
+
+    if (resolve_path(new_fs_path) != -1) {
+        printf("File already exists: %s\n", new_name);
+        return FS_ERR_EXISTS;
+    }
+
+    char old_path[MAX_PATH_LEN];
+    char new_path[MAX_PATH_LEN];
+    if ((make_host_path(old_fs_path, old_path, sizeof(old_path)) != 0 ||
+         make_host_path(new_fs_path, new_path, sizeof(new_path)) != 0) && fs_host_mirror) {
+        printf("Path too long for the host folder: %s\n", new_name);
+        return FS_ERR_INVALID;
+    }
+
+    int inode_number = resolve_path(old_fs_path);
+    if (!fs_host_mirror && inode_number == -1) {
+        printf("File does not exist: %s\n", old_name);
+        return FS_ERR_NOT_FOUND;
+    }
+
+    // A file only the host folder knows is renamed there alone. Otherwise the new parent must exist and,
+    // for a directory, must not lie below it, or the moved subtree would be cut off from the root
+    if (inode_number != -1) {
+        const char *new_leaf;
+        int new_parent_inode = resolve_parent(new_fs_path, &new_leaf);
+        if (new_parent_inode == -1) {
+            printf("No parent directory for %s\n", new_name);
+            return FS_ERR_NOT_FOUND;
+        }
+        for (int up = new_parent_inode; inode_table[inode_number].is_directory && up != ROOT_INODE; up = inode_cold(up)->parent_inode) {
+            if (up == inode_number) {
+                printf("Cannot move %s into itself\n", old_name);
+                return FS_ERR_INVALID;
+            }
+        }
+    }
+
+    if (fs_host_mirror && rename(old_path, new_path) != 0) {
+        perror("Failed to rename file");
+        return FS_ERR_IO;
+    }
+
+    // Update the directory tree; a new name with a different parent moves the entry
+    if (inode_number != -1 && apply_rename(old_fs_path, new_fs_path) != 0) {
+        printf("Cannot add %s to its parent directory\n", new_name);
+        if (fs_host_mirror && rename(new_path, old_path) != 0) perror("Failed to undo the host rename");
+        return FS_ERR_NO_SPACE;
+    }
+
+    return journal_op(txn, RENAME, inode_number, old_fs_path, new_fs_path, NULL, 0) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+int rename_file(const char *old_name, const char *new_name) {
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int result = rename_file_locked(old_name, new_name, &txn);
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && result == FS_OK) result = FS_ERR_IO;
+    return result;
+}
+
+void save_permissions() {
+
+    save_file_system_state();
+}
+
+void load_permissions() {
+
+    load_file_system_state();
+}
+
+int change_file_permissions(const char *filename, unsigned int new_mode) {
+
+    char fs_path[MAX_PATH_LEN];
+    if (make_fs_path(filename, fs_path) != 0) {
+        return FS_ERR_INVALID;
+    }
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    if (apply_set_mode(fs_path, new_mode) != 0) {
+        g_rw_lock_writer_unlock(&namespace_lock);
+        return FS_ERR_NOT_FOUND;
+    }
+
+    // The journal entry makes the change durable, the inode slot is written back with the dirty blocks.
+    // The new mode is its payload
+    uint32_t mode = new_mode;
+    journal_op(&txn, CHANGE_PERMISSIONS, resolve_path(fs_path), fs_path, NULL, &mode, sizeof(mode));
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    return journal_txn_end(&txn) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+
+
+//create directory at inode `want_inode`, or a new one if it is -1; called with namespace_lock held exclusively
+static int create_directory_locked(const char *path, int want_inode, JournalTransaction *txn) {
+
+    char fs_path[MAX_PATH_LEN];
+    if (make_fs_path(path, fs_path) != 0 || fs_path[0] == '\0') {
+        printf("Invalid directory name: %s\n", path);
+        return FS_ERR_INVALID;
+    }
+
+    if (resolve_path(fs_path) != -1) {
+        printf("Directory already exists: %s\n", path);
+        return FS_ERR_EXISTS;
+    }
+
+    const char *name;
+    int parent_inode = resolve_parent(fs_path, &name);
+    if (parent_inode == -1) {
+        printf("No parent directory for %s\n", path);
+        return FS_ERR_NOT_FOUND;
+    }
+    if (dir_get(parent_inode)->entry_count >= DIR_MAX_ENTRIES) {
+        printf("Cannot add %s to its parent directory\n", path);
+        return FS_ERR_NO_SPACE;
+    }
+
+    char full_path[MAX_PATH_LEN];
+    if (make_host_path(fs_path, full_path, sizeof(full_path)) != 0 && fs_host_mirror) {
+        printf("Path too long for the host folder: %s\n", path);
+        return FS_ERR_INVALID;
+    }
+
+    // Create directory on disk
+    if (fs_host_mirror && _mkdir(full_path) != 0) {  // Default permissions for directories
+        perror("Failed to create directory");
+        return FS_ERR_IO;
+    }
+
+    // Create inode for the directory and add it to its parent directory
+    int inode_number = apply_create(fs_path, 1, 0755, want_inode);
+    if (inode_number == -1) {
+        printf("Failed to create inode for directory\n");
+        if (fs_host_mirror) _rmdir(full_path);
+        return FS_ERR_NO_SPACE;
+    }
+
+    return journal_op(txn, CREATE_DIRECTORY, inode_number, fs_path, NULL, NULL, 0) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+int create_directory(const char *path) {
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int result = create_directory_locked(path, -1, &txn);
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && result == FS_OK) result = FS_ERR_IO;
+    return result;
+}
+
+//called with namespace_lock held exclusively
+static int delete_directory_locked(const char *path, JournalTransaction *txn) {
+
+    char fs_path[MAX_PATH_LEN];
+    if (make_fs_path(path, fs_path) != 0 || fs_path[0] == '\0') {
+        printf("Invalid directory name: %s\n", path);
+        return FS_ERR_INVALID;
+    }
+
+    char full_path[MAX_PATH_LEN];
+    if (make_host_path(fs_path, full_path, sizeof(full_path)) != 0 && fs_host_mirror) {
+        printf("Path too long for the host folder: %s\n", path);
+        return FS_ERR_INVALID;
+    }
+
+    Directory *dir;
+    int slot = find_entry(fs_path, &dir);
+
+    // Check if directory exists
+    if (fs_host_mirror ? access(full_path, F_OK) != 0 : slot == -1) {
+        printf("Directory does not exist: %s\n", path);
+        return FS_ERR_NOT_FOUND;
+    }
+
+    int inode_number = slot == -1 ? -1 : dir->entries[slot].inode_number;
+    Directory *victim = inode_number == -1 ? NULL : dir_get(inode_number);
+    if (victim != NULL && victim->entry_count > 0) {
+        printf("Directory is not empty: %s\n", path);
+        return FS_ERR_NOT_EMPTY;
+    }
+
+    // Remove directory from disk
+    if (fs_host_mirror && _rmdir(full_path) != 0) {
+        perror("Failed to delete directory");
+        return FS_ERR_IO;
+    }
+
+    // Remove directory entry from its parent directory and free inode
+    if (apply_delete(fs_path) != 0) {
+        printf("Volume too full to delete %s\n", path);
+        return FS_ERR_NO_SPACE;
+    }
+
+    // The slot may hold another entry once this one is removed, so the number is taken before
+    return journal_op(txn, DELETE, inode_number, fs_path, NULL, NULL, 0) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+int delete_directory(const char *path) {
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int result = delete_directory_locked(path, &txn);
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && result == FS_OK) result = FS_ERR_IO;
+    return result;
+}
+
+
+
+//queue `name` under `parent_path` (the root if empty) in a walk. Returns 0, or -1 if memory ran out or the
+//path would not fit in MAX_PATH_LEN
+static int tree_walk_push(TreeWalk *walk, const char *parent_path, const char *name, int inode_number) {
+
+    if (walk->count == walk->capacity) {
+        int capacity = walk->capacity == 0 ? 64 : walk->capacity * 2;
+        TreeWalkNode *grown = realloc(walk->nodes, (size_t)capacity * sizeof(TreeWalkNode));
+        if (grown == NULL) return -1;
+        walk->nodes = grown;
+        walk->capacity = capacity;
+    }
+    size_t parent_length = strlen(parent_path), name_length = strlen(name);
+    size_t separator = parent_length > 0 ? 1 : 0;
+    size_t length = parent_length + separator + name_length + 1;
+    char *path = length <= MAX_PATH_LEN ? malloc(length) : NULL;
+    if (path == NULL) return -1;
+    memcpy(path, parent_path, parent_length);
+    if (separator) path[parent_length] = '/';
+    memcpy(path + parent_length + separator, name, name_length + 1);
+    walk->nodes[walk->count].path = path;
+    walk->nodes[walk->count].inode_number = inode_number;
+    walk->count++;
+    return 0;
+}
+
+//take the node pushed last; its path is then the caller's to free. Returns 0 once the walk is done
+static int tree_walk_pop(TreeWalk *walk, TreeWalkNode *node) {
+
+    if (walk->count == 0) return 0;
+    *node = walk->nodes[--walk->count];
+    return 1;
+}
+
+static void tree_walk_free(TreeWalk *walk) {
+
+    while (walk->count > 0) {
+        free(walk->nodes[--walk->count].path);
+    }
+    free(walk->nodes);
+    walk->nodes = NULL;
+    walk->capacity = 0;
+}
+
+//record paths[i]'s result and count the successes
+static int batch_result(int results[], int i, int result) {
+
+    if (results != NULL) results[i] = result;
+    return result == FS_OK;
+}
+
+//the batch's records could not be made durable: every name that succeeded is reported as FS_ERR_IO
+static int batch_journal_failed(int results[], int count) {
+
+    for (int i = 0; results != NULL && i < count; i++) {
+        if (results[i] == FS_OK) results[i] = FS_ERR_IO;
+    }
+    return 0;
+}
+
+int create_files(const char *const paths[], int count, int is_directory, int results[]) {
+
+    int *numbers = count > 0 ? malloc((size_t)count * sizeof(int)) : NULL;
+    int claimed = numbers != NULL ? allocate_inodes(count, numbers) : 0;
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    int done = 0;
+
+    g_rw_lock_writer_lock(&namespace_lock);
+    for (int i = 0; i < count; i++) {
+        // Past the claimed numbers each create allocates its own, and reports a full inode table itself
+        int want_inode = i < claimed ? numbers[i] : -1;
+        int result = is_directory ? create_directory_locked(paths[i], want_inode, &txn) :
+                     create_file_locked(paths[i], 0, want_inode, &txn);
+        done += batch_result(results, i, result);
+    }
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0) done = batch_journal_failed(results, count);
+
+    release_inodes(numbers, claimed);
+    free(numbers);
+    return done;
+}
+
+int delete_files(const char *const paths[], int count, int results[]) {
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    int done = 0;
+
+    g_rw_lock_writer_lock(&namespace_lock);
+    for (int i = 0; i < count; i++) {
+        char fs_path[MAX_PATH_LEN];
+        int inode_number = make_fs_path(paths[i], fs_path) == 0 ? resolve_path(fs_path) : -1;
+        int result = inode_number != -1 && inode_table[inode_number].is_directory ? delete_directory_locked(paths[i], &txn) :
+                     delete_file_locked(paths[i], &txn);
+        done += batch_result(results, i, result);
+    }
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0) done = batch_journal_failed(results, count);
+    return done;
+}
+
+//set one inode's mode, `fs_path` naming it, and queue its record in `txn`; namespace_lock held exclusively
+static int change_mode_locked(int inode_number, const char *fs_path, unsigned int new_mode, JournalTransaction *txn) {
+
+    if (inode_set_mode(inode_number, new_mode) != 0) return FS_ERR_NO_SPACE;
+    uint32_t mode = new_mode;
+    return journal_op(txn, CHANGE_PERMISSIONS, inode_number, fs_path, NULL, &mode, sizeof(mode)) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+//change every path's mode and, with `recursive`, that of everything below the directories among them. The
+//walk carries each entry's inode number down from its directory, so nothing is resolved from the root twice.
+//results[i] is the first failure at or below paths[i] if there was one
+int change_files_permissions(const char *const paths[], int count, unsigned int new_mode, int recursive, int results[]) {
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    TreeWalk walk = {0};
+    int done = 0;
+
+    g_rw_lock_writer_lock(&namespace_lock);
+    for (int i = 0; i < count; i++) {
+        char fs_path[MAX_PATH_LEN];
+        int result = make_fs_path(paths[i], fs_path) == 0 ? FS_OK : FS_ERR_INVALID;
+        int inode_number = result == FS_OK ? resolve_path(fs_path) : -1;
+        if (inode_number == -1 || tree_walk_push(&walk, "", fs_path, inode_number) != 0) {
+            done += batch_result(results, i, result != FS_OK ? result : inode_number == -1 ? FS_ERR_NOT_FOUND : FS_ERR_NO_SPACE);
+            continue;
+        }
+
+        TreeWalkNode node;
+        while (tree_walk_pop(&walk, &node)) {
+            int node_result = change_mode_locked(node.inode_number, node.path, new_mode, &txn);
+            Directory *dir = recursive && node_result == FS_OK ? dir_get(node.inode_number) : NULL;
+            for (int e = 0; dir != NULL && e < dir->entry_count && node_result == FS_OK; e++) {
+                if (tree_walk_push(&walk, node.path, dir->entries[e].name, dir->entries[e].inode_number) != 0) {
+                    node_result = FS_ERR_NO_SPACE;
+                }
+            }
+            if (node_result != FS_OK && result == FS_OK) result = node_result;
+            free(node.path);
+        }
+        done += batch_result(results, i, result);
+    }
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0) done = batch_journal_failed(results, count);
+    tree_walk_free(&walk);
+    return done;
+}
+
+//remove the host copies of fs_path and everything below it, walking the in-FS tree from `inode_number` and
+//removing children before their directory. Host files already gone are skipped. Returns 0, or -1 at the
+//first one the host refused, leaving it and the rest in place
+static int host_remove_tree(const char *fs_path, int inode_number) {
+
+    TreeWalk walk = {0};
+    TreeWalk order = {0}; // every node in the order visited, parents before their children
+    int result = tree_walk_push(&walk, "", fs_path, inode_number);
+    TreeWalkNode node;
+    while (result == 0 && tree_walk_pop(&walk, &node)) {
+        Directory *dir = inode_table[node.inode_number].is_directory ? dir_get(node.inode_number) : NULL;
+        for (int e = 0; dir != NULL && e < dir->entry_count && result == 0; e++) {
+            result = tree_walk_push(&walk, node.path, dir->entries[e].name, dir->entries[e].inode_number);
+        }
+        if (result == 0) result = tree_walk_push(&order, "", node.path, node.inode_number);
+        free(node.path);
+    }
+
+    while (result == 0 && tree_walk_pop(&order, &node)) {
+        char host_path[MAX_PATH_LEN];
+        if (make_host_path(node.path, host_path, sizeof(host_path)) != 0) {
+            printf("Path too long for the host folder: %s\n", node.path);
+            result = -1;
+        } else if (access(host_path, F_OK) == 0 &&
+                   (inode_table[node.inode_number].is_directory ? _rmdir(host_path) : remove(host_path)) != 0) {
+            perror("Failed to delete from the host folder");
+            result = -1;
+        }
+        free(node.path);
+    }
+    tree_walk_free(&walk);
+    tree_walk_free(&order);
+    return result;
+}
+
+int delete_tree(const char *path) {
+
+    char fs_path[MAX_PATH_LEN];
+    if (make_fs_path(path, fs_path) != 0 || fs_path[0] == '\0') {
+        printf("Invalid file name: %s\n", path);
+        return FS_ERR_INVALID;
+    }
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int inode_number = resolve_path(fs_path);
+    int result = FS_OK;
+    if (inode_number == -1 || !inode_table[inode_number].is_directory) {
+        result = delete_file_locked(path, &txn);
+    } else if (fs_host_mirror && host_remove_tree(fs_path, inode_number) != 0) {
+        result = FS_ERR_IO;
+    } else {
+        // apply_delete frees the subtree with the directory, so replaying this one record does the same
+        if (apply_delete(fs_path) != 0) {
+            printf("Volume too full to delete %s\n", path);
+            result = FS_ERR_NO_SPACE;
+        } else if (journal_op(&txn, DELETE, inode_number, fs_path, NULL, NULL, 0) != 0) {
+            result = FS_ERR_IO;
+        }
+    }
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && result == FS_OK) result = FS_ERR_IO;
+    return result;
+}
+
+//copy host file `src` over `dst`. Returns 0, or -1 if either could not be opened, read or written
+static int host_copy_file(const char *src, const char *dst) {
+
+    int in = open(src, O_RDONLY | O_BINARY);
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    char *buffer = malloc(TREE_COPY_CHUNK);
+    int result = in != -1 && out != -1 && buffer != NULL ? 0 : -1;
+    ssize_t got = 0;
+    while (result == 0 && (got = read(in, buffer, TREE_COPY_CHUNK)) > 0) {
+        if (write(out, buffer, (size_t)got) != got) result = -1;
+    }
+    if (got < 0) result = -1;
+    free(buffer);
+    if (in != -1) close(in);
+    if (out != -1 && close(out) != 0) result = -1;
+    return result;
+}
+
+//tree pool task of copy_tree: copy the host file of source `task`; pool->data holds the source and copy lists
+static void tree_copy_host_file(TreePool *pool, int worker, int task) {
+
+    (void)worker;
+    TreeWalk *lists = pool->data;
+    char src[MAX_PATH_LEN], dst[MAX_PATH_LEN];
+    if (make_host_path(lists[0].nodes[task].path, src, sizeof(src)) != 0 ||
+        make_host_path(lists[1].nodes[task].path, dst, sizeof(dst)) != 0 || host_copy_file(src, dst) != 0) {
+        printf("Failed to copy %s\n", lists[0].nodes[task].path);
+        g_atomic_int_set(&pool->failed, 1);
+    }
+}
+
+//give the copy of inode `src` at `fs_path` the original's owner, ACL and mode, queueing the mode's record in `txn`.
+//Owner and ACL have no journal record, they reach the image the way fuse_make_node's owner does. Called with
+//namespace_lock held exclusively
+static int tree_copy_attributes(int src, const char *fs_path, JournalTransaction *txn) {
+
+    int dst = resolve_path(fs_path);
+    if (dst == -1) return FS_ERR_NOT_FOUND;
+    inode_table[dst].owner_id = inode_table[src].owner_id;
+    inode_table[dst].group_id = inode_table[src].group_id;
+    InodeCold *from = inode_cold(src), *to = inode_cold(dst);
+    acl_release(to);
+    to->acl_count = from->acl_count;
+    to->acl_block = from->acl_block;
+    memcpy(to->acl, from->acl, sizeof(to->acl));
+    acl_share(to);
+    inode_cold_mark_dirty(to);
+
+    uint32_t mode = inode_table[src].mode;
+    if (inode_set_mode(dst, mode) != 0) return FS_ERR_NO_SPACE; // also marks the inode dirty and retires cached answers
+    return journal_op(txn, CHANGE_PERMISSIONS, dst, fs_path, NULL, &mode, sizeof(mode)) == 0 ? FS_OK : FS_ERR_IO;
+}
+
+//the copy is made parents first under one namespace_lock hold, each file and directory with its original's mode,
+//owner and ACL; with fs_host_mirror the host files are copied
+//afterwards on the tree pool, without the lock. A copy that fails part way is deleted again
+int copy_tree(const char *src, const char *dst) {
+
+    char src_fs[MAX_PATH_LEN], dst_fs[MAX_PATH_LEN];
+    if (make_fs_path(src, src_fs) != 0 || make_fs_path(dst, dst_fs) != 0 || dst_fs[0] == '\0') {
+        printf("Invalid file name: %s\n", dst);
+        return FS_ERR_INVALID;
+    }
+    size_t src_len = strlen(src_fs);
+    if (src_len == 0 || (strncmp(dst_fs, src_fs, src_len) == 0 && (dst_fs[src_len] == '\0' || dst_fs[src_len] == '/'))) {
+        printf("Cannot copy %s into itself\n", src);
+        return FS_ERR_INVALID;
+    }
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    TreeWalk walk = {0};
+    TreeWalk host_files[2] = {{0}, {0}}; // sources and their copies, at the same index
+    int result = FS_OK;
+    int created = 0;
+
+    g_rw_lock_writer_lock(&namespace_lock);
+    int src_inode = resolve_path(src_fs);
+    if (src_inode == -1) {
+        printf("File does not exist: %s\n", src);
+        result = FS_ERR_NOT_FOUND;
+    } else if (tree_walk_push(&walk, "", src_fs, src_inode) != 0) {
+        result = FS_ERR_NO_SPACE;
+    }
+
+    TreeWalkNode node;
+    while (result == FS_OK && tree_walk_pop(&walk, &node)) {
+        // Paths starting with '/' are taken from the root, whatever current_dir_path is
+        char copy_path[MAX_PATH_LEN + 1];
+        snprintf(copy_path, sizeof(copy_path), "/%s%s", dst_fs, node.path + src_len);
+        if (inode_table[node.inode_number].is_directory) {
+            result = create_directory_locked(copy_path, -1, &txn);
+            created |= result == FS_OK;
+            if (result == FS_OK) result = tree_copy_attributes(node.inode_number, copy_path + 1, &txn);
+            Directory *dir = result == FS_OK ? dir_get(node.inode_number) : NULL;
+            if (result == FS_OK && dir == NULL) result = FS_ERR_NO_SPACE;
+            for (int e = 0; dir != NULL && e < dir->entry_count && result == FS_OK; e++) {
+                if (tree_walk_push(&walk, node.path, dir->entries[e].name, dir->entries[e].inode_number) != 0) {
+                    result = FS_ERR_NO_SPACE;
+                }
+            }
+        } else if ((result = create_file_locked(copy_path, 0, -1, &txn)) == FS_OK) {
+            created = 1;
+            if (inode_clone(node.inode_number, resolve_path(copy_path + 1)) != 0) {
+                printf("Not enough free blocks to share %s\n", node.path);
+                result = FS_ERR_NO_SPACE;
+            }
+            if (result == FS_OK) result = tree_copy_attributes(node.inode_number, copy_path + 1, &txn);
+            if (result == FS_OK && fs_host_mirror && (tree_walk_push(&host_files[0], "", node.path, node.inode_number) != 0 ||
+                                                      tree_walk_push(&host_files[1], "", copy_path + 1, -1) != 0)) {
+                result = FS_ERR_NO_SPACE;
+            }
+        }
+        free(node.path);
+    }
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && result == FS_OK) result = FS_ERR_IO;
+    tree_walk_free(&walk);
+
+    // The data blocks are shared, only the host copies still have bytes to move
+    TreePool pool;
+    if (result == FS_OK && host_files[1].count > 0 &&
+        tree_pool_run(&pool, tree_copy_host_file, host_files, NULL, host_files[1].count) != 0) {
+        result = FS_ERR_IO;
+    }
+    tree_walk_free(&host_files[0]);
+    tree_walk_free(&host_files[1]);
+
+    if (result != FS_OK && created) {
+        char copy_path[MAX_PATH_LEN + 1];
+        snprintf(copy_path, sizeof(copy_path), "/%s", dst_fs);
+        delete_tree(copy_path);
+    }
+    return result;
+}
+
+
+
+//write a checkpoint of the current state and truncate the log; recovery then starts from here.
+//Returns 0 on success, -1 if the state could not be written (the log is then kept)
+int checkpoint_file_system() {
+
+    STATS_START(start);
+    // Appends wait while the state is saved, so every record the truncation drops is in the saved state.
+    // A failed journal fsync does not stop it, the saved state then stands in for the records
+    g_rw_lock_writer_lock(&journal_checkpoint_lock);
+    g_mutex_lock(&journal_lock);
+    journal_wait_durable(journal_appended_seq);
+    g_mutex_unlock(&journal_lock);
+
+    if (save_file_system_state() != 0) {
+        printf("Error: Checkpoint failed, keeping the journal\n");
+        g_rw_lock_writer_unlock(&journal_checkpoint_lock);
+        return -1;
+    }
+
+    g_mutex_lock(&journal_lock);
+    if ((journal_fd != -1 && ftruncate(journal_fd, 0) != 0) ||
+        (journal_segment_fd != -1 && ftruncate(journal_segment_fd, 0) != 0)) {
+        perror("Error: Could not truncate journal after checkpoint");
+    }
+    for (int i = 0; i < JOURNAL_SIZE; i++) {
+        free(journal[i]);
+        journal[i] = NULL;
+    }
+    journal_index = 0;
+    journal_since_checkpoint = 0;
+    journal_durable_seq = journal_appended_seq;
+    journal_sync_failed = 0;
+    g_mutex_unlock(&journal_lock);
+    g_rw_lock_writer_unlock(&journal_checkpoint_lock);
+    STATS_END(STAT_CHECKPOINT, start);
+    FS_TRACE("checkpoint: journal truncated\n");
+    return 0;
+}
+
+//true when a record's path no longer names the inode it was journaled with, so the disk image is already
+//past it (the image is written in place and can be ahead of its checkpoint)
+static int replay_stale(const JournalRecord *record, const char *fs_path) {
+
+    return record->inode_number != -1 && resolve_path(fs_path) != record->inode_number;
+}
+
+//redo one record against the host folder and the in-memory tree. A record is applied only when the tree
+//is still in the state it was appended against, so records already reflected in the image are skipped.
+//Host steps are skipped when they are already done, and when the volume is mounted through FUSE,
+//where there is no host copy
+static void replay_record(const JournalRecord *record) {
+
+    const char *fs_path = journal_record_filename(record);
+    char host_path[MAX_PATH_LEN];
+    if (make_host_path(fs_path, host_path, sizeof(host_path)) != 0 && fs_host_mirror) {
+        printf("Journal: path too long for the host folder, skipping %s\n", fs_path);
+        return;
+    }
+
+    switch (record->operation) {
+        case CREATE:
+        case CREATE_DIRECTORY: {
+            int is_directory = record->operation == CREATE_DIRECTORY;
+            if (resolve_path(fs_path) != -1) break;
+            if (record->inode_number != -1 && (record->inode_number >= superblock->inode_table_size ||
+                                               inode_cold(record->inode_number)->nlink != 0)) break;
+            if (fs_host_mirror && is_directory) {
+                if (access(host_path, F_OK) != 0) _mkdir(host_path);
+            } else if (fs_host_mirror) {
+                int fd = open(host_path, O_CREAT | O_RDWR | O_BINARY, 0666); // never truncates an existing file
+                if (fd != -1) close(fd);
+            }
+            apply_create(fs_path, is_directory, is_directory ? 0755 : 0777, record->inode_number);
+            break;
+        }
+        case DELETE: {
+            int inode_number = resolve_path(fs_path);
+            if (inode_number == -1 || replay_stale(record, fs_path)) break;
+            if (fs_host_mirror && inode_table[inode_number].is_directory) {
+                host_remove_tree(fs_path, inode_number);
+            } else if (fs_host_mirror && access(host_path, F_OK) == 0) {
+                remove(host_path);
+            }
+            apply_delete(fs_path);
+            break;
+        }
+        case RENAME: {
+            const char *new_fs_path = journal_record_new_filename(record);
+            if (resolve_path(fs_path) == -1 || resolve_path(new_fs_path) != -1 || replay_stale(record, fs_path)) break;
+            char new_host_path[MAX_PATH_LEN];
+            if (make_host_path(new_fs_path, new_host_path, sizeof(new_host_path)) != 0 && fs_host_mirror) {
+                printf("Journal: path too long for the host folder, skipping %s\n", new_fs_path);
+                break;
+            }
+            if (fs_host_mirror && access(host_path, F_OK) == 0 && access(new_host_path, F_OK) != 0) {
+                rename(host_path, new_host_path);
+            }
+            apply_rename(fs_path, new_fs_path);
+            break;
+        }
+        case MODIFY: {
+            // Block lists describe data already written in place, only diffs need applying
+            if (!fs_host_mirror || record->payload_kind == JOURNAL_PAYLOAD_NONE || record->payload_kind == JOURNAL_PAYLOAD_BLOCKS) break;
+            if (replay_stale(record, fs_path)) break;
+            uint32_t length;
+            unsigned char *diff = journal_load_payload(record, &length);
+            if (diff) {
+                apply_diff_to_file(host_path, diff, length);
+            }
+            free(diff);
+            break;
+        }
+        case CHANGE_PERMISSIONS: {
+            if (replay_stale(record, fs_path)) break;
+            uint32_t length;
+            unsigned char *mode = journal_load_payload(record, &length);
+            if (mode && length == sizeof(uint32_t)) {
+                uint32_t new_mode;
+                memcpy(&new_mode, mode, sizeof(new_mode));
+                apply_set_mode(fs_path, new_mode);
+            }
+            free(mode);
+            break;
+        }
+        case READ:
+            break;
+        default:
+            printf("Warning: Unknown operation in journal entry\n");
+            break;
+    }
+}
+
+//crash recovery: apply, in sequence order, the records appended after the loaded checkpoint,
+//then checkpoint so the next start has nothing to replay. Work is bounded by JOURNAL_CHECKPOINT_INTERVAL
+void replay_journal() {
+
+    uint64_t last_seq = superblock->checkpoint_seq;
+    int replayed = 0;
+
+    // The ring is in append order starting at its oldest slot
+    for (int i = 0; i < JOURNAL_SIZE; i++) {
+        JournalRecord *record = journal[(journal_index + i) % JOURNAL_SIZE];
+        if (record == NULL || record->seq <= last_seq) continue; // empty slot or covered by the checkpoint
+
+        FS_TRACE("replay: record %lu, %s %s\n", (unsigned long)record->seq, operation_to_string(record->operation),
+                 journal_record_filename(record));
+        STATS_START(start);
+        replay_record(record);
+        STATS_END(STAT_REPLAY, start);
+        last_seq = record->seq;
+        replayed++;
+    }
+
+    if (replayed > 0) {
+        checkpoint_file_system();
+    }
+}
+
+
+
+/* FUSE FRONTEND */
+
+#ifdef FS_WITH_FUSE
+
+//FUSE worker threads run in parallel: handlers that only look names up or work on one inode hold namespace_lock
+//shared plus that inode's lock, handlers that change the namespace hold namespace_lock exclusively
+
+//FUSE reserves inode 0, so FUSE inode numbers are engine inode numbers plus one (the root becomes FUSE_ROOT_ID)
+#define FUSE_INO(inode_number) ((fuse_ino_t)(inode_number) + 1)
+#define ENGINE_INO(ino) ((int)(ino) - 1)
+#define FUSE_TIMEOUT 1.0 // seconds the kernel may cache attributes and names
+
+//read-only virtual file in the root holding the stats_format report. It has the first inode number past the
+//inode table, is not listed by readdir, and every open takes its own snapshot of the counters
+#define FUSE_STATS_NAME ".stats"
+#define FUSE_STATS_INO ((fuse_ino_t)superblock->inode_table_size + 1)
+
+//engine inode for a FUSE inode, or -1 if it is not in use
+static int fuse_inode(fuse_ino_t ino) {
+
+    int inode_number = ENGINE_INO(ino);
+    if (inode_number < 0 || inode_number >= superblock->inode_table_size || inode_cold(inode_number)->nlink == 0) return -1;
+    return inode_number;
+}
+
+static void fuse_fill_attr(int inode_number, struct stat *st) {
+
+    const Inode *inode = &inode_table[inode_number];
+    const InodeCold *cold = inode_cold(inode_number);
+    memset(st, 0, sizeof(*st));
+    st->st_ino = FUSE_INO(inode_number);
+    st->st_mode = (inode->is_directory ? S_IFDIR : S_IFREG) | (inode->mode & 07777);
+    st->st_nlink = inode->is_directory ? 2 : cold->nlink;
+    st->st_uid = inode->owner_id;
+    st->st_gid = inode->group_id;
+    st->st_size = inode->_size;
+    st->st_blksize = superblock->block_size;
+    st->st_blocks = (inode->_size + 511) / 512;
+    st->st_atime = cold->atime;
+    st->st_mtime = cold->mtime;
+    st->st_ctime = cold->ctime;
+}
+
+static void fuse_fill_stats_attr(struct stat *st) {
+
+    memset(st, 0, sizeof(*st));
+    st->st_ino = FUSE_STATS_INO;
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_blksize = superblock->block_size;
+    st->st_atime = st->st_mtime = st->st_ctime = time(NULL);
+}
+
+static void fuse_fill_entry(int inode_number, struct fuse_entry_param *e) {
+
+    memset(e, 0, sizeof(*e));
+    e->ino = FUSE_INO(inode_number);
+    e->attr_timeout = FUSE_TIMEOUT;
+    e->entry_timeout = FUSE_TIMEOUT;
+    fuse_fill_attr(inode_number, &e->attr);
+}
+
+//file system path of `name` inside FUSE directory `parent`, for the apply functions and the journal.
+//Returns 0 or a negative errno
+static int fuse_child_path(fuse_ino_t parent, const char *name, char *out) {
+
+    int parent_inode = fuse_inode(parent);
+    if (parent_inode == -1) return -ENOENT;
+    if (!inode_table[parent_inode].is_directory) return -ENOTDIR;
+    if (strlen(name) >= MAX_FILENAME_LEN) return -ENAMETOOLONG;
+
+    char parent_path[MAX_PATH_LEN];
+    if (inode_to_path(parent_inode, parent_path, sizeof(parent_path)) != 0) return -ENOENT;
+    int n = parent_path[0] ? snprintf(out, MAX_PATH_LEN, "%s/%s", parent_path, name) : snprintf(out, MAX_PATH_LEN, "%s", name);
+    return n < MAX_PATH_LEN ? 0 : -ENAMETOOLONG;
+}
+
+//whether the caller may access an inode, checked by has_permission; uid 0 may do anything
+static int fuse_permitted(fuse_req_t req, int inode_number, unsigned int required) {
+
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    return ctx->uid == 0 || has_permission(inode_number, (int)ctx->uid, required);
+}
+
+//why the caller may not make the setattr change `to_set`, or 0. Mode, owner and explicit times are the owner's
+//to change, the group only to the caller's own; the size and times set to now need write permission as well
+static int fuse_setattr_denied(fuse_req_t req, int inode_number, const struct stat *attr, int to_set,
+                               struct fuse_file_info *fi) {
+
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    if (ctx->uid == 0) return 0;
+    Inode *inode = &inode_table[inode_number];
+    int owner = (int)ctx->uid == inode->owner_id;
+    int explicit_times = ((to_set & FUSE_SET_ATTR_ATIME) && !(to_set & FUSE_SET_ATTR_ATIME_NOW)) ||
+                         ((to_set & FUSE_SET_ATTR_MTIME) && !(to_set & FUSE_SET_ATTR_MTIME_NOW));
+    if ((to_set & FUSE_SET_ATTR_UID) && (int)attr->st_uid != inode->owner_id) return EPERM;
+    if ((to_set & FUSE_SET_ATTR_GID) && (int)attr->st_gid != inode->group_id && (!owner || attr->st_gid != ctx->gid)) return EPERM;
+    if (((to_set & FUSE_SET_ATTR_MODE) || explicit_times) && !owner) return EPERM;
+
+    int needs_write = ((to_set & FUSE_SET_ATTR_SIZE) && fi == NULL) || // an open file was checked by fs_fuse_open
+                      ((to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) && !owner);
+    return needs_write && !has_permission(inode_number, (int)ctx->uid, PERMISSION_WRITE) ? EACCES : 0;
+}
+
+//create a file or directory and queue its record in `txn`; returns its inode number or a negative errno
+static int fuse_make_node(fuse_req_t req, fuse_ino_t parent, const char *name, int is_directory, mode_t mode,
+                          JournalTransaction *txn) {
+
+    char path[MAX_PATH_LEN];
+    int err = fuse_child_path(parent, name, path);
+    if (err != 0) return err;
+    if (!fuse_permitted(req, ENGINE_INO(parent), PERMISSION_WRITE | PERMISSION_EXECUTE)) return -EACCES;
+    if (resolve_path(path) != -1 || (parent == FUSE_ROOT_ID && strcmp(name, FUSE_STATS_NAME) == 0)) return -EEXIST;
+
+    int inode_number = apply_create(path, is_directory, mode & 07777, -1);
+    if (inode_number == -1) return -ENOSPC;
+
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    inode_table[inode_number].owner_id = ctx->uid;
+    inode_table[inode_number].group_id = ctx->gid;
+    inode_mark_dirty(&inode_table[inode_number]);
+    perm_invalidate(inode_number);
+    journal_op(txn, is_directory ? CREATE_DIRECTORY : CREATE, inode_number, path, NULL, NULL, 0);
+    return inode_number;
+}
+
+//remove a name and queue its record in `txn`; `want_directory` selects rmdir semantics. Returns 0 or a
+//negative errno
+static int fuse_remove_node(fuse_req_t req, fuse_ino_t parent, const char *name, int want_directory,
+                            JournalTransaction *txn) {
+
+    char path[MAX_PATH_LEN];
+    int err = fuse_child_path(parent, name, path);
+    if (err != 0) return err;
+    if (!fuse_permitted(req, ENGINE_INO(parent), PERMISSION_WRITE | PERMISSION_EXECUTE)) return -EACCES;
+
+    int inode_number = resolve_path(path);
+    if (inode_number == -1) return -ENOENT;
+    if (want_directory && !inode_table[inode_number].is_directory) return -ENOTDIR;
+    if (!want_directory && inode_table[inode_number].is_directory) return -EISDIR;
+    if (want_directory && dir_get(inode_number)->entry_count > 0) return -ENOTEMPTY;
+
+    if (apply_delete(path) != 0) return -ENOSPC;
+    return journal_op(txn, DELETE, inode_number, path, NULL, NULL, 0) == 0 ? 0 : -EIO;
+}
+
+static void fs_fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+
+    if (parent == FUSE_ROOT_ID && strcmp(name, FUSE_STATS_NAME) == 0) {
+        // size 0 and no caching: the report is generated on open and served with direct_io
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.ino = FUSE_STATS_INO;
+        fuse_fill_stats_attr(&e.attr);
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    g_rw_lock_reader_lock(&namespace_lock);
+    int parent_inode = fuse_inode(parent);
+    Directory *dir = parent_inode == -1 ? NULL : dir_get(parent_inode);
+    int slot = dir == NULL ? -1 : dir_lookup(dir, name);
+    if (slot == -1) {
+        g_rw_lock_reader_unlock(&namespace_lock);
+        fuse_reply_err(req, dir == NULL && parent_inode != -1 ? ENOTDIR : ENOENT);
+        return;
+    }
+
+    struct fuse_entry_param e;
+    int inode_number = dir->entries[slot].inode_number;
+    inode_lock_shared(inode_number);
+    fuse_fill_entry(inode_number, &e);
+    inode_unlock_shared(inode_number);
+    g_rw_lock_reader_unlock(&namespace_lock);
+    fuse_reply_entry(req, &e);
+}
+
+static void fs_fuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+
+    (void)fi;
+    if (ino == FUSE_STATS_INO) {
+        struct stat st;
+        fuse_fill_stats_attr(&st);
+        fuse_reply_attr(req, &st, 0);
+        return;
+    }
+    g_rw_lock_reader_lock(&namespace_lock);
+    int inode_number = fuse_inode(ino);
+    struct stat st;
+    if (inode_number != -1) {
+        inode_lock_shared(inode_number);
+        fuse_fill_attr(inode_number, &st);
+        inode_unlock_shared(inode_number);
+    }
+    g_rw_lock_reader_unlock(&namespace_lock);
+
+    if (inode_number == -1) {
+        fuse_reply_err(req, ENOENT);
+    } else {
+        fuse_reply_attr(req, &st, FUSE_TIMEOUT);
+    }
+}
+
+static void fs_fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+
+    if (fs_read_only) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_reader_lock(&namespace_lock);
+    int inode_number = fuse_inode(ino);
+    int err = inode_number == -1 ? ENOENT : 0;
+    if (!err) inode_lock(inode_number);
+    if (!err) err = fuse_setattr_denied(req, inode_number, attr, to_set, fi);
+    if (!err && snapshot_preserve(inode_number) != 0) err = ENOSPC;
+
+    if (!err && (to_set & FUSE_SET_ATTR_SIZE)) {
+        if (inode_table[inode_number].is_directory) {
+            err = EISDIR;
+        } else if (inode_truncate(inode_number, attr->st_size) != 0) {
+            err = attr->st_size > inode_max_size() ? EFBIG : ENOSPC;
+        }
+    }
+    if (!err && (to_set & FUSE_SET_ATTR_MODE)) {
+        char path[MAX_PATH_LEN];
+        uint32_t mode = attr->st_mode & 07777;
+        if (inode_set_mode(inode_number, mode) != 0) {
+            err = ENOSPC;
+        } else if (inode_to_path(inode_number, path, sizeof(path)) == 0 &&
+                   journal_op(&txn, CHANGE_PERMISSIONS, inode_number, path, NULL, &mode, sizeof(mode)) != 0) {
+            err = EIO;
+        }
+    }
+    if (!err) {
+        Inode *inode = &inode_table[inode_number];
+        if (to_set & FUSE_SET_ATTR_UID) inode->owner_id = attr->st_uid;
+        if (to_set & FUSE_SET_ATTR_GID) inode->group_id = attr->st_gid;
+        inode_mark_dirty(inode);
+        InodeCold *cold = inode_cold(inode_number);
+        if (to_set & FUSE_SET_ATTR_ATIME) cold->atime = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? time(NULL) : attr->st_atime;
+        if (to_set & FUSE_SET_ATTR_MTIME) cold->mtime = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(NULL) : attr->st_mtime;
+        cold->ctime = time(NULL);
+        inode_cold_mark_dirty(cold);
+        if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) perm_invalidate(inode_number);
+    }
+
+    struct stat st;
+    if (!err) fuse_fill_attr(inode_number, &st);
+    journal_txn_append(&txn);
+    if (inode_number != -1) inode_unlock(inode_number);
+    g_rw_lock_reader_unlock(&namespace_lock);
+    // The durability wait happens with no lock held, like the namespace handlers
+    if (journal_txn_end(&txn) != 0 && !err) err = EIO;
+
+    if (err) {
+        fuse_reply_err(req, err);
+    } else {
+        fuse_reply_attr(req, &st, FUSE_TIMEOUT);
+    }
+}
+
+//the report of an open .stats file, kept in fi->fh until release
+static int fuse_open_stats(fuse_req_t req, struct fuse_file_info *fi) {
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return EACCES;
+    char *text = malloc(STATS_TEXT_MAX);
+    if (text == NULL) return ENOMEM;
+    stats_format(text, STATS_TEXT_MAX);
+    fi->fh = (uint64_t)(uintptr_t)text;
+    fi->direct_io = 1;
+    fuse_reply_open(req, fi);
+    return 0;
+}
+
+static void fs_fuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+
+    if (ino == FUSE_STATS_INO) {
+        int err = fuse_open_stats(req, fi);
+        if (err) fuse_reply_err(req, err);
+        return;
+    }
+    int access_mode = fi->flags & O_ACCMODE;
+    unsigned int required = (access_mode != O_WRONLY ? PERMISSION_READ : 0) | (access_mode != O_RDONLY ? PERMISSION_WRITE : 0);
+    g_rw_lock_reader_lock(&namespace_lock);
+    int inode_number = fuse_inode(ino);
+    int err = inode_number == -1 ? ENOENT : 0;
+    if (!err && fs_read_only && access_mode != O_RDONLY) err = EROFS;
+    if (!err && !fuse_permitted(req, inode_number, required)) err = EACCES;
+    g_rw_lock_reader_unlock(&namespace_lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+    } else {
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void fs_fuse_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+
+    unsigned int required = ((mask & R_OK) ? PERMISSION_READ : 0) | ((mask & W_OK) ? PERMISSION_WRITE : 0) |
+                            ((mask & X_OK) ? PERMISSION_EXECUTE : 0);
+    if (ino == FUSE_STATS_INO) {
+        fuse_reply_err(req, (mask & (W_OK | X_OK)) ? EACCES : 0);
+        return;
+    }
+    g_rw_lock_reader_lock(&namespace_lock);
+    int inode_number = fuse_inode(ino);
+    int err = inode_number == -1 ? ENOENT : 0;
+    if (!err && fs_read_only && (mask & W_OK)) err = EROFS;
+    if (!err && !fuse_permitted(req, inode_number, required)) err = EACCES;
+    g_rw_lock_reader_unlock(&namespace_lock);
+    fuse_reply_err(req, err);
+}
+
+static void fs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+
+    if (ino == FUSE_STATS_INO) {
+        const char *text = (const char *)(uintptr_t)fi->fh;
+        size_t length = strlen(text);
+        size_t start = (size_t)off < length ? (size_t)off : length;
+        fuse_reply_buf(req, text + start, size < length - start ? size : length - start);
+        return;
+    }
+    char *buf = malloc(size ? size : 1);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    g_rw_lock_reader_lock(&namespace_lock);
+    int inode_number = fuse_inode(ino);
+    int64_t n = -1;
+    if (inode_number != -1) {
+        inode_lock_shared(inode_number);
+        n = inode_read(inode_number, buf, size, off);
+        inode_unlock_shared(inode_number);
+    }
+    g_rw_lock_reader_unlock(&namespace_lock);
+
+    if (n < 0) {
+        fuse_reply_err(req, ENOENT);
+    } else {
+        fuse_reply_buf(req, buf, (size_t)n);
+    }
+    free(buf);
+}
+
+static void fs_fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+
+    if (fs_read_only) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    (void)fi;
+    g_rw_lock_reader_lock(&namespace_lock);
+    int inode_number = fuse_inode(ino);
+    int64_t n = -1;
+    if (inode_number != -1) {
+        inode_lock(inode_number);
+        n = inode_write(inode_number, buf, size, off);
+        inode_unlock(inode_number);
+    }
+    g_rw_lock_reader_unlock(&namespace_lock);
+
+    if (inode_number == -1) {
+        fuse_reply_err(req, ENOENT);
+    } else if (n < 0) {
+        fuse_reply_err(req, off >= inode_max_size() ? EFBIG : ENOSPC);
+    } else {
+        fuse_reply_write(req, (size_t)n);
+    }
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+//copy_file_range(2), which cp uses by default: copying a whole file into an empty one shares its blocks
+//(inode_clone), other ranges are copied through a buffer. Both inodes are locked in inode number order
+static void fs_fuse_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info *fi_in,
+                                    fuse_ino_t ino_out, off_t off_out, struct fuse_file_info *fi_out, size_t len, int flags) {
+
+    if (fs_read_only) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    (void)fi_in;
+    (void)fi_out;
+    if (flags != 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    g_rw_lock_reader_lock(&namespace_lock);
+    int in = fuse_inode(ino_in);
+    int out = fuse_inode(ino_out);
+    int err = in == -1 || out == -1 ? ENOENT : 0;
+    if (!err && (inode_table[in].is_directory || inode_table[out].is_directory)) err = EISDIR;
+    if (!err && in == out && off_in < off_out + (off_t)len && off_out < off_in + (off_t)len) err = EINVAL;
+    if (err) {
+        g_rw_lock_reader_unlock(&namespace_lock);
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    if (in == out) {
+        inode_lock(out);
+    } else if (in < out) {
+        inode_lock_shared(in);
+        inode_lock(out);
+    } else {
+        inode_lock(out);
+        inode_lock_shared(in);
+    }
+    int64_t n;
+    int64_t src_size = inode_table[in]._size;
+    if (in != out && off_in == 0 && off_out == 0 && inode_table[out]._size == 0 && (int64_t)len >= src_size &&
+        inode_clone(in, out) == 0) {
+        n = src_size;
+    } else {
+        n = inode_copy_range(in, off_in, out, off_out, len);
+    }
+    inode_unlock(out);
+    if (in != out) inode_unlock_shared(in);
+    g_rw_lock_reader_unlock(&namespace_lock);
+
+    if (n < 0) {
+        fuse_reply_err(req, off_out >= inode_max_size() ? EFBIG : ENOSPC);
+    } else {
+        fuse_reply_write(req, (size_t)n);
+    }
+}
+#endif
+
+//offsets 0 and 1 are "." and "..", offset i + 2 is entry slot i. Slots move when entries are removed
+//(the last entry fills the hole), so a listing that races a removal may skip or repeat a name
+static void fs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+
+    (void)fi;
+    char *buf = malloc(size ? size : 1);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    g_rw_lock_reader_lock(&namespace_lock);
+    int inode_number = fuse_inode(ino);
+    Directory *dir = inode_number == -1 ? NULL : dir_get(inode_number);
+    if (dir == NULL) {
+        g_rw_lock_reader_unlock(&namespace_lock);
+        free(buf);
+        fuse_reply_err(req, inode_number == -1 ? ENOENT : ENOTDIR);
+        return;
+    }
+
+    size_t used = 0;
+    for (off_t i = off; i < (off_t)dir->entry_count + 2; i++) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        const char *name;
+        int child;
+        if (i < 2) {
+            name = i == 0 ? "." : "..";
+            child = i == 0 ? inode_number : inode_cold(inode_number)->parent_inode;
+        } else {
+            name = dir->entries[i - 2].name;
+            child = dir->entries[i - 2].inode_number;
+        }
+        st.st_ino = FUSE_INO(child);
+        st.st_mode = inode_table[child].is_directory ? S_IFDIR : S_IFREG;
+
+        size_t len = fuse_add_direntry(req, buf + used, size - used, name, &st, i + 1);
+        if (len > size - used) break;
+        used += len;
+    }
+    g_rw_lock_reader_unlock(&namespace_lock);
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void fs_fuse_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+
+    if (fs_read_only) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int inode_number = fuse_make_node(req, parent, name, 0, mode, &txn);
+    struct fuse_entry_param e;
+    if (inode_number >= 0) fuse_fill_entry(inode_number, &e);
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && inode_number >= 0) inode_number = -EIO;
+
+    if (inode_number < 0) {
+        fuse_reply_err(req, -inode_number);
+    } else {
+        fuse_reply_create(req, &e, fi);
+    }
+}
+
+static void fs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+
+    if (fs_read_only) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int inode_number = fuse_make_node(req, parent, name, 1, mode, &txn);
+    struct fuse_entry_param e;
+    if (inode_number >= 0) fuse_fill_entry(inode_number, &e);
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && inode_number >= 0) inode_number = -EIO;
+
+    if (inode_number < 0) {
+        fuse_reply_err(req, -inode_number);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void fs_fuse_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+
+    if (fs_read_only) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int err = fuse_remove_node(req, parent, name, 0, &txn);
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && !err) err = -EIO;
+    fuse_reply_err(req, -err);
+}
+
+static void fs_fuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+
+    if (fs_read_only) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    int err = fuse_remove_node(req, parent, name, 1, &txn);
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && !err) err = -EIO;
+    fuse_reply_err(req, -err);
+}
+
+//rename(2) semantics: an existing target of the same kind is replaced, a directory cannot move below itself
+static void fs_fuse_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname,
+                           unsigned int flags) {
+
+    if (fs_read_only) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    if (flags != 0) {
+        fuse_reply_err(req, EINVAL); // RENAME_NOREPLACE / RENAME_EXCHANGE are not supported
+        return;
+    }
+
+    JournalTransaction txn;
+    journal_txn_begin(&txn);
+    g_rw_lock_writer_lock(&namespace_lock);
+    char old_path[MAX_PATH_LEN], new_path[MAX_PATH_LEN];
+    int err = fuse_child_path(parent, name, old_path);
+    if (!err) err = fuse_child_path(newparent, newname, new_path);
+    if (!err && (!fuse_permitted(req, ENGINE_INO(parent), PERMISSION_WRITE | PERMISSION_EXECUTE) ||
+                 !fuse_permitted(req, ENGINE_INO(newparent), PERMISSION_WRITE | PERMISSION_EXECUTE))) {
+        err = -EACCES;
+    }
+
+    int inode_number = err ? -1 : resolve_path(old_path);
+    if (!err && inode_number == -1) err = -ENOENT;
+
+    if (!err && inode_table[inode_number].is_directory) {
+        for (int up = ENGINE_INO(newparent); up != ROOT_INODE; up = inode_cold(up)->parent_inode) {
+            if (up == inode_number) {
+                err = -EINVAL;
+                break;
+            }
+        }
+    }
+
+    int target = err ? -1 : resolve_path(new_path);
+    if (!err && target == inode_number) {
+        g_rw_lock_writer_unlock(&namespace_lock);
+        fuse_reply_err(req, 0);
+        return;
+    }
+    if (!err && target != -1) {
+        if (inode_table[target].is_directory != inode_table[inode_number].is_directory) {
+            err = inode_table[target].is_directory ? -EISDIR : -ENOTDIR;
+        } else if (inode_table[target].is_directory && dir_get(target)->entry_count > 0) {
+            err = -ENOTEMPTY;
+        } else if (apply_delete(new_path) != 0) {
+            err = -ENOSPC;
+        } else {
+            journal_op(&txn, DELETE, target, new_path, NULL, NULL, 0);
+        }
+    }
+
+    if (!err) {
+        if (apply_rename(old_path, new_path) == 0) {
+            journal_op(&txn, RENAME, inode_number, old_path, new_path, NULL, 0);
+        } else {
+            err = -ENOSPC;
+        }
+    }
+    journal_txn_append(&txn);
+    g_rw_lock_writer_unlock(&namespace_lock);
+    if (journal_txn_end(&txn) != 0 && !err) err = -EIO;
+    fuse_reply_err(req, -err);
+}
+
+//file data is written in place in the mapping, so fsync flushes the image
+static void fs_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+
+    (void)ino;
+    (void)datasync;
+    (void)fi;
+    fuse_reply_err(req, image_flush_dirty() == 0 ? 0 : EIO);
+}
+
+static void fs_fuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+
+    if (ino == FUSE_STATS_INO) free((char *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static const struct fuse_lowlevel_ops fs_fuse_ops = {
+    .lookup = fs_fuse_lookup,
+    .getattr = fs_fuse_getattr,
+    .setattr = fs_fuse_setattr,
+    .open = fs_fuse_open,
+    .access = fs_fuse_access,
+    .read = fs_fuse_read,
+    .release = fs_fuse_release,
+    .write = fs_fuse_write,
+    .readdir = fs_fuse_readdir,
+    .create = fs_fuse_create,
+    .mkdir = fs_fuse_mkdir,
+    .unlink = fs_fuse_unlink,
+    .rmdir = fs_fuse_rmdir,
+    .rename = fs_fuse_rename,
+    .fsync = fs_fuse_fsync,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+    .copy_file_range = fs_fuse_copy_file_range,
+#endif
+};
+
+//mount the disk image at the mountpoint given in argv and serve requests until unmounted,
+//on several threads unless -s is given. File contents then live in the image's data blocks.
+//A `snapshot_id` other than 0 mounts that snapshot read-only instead of the live tree
+int fuse_mount_file_system(int argc, char *argv[], int snapshot_id) {
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(&args, &opts) != 0) return EXIT_FAILURE;
+    if (opts.show_help || opts.mountpoint == NULL) {
+        printf("usage: %s --mount [--snapshot ID] [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return opts.show_help ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    fs_host_mirror = 0;
+    init_file_system();
+
+    // The handlers read the inode tables, so a snapshot is mounted by putting its view there
+    Inode *live_inode_table = inode_table;
+    InodeCold *live_cold_table = inode_cold_table;
+    InodeCold *view_cold = NULL;
+    if (snapshot_id != 0) prefetch_stop();
+    Inode *view = snapshot_id != 0 ? snapshot_view(snapshot_id, &view_cold) : NULL;
+    if (snapshot_id != 0 && view == NULL) {
+        printf("No snapshot %d\n", snapshot_id);
+        close_journal();
+        free_memory();
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+    if (view != NULL) {
+        dir_cache_clear(); // replay may have loaded live directories
+        inode_table = view;
+        inode_cold_table = view_cold;
+        fs_read_only = 1;
+    }
+
+    int result = EXIT_FAILURE;
+    struct fuse_session *se = fuse_session_new(&args, &fs_fuse_ops, sizeof(fs_fuse_ops), NULL);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            if (fuse_session_mount(se, opts.mountpoint) == 0) {
+                fuse_daemonize(opts.foreground);
+                result = (opts.singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se, opts.clone_fd)) == 0
+                         ? EXIT_SUCCESS : EXIT_FAILURE;
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+
+    if (view != NULL) {
+        dir_cache_clear(); // views loaded from the snapshot must not outlive it
+        inode_table = live_inode_table;
+        inode_cold_table = live_cold_table;
+        fs_read_only = 0;
+        free(view);
+        free(view_cold);
+    }
+    checkpoint_file_system();
+    close_journal();
+    free_memory();
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return result;
+}
+
+#endif
+
+void ensure_trailing_slash(char *path) {
+    size_t len = strlen(path);
+    if (len > 0 && path[len - 1] != '/') {
+        if (len < MAX_FILENAME_LEN - 1) {
+            path[len] = '/';
+            path[len + 1] = '\0';
+        } else {
+            // Handle error: path is too long
+        }
+    }
+}
+void change_directory(const char *new_path) {
+
+    char fs_path[MAX_PATH_LEN];
+    if (make_fs_path(new_path, fs_path) != 0) {
+        printf("Invalid directory path: %s\n", new_path);
+        return;
+    }
+
+    // The current directory's host path, with its trailing '/', must fit TEST_FOLDER_PATH
+    char full_path[MAX_PATH_LEN];
+    if (make_host_path(fs_path, full_path, sizeof(full_path)) != 0 || strlen(full_path) + 2 > sizeof(TEST_FOLDER_PATH)) {
+        printf("Directory path too long: %s\n", new_path);
+        return;
+    }
+
+    // Ensure the new path ends with a '/'
+    ensure_trailing_slash(full_path);
+
+    // Check if the new path exists and is a directory
+    struct stat statbuf;
+    if (stat(full_path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
+        // Save the current root directory as the previous root
+        snprintf(PREVIOUS_ROOT_PATH, sizeof(PREVIOUS_ROOT_PATH), "%s", TEST_FOLDER_PATH);
+        snprintf(previous_dir_path, sizeof(previous_dir_path), "%s", current_dir_path);
+
+        // Update the global path to the new root directory
+        snprintf(TEST_FOLDER_PATH, sizeof(TEST_FOLDER_PATH), "%s", full_path);
+        snprintf(current_dir_path, sizeof(current_dir_path), "%s", fs_path);
+
+        // Paths are always built from these two, so the process working directory is left alone
+        printf("Changed directory to new root: %s\n", TEST_FOLDER_PATH);
+    } else {
+        printf("Invalid directory path: %s\n", full_path);
+        // Optionally show an error dialog
+    }
+}
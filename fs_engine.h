@@ -0,0 +1,864 @@
+/*
+    FILE SYSTEM ENGINE
+
+    Interface of the headless engine in fs_engine.c: the on-disk structures, the engine state and its
+    operations. It needs GLib only, so the file system can be driven without a display; the GTK file manager
+    (fsWithoutPermissions.c), the FUSE frontend and the benchmark harness (fs_bench.c) are built on it.
+*/
+
+#ifndef FS_ENGINE_H
+#define FS_ENGINE_H
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // copy_file_range()
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include <dirent.h>
+#include<direct.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#undef DELETE // winnt.h access right, clashes with JournalOperation
+#define fsync _commit
+#else
+#include <sys/mman.h>
+#define O_BINARY 0
+#endif
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h> // FICLONE
+#endif
+//geometry used when a disk image is formatted, the superblock records the actual values
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_NUM_BLOCKS 1024
+#define DEFAULT_INODE_COUNT 128
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE 65536
+#define MIN_NUM_BLOCKS 16
+#define MAX_FILENAME_LEN 255
+#define MAX_PATH_LEN 1024
+#define DIRECT_BLOCKS 12
+#define INDEX_BLOCKS 1
+#define INODE_EXTENTS 4 // contiguous runs mapped straight from the inode, ahead of the block map
+#define INODE_INLINE_MAX (INODE_EXTENTS * (int)sizeof(Extent) + (DIRECT_BLOCKS + 2) * (int)sizeof(int)) // bytes of the block map, a file this small is kept there
+#define FRAGMENTS_PER_BLOCK 8 // slots a fragment block is split into
+#define FRAGMENT_SIZE(block_size) ((block_size) / FRAGMENTS_PER_BLOCK)
+#define FRAGMENT_FILE_MAX(block_size) ((block_size) / 2) // larger files than this get data blocks of their own
+#define FRAGMENT_FULL ((1 << FRAGMENTS_PER_BLOCK) - 1)
+#define FRAGMENT_SEARCH_MAX 16 // partly used fragment blocks tried before a new one is taken
+#define MAX_ACL_ENTRIES 512 // entries in one ACL block of the smallest block size
+#define ACL_INLINE_ENTRIES 4 // ACL entries kept in the inode, longer lists move to a shared ACL block
+#define PERM_CACHE_SIZE 256 // permission decisions remembered per thread
+#define MAX_USERS 100
+#define DIR_INITIAL_CAPACITY 16 // entries a directory view starts with, doubled as it grows
+#define DIR_HASH_EMPTY -1
+#define ROOT_INODE 0
+
+//dentry cache geometry
+#define DCACHE_SIZE 512
+#define DCACHE_HASH_SIZE 1024
+
+//permission definitions
+#define PERMISSION_READ  0x4
+#define PERMISSION_WRITE 0x2
+#define PERMISSION_EXECUTE 0x1
+
+#define JOURNAL_SIZE 1024
+#define JOURNAL_FILENAME "journal.bin"
+#define JOURNAL_SEGMENT_FILENAME "journal.seg" // large record payloads, referenced from journal.bin
+#define JOURNAL_RECORD_MAGIC 0x344E524A // "JRN4", starts every on-disk journal record
+#define JOURNAL_INLINE_MAX 256 // payloads up to this size are stored inside the record itself
+#define JOURNAL_COMMIT_WINDOW_MS 2 // default time a committing writer waits for others to share its fsync
+#define JOURNAL_CHECKPOINT_INTERVAL (JOURNAL_SIZE / 2) // records after which a checkpoint truncates the log, keeps recovery within the ring
+#define JOURNAL_TXN_MAX (JOURNAL_CHECKPOINT_INTERVAL / 2) // records a transaction queues before it appends them, so one batch never outgrows the ring
+#define DIFF_COPY_CHUNK (1 << 20) // bytes per step when applying a diff moves the rest of a host file
+#define FILE_VIEW_PAGE (64 << 10) // bytes a FileView page starts from, before it is aligned to a UTF-8 character
+
+#define INODE_TABLE_FILENAME "inode_table.bin"
+#define FS_IMAGE_FILENAME "disk.img" // memory-mapped disk image holding the whole file system
+#define HOTLIST_FILENAME "hotlist.bin" // directories in use at the last unmount, warmed in the background at the next mount
+#define HOTLIST_MAGIC 0x31544F48 // "HOT1"
+#define HOTLIST_MAX_DIRS 256
+
+#define FS_MAGIC 0x4D495346 // "FSIM", identifies a compatible disk image
+#define WRITEBACK_INTERVAL_MS 1000 // the flusher writes dirty blocks back at least this often
+#define WRITEBACK_DIRTY_HIGH 1024 // dirty blocks that wake the flusher early
+#define ALLOC_POOL_BLOCKS 32 // block numbers a thread claims from the bitmap at a time
+#define ALLOC_POOL_INODES 8 // inode numbers a thread claims at a time, at most ALLOC_POOL_BLOCKS
+#define INODE_COPY_CHUNK (1 << 20) // bytes per step when a file range is copied rather than shared
+#define BLOCK_BATCH_MAX 256 // block numbers queued before free_blocks releases them under one bitmap_lock hold
+#define TREE_WORKERS_MAX 8 // threads a tree-wide delete or copy runs on, at most one per processor
+#define SCRUB_CHUNK_BLOCKS 1024 // image blocks one scrub task verifies
+#define SCRUB_BAD_MAX 64 // mismatching blocks a scrub lists by number
+#define TREE_DEQUE_INITIAL 64 // tasks a worker's deque has room for before it grows
+#define TREE_COPY_CHUNK (1 << 20) // bytes per step when a tree copy moves a host file
+#define MAX_SNAPSHOTS 16 // snapshots the superblock can list
+#define SNAPSHOT_TABLE INT_MAX // snapshot_seen of a snapshot's own table, which is never preserved
+#define FS_VERSION 15 // bump whenever the persisted Superblock or Inode layout changes
+#define STATS_BUCKETS 40 // latency histogram buckets, the last starts at 2^38 ns (about 4.6 minutes)
+#define STATS_TEXT_MAX 4096 // room stats_format needs
+
+#define DEFAULT_ROOT_PATH "C:/Users/CLIENT/Music/tests/" //host folder mirroring the file system root, change to your preference for testing
+
+//block bitmap geometry: one bit per block, packed into 64-bit words
+#define BITMAP_WORD_BITS 64
+#define BITMAP_WORDS(blocks) (((int64_t)(blocks) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+typedef enum {
+    CREATE,
+    DELETE,
+    MODIFY,
+    RENAME,
+    READ,
+    CHANGE_PERMISSIONS,
+    CREATE_DIRECTORY
+} JournalOperation;
+
+//where a record's payload lives
+typedef enum {
+    JOURNAL_PAYLOAD_NONE,
+    JOURNAL_PAYLOAD_INLINE, // bytes follow the names inside the record
+    JOURNAL_PAYLOAD_SEGMENT, // a JournalSegmentRef to bytes appended to the log segment
+    JOURNAL_PAYLOAD_BLOCKS // a list of int32 data block numbers already holding the new contents
+} JournalPayloadKind;
+
+typedef struct {
+    uint64_t offset; // byte offset in the log segment
+    uint32_t length;
+    uint32_t checksum; // CRC-32C of the referenced bytes
+} JournalSegmentRef;
+
+//in-memory journal record, allocated to exactly the size it needs
+typedef struct {
+    uint64_t seq; // position in the log, increases by one per record and survives checkpoints
+    int32_t inode_number; // inode the operation applied to, -1 if not known
+    JournalOperation operation;
+    time_t timestamp;
+    JournalPayloadKind payload_kind;
+    uint32_t payload_len; // logical payload size, whatever its kind
+    uint16_t filename_len;
+    uint16_t new_filename_len; // For rename operation
+    char bytes[]; // filename\0 new_filename\0 then the stored payload (inline bytes, segment ref or block list)
+} JournalRecord;
+
+#define journal_record_filename(record) ((record)->bytes)
+#define journal_record_new_filename(record) ((record)->bytes + (record)->filename_len + 1)
+#define journal_record_stored(record) ((record)->bytes + (record)->filename_len + (record)->new_filename_len + 2)
+
+//MODIFY payload: this header followed by hunk_count hunks, each a JournalDiffHunk and its inserted bytes
+typedef struct {
+    int64_t old_size;
+    int64_t new_size;
+    uint32_t hunk_count;
+} JournalDiffHeader;
+
+typedef struct {
+    int64_t offset; // position in the file as left by the previous hunks
+    int64_t removed; // bytes replaced at offset
+    int64_t inserted; // bytes that follow this hunk
+} JournalDiffHunk;
+
+//one edited page of a FileView, replacing the page's original bytes
+typedef struct {
+    int64_t page;
+    char *data;
+    size_t length;
+} FileViewEdit;
+
+//a host file opened for paging through and editing without being read whole. Pages are read when asked for,
+//and an edited page keeps its new text until file_view_save writes the changed ranges back
+typedef struct {
+    char path[MAX_PATH_LEN];
+    int fd;
+    int64_t size;
+    time_t mtime; // with size, tells whether the file changed since it was opened
+    char *page; // the unedited page read last, FILE_VIEW_PAGE + 8 bytes
+    FileViewEdit *edits; // sorted by page
+    int edit_count;
+    int edit_capacity;
+} FileView;
+
+extern JournalRecord* journal[JOURNAL_SIZE]; // ring of the most recent records, NULL = unused slot
+extern int journal_index;
+
+//on-disk journal record: this header, then `length` payload bytes
+typedef struct {
+    uint32_t magic;
+    uint32_t length;
+    uint32_t checksum; // CRC-32C of the payload
+} JournalRecordHeader;
+
+//payload: sequence number, operation, timestamp, payload kind, payload length, the two name lengths, the names without terminators, then the stored payload
+#define JOURNAL_PAYLOAD_FIXED (8 + 4 + 4 + 8 + 4 + 4 + 2 + 2)
+#define JOURNAL_MAX_STORED (JOURNAL_INLINE_MAX > (int)sizeof(JournalSegmentRef) ? JOURNAL_INLINE_MAX : (int)sizeof(JournalSegmentRef))
+#define JOURNAL_MAX_PAYLOAD (JOURNAL_PAYLOAD_FIXED + 2 * MAX_PATH_LEN + JOURNAL_MAX_STORED) // names are whole paths
+
+extern int journal_fd; // journal file, opened with O_APPEND
+extern int journal_segment_fd; // log segment for large payloads, opened with O_APPEND
+extern GMutex journal_lock; // guards journal[], journal_index, both descriptors and the commit state below
+extern GCond journal_commit_cond;
+extern uint64_t journal_next_seq; // sequence number of the next record
+extern uint64_t journal_since_checkpoint; // records appended since the log was last truncated
+extern uint64_t journal_appended_seq; // records written to journal_fd
+extern uint64_t journal_durable_seq; // records covered by a completed fsync
+extern int journal_flush_in_progress;
+extern int journal_sync_failed; // an fsync failed, nothing past journal_durable_seq is durable until a checkpoint
+extern int journal_waiters; // callers inside journal_wait_durable
+extern int journal_commit_window_ms;
+
+//a record waiting to be written. Producers encode it on their own stack and push it onto journal_submit_head
+//without taking journal_lock; whoever holds the lock next writes every queued record with one write()
+typedef struct JournalSubmission {
+    struct JournalSubmission *next;
+    JournalRecord *record;
+    size_t size; // bytes used in encoded[]
+    uint64_t appended; // journal_appended_seq once written, 0 while queued
+    int failed;
+    unsigned char encoded[sizeof(JournalRecordHeader) + JOURNAL_MAX_PAYLOAD];
+} JournalSubmission;
+
+extern JournalSubmission *journal_submit_head; // lock-free stack of queued submissions, newest first
+
+//a compound journal transaction: the records of an operation, queued while it runs and appended together with
+//one write(), then made durable with one fsync. A batch longer than JOURNAL_TXN_MAX appends each full group as
+//it goes
+typedef struct {
+    JournalSubmission *submissions; // up to JOURNAL_TXN_MAX, grown by journal_txn_add
+    int count;
+    int capacity;
+    int failed; // a record could not be queued or written
+    uint64_t appended; // newest record written so far, what journal_txn_commit waits for
+} JournalTransaction;
+extern GMutex journal_segment_lock; // orders appends to journal_segment_fd
+extern GRWLock journal_checkpoint_lock; // shared by appenders, exclusive while a checkpoint saves and truncates the log
+extern unsigned char *journal_batch; // a drained batch is gathered here for its write(), guarded by journal_lock
+extern size_t journal_batch_capacity;
+
+//a point-in-time snapshot. Its table is a file linked into no directory, holding a SnapshotSlot per inode
+//number: the inode as it was when the snapshot was taken, for the inodes changed since. The other slots are
+//holes, those inodes look the same as in the next newer snapshot or, for the newest, in the live inode table
+typedef struct {
+    int id;
+    int table_inode;
+    time_t created;
+} SnapshotInfo;
+
+//SuperBlock Structure
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    int64_t _size; // capacity of the data region in bytes
+    int block_size; // power of two between MIN_BLOCK_SIZE and MAX_BLOCK_SIZE
+    int num_blocks;
+    int free_blocks;
+    int inode_table_size;
+    int free_inode_count;
+    int next_free_hint; // block number where the next allocation scan starts
+    uint64_t checkpoint_seq; // last journal record reflected in this state, replay starts after it
+    int64_t bitmap_start; // image block where the block bitmap begins
+    int64_t refcount_start; // image block where the block reference counts begin
+    int64_t inode_bitmap_start; // image block where the inode bitmap begins
+    int64_t inode_table_start; // image block where the inode table begins
+    int64_t inode_cold_start; // image block where the cold halves of the inodes begin
+    int64_t checksum_start; // image block where the block checksums begin
+    int64_t data_start; // image block holding data block 0
+    int64_t image_blocks; // size of the whole image in blocks
+    int snapshot_count;
+    int next_snapshot_id;
+    SnapshotInfo snapshots[MAX_SNAPSHOTS]; // oldest first
+    unsigned int features; // FS_FEATURE_* chosen at format time
+    uint32_t layout_checksum; // crc32c of the fields fixed at format time, see superblock_layout_checksum
+} Superblock;
+
+//Superblock.features
+#define FS_FEATURE_DEDUP 0x1 // whole-block writes share a block already holding the same bytes, zero blocks stay holes
+
+//access control list structure
+typedef struct {
+    int user_id;
+    unsigned int permissions;
+} ACL_Entry;
+
+//a run of `length` data blocks starting at `start`, holding the file blocks from `file_block` on
+typedef struct {
+    int file_block;
+    int start;
+    int length; // 0 = unused slot
+} Extent;
+
+//Inode.flags: where a small file keeps its bytes instead of the block map. Directories always use blocks
+#define INODE_INLINE 0x1 // in inline_data, in place of the block map
+#define INODE_FRAGMENT 0x2 // in fragment slots of a block shared with other small files, see fragment
+
+//inode structure, hot half: what reads, writes and permission checks look at, exactly two cache lines.
+//Times, links and the ACL are in the inode's InodeCold record, the same index of inode_cold_table
+typedef struct {
+    int64_t _size;
+    union {
+        struct {
+            Extent extents[INODE_EXTENTS]; // checked first; file blocks they cover have no block map entry
+            int direct_blocks[DIRECT_BLOCKS];
+            int index_block; // block of INDEX_ENTRIES_PER_BLOCK block numbers
+            int double_index_block; // block of index block numbers
+        };
+        char inline_data[INODE_INLINE_MAX]; // INODE_INLINE: the file's bytes
+        int fragment; // INODE_FRAGMENT: block * FRAGMENTS_PER_BLOCK + first slot; the size gives the slot count
+    };
+    uint16_t is_directory;
+    uint16_t flags; // INODE_INLINE or INODE_FRAGMENT, 0 for a block-mapped file
+    unsigned int mode;
+    int owner_id;
+    int group_id;
+} Inode;
+G_STATIC_ASSERT(sizeof(Inode) == 128);
+
+//inode structure, cold half: read by stat, path building, ACL changes and snapshots
+typedef struct {
+    time_t atime; // access time
+    time_t mtime; // modification time
+    time_t ctime; // creation time
+    int nlink; // directory entries referring to this inode, 0 = free
+    int parent_inode; // directory holding this inode's entry
+    int snapshot_seen; // newest snapshot that already holds this inode's state from before its next change
+    int acl_count;
+    int acl_block; // holds the acl_count entries of a longer list, shared by the inodes with the same list
+    ACL_Entry acl[ACL_INLINE_ENTRIES]; // sorted by user_id, the whole list while acl_count <= ACL_INLINE_ENTRIES
+} InodeCold;
+
+//a slot of a snapshot table
+typedef struct {
+    int present; // 0 in a hole
+    Inode inode;
+    InodeCold cold;
+} SnapshotSlot;
+
+typedef struct {
+    char name[MAX_FILENAME_LEN];
+    int inode_number;
+} DirectoryEntry;
+
+//directory entries are stored back to back in the directory inode's direct blocks
+#define DIR_ENTRIES_PER_BLOCK (superblock->block_size / (int)sizeof(DirectoryEntry))
+#define DIR_MAX_ENTRIES (DIRECT_BLOCKS * DIR_ENTRIES_PER_BLOCK)
+
+//in-memory view of a directory inode
+typedef struct {
+    int inode_number;
+    DirectoryEntry *entries;
+    int entry_count;
+    int capacity; // slots allocated in entries[]
+    int *hash_index; // name hash -> slot in entries[], open addressing with linear probing
+    int hash_size; // power of two, twice the capacity so the index is at most half full
+} Directory;
+
+//a subtree walk: the entries still to visit, depth first, each with its path and inode number
+typedef struct {
+    char *path; // malloc'd fs path
+    int inode_number;
+} TreeWalkNode;
+
+typedef struct {
+    TreeWalkNode *nodes;
+    int count;
+    int capacity;
+} TreeWalk;
+
+//block numbers queued to be freed together, see free_blocks
+typedef struct {
+    int blocks[BLOCK_BATCH_MAX];
+    int count;
+} BlockBatch;
+
+//work-stealing pool for tree-wide operations. A task is an int, a directory's inode number or an index into
+//the caller's list, and may push more tasks. Every worker takes from the tail of its own deque, so it stays
+//within the subtree it is in; one whose deque ran dry steals from the head of another's, where the oldest and
+//usually largest subtrees wait
+typedef struct TreePool TreePool;
+typedef void (*TreeTaskFunc)(TreePool *pool, int worker, int task);
+
+typedef struct {
+    int *tasks;
+    int head; // next task to steal
+    int tail; // one past the owner's next task
+    int capacity;
+    GMutex lock;
+} TreeDeque;
+
+struct TreePool {
+    TreeDeque deques[TREE_WORKERS_MAX];
+    int worker_count;
+    gint next_worker; // hands each thread its deque
+    gint pending; // tasks pushed and not yet finished
+    gint failed; // set by a task that could not do its part
+    TreeTaskFunc run;
+    void *data; // the caller's, e.g. a BlockBatch per worker
+};
+
+//disk image layout, in blocks: superblock, block bitmap (bit set = block in use), block reference counts,
+//inode bitmap (bit set = inode in use), inode table (hot halves), cold inode table, block checksums, data
+//region. Every region starts on a block boundary, so inode records never straddle a cache line. The checksum
+//region holds a crc32c for every image block but its own, see image_checksum_slot
+#define BITMAP_BLOCKS(blocks, block_size) ((BITMAP_WORDS(blocks) * 8 + (block_size) - 1) / (block_size))
+#define REFCOUNT_BLOCKS(blocks, block_size) (((int64_t)(blocks) * (int64_t)sizeof(uint32_t) + (block_size) - 1) / (block_size))
+#define INODE_TABLE_BLOCKS(inodes, block_size) (((int64_t)(inodes) * (int64_t)sizeof(Inode) + (block_size) - 1) / (block_size))
+#define INODE_COLD_BLOCKS(inodes, block_size) (((int64_t)(inodes) * (int64_t)sizeof(InodeCold) + (block_size) - 1) / (block_size))
+#define CHECKED_BLOCKS(blocks, inodes, block_size) (1 + BITMAP_BLOCKS(blocks, block_size) + REFCOUNT_BLOCKS(blocks, block_size) + BITMAP_BLOCKS(inodes, block_size) + \
+                                                    INODE_TABLE_BLOCKS(inodes, block_size) + INODE_COLD_BLOCKS(inodes, block_size) + (blocks))
+#define CHECKSUM_BLOCKS(blocks, inodes, block_size) ((CHECKED_BLOCKS(blocks, inodes, block_size) * (int64_t)sizeof(uint32_t) + (block_size) - 1) / (block_size))
+#define METADATA_BLOCKS(blocks, inodes, block_size) (CHECKED_BLOCKS(blocks, inodes, block_size) - (blocks) + CHECKSUM_BLOCKS(blocks, inodes, block_size))
+
+extern unsigned char *fs_image; // the mapped disk image
+extern size_t fs_image_size;
+extern int fs_image_fd;
+#ifdef _WIN32
+extern HANDLE fs_image_mapping;
+#endif
+
+//write-back state: one bit per image block changed since it was last flushed
+extern uint64_t *image_dirty;
+extern int64_t image_dirty_count;
+extern GMutex image_dirty_lock;
+extern GMutex image_flush_lock; // one flush at a time, so a finished flush has stored the checksums of what it wrote
+extern GCond image_flush_cond;
+extern GThread *image_flusher;
+extern int image_flusher_stop;
+extern GThread *prefetcher;
+extern int prefetcher_stop;
+
+//these point into fs_image once it is mapped
+extern Superblock *superblock;
+extern uint64_t *block_bitmap;
+extern uint32_t *block_refs; // per data block: references beyond the first, from files sharing it after a clone
+extern uint32_t *image_checksums; // per image block outside the checksum region, crc32c as of its last write-back
+extern uint64_t *inode_bitmap;
+extern Inode *inode_table;
+extern InodeCold *inode_cold_table;
+
+//the cold half of inode `inode_number`
+#define inode_cold(inode_number) (&inode_cold_table[inode_number])
+
+//index block entries: data block numbers stored as int32, -1 = hole
+#define INDEX_ENTRIES_PER_BLOCK (superblock->block_size / (int)sizeof(int))
+
+//a shared block must be copied before it is written. Counts change under bitmap_lock; writers of a file
+//read them without it, since only the file's own frees and clones (which exclude its writers) can raise them.
+//A block in the dedup registry counts as shared too, another file may take a reference to it at any time
+#define block_shared(block_number) (g_atomic_int_get((gint *)&block_refs[block_number]) > 0 || block_deduped(block_number))
+#define block_deduped(block_number) (dedup_registered != NULL && g_atomic_int_get(&dedup_registered[block_number]) != -1)
+
+//address of a data block inside the mapping
+#define block_data(block_number) ((char *)fs_image + ((size_t)superblock->data_start + (block_number)) * superblock->block_size)
+
+//changed metadata is written back slot by slot with the dirty blocks, not with the whole table
+#define inode_mark_dirty(inode) image_mark_dirty((inode), sizeof(Inode))
+#define inode_cold_mark_dirty(cold) image_mark_dirty((cold), sizeof(InodeCold))
+#define superblock_mark_dirty() image_mark_dirty(superblock, sizeof(Superblock))
+extern Directory** directory_cache; // loaded directory views, indexed by inode number, sized from the superblock
+
+//dentry cache node: a resolved path and its inode number, or -1 if the path does not exist
+typedef struct {
+    char *path; // NULL while the node is on the free list
+    unsigned int hash;
+    int inode_number;
+    int hash_next; // next node in the bucket, or in the free list
+    int lru_prev;
+    int lru_next;
+} DentryCacheEntry;
+
+extern DentryCacheEntry dcache[DCACHE_SIZE];
+extern int dcache_buckets[DCACHE_HASH_SIZE];
+extern int dcache_lru_head; // most recently used
+extern int dcache_lru_tail; // evicted first
+extern int dcache_free_head;
+
+//name search index: one record per directory entry of the tree, and per trigram (three consecutive bytes
+//of a name) a posting list of the records whose name contains it
+typedef struct {
+    char *name; // NULL once the entry is gone
+    int dir_inode;
+    int inode_number;
+} NameRecord;
+
+typedef struct {
+    uint32_t trigram; // 0 = unused slot, names hold no NUL bytes
+    int count;
+    int capacity;
+    int *records; // increasing record numbers
+} NamePosting;
+
+typedef struct {
+    int built;
+    NameRecord *records;
+    int record_count;
+    int record_capacity;
+    int live_count;
+    NamePosting *postings; // open addressing on the trigram
+    int posting_size; // power of two, at least twice posting_used
+    int posting_used;
+    int *entry_hash; // (directory, name) -> live record, open addressing with linear probing
+    int entry_hash_size; // power of two, at least twice live_count
+} NameIndex;
+
+//a search result: an inode and the path naming it, from the root without a leading '/'
+typedef struct {
+    int inode_number;
+    char path[MAX_PATH_LEN];
+} NameMatch;
+
+extern NameIndex name_index;
+extern GMutex name_index_lock; // makes sure concurrent first searches build the index once
+
+//engine locks. namespace_lock is held shared by lookups and by operations on a single inode, and exclusively by
+//anything that adds, removes or moves a name; inode_locks[i] then orders readers and writers of inode i's
+//attributes and data, and is always taken after namespace_lock. bitmap_lock covers the block bitmap, the block
+//reference counts and the free block count, dcache_lock the dentry cache, dir_load_lock the lazy loading of directory_cache[]
+extern GRWLock namespace_lock;
+extern GRWLock *inode_locks; // one per inode, sized from the superblock
+extern GMutex bitmap_lock;
+extern GMutex inode_bitmap_lock; // covers the inode bitmap and the free inode count
+extern GMutex dcache_lock;
+extern GMutex dir_load_lock;
+extern int inode_next_free_hint; // inode number where the next inode bitmap scan starts
+
+#define inode_lock_shared(inode_number) g_rw_lock_reader_lock(&inode_locks[inode_number])
+#define inode_unlock_shared(inode_number) g_rw_lock_reader_unlock(&inode_locks[inode_number])
+#define inode_lock(inode_number) g_rw_lock_writer_lock(&inode_locks[inode_number])
+#define inode_unlock(inode_number) g_rw_lock_writer_unlock(&inode_locks[inode_number])
+
+//registry of ACL blocks by contents, so an equal list finds the block already holding it
+typedef struct {
+    uint32_t hash; // crc32c of the entries
+    int count;
+    int block; // -1 = empty, -2 = removed
+} AclBlockSlot;
+
+extern AclBlockSlot *acl_blocks; // open addressing, built from the inode table on first use
+extern int acl_blocks_size; // power of two
+extern int acl_blocks_used; // slots not empty, removed ones included
+extern GMutex acl_lock; // covers acl_blocks and the reference counts of ACL blocks
+
+extern uint8_t *fragment_used; // per block, bit i set = fragment slot i holds a file's bytes; built from the inode table on first use
+extern int *fragment_partial; // fragment blocks with a free slot, the newest last
+extern int fragment_partial_count;
+extern int fragment_partial_capacity;
+extern GMutex fragment_lock; // covers the three above
+
+//registry of data blocks by contents, for volumes formatted with FS_FEATURE_DEDUP
+typedef struct {
+    uint32_t hash; // crc32c of the block
+    int block; // -1 = empty, -2 = removed
+} DedupSlot;
+
+extern DedupSlot *dedup_blocks; // open addressing, holds the blocks written whole since the mount
+extern int dedup_blocks_size; // power of two
+extern int dedup_blocks_used; // slots not empty, removed ones included
+extern gint *dedup_registered; // per block, its slot in dedup_blocks or -1. All of these change under bitmap_lock
+
+//a has_permission answer, valid while the inode's permission generation is unchanged within one mount
+typedef struct {
+    int inode_number; // -1 = unused
+    int user_id;
+    guint generation;
+    guint epoch; // perm_mount_epoch when the answer was cached
+    unsigned int permissions;
+} PermCacheEntry;
+
+extern guint *perm_generations; // per inode, bumped by every change to its mode, owner or ACL
+
+//numbers claimed from a bitmap but not handed out yet; numbers[first .. count) are unused
+typedef struct {
+    int numbers[ALLOC_POOL_BLOCKS];
+    int first;
+    int count;
+    int capacity; // claimed per refill
+} AllocCache;
+
+//per-thread allocation pool, so single-block and inode allocations do not take the shared bitmap locks each
+//time. Claimed numbers are marked in use in the image until the pool hands them out or returns them
+typedef struct AllocPool {
+    GMutex lock; // only contended while another thread drains the pool
+    AllocCache blocks;
+    AllocCache inodes;
+    struct AllocPool *next;
+} AllocPool;
+
+extern AllocPool *alloc_pools; // every thread's pool
+extern GMutex alloc_pools_lock;
+
+extern GMutex snapshot_lock; // orders writes to the newest snapshot's table
+extern int fs_read_only; // 1 while a snapshot is mounted, changes are refused
+
+
+//engine results: 0 on success, a negative FsResult when an operation is refused. fs_strerror describes one
+typedef enum {
+    FS_OK = 0,
+    FS_ERR_INVALID = -1, // malformed or too long name or path
+    FS_ERR_EXISTS = -2, // the target name is taken
+    FS_ERR_NOT_FOUND = -3,
+    FS_ERR_NOT_EMPTY = -4, // the directory still has entries
+    FS_ERR_NO_SPACE = -5, // no free inode, block or directory slot
+    FS_ERR_IO = -6 // the host folder refused the change
+} FsResult;
+
+//engine statistics: per operation a count, total and maximum latency and a histogram of latencies in
+//power-of-two nanosecond buckets, updated with atomic adds so recording never takes a lock
+typedef enum {
+    STAT_LOOKUP, // resolve_path
+    STAT_ALLOC, // block and inode allocation
+    STAT_JOURNAL_APPEND, // add_journal_record, until the record is durable
+    STAT_JOURNAL_FSYNC, // one group commit
+    STAT_FLUSH, // image_flush_dirty
+    STAT_CHECKPOINT,
+    STAT_REPLAY, // one replayed journal record
+    STAT_MOUNT, // load_file_system_state
+    STAT_OP_COUNT
+} StatOp;
+
+typedef enum {
+    STAT_DCACHE_HIT,
+    STAT_DCACHE_MISS,
+    STAT_PREFETCH_DIR, // directory views loaded by the prefetcher
+    STAT_DEDUP_HIT, // whole-block writes that shared a block already holding the bytes
+    STAT_ZERO_BLOCK, // whole-block writes of zeroes left as holes
+    STAT_COUNTER_COUNT
+} StatCounter;
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS]; // buckets[b]: latencies from 2^(b-1) to below 2^b ns, the last one everything longer
+} OpStats;
+
+extern OpStats op_stats[STAT_OP_COUNT];
+extern uint64_t stat_counters[STAT_COUNTER_COUNT];
+
+//compiled in unless FS_WITHOUT_STATS is defined. STATS_START declares `start`, STATS_END records since then
+#ifdef FS_WITHOUT_STATS
+#define STATS_START(start)
+#define STATS_END(op, start)
+#define STATS_COUNT(counter)
+#else
+#define STATS_START(start) int64_t start = stats_now()
+#define STATS_END(op, start) stats_record((op), stats_now() - (start))
+#define STATS_COUNT(counter) stats_count(counter)
+#endif
+
+//trace points, written to stderr in builds with FS_WITH_TRACE and compiled out otherwise
+#ifdef FS_WITH_TRACE
+#define FS_TRACE(...) fprintf(stderr, "trace: " __VA_ARGS__)
+#else
+#define FS_TRACE(...) ((void)0)
+#endif
+
+extern int current_user_id;
+extern int current_group_id;
+extern char TEST_FOLDER_PATH[MAX_FILENAME_LEN]; //for current directory
+extern char PREVIOUS_ROOT_PATH[MAX_FILENAME_LEN];//to keep "root directory"
+extern char FS_ROOT_PATH[MAX_FILENAME_LEN]; //host folder for the file system root
+extern char current_dir_path[MAX_PATH_LEN]; //current directory, relative to the file system root
+extern char previous_dir_path[MAX_PATH_LEN];
+extern int fs_host_mirror; //1 while file contents live in the host folder (GUI), 0 when they live in data blocks (FUSE mount, benchmarks)
+
+const char *fs_strerror(int result);
+
+//statistics
+int64_t stats_now();
+void stats_record(StatOp op, int64_t elapsed_ns);
+void stats_count(StatCounter counter);
+void stats_reset();
+int stats_format(char *out, size_t out_size);
+const char* operation_to_string(JournalOperation operation);
+JournalOperation string_to_operation(const char* str);
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+int crc32c_hardware();
+
+//journal
+void init_journal();
+void journal_set_commit_window(int milliseconds);
+void close_journal();
+void add_journal_entry(JournalOperation operation, int inode_number, const char *filename, const char *new_filename, const char *data);
+int add_journal_record(JournalOperation operation, int inode_number, const char *filename, const char *new_filename,
+                       JournalPayloadKind kind, const void *payload, uint32_t length);
+void journal_txn_begin(JournalTransaction *txn);
+int journal_txn_add(JournalTransaction *txn, JournalOperation operation, int inode_number, const char *filename,
+                    const char *new_filename, const void *payload, uint32_t length);
+int journal_txn_append(JournalTransaction *txn);
+int journal_txn_commit(JournalTransaction *txn);
+int journal_txn_end(JournalTransaction *txn);
+unsigned char *journal_load_payload(const JournalRecord *record, uint32_t *length);
+unsigned char *journal_make_diff(const char *old_data, size_t old_len, const char *new_data, size_t new_len, uint32_t *length);
+int apply_diff_to_file(const char *host_path, const unsigned char *diff, uint32_t length);
+FileView *file_view_open(const char *host_path);
+void file_view_close(FileView *view);
+int64_t file_view_page_count(const FileView *view);
+void file_view_page_range(FileView *view, int64_t page, int64_t *start, int64_t *end);
+const char *file_view_page(FileView *view, int64_t page, size_t *length);
+int file_view_set_page(FileView *view, int64_t page, const char *text, size_t length);
+int file_view_diff(FileView *view, unsigned char **diff, uint32_t *length);
+int file_view_save(FileView *view, unsigned char **diff, uint32_t *length);
+void replay_journal();
+
+//directories, paths and the dentry cache
+int dir_init(Directory *dir, int inode_number);
+int dir_lookup(Directory *dir, const char *name);
+int dir_add_entry(Directory *dir, const char *name, int inode_number);
+int dir_remove_entry(Directory *dir, int slot);
+int dir_rename_entry(Directory *dir, int slot, const char *new_name);
+Directory* dir_get(int inode_number);
+void dir_release(int inode_number);
+void dir_cache_clear();
+void dcache_init();
+int dcache_lookup(const char *path, int *inode_number);
+void dcache_insert(const char *path, int inode_number);
+void dcache_invalidate_prefix(const char *path);
+int normalize_path(const char *path, char *out, size_t out_size);
+int make_fs_path(const char *name, char *out);
+int make_host_path(const char *fs_path, char *out, size_t out_size);
+int resolve_path(const char *path);
+int resolve_parent(const char *path, const char **name);
+int find_inode_by_filename(const char *filename);
+int inode_to_path(int inode_number, char *out, size_t out_size);
+void ensure_trailing_slash(char *path);
+void change_directory(const char *new_path);
+
+//name search index
+void name_index_add(int dir_inode, const char *name, int inode_number);
+void name_index_remove(int dir_inode, const char *name);
+void name_index_reset();
+int name_index_search(const char *query, int prefix, NameMatch *out, int max);
+
+//disk image and persistent state
+void image_mark_dirty(const void *addr, size_t size);
+int image_flush_dirty();
+int geometry_valid(int block_size, int64_t num_blocks, int64_t inode_count);
+void format_superblock(int block_size, int num_blocks, int inode_count);
+int format_file_system(const char *image_path, int block_size, int num_blocks, int inode_count, unsigned int features);
+void init_file_system();
+void free_memory();
+int hotlist_save();
+void prefetch_start();
+void prefetch_stop();
+int save_file_system_state();
+int load_file_system_state();
+int checkpoint_file_system();
+void load_permissions();
+void save_permissions();
+
+//permissions
+void set_permissions(int inode_number, unsigned int permissions);
+unsigned int get_permissions(int inode_number);
+void add_acl_entry(int inode_number, int user_id, unsigned int permissions);
+void remove_acl_entry(int inode_number, int user_id);
+unsigned int get_acl_permissions(int inode_number, int user_id);
+int has_permission(int inode_number, int user_id, unsigned int required_permission);
+void acl_share(const InodeCold *cold);
+void acl_release(InodeCold *cold);
+void perm_invalidate(int inode_number);
+void perm_invalidate_all();
+
+//blocks and inodes
+void alloc_pools_drain();
+int allocate_block();
+int allocate_blocks(int n, int out[]);
+int allocate_inodes(int n, int out[]);
+void release_inodes(const int numbers[], int n);
+void free_block(int block_number);
+void free_blocks(const int blocks[], int n);
+int allocate_index_block();
+void free_index_block(int block_number);
+int create_inode(int is_directory, unsigned int mode, int owner_id, int group_id);
+int create_inode_at(int i, int is_directory, unsigned int mode, int owner_id, int group_id);
+void free_inode(int inode_number);
+int64_t inode_max_size();
+int inode_bmap(Inode *inode, int64_t file_block, int allocate, int64_t *run);
+void inode_free_blocks(Inode *inode, int64_t first_block);
+int64_t inode_read(int inode_number, char *buf, size_t size, int64_t offset);
+int64_t inode_write(int inode_number, const char *buf, size_t size, int64_t offset);
+int inode_truncate(int inode_number, int64_t size);
+int inode_clone(int src_inode, int dst_inode);
+int64_t inode_copy_range(int src_inode, int64_t src_offset, int dst_inode, int64_t dst_offset, size_t len);
+
+//in-memory tree changes, used by replay and the FUSE frontend
+int apply_create(const char *fs_path, int is_directory, unsigned int mode, int want_inode);
+int apply_delete(const char *fs_path);
+int apply_rename(const char *old_fs_path, const char *new_fs_path);
+int apply_set_mode(const char *fs_path, unsigned int mode);
+
+//integrity: fs_scrub flushes the image and checks every block against its checksum on a TreePool
+typedef enum {
+    IMAGE_SUPERBLOCK,
+    IMAGE_BLOCK_BITMAP,
+    IMAGE_REFCOUNTS,
+    IMAGE_INODE_BITMAP,
+    IMAGE_INODE_TABLE,
+    IMAGE_INODE_COLD,
+    IMAGE_DATA,
+    IMAGE_REGION_COUNT
+} ImageRegion;
+
+typedef struct {
+    int64_t checked; // blocks verified
+    int64_t bad; // blocks whose bytes do not match their checksum
+    int64_t bad_by_region[IMAGE_REGION_COUNT];
+    int64_t bad_blocks[SCRUB_BAD_MAX]; // image block numbers of the first mismatches found, in no particular order
+    int layout_ok; // the superblock's layout fields match layout_checksum
+    int64_t elapsed_ns;
+} ScrubReport;
+
+uint32_t superblock_layout_checksum(const Superblock *sb);
+int64_t fs_scrub(ScrubReport *report);
+const char *image_region_name(ImageRegion region);
+
+//snapshots
+int snapshot_preserve(int inode_number);
+int snapshot_create();
+void snapshot_list();
+int snapshot_delete(int id);
+int snapshot_rollback(int id);
+Inode *snapshot_view(int id, InodeCold **cold);
+
+//file and directory operations on paths relative to current_dir_path, mirrored in the host folder while
+//fs_host_mirror is set. They return FS_OK or a negative FsResult
+int file_exists(const char *path);
+int create_file(const char *path, int is_directory);
+int clone_file(const char *src, const char *dst);
+int delete_file(const char *filename);
+int rename_file(const char *old_name, const char *new_name);
+int change_file_permissions(const char *filename, unsigned int new_mode);
+int create_directory(const char *path);
+int delete_directory(const char *path);
+
+//tree-wide operations: the subtree is walked in the file system, not on the host, and its inodes are worked
+//through by a TreePool. delete_tree frees every block of the subtree through free_blocks and logs one DELETE
+//record for all of it; copy_tree shares the files' data blocks and queues its creates in one journal
+//transaction. Both return FS_OK or a negative FsResult
+int delete_tree(const char *path);
+int copy_tree(const char *src, const char *dst);
+
+//batch operations: the namespace lock is taken once, inode numbers are claimed in one pass and the records of
+//the whole batch form one journal transaction. results[i], unless results is NULL, gets paths[i]'s FsResult.
+//They return how many paths succeeded
+int create_files(const char *const paths[], int count, int is_directory, int results[]);
+int delete_files(const char *const paths[], int count, int results[]);
+int change_files_permissions(const char *const paths[], int count, unsigned int new_mode, int recursive, int results[]);
+
+#ifdef FS_WITH_FUSE
+int fuse_mount_file_system(int argc, char *argv[], int snapshot_id);
+#endif
+
+#endif